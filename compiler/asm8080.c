@@ -1,53 +1,233 @@
-// 8080 Assembler - outputs Intel HEX
+// 8080 Assembler - outputs Intel HEX, raw binary, CP/M .com or relocatable
+// objects for ld8080. Built with ASM8080_LIBRARY it is asm8080_assemble()
+// instead, for assembling into memory (asm8080.h).
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <strings.h>
 #include <stdint.h>
-
-#define MAX_LABELS 1024
-#define MAX_LINE 256
-
+#include "opcodes.h"
+#include "obj8080.h"
+#include "peep8080.h"
+#include "asm8080.h"
+#ifndef ASM8080_LIBRARY
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "linetab.h"
+#include "timing8080.h"
+#endif
+
+// A token: a view into the source buffer, not NUL-terminated
 typedef struct {
-    char name[32];
-    uint16_t addr;
-} Label;
+    const char *ptr;
+    size_t len;
+} Span;
 
-static Label labels[MAX_LABELS];
-static int label_count = 0;
 static uint16_t current_addr = 0;
 static int line_num = 0;
-static int pass = 1;
+static const char *file_name = NULL;  // Current INCLUDE file, NULL in the main source
+static int file_index = 0;            // 0 for the main source, then INCLUDE files in order
+static Span line_text;                // The current source line, ptr NULL in a macro
+static int keep_lines = 0;            // Record every line for a listing or line table
+static int error_count = 0;
+
+// Report an error at a source position: "Line N" in the main source,
+// "file:N" in included files
+static void error_at(const char *file, int line, const char *fmt, ...) {
+    va_list ap;
+    if (file) fprintf(stderr, "%s:%d: ", file, line);
+    else fprintf(stderr, "Line %d: ", line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    error_count++;
+}
 
-// Output buffer for Intel HEX
-static uint8_t hex_buf[16];
-static int hex_count = 0;
-static uint16_t hex_addr = 0;
-static FILE *outfile = NULL;
+#define error(...) error_at(file_name, line_num, __VA_ARGS__)
+
+// Assembled bytes in emission order, split into segments at each ORG or
+// section change. Written out once the source is done.
+static uint8_t *code = NULL;
+static size_t code_len = 0, code_cap = 0;
+static Segment *segments = NULL;
+static size_t segment_count = 0, segment_cap = 0;
+static int segment_open = 0;
+
+// Current section and the location counters of the others. CSEG and DSEG
+// are relocatable, so only object output allows them.
+static int output_format = OUT_HEX;
+static int section = SEC_ABS;
+static uint16_t section_addr[SEC_COUNT];
+
+// Operands that depend on a label not defined yet, or on a relocatable or
+// external one, are emitted as zero. Once the whole source has been read the
+// expression's postfix code (see below) is run to patch them, or passed on
+// to the linker as a relocation.
+typedef struct {
+    uint32_t expr;      // Into expr_code[]
+    uint32_t expr_len;
+    size_t offset;      // Into code[]
+    int size;           // 1 or 2 bytes
+    int line;
+    const char *file;
+} Fixup;
+
+static Fixup *fixups = NULL;
+static size_t fixup_count = 0, fixup_cap = 0;
+static Span forward_ref;     // First non-constant symbol in the last operand, ptr NULL if none
+static size_t pending_expr;  // Start of the last operand's code in expr_code[]
+
+// Mnemonics and directives. Each entry names a base opcode (register
+// fields zero) and the form its operands take; instruction lengths come
+// from OP_LENGTHS, shared with the emulator.
+enum {
+    FORM_NONE,     // NOP
+    FORM_REG_HI,   // INR r: register in bits 3-5
+    FORM_REG_LO,   // ADD r: register in bits 0-2
+    FORM_MOV,      // MOV d,s
+    FORM_REG_IMM,  // MVI r,n
+    FORM_RP,       // INX rp: register pair in bits 4-5
+    FORM_RP_BD,    // LDAX rp: B or D only
+    FORM_RP_IMM,   // LXI rp,nn
+    FORM_IMM,      // ADI n, JMP nn
+    FORM_RST,      // RST 0-7
+    FORM_ORG,
+    FORM_DB,
+    FORM_DW,
+    FORM_DS,
+    FORM_EQU,
+    FORM_SECTION,  // ASEG, CSEG, DSEG: section in the opcode field
+    FORM_PUBLIC,
+    FORM_EXTRN,
+    FORM_INCLUDE,
+    FORM_MACRO,
+    FORM_REPT,
+    FORM_LOCAL,
+    FORM_ENDM,
+    FORM_IF,       // IF, IFDEF, IFNDEF: COND_* in the opcode field
+    FORM_ELSE,
+    FORM_ENDIF,
+};
+
+enum { COND_IF, COND_IFDEF, COND_IFNDEF };
 
-// Opcode tables
 typedef struct {
-    const char *mnem;
+    const char *name;
     uint8_t opcode;
-    int len;  // 1, 2, or 3 bytes
-} Opcode;
-
-static const Opcode simple_ops[] = {
-    {"NOP", 0x00, 1}, {"HLT", 0x76, 1}, {"RET", 0xC9, 1},
-    {"PCHL", 0xE9, 1}, {"SPHL", 0xF9, 1}, {"XCHG", 0xEB, 1},
-    {"XTHL", 0xE3, 1}, {"EI", 0xFB, 1}, {"DI", 0xF3, 1},
-    {"RLC", 0x07, 1}, {"RRC", 0x0F, 1}, {"RAL", 0x17, 1},
-    {"RAR", 0x1F, 1}, {"DAA", 0x27, 1}, {"CMA", 0x2F, 1},
-    {"STC", 0x37, 1}, {"CMC", 0x3F, 1},
-    // Conditional returns
-    {"RNZ", 0xC0, 1}, {"RZ", 0xC8, 1}, {"RNC", 0xD0, 1},
-    {"RC", 0xD8, 1}, {"RPO", 0xE0, 1}, {"RPE", 0xE8, 1},
-    {"RP", 0xF0, 1}, {"RM", 0xF8, 1},
-    {NULL, 0, 0}
+    uint8_t form;
+} Encoding;
+
+static const Encoding ENCODINGS[] = {
+    {"ORG", 0, FORM_ORG}, {"EQU", 0, FORM_EQU},
+    {"DB", 0, FORM_DB}, {"DEFB", 0, FORM_DB},
+    {"DW", 0, FORM_DW}, {"DEFW", 0, FORM_DW},
+    {"DS", 0, FORM_DS}, {"DEFS", 0, FORM_DS},
+    {"ASEG", SEC_ABS, FORM_SECTION}, {"CSEG", SEC_CODE, FORM_SECTION},
+    {"DSEG", SEC_DATA, FORM_SECTION},
+    {"PUBLIC", 0, FORM_PUBLIC}, {"EXTRN", 0, FORM_EXTRN},
+    {"INCLUDE", 0, FORM_INCLUDE},
+    {"MACRO", 0, FORM_MACRO}, {"REPT", 0, FORM_REPT},
+    {"LOCAL", 0, FORM_LOCAL}, {"ENDM", 0, FORM_ENDM},
+    {"IF", COND_IF, FORM_IF}, {"IFDEF", COND_IFDEF, FORM_IF},
+    {"IFNDEF", COND_IFNDEF, FORM_IF}, {"ELSE", 0, FORM_ELSE}, {"ENDIF", 0, FORM_ENDIF},
+
+    {"NOP", 0x00, FORM_NONE}, {"HLT", 0x76, FORM_NONE}, {"RET", 0xC9, FORM_NONE},
+    {"PCHL", 0xE9, FORM_NONE}, {"SPHL", 0xF9, FORM_NONE}, {"XCHG", 0xEB, FORM_NONE},
+    {"XTHL", 0xE3, FORM_NONE}, {"EI", 0xFB, FORM_NONE}, {"DI", 0xF3, FORM_NONE},
+    {"RLC", 0x07, FORM_NONE}, {"RRC", 0x0F, FORM_NONE}, {"RAL", 0x17, FORM_NONE},
+    {"RAR", 0x1F, FORM_NONE}, {"DAA", 0x27, FORM_NONE}, {"CMA", 0x2F, FORM_NONE},
+    {"STC", 0x37, FORM_NONE}, {"CMC", 0x3F, FORM_NONE},
+    {"RNZ", 0xC0, FORM_NONE}, {"RZ", 0xC8, FORM_NONE}, {"RNC", 0xD0, FORM_NONE},
+    {"RC", 0xD8, FORM_NONE}, {"RPO", 0xE0, FORM_NONE}, {"RPE", 0xE8, FORM_NONE},
+    {"RP", 0xF0, FORM_NONE}, {"RM", 0xF8, FORM_NONE},
+
+    {"MOV", 0x40, FORM_MOV}, {"MVI", 0x06, FORM_REG_IMM},
+    {"INR", 0x04, FORM_REG_HI}, {"DCR", 0x05, FORM_REG_HI},
+    {"ADD", 0x80, FORM_REG_LO}, {"ADC", 0x88, FORM_REG_LO},
+    {"SUB", 0x90, FORM_REG_LO}, {"SBB", 0x98, FORM_REG_LO},
+    {"ANA", 0xA0, FORM_REG_LO}, {"XRA", 0xA8, FORM_REG_LO},
+    {"ORA", 0xB0, FORM_REG_LO}, {"CMP", 0xB8, FORM_REG_LO},
+
+    {"LXI", 0x01, FORM_RP_IMM},
+    {"PUSH", 0xC5, FORM_RP}, {"POP", 0xC1, FORM_RP}, {"DAD", 0x09, FORM_RP},
+    {"INX", 0x03, FORM_RP}, {"DCX", 0x0B, FORM_RP},
+    {"LDAX", 0x0A, FORM_RP_BD}, {"STAX", 0x02, FORM_RP_BD},
+
+    {"ADI", 0xC6, FORM_IMM}, {"ACI", 0xCE, FORM_IMM},
+    {"SUI", 0xD6, FORM_IMM}, {"SBI", 0xDE, FORM_IMM},
+    {"ANI", 0xE6, FORM_IMM}, {"XRI", 0xEE, FORM_IMM},
+    {"ORI", 0xF6, FORM_IMM}, {"CPI", 0xFE, FORM_IMM},
+    {"IN", 0xDB, FORM_IMM}, {"OUT", 0xD3, FORM_IMM},
+
+    {"JMP", 0xC3, FORM_IMM}, {"JNZ", 0xC2, FORM_IMM}, {"JZ", 0xCA, FORM_IMM},
+    {"JNC", 0xD2, FORM_IMM}, {"JC", 0xDA, FORM_IMM}, {"JPO", 0xE2, FORM_IMM},
+    {"JPE", 0xEA, FORM_IMM}, {"JP", 0xF2, FORM_IMM}, {"JM", 0xFA, FORM_IMM},
+    {"CALL", 0xCD, FORM_IMM}, {"CNZ", 0xC4, FORM_IMM}, {"CZ", 0xCC, FORM_IMM},
+    {"CNC", 0xD4, FORM_IMM}, {"CC", 0xDC, FORM_IMM}, {"CPO", 0xE4, FORM_IMM},
+    {"CPE", 0xEC, FORM_IMM}, {"CP", 0xF4, FORM_IMM}, {"CM", 0xFC, FORM_IMM},
+    {"LDA", 0x3A, FORM_IMM}, {"STA", 0x32, FORM_IMM},
+    {"LHLD", 0x2A, FORM_IMM}, {"SHLD", 0x22, FORM_IMM},
+
+    {"RST", 0xC7, FORM_RST},
 };
 
-static int reg_num(char c) {
-    switch (toupper(c)) {
+#define ENCODING_COUNT (sizeof(ENCODINGS) / sizeof(ENCODINGS[0]))
+
+// Perfect hash over mnemonics packed into a 64-bit integer (up to 8
+// characters, upper case, first character in the low byte). The multiplier
+// was searched for offline so that every entry of ENCODINGS gets a slot of
+// its own; init_mnemonics() checks this, so after adding an entry, search
+// again if it reports a collision.
+#define MNEMONIC_BITS 9
+#define MNEMONIC_MUL  0x1896877522784AC3ULL
+
+static struct {
+    uint64_t key;
+    const Encoding *enc;
+} mnemonic_table[1 << MNEMONIC_BITS];
+
+static uint64_t pack_mnemonic(const char *s, size_t len) {
+    if (len == 0 || len > 8) return 0;
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++) {
+        key |= (uint64_t)(uint8_t)toupper((unsigned char)s[i]) << (8 * i);
+    }
+    return key;
+}
+
+static unsigned mnemonic_slot(uint64_t key) {
+    return (key * MNEMONIC_MUL) >> (64 - MNEMONIC_BITS);
+}
+
+static void init_mnemonics(void) {
+    for (size_t i = 0; i < ENCODING_COUNT; i++) {
+        uint64_t key = pack_mnemonic(ENCODINGS[i].name, strlen(ENCODINGS[i].name));
+        unsigned slot = mnemonic_slot(key);
+        if (mnemonic_table[slot].enc) {
+            fprintf(stderr, "Internal error: mnemonic hash collision between %s and %s\n",
+                    ENCODINGS[i].name, mnemonic_table[slot].enc->name);
+            exit(1);
+        }
+        mnemonic_table[slot].key = key;
+        mnemonic_table[slot].enc = &ENCODINGS[i];
+    }
+}
+
+static const Encoding *find_mnemonic(Span s) {
+    uint64_t key = pack_mnemonic(s.ptr, s.len);
+    if (!key) return NULL;
+    unsigned slot = mnemonic_slot(key);
+    return mnemonic_table[slot].key == key ? mnemonic_table[slot].enc : NULL;
+}
+
+static int reg_num(Span s) {
+    if (!s.len) return -1;
+    switch (toupper((unsigned char)s.ptr[0])) {
         case 'B': return 0; case 'C': return 1;
         case 'D': return 2; case 'E': return 3;
         case 'H': return 4; case 'L': return 5;
@@ -56,121 +236,460 @@ static int reg_num(char c) {
     }
 }
 
-static int rp_num(const char *s) {
-    if (toupper(s[0]) == 'B') return 0;
-    if (toupper(s[0]) == 'D') return 1;
-    if (toupper(s[0]) == 'H') return 2;
-    if (strncasecmp(s, "SP", 2) == 0) return 3;
-    if (strncasecmp(s, "PSW", 3) == 0) return 3;
+static int rp_num(Span s) {
+    if (!s.len) return -1;
+    switch (toupper((unsigned char)s.ptr[0])) {
+        case 'B': return 0;
+        case 'D': return 1;
+        case 'H': return 2;
+    }
+    if (s.len >= 2 && strncasecmp(s.ptr, "SP", 2) == 0) return 3;
+    if (s.len >= 3 && strncasecmp(s.ptr, "PSW", 3) == 0) return 3;
     return -1;
 }
 
-static void add_label(const char *name) {
-    if (label_count >= MAX_LABELS) {
-        fprintf(stderr, "Error: too many labels\n");
+// Grow a dynamic array so it can hold at least `need` elements
+static void *grow(void *ptr, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return ptr;
+    size_t new_cap = *cap ? *cap * 2 : 256;
+    while (new_cap < need) new_cap *= 2;
+    ptr = realloc(ptr, new_cap * elem);
+    if (!ptr) {
+        fprintf(stderr, "Error: out of memory\n");
         exit(1);
     }
-    size_t len = strlen(name);
-    if (len >= sizeof(labels[0].name)) len = sizeof(labels[0].name) - 1;
-    memcpy(labels[label_count].name, name, len);
-    labels[label_count].name[len] = '\0';
-    labels[label_count].addr = current_addr;
-    label_count++;
+    *cap = new_cap;
+    return ptr;
 }
 
-static int lookup_label(const char *name, uint16_t *addr) {
-    for (int i = 0; i < label_count; i++) {
-        if (strcasecmp(labels[i].name, name) == 0) {
-            *addr = labels[i].addr;
-            return 1;
+// Symbol table: open addressing with linear probing, keyed case-insensitively.
+// Names live in an arena that is never freed; the table doubles when 3/4 full.
+typedef struct {
+    const char *name;  // NULL for an empty slot
+    uint32_t len;
+    uint32_t hash;
+    uint16_t addr;     // Offset into the section, or the value for SEC_ABS
+    uint8_t section;
+    uint8_t flags;     // SYM_PUBLIC, LABEL_EQU
+    uint32_t index;    // In the object's symbol table
+} Label;
+
+#define LABEL_EQU 0x80  // A value rather than an address; not written to objects
+
+#define ARENA_CHUNK 65536
+
+static Label *labels = NULL;
+static size_t label_cap = 0;
+static size_t label_count = 0;
+static Label *last_label = NULL;  // Most recent definition, for EQU
+
+static char *arena_chunk = NULL;  // Newest; each starts with a pointer to the one before
+static char *arena_ptr = NULL;
+static size_t arena_left = 0;
+
+static char *arena_alloc(size_t size) {
+    if (size > arena_left) {
+        size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        char *block = malloc(sizeof(char *) + chunk);
+        if (!block) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
         }
+        *(char **)block = arena_chunk;
+        arena_chunk = block;
+        arena_ptr = block + sizeof(char *);
+        arena_left = chunk;
     }
-    return 0;
+    char *dst = arena_ptr;
+    arena_ptr += size;
+    arena_left -= size;
+    return dst;
 }
 
-static uint16_t parse_number(const char *s) {
-    if (!s || !*s) return 0;
-
-    int len = strlen(s);
+static char *arena_strdup(const char *s, size_t len) {
+    char *dst = arena_alloc(len + 1);
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    return dst;
+}
 
-    // Hex with H suffix
-    if (toupper(s[len-1]) == 'H') {
-        return (uint16_t)strtol(s, NULL, 16);
+// FNV-1a over the upper-cased name
+static uint32_t hash_name(Span name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.len; i++) {
+        h = (h ^ (uint8_t)toupper((unsigned char)name.ptr[i])) * 16777619u;
     }
-    // Hex with 0x prefix
-    if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
-        return (uint16_t)strtol(s + 2, NULL, 16);
+    return h;
+}
+
+static Label *find_slot(Label *table, size_t cap, Span name, uint32_t hash) {
+    size_t i = hash & (cap - 1);
+    while (table[i].name) {
+        if (table[i].hash == hash && table[i].len == name.len &&
+            strncasecmp(table[i].name, name.ptr, name.len) == 0) break;
+        i = (i + 1) & (cap - 1);
     }
-    // Binary with B suffix
-    if (toupper(s[len-1]) == 'B' && s[0] != '0') {
-        char tmp[32];
-        int copylen = len - 1;
-        if (copylen > 31) copylen = 31;
-        memcpy(tmp, s, copylen);
-        tmp[copylen] = '\0';
-        return (uint16_t)strtol(tmp, NULL, 2);
+    return &table[i];
+}
+
+static void grow_labels(void) {
+    size_t new_cap = label_cap ? label_cap * 2 : 1024;
+    Label *table = calloc(new_cap, sizeof(Label));
+    if (!table) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
     }
-    // Character literal
-    if (s[0] == '\'' && len >= 2) {
-        return (uint8_t)s[1];
+    for (size_t i = 0; i < label_cap; i++) {
+        if (labels[i].name) {
+            Span name = { labels[i].name, labels[i].len };
+            *find_slot(table, new_cap, name, labels[i].hash) = labels[i];
+        }
     }
-    // Decimal
-    return (uint16_t)atoi(s);
+    free(labels);
+    labels = table;
+    label_cap = new_cap;
 }
 
-static int parse_operand(const char *s, uint16_t *val) {
-    if (!s || !*s) return 0;
+static void add_label(Span name) {
+    if ((label_count + 1) * 4 > label_cap * 3) grow_labels();
 
-    // Is it a number?
-    if (isdigit(s[0]) || s[0] == '\'' ||
-        (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))) {
-        *val = parse_number(s);
-        return 1;
+    uint32_t hash = hash_name(name);
+    Label *slot = find_slot(labels, label_cap, name, hash);
+    if (slot->name) {
+        error("duplicate label '%.*s'", (int)name.len, name.ptr);
+        last_label = NULL;
+        return;
     }
+    slot->name = arena_strdup(name.ptr, name.len);
+    slot->len = name.len;
+    slot->hash = hash;
+    slot->addr = current_addr;
+    slot->section = section;
+    slot->flags = 0;
+    last_label = slot;
+    label_count++;
+}
 
-    // Try label lookup
-    if (lookup_label(s, val)) {
-        return 1;
-    }
+static Label *find_label(Span name) {
+    if (!label_count) return NULL;
+    Label *slot = find_slot(labels, label_cap, name, hash_name(name));
+    return slot->name ? slot : NULL;
+}
 
-    // On pass 1, assume unknown identifiers are forward references
-    if (pass == 1) {
-        *val = 0;
-        return 1;
+static int digit_value(int c) {
+    c = toupper(c);
+    if (isdigit(c)) return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 99;
+}
+
+static int parse_digits(const char *p, const char *end, int base, uint16_t *val) {
+    if (p == end) return 0;
+    uint16_t v = 0;
+    for (; p < end; p++) {
+        int d = digit_value((unsigned char)*p);
+        if (d >= base) return 0;
+        v = v * base + d;
     }
+    *val = v;
+    return 1;
+}
+
+// A numeric literal: decimal, hex with an H suffix or 0x prefix, binary with
+// a B suffix. Returns 0 if it is malformed.
+static int parse_number(Span s, uint16_t *val) {
+    const char *p = s.ptr, *end = s.ptr + s.len;
+    int last = toupper((unsigned char)end[-1]);
+    int hex_prefix = s.len > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+
+    if (last == 'H') return parse_digits(hex_prefix ? p + 2 : p, end - 1, 16, val);
+    if (hex_prefix) return parse_digits(p + 2, end, 16, val);
+    if (last == 'B') return parse_digits(p, end - 1, 2, val);
+    return parse_digits(p, end, 10, val);
+}
 
-    fprintf(stderr, "Line %d: undefined symbol '%s'\n", line_num, s);
+// Operand expressions. Constant subexpressions are folded while parsing;
+// one that still depends on an undefined or relocatable symbol is also
+// compiled to postfix code (obj8080.h) in expr_code[], which apply_fixups()
+// runs once every label is known. EX_SYM operands index expr_syms[].
+//
+// Precedence, loosest first: OR | XOR ^, AND &, comparisons (EQ = NE <>
+// LT < GT > LE <= GE >=, true is FFFFh), SHL << SHR >>, + -, * / MOD %,
+// then the unary operators - + NOT ~ HIGH LOW.
+static uint8_t *expr_code = NULL;
+static size_t expr_len = 0, expr_cap = 0;
+static Span *expr_syms = NULL;
+static size_t expr_sym_count = 0, expr_sym_cap = 0;
+
+typedef struct {
+    const char *p, *end;
+    const char *error;  // First syntax error, NULL if none
+} ExprParser;
+
+typedef struct {
+    int known;
+    uint16_t val;
+} ExprVal;
+
+static void expr_put(const uint8_t *bytes, size_t n) {
+    expr_code = grow(expr_code, &expr_cap, expr_len + n, 1);
+    memcpy(expr_code + expr_len, bytes, n);
+    expr_len += n;
+}
+
+static void expr_push(uint16_t val) {
+    uint8_t op[3] = { EX_PUSH, val & 0xFF, val >> 8 };
+    expr_put(op, 3);
+}
+
+// Insert a constant before code already emitted from `mark` on, for a
+// known left operand whose right operand turned out not to be
+static void expr_push_at(size_t mark, uint16_t val) {
+    expr_push(val);
+    uint8_t op[3];
+    memcpy(op, expr_code + expr_len - 3, 3);
+    memmove(expr_code + mark + 3, expr_code + mark, expr_len - 3 - mark);
+    memcpy(expr_code + mark, op, 3);
+}
+
+static void expr_sym(Span name) {
+    expr_syms = grow(expr_syms, &expr_sym_cap, expr_sym_count + 1, sizeof(Span));
+    expr_syms[expr_sym_count] = name;
+    uint32_t i = expr_sym_count++;
+    uint8_t op[5] = { EX_SYM, i & 0xFF, (i >> 8) & 0xFF, (i >> 16) & 0xFF, i >> 24 };
+    expr_put(op, 5);
+}
+
+static int is_ident_char(int c) {
+    return isalnum(c) || c == '_' || c == '?' || c == '@' || c == '.';
+}
+
+static void expr_skip_ws(ExprParser *e) {
+    while (e->p < e->end && (*e->p == ' ' || *e->p == '\t')) e->p++;
+}
+
+static void expr_fail(ExprParser *e, const char *msg) {
+    if (!e->error) e->error = msg;
+    e->p = e->end;
+}
+
+// Identifier or number starting at the parser position
+static Span expr_word(ExprParser *e) {
+    Span w = { e->p, 0 };
+    while (e->p < e->end && is_ident_char((unsigned char)*e->p)) e->p++;
+    w.len = e->p - w.ptr;
+    return w;
+}
+
+// Binary operator at the parser position, without consuming it. Returns
+// its precedence, or 0 if there is none.
+static int peek_binary(ExprParser *e, int *op, size_t *len) {
+    expr_skip_ws(e);
+    if (e->p >= e->end) return 0;
+    const char *p = e->p;
+    size_t left = e->end - p;
+    *len = 1;
+    switch (*p) {
+        case '|': *op = EX_OR;  return 1;
+        case '^': *op = EX_XOR; return 1;
+        case '&': *op = EX_AND; return 2;
+        case '=': *op = EX_EQ;  return 3;
+        case '+': *op = EX_ADD; return 5;
+        case '-': *op = EX_SUB; return 5;
+        case '*': *op = EX_MUL; return 6;
+        case '/': *op = EX_DIV; return 6;
+        case '%': *op = EX_MOD; return 6;
+        case '<':
+        case '>': {
+            char next = left >= 2 ? p[1] : 0;
+            *len = 2;
+            if (next == p[0]) { *op = p[0] == '<' ? EX_SHL : EX_SHR; return 4; }
+            if (next == '=') { *op = p[0] == '<' ? EX_LE : EX_GE; return 3; }
+            if (p[0] == '<' && next == '>') { *op = EX_NE; return 3; }
+            *len = 1;
+            *op = p[0] == '<' ? EX_LT : EX_GT;
+            return 3;
+        }
+    }
+    static const struct { const char *name; int op, prec; } WORDS[] = {
+        { "OR", EX_OR, 1 }, { "XOR", EX_XOR, 1 }, { "AND", EX_AND, 2 },
+        { "EQ", EX_EQ, 3 }, { "NE", EX_NE, 3 }, { "LT", EX_LT, 3 },
+        { "GT", EX_GT, 3 }, { "LE", EX_LE, 3 }, { "GE", EX_GE, 3 },
+        { "SHL", EX_SHL, 4 }, { "SHR", EX_SHR, 4 }, { "MOD", EX_MOD, 6 },
+    };
+    size_t n = 0;
+    while (n < left && is_ident_char((unsigned char)p[n])) n++;
+    for (size_t i = 0; i < sizeof(WORDS) / sizeof(WORDS[0]); i++) {
+        if (strlen(WORDS[i].name) == n && strncasecmp(p, WORDS[i].name, n) == 0) {
+            *op = WORDS[i].op;
+            *len = n;
+            return WORDS[i].prec;
+        }
+    }
     return 0;
 }
 
-static void flush_hex(void) {
-    if (hex_count == 0) return;
+static ExprVal parse_expr(ExprParser *e, int min_prec);
+
+static ExprVal parse_unary(ExprParser *e) {
+    ExprVal v = { 1, 0 };
+    int op = -1;
+
+    expr_skip_ws(e);
+    if (e->p >= e->end) {
+        expr_fail(e, "missing operand");
+        return v;
+    }
+
+    char c = *e->p;
+    if (c == '(') {
+        e->p++;
+        v = parse_expr(e, 1);
+        expr_skip_ws(e);
+        if (e->p < e->end && *e->p == ')') e->p++;
+        else expr_fail(e, "missing ')'");
+        return v;
+    }
+    if (c == '-' || c == '+' || c == '~') {
+        e->p++;
+        op = c == '-' ? EX_NEG : c == '~' ? EX_NOT : -1;
+        if (op < 0) return parse_unary(e);
+    } else if (c == '$' || c == '*') {
+        e->p++;
+        v.val = current_addr;
+        if (section != SEC_ABS) {
+            // Relative to a section base the linker picks
+            uint8_t op[4] = { EX_REL, section, current_addr & 0xFF, current_addr >> 8 };
+            expr_put(op, 4);
+            if (!forward_ref.ptr) forward_ref = (Span){ e->p - 1, 1 };
+            v.known = 0;
+        }
+        return v;
+    } else if (c == '\'') {
+        // One or two characters, the first in the high byte
+        const char *q = e->p + 1;
+        while (q < e->end && *q != '\'') q++;
+        size_t n = q - (e->p + 1);
+        if (q >= e->end || n == 0 || n > 2) {
+            expr_fail(e, "bad character constant");
+            return v;
+        }
+        for (const char *c = e->p + 1; c < q; c++) v.val = (v.val << 8) | (uint8_t)*c;
+        e->p = q + 1;
+        return v;
+    } else if (isdigit((unsigned char)c)) {
+        Span w = expr_word(e);
+        if (!parse_number(w, &v.val)) expr_fail(e, "bad number");
+        return v;
+    } else if (is_ident_char((unsigned char)c)) {
+        Span w = expr_word(e);
+        if (w.len == 4 && strncasecmp(w.ptr, "HIGH", 4) == 0) op = EX_HIGH;
+        else if (w.len == 3 && strncasecmp(w.ptr, "LOW", 3) == 0) op = EX_LOW;
+        else if (w.len == 3 && strncasecmp(w.ptr, "NOT", 3) == 0) op = EX_NOT;
+        else {
+            const Label *l = find_label(w);
+            if (l && l->section == SEC_ABS) {
+                v.val = l->addr;
+                return v;
+            }
+            if (!forward_ref.ptr) forward_ref = w;
+            expr_sym(w);
+            v.known = 0;
+            return v;
+        }
+    } else {
+        expr_fail(e, "unexpected character");
+        return v;
+    }
+
+    v = parse_unary(e);
+    if (v.known) {
+        v.val = expr_unary(op, v.val);
+    } else {
+        uint8_t b = op;
+        expr_put(&b, 1);
+    }
+    return v;
+}
 
-    uint8_t checksum = hex_count + (hex_addr >> 8) + (hex_addr & 0xFF);
-    fprintf(outfile, ":%02X%04X00", hex_count, hex_addr);
-    for (int i = 0; i < hex_count; i++) {
-        fprintf(outfile, "%02X", hex_buf[i]);
-        checksum += hex_buf[i];
+// Precedence climbing over left-associative binary operators
+static ExprVal parse_expr(ExprParser *e, int min_prec) {
+    ExprVal lhs = parse_unary(e);
+    int op, prec;
+    size_t len;
+
+    while ((prec = peek_binary(e, &op, &len)) >= min_prec) {
+        e->p += len;
+        size_t mark = expr_len;
+        ExprVal rhs = parse_expr(e, prec + 1);
+
+        if (lhs.known && rhs.known) {
+            int r = expr_binary(op, lhs.val, rhs.val);
+            if (r < 0) {
+                expr_fail(e, "division by zero");
+                r = 0;
+            }
+            lhs.val = r;
+            continue;
+        }
+        if (lhs.known) expr_push_at(mark, lhs.val);
+        if (rhs.known) expr_push(rhs.val);
+        uint8_t b = op;
+        expr_put(&b, 1);
+        lhs.known = 0;
     }
-    fprintf(outfile, "%02X\n", (uint8_t)(~checksum + 1));
-    hex_count = 0;
+    return lhs;
 }
 
-static void emit_byte(uint8_t b) {
-    if (pass == 1) {
-        current_addr++;
-        return;
+// Evaluate an operand. If it depends on an identifier that is not defined
+// yet it evaluates to 0; forward_ref names the identifier and the code from
+// pending_expr on computes the value, for the emitter to record a fixup.
+static int parse_operand(Span s, uint16_t *val) {
+    forward_ref.ptr = NULL;
+    pending_expr = expr_len;
+    if (!s.len) return 0;
+
+    ExprParser e = { s.ptr, s.ptr + s.len, NULL };
+    ExprVal v = parse_expr(&e, 1);
+    if (!e.error && e.p < e.end) e.error = "unexpected character";
+
+    if (e.error) {
+        error("%s in expression '%.*s'", e.error, (int)s.len, s.ptr);
+        v.known = 1;
+        v.val = 0;
+    }
+    if (v.known) {
+        // Anything compiled for a subexpression is dead
+        forward_ref.ptr = NULL;
+        expr_len = pending_expr;
     }
+    *val = v.known ? v.val : 0;
+    return 1;
+}
 
-    if (hex_count == 0) {
-        hex_addr = current_addr;
+// For directives whose value must be known on the spot (ORG, DS, EQU)
+static int parse_operand_now(Span s, uint16_t *val, const char *what) {
+    if (!parse_operand(s, val)) return 0;
+    if (forward_ref.ptr) {
+        error("%s needs an absolute value defined earlier, '%.*s' is not",
+              what, (int)forward_ref.len, forward_ref.ptr);
+        *val = 0;
+        forward_ref.ptr = NULL;
+        expr_len = pending_expr;
     }
-    hex_buf[hex_count++] = b;
-    current_addr++;
+    return 1;
+}
 
-    if (hex_count >= 16) {
-        flush_hex();
+static void emit_byte(uint8_t b) {
+    if (!segment_open) {
+        segments = grow(segments, &segment_cap, segment_count + 1, sizeof(Segment));
+        segments[segment_count++] = (Segment){ current_addr, section, code_len, 0 };
+        segment_open = 1;
     }
+    code = grow(code, &code_cap, code_len + 1, 1);
+    code[code_len++] = b;
+    segments[segment_count - 1].len++;
+    current_addr++;
 }
 
 static void emit_word(uint16_t w) {
@@ -178,304 +697,1671 @@ static void emit_word(uint16_t w) {
     emit_byte(w >> 8);
 }
 
-static char *skip_ws(char *p) {
-    while (*p && (*p == ' ' || *p == '\t')) p++;
+// Emit an operand value, recording a fixup if it was a forward reference
+static void emit_value(uint16_t val, int size) {
+    if (forward_ref.ptr) {
+        fixups = grow(fixups, &fixup_cap, fixup_count + 1, sizeof(Fixup));
+        fixups[fixup_count++] = (Fixup){ pending_expr, expr_len - pending_expr,
+                                         code_len, size, line_num, file_name };
+        forward_ref.ptr = NULL;
+    } else if (size == 1 && !EXPR_FITS_BYTE(val)) {
+        error("value %04Xh does not fit in a byte", val);
+    }
+    if (size == 1) emit_byte(val & 0xFF);
+    else emit_word(val);
+}
+
+// Names listed by PUBLIC, checked once the source is done
+typedef struct {
+    Span name;
+    int line;
+    const char *file;
+} Public;
+
+static Public *publics = NULL;
+static size_t public_count = 0, public_cap = 0;
+
+static void add_public(Span name) {
+    publics = grow(publics, &public_cap, public_count + 1, sizeof(Public));
+    publics[public_count++] = (Public){ name, line_num, file_name };
+}
+
+static void add_extern(Span name) {
+    add_label(name);
+    if (last_label) {
+        last_label->section = SEC_EXTERN;
+        last_label->addr = 0;
+    }
+}
+
+static void mark_publics(void) {
+    for (size_t i = 0; i < public_count; i++) {
+        const Public *pub = &publics[i];
+        Label *l = find_label(pub->name);
+        if (!l || l->section == SEC_EXTERN) {
+            error_at(pub->file, pub->line, "PUBLIC symbol '%.*s' is not defined here",
+                     (int)pub->name.len, pub->name.ptr);
+            continue;
+        }
+        l->flags |= SYM_PUBLIC;
+    }
+}
+
+// Object output: every label, plus relocations for the fixups whose value
+// depends on where the linker puts a section or on another module
+static ObjSymbol *obj_symbols = NULL;
+static ObjReloc *relocs = NULL;
+static size_t reloc_count = 0, reloc_cap = 0;
+static uint8_t *reloc_expr = NULL;
+static size_t reloc_expr_len = 0, reloc_expr_cap = 0;
+
+static void build_symbols(void) {
+    size_t cap = 0;
+    obj_symbols = grow(NULL, &cap, label_count, sizeof(ObjSymbol));
+    size_t n = 0;
+    for (size_t i = 0; i < label_cap; i++) {
+        Label *l = &labels[i];
+        if (!l->name) continue;
+        l->index = n;
+        obj_symbols[n++] = (ObjSymbol){ l->name, l->addr, l->section, l->flags & SYM_PUBLIC };
+    }
+}
+
+static void reloc_put(const uint8_t *bytes, size_t n) {
+    reloc_expr = grow(reloc_expr, &reloc_expr_cap, reloc_expr_len + n, 1);
+    memcpy(reloc_expr + reloc_expr_len, bytes, n);
+    reloc_expr_len += n;
+}
+
+// Copy a fixup's code for the linker: labels defined here become constants
+// or section offsets, externals become indices into the symbol table
+static void add_reloc(const Fixup *f) {
+    const uint8_t *pc = expr_code + f->expr, *end = pc + f->expr_len;
+    uint32_t start = reloc_expr_len;
+
+    while (pc < end) {
+        int op = *pc++;
+        size_t n = EX_OPERAND_SIZE(op);
+        if (op != EX_SYM) {
+            reloc_put(pc - 1, n + 1);
+            pc += n;
+            continue;
+        }
+
+        uint32_t i = pc[0] | (pc[1] << 8) | (pc[2] << 16) | ((uint32_t)pc[3] << 24);
+        const Label *l = find_label(expr_syms[i]);
+        pc += n;
+        if (l->section == SEC_EXTERN) {
+            uint32_t x = l->index;
+            uint8_t sym[5] = { EX_SYM, x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, x >> 24 };
+            reloc_put(sym, 5);
+        } else if (l->section == SEC_ABS) {
+            uint8_t push[3] = { EX_PUSH, l->addr & 0xFF, l->addr >> 8 };
+            reloc_put(push, 3);
+        } else {
+            uint8_t rel[4] = { EX_REL, l->section, l->addr & 0xFF, l->addr >> 8 };
+            reloc_put(rel, 4);
+        }
+    }
+
+    relocs = grow(relocs, &reloc_cap, reloc_count + 1, sizeof(ObjReloc));
+    relocs[reloc_count++] = (ObjReloc){ f->offset, start, reloc_expr_len - start, f->size, f->line };
+}
+
+// While resolving fixups: symbols in other sections or modules are left to
+// the linker, undefined ones are reported
+static int fixup_sym(void *ctx, uint32_t index, uint16_t *val) {
+    const Label *l = find_label(expr_syms[index]);
+    if (!l) {
+        const Fixup *f = ctx;
+        error_at(f->file, f->line, "undefined symbol '%.*s'",
+                 (int)expr_syms[index].len, expr_syms[index].ptr);
+        return 0;
+    }
+    if (l->section != SEC_ABS) return 0;
+    *val = l->addr;
+    return 1;
+}
+
+static int fixup_rel(void *ctx, int sec, uint16_t offset, uint16_t *val) {
+    (void)ctx; (void)sec; (void)offset; (void)val;
+    return 0;
+}
+
+static void apply_fixups(void) {
+    for (size_t i = 0; i < fixup_count; i++) {
+        const Fixup *f = &fixups[i];
+        int errors = error_count;
+        ExprEnv env = { fixup_sym, fixup_rel, (void *)f };
+        uint16_t val;
+        int status = expr_eval(expr_code + f->expr, f->expr_len, &env, &val);
+
+        if (status == EXPR_UNRESOLVED) {
+            // Only object output has anything left for the linker
+            if (error_count == errors) add_reloc(f);
+            continue;
+        }
+        if (status != EXPR_OK) {
+            error_at(f->file, f->line, "%s", expr_error(status));
+            continue;
+        }
+        if (f->size == 1 && !EXPR_FITS_BYTE(val)) {
+            error_at(f->file, f->line, "value %04Xh does not fit in a byte", val);
+        }
+        code[f->offset] = val & 0xFF;
+        if (f->size == 2) code[f->offset + 1] = val >> 8;
+    }
+}
+
+// Source text. Regular files are mapped, anything else (a pipe, stdin) is
+// read into memory; either way it stays valid until exit so that tokens
+// and fixups can point into it. The library reads INCLUDE files with
+// stdio, which is all some of its hosts have, and frees them when done.
+typedef struct {
+    const char *data;
+    size_t len;
+} Source;
+
+#ifdef ASM8080_LIBRARY
+static int load_source(const char *name, Source *src) {
+    FILE *f = fopen(name, "rb");
+    if (!f) return -1;
+    char *buf = NULL;
+    size_t len = 0, cap = 0, n;
+    do {
+        buf = grow(buf, &cap, len + 4096, 1);
+        n = fread(buf + len, 1, cap - len, f);
+        len += n;
+    } while (n);
+    fclose(f);
+    src->data = buf;
+    src->len = len;
+    return 0;
+}
+#else
+static int load_source(const char *name, Source *src) {
+    int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src->len = st.st_size;
+        src->data = "";
+        if (src->len) {
+            void *map = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            src->data = map;
+        }
+    } else {
+        char *buf = NULL;
+        size_t len = 0, cap = 0;
+        for (;;) {
+            buf = grow(buf, &cap, len + 65536, 1);
+            ssize_t n = read(fd, buf + len, cap - len);
+            if (n < 0) {
+                close(fd);
+                return -1;
+            }
+            if (n == 0) break;
+            len += n;
+        }
+        src->data = buf;
+        src->len = len;
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    return 0;
+}
+#endif
+
+static const char *skip_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
     return p;
 }
 
-static char *get_token(char *p, char *buf, int buflen) {
-    p = skip_ws(p);
-    int i = 0;
-    while (*p && !isspace(*p) && *p != ',' && *p != ';' && *p != ':' && i < buflen - 1) {
-        buf[i++] = *p++;
+static const char *get_token(const char *p, const char *end, Span *tok) {
+    p = skip_ws(p, end);
+    tok->ptr = p;
+    while (p < end && !isspace((unsigned char)*p) && *p != ',' && *p != ';' && *p != ':') p++;
+    tok->len = p - tok->ptr;
+    return p;
+}
+
+// An operand runs to the next comma or comment outside quotes and
+// parentheses, minus trailing blanks
+static const char *get_operand(const char *p, const char *end, Span *tok) {
+    int depth = 0, quoted = 0;
+    p = skip_ws(p, end);
+    tok->ptr = p;
+    for (; p < end; p++) {
+        if (*p == '\'') quoted = !quoted;
+        else if (quoted) continue;
+        else if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        else if ((*p == ',' && depth <= 0) || *p == ';') break;
     }
-    buf[i] = '\0';
+    const char *last = p;
+    while (last > tok->ptr && (last[-1] == ' ' || last[-1] == '\t')) last--;
+    tok->len = last - tok->ptr;
     return p;
 }
 
-static void process_line(char *line) {
-    char label[32] = "", mnem[16] = "", op1[32] = "", op2[32] = "";
-    char *p = line;
+// A source line split into fields. Spans point into the source, or into
+// the arena for macro lines with arguments substituted.
+#define MAX_OPERANDS 16
+
+typedef struct {
+    Span label;
+    Span mnem;
+    Span ops[MAX_OPERANDS];
+    int op_count;
+} Line;
+
+// Field 0 is the label, 1 the mnemonic, then the operands
+static Span *line_field(Line *line, int field) {
+    return field == 0 ? &line->label : field == 1 ? &line->mnem : &line->ops[field - 2];
+}
 
-    line_num++;
+// Split [p, end) into fields. Returns 0 for a blank or comment line.
+static int split_line(const char *p, const char *end, Line *line) {
+    line->label = (Span){ p, 0 };
+    line->mnem = (Span){ p, 0 };
+    line->op_count = 0;
 
-    // Skip leading whitespace
-    p = skip_ws(p);
-    if (!*p || *p == ';' || *p == '*') return;
+    p = skip_ws(p, end);
+    if (p == end || *p == ';' || *p == '*') return 0;
 
     // Check for label (identifier followed by colon)
-    char *colon = strchr(p, ':');
+    const char *colon = memchr(p, ':', end - p);
     if (colon && colon > p) {
         // Make sure it's not inside a string or after mnemonic
-        char *space = p;
-        while (space < colon && !isspace(*space)) space++;
+        const char *space = p;
+        while (space < colon && !isspace((unsigned char)*space)) space++;
         if (space >= colon) {
-            // It's a label
-            int len = colon - p;
-            if (len > 31) len = 31;
-            strncpy(label, p, len);
-            label[len] = '\0';
-            if (pass == 1) {
-                add_label(label);
-            }
+            line->label.ptr = p;
+            line->label.len = colon - p;
             p = colon + 1;
         }
     }
 
-    // Get mnemonic
-    p = get_token(p, mnem, sizeof(mnem));
-    if (!mnem[0]) return;
+    p = get_token(p, end, &line->mnem);
+
+    // "NAME MACRO" and "NAME EQU" may leave out the colon
+    if (!line->label.len && line->mnem.len) {
+        Span next;
+        const char *after = get_token(p, end, &next);
+        const Encoding *enc = next.len == 3 || next.len == 5 ? find_mnemonic(next) : NULL;
+        if (enc && (enc->form == FORM_MACRO || enc->form == FORM_EQU)) {
+            line->label = line->mnem;
+            line->mnem = next;
+            p = after;
+        }
+    }
 
-    // Get operands
-    p = skip_ws(p);
-    if (*p && *p != ';') {
-        p = get_token(p, op1, sizeof(op1));
-        p = skip_ws(p);
-        if (*p == ',') {
+    p = skip_ws(p, end);
+    if (p < end && *p != ';') {
+        for (;;) {
+            if (line->op_count == MAX_OPERANDS) {
+                error("more than %d operands", MAX_OPERANDS);
+                break;
+            }
+            p = get_operand(p, end, &line->ops[line->op_count++]);
+            if (p == end || *p != ',') break;
             p++;
-            p = get_token(p, op2, sizeof(op2));
         }
     }
+    return line->label.len || line->mnem.len;
+}
 
-    // Convert mnemonic to uppercase
-    for (int i = 0; mnem[i]; i++) mnem[i] = toupper(mnem[i]);
+// Macros and REPT blocks. Body lines are kept split into fields; a field
+// that mentions a parameter or LOCAL name also gets a list of pieces,
+// literal text and parameter references, to rebuild it from on expansion.
+#define MAX_PARAMS MAX_OPERANDS
+#define MAX_NESTING 64
 
-    // Directives
-    if (strcmp(mnem, "ORG") == 0) {
-        uint16_t addr;
-        parse_operand(op1, &addr);
-        if (pass == 2 && hex_count > 0) flush_hex();
-        current_addr = addr;
-        return;
+typedef struct {
+    uint8_t field;
+    int8_t param;  // Index into the arguments, -1 for literal text
+    Span text;
+} Piece;
+
+typedef struct {
+    Line line;
+    uint32_t piece_start, piece_count;
+} BodyLine;
+
+typedef struct Macro {
+    Span name;
+    Span params[MAX_PARAMS * 2];  // Parameters, then LOCAL names
+    int param_count, local_count;
+    BodyLine *body;
+    size_t body_count, body_cap;
+    Piece *pieces;
+    size_t piece_count, piece_cap;
+    struct Macro *next;  // Hash chain
+} Macro;
+
+#define MACRO_BUCKETS 256
+
+static Macro *macro_table[MACRO_BUCKETS];
+static Macro *recording = NULL;  // Body being recorded
+static int record_depth;         // MACRO/REPT blocks nested inside it
+static int rept_count;           // Passes for a REPT body, -1 for a MACRO
+static unsigned local_serial = 0;
+
+static Macro *find_macro(Span name) {
+    for (Macro *m = macro_table[hash_name(name) % MACRO_BUCKETS]; m; m = m->next) {
+        if (m->name.len == name.len && strncasecmp(m->name.ptr, name.ptr, name.len) == 0) return m;
     }
+    return NULL;
+}
 
-    if (strcmp(mnem, "DB") == 0 || strcmp(mnem, "DEFB") == 0) {
-        uint16_t val;
-        parse_operand(op1, &val);
-        emit_byte(val & 0xFF);
-        return;
+static int find_param(const Macro *m, Span name) {
+    for (int i = 0; i < m->param_count + m->local_count; i++) {
+        if (m->params[i].len == name.len && strncasecmp(m->params[i].ptr, name.ptr, name.len) == 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    if (strcmp(mnem, "DW") == 0 || strcmp(mnem, "DEFW") == 0) {
-        uint16_t val;
-        parse_operand(op1, &val);
-        emit_word(val);
+static void add_piece(Macro *m, int field, int param, const char *p, size_t len) {
+    m->pieces = grow(m->pieces, &m->piece_cap, m->piece_count + 1, sizeof(Piece));
+    m->pieces[m->piece_count++] = (Piece){ field, param, { p, len } };
+}
+
+// Split a field into pieces if it names a parameter; quoted text is literal
+static void record_field(Macro *m, int field, Span s) {
+    size_t first = m->piece_count;
+    const char *p = s.ptr, *end = s.ptr + s.len, *lit = p;
+    int quoted = 0;
+
+    while (p < end) {
+        if (*p == '\'') quoted = !quoted;
+        if (quoted || !is_ident_char((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        Span word = { p, 0 };
+        while (p < end && is_ident_char((unsigned char)*p)) p++;
+        word.len = p - word.ptr;
+        int param = find_param(m, word);
+        if (param < 0) continue;
+        if (word.ptr > lit) add_piece(m, field, -1, lit, word.ptr - lit);
+        add_piece(m, field, param, word.ptr, word.len);
+        lit = p;
+    }
+    if (m->piece_count > first && end > lit) add_piece(m, field, -1, lit, end - lit);
+}
+
+static void record_line(Line *line) {
+    Macro *m = recording;
+    m->body = grow(m->body, &m->body_cap, m->body_count + 1, sizeof(BodyLine));
+    BodyLine *b = &m->body[m->body_count++];
+    b->line = *line;
+    b->piece_start = m->piece_count;
+    for (int f = 0; f < line->op_count + 2; f++) record_field(m, f, *line_field(line, f));
+    b->piece_count = m->piece_count - b->piece_start;
+}
+
+// Input: the main source and INCLUDE files, read line by line, and macro
+// expansions, replayed from their recorded lines
+typedef struct {
+    const Macro *macro;  // NULL for a file
+    // Files
+    const char *p, *end;
+    const char *path;    // For resolving INCLUDE names
+    const char *name;    // For messages, NULL for the main source
+    int file;            // file_index
+    int line;
+    // Macros
+    size_t next;         // Body line
+    int repeat;          // REPT passes left after this one
+    int owned;           // A REPT body, freed when done
+    Span args[MAX_PARAMS * 2];
+} Input;
+
+static Input inputs[MAX_NESTING];
+static int input_depth = 0;
+
+// Each INCLUDE file is loaded once, however often it is included
+typedef struct {
+    const char *path;
+    Source src;
+} CachedFile;
+
+static CachedFile *file_cache = NULL;
+static size_t file_count = 0, file_cap = 0;
+
+// Returns the file's index in the cache, -1 if it cannot be read
+static int cached_source(const char *path) {
+    for (size_t i = 0; i < file_count; i++) {
+        if (strcmp(file_cache[i].path, path) == 0) return i;
+    }
+    Source src;
+    if (load_source(path, &src) < 0) return -1;
+    file_cache = grow(file_cache, &file_cap, file_count + 1, sizeof(CachedFile));
+    file_cache[file_count] = (CachedFile){ arena_strdup(path, strlen(path)), src };
+    return file_count++;
+}
+
+static Input *push_input(void) {
+    if (input_depth == MAX_NESTING) {
+        error("macros or INCLUDE files nested too deeply");
+        return NULL;
+    }
+    Input *in = &inputs[input_depth++];
+    memset(in, 0, sizeof(*in));
+    return in;
+}
+
+static void push_file(const Source *src, const char *path, const char *name, int file) {
+    Input *in = push_input();
+    if (!in) return;
+    in->p = src->data;
+    in->end = src->data + src->len;
+    in->path = path;
+    in->name = name;
+    in->file = file;
+}
+
+static void free_macro(Macro *m) {
+    free(m->body);
+    free(m->pieces);
+    free(m);
+}
+
+// Messages point at the innermost file; a macro's lines report the line
+// that invoked it
+static void pop_input(void) {
+    input_depth--;
+    if (inputs[input_depth].owned) free_macro((Macro *)inputs[input_depth].macro);
+    for (int i = input_depth - 1; i >= 0; i--) {
+        if (!inputs[i].macro) {
+            line_num = inputs[i].line;
+            file_name = inputs[i].name;
+            file_index = inputs[i].file;
+            break;
+        }
+    }
+}
+
+// Fresh names for a macro's LOCAL labels, once per expansion or REPT pass
+static void new_locals(Input *in) {
+    const Macro *m = in->macro;
+    for (int i = 0; i < m->local_count; i++) {
+        char name[16];
+        int len = snprintf(name, sizeof(name), "??%04X", local_serial++ & 0xFFFF);
+        in->args[m->param_count + i] = (Span){ arena_strdup(name, len), len };
+    }
+}
+
+// Returns 0 if nested too deeply
+static int push_macro(const Macro *m, const Line *call, int repeat) {
+    Input *in = push_input();
+    if (!in) return 0;
+    in->macro = m;
+    in->repeat = repeat;
+    if (call) {
+        if (call->op_count > m->param_count) {
+            error("too many arguments for %.*s", (int)m->name.len, m->name.ptr);
+        }
+        for (int i = 0; i < call->op_count && i < m->param_count; i++) in->args[i] = call->ops[i];
+    }
+    new_locals(in);
+    return 1;
+}
+
+// Replay a recorded line, rebuilding the fields that use arguments
+static void expand_line(const Input *in, const BodyLine *b, Line *line) {
+    const Piece *pieces = in->macro->pieces + b->piece_start;
+    *line = b->line;
+
+    for (uint32_t i = 0; i < b->piece_count;) {
+        int field = pieces[i].field;
+        uint32_t j;
+        size_t len = 0;
+        for (j = i; j < b->piece_count && pieces[j].field == field; j++) {
+            len += pieces[j].param < 0 ? pieces[j].text.len : in->args[pieces[j].param].len;
+        }
+        char *dst = arena_alloc(len), *q = dst;
+        for (; i < j; i++) {
+            Span s = pieces[i].param < 0 ? pieces[i].text : in->args[pieces[i].param];
+            memcpy(q, s.ptr, s.len);
+            q += s.len;
+        }
+        *line_field(line, field) = (Span){ dst, len };
+    }
+}
+
+// Next line to assemble from the innermost input; 0 when all are done
+static int next_line(Line *line) {
+    while (input_depth) {
+        Input *in = &inputs[input_depth - 1];
+
+        if (in->macro) {
+            if (in->next < in->macro->body_count) {
+                expand_line(in, &in->macro->body[in->next++], line);
+                line_text.ptr = NULL;
+                return 1;
+            }
+            if (in->repeat > 0) {
+                in->repeat--;
+                in->next = 0;
+                new_locals(in);
+                continue;
+            }
+            pop_input();
+            continue;
+        }
+
+        if (in->p >= in->end) {
+            pop_input();
+            continue;
+        }
+        const char *p = in->p;
+        const char *eol = memchr(p, '\n', in->end - p);
+        in->p = eol ? eol + 1 : in->end;
+        if (!eol) eol = in->end;
+        if (eol > p && eol[-1] == '\r') eol--;
+
+        line_num = ++in->line;
+        file_name = in->name;
+        file_index = in->file;
+        line_text = (Span){ p, eol - p };
+        if (split_line(p, eol, line) || keep_lines) return 1;
+    }
+    return 0;
+}
+
+// INCLUDE names are tried relative to the including file first
+static void include_file(Span operand) {
+    Span name = operand;
+    if (name.len >= 2 && (name.ptr[0] == '"' || name.ptr[0] == '\'') &&
+        name.ptr[name.len - 1] == name.ptr[0]) {
+        name.ptr++;
+        name.len -= 2;
+    }
+    if (!name.len) {
+        error("INCLUDE needs a file name");
         return;
     }
 
-    if (strcmp(mnem, "DS") == 0 || strcmp(mnem, "DEFS") == 0) {
-        uint16_t count;
-        parse_operand(op1, &count);
-        for (int i = 0; i < count; i++) emit_byte(0);
+    const char *base = NULL;
+    for (int i = input_depth - 1; i >= 0 && !base; i--) {
+        if (!inputs[i].macro) base = inputs[i].path;
+    }
+    const char *slash = base ? strrchr(base, '/') : NULL;
+    size_t dir_len = slash && name.ptr[0] != '/' ? (size_t)(slash - base + 1) : 0;
+
+    char *path = arena_alloc(dir_len + name.len + 1);
+    memcpy(path, base, dir_len);
+    memcpy(path + dir_len, name.ptr, name.len);
+    path[dir_len + name.len] = '\0';
+
+    int file = cached_source(path);
+    if (file < 0 && dir_len) {
+        path += dir_len;
+        file = cached_source(path);
+    }
+    if (file < 0) {
+        error("cannot open INCLUDE file '%.*s'", (int)name.len, name.ptr);
         return;
     }
+    push_file(&file_cache[file].src, path, path, file + 1);
+}
 
-    if (strcmp(mnem, "EQU") == 0) {
-        // For EQU, the label was already added with current_addr
-        // We need to update it with the actual value
-        if (pass == 1 && label[0]) {
+// Conditional assembly. Assembly is on when every enclosing condition is
+// true; IF lines inside a false block are only counted.
+#define MAX_CONDITIONS 32
+
+static struct {
+    uint8_t outer_on;  // Assembly was on around the IF
+    uint8_t value;
+    uint8_t in_else;
+} conditions[MAX_CONDITIONS];
+static int condition_depth = 0;
+static int assembly_on = 1;
+
+static void conditional(const Line *line, const Encoding *enc) {
+    if (enc->form == FORM_IF) {
+        if (condition_depth == MAX_CONDITIONS) {
+            error("IF nested too deeply");
+            return;
+        }
+        int value = 0;
+        if (assembly_on) {
             uint16_t val;
-            parse_operand(op1, &val);
-            // Update the last label's address
-            labels[label_count - 1].addr = val;
+            if (!line->op_count || !line->ops[0].len) {
+                error("%s needs an operand", enc->name);
+            } else if (enc->opcode == COND_IF) {
+                value = parse_operand_now(line->ops[0], &val, "IF") && val != 0;
+            } else {
+                int defined = find_label(line->ops[0]) != NULL;
+                value = enc->opcode == COND_IFDEF ? defined : !defined;
+            }
         }
+        conditions[condition_depth].outer_on = assembly_on;
+        conditions[condition_depth].value = value;
+        conditions[condition_depth].in_else = 0;
+        condition_depth++;
+    } else if (!condition_depth) {
+        error("%s without IF", enc->name);
         return;
+    } else if (enc->form == FORM_ELSE) {
+        if (conditions[condition_depth - 1].in_else) {
+            error("second ELSE for one IF");
+        }
+        conditions[condition_depth - 1].in_else = 1;
+    } else {
+        condition_depth--;
     }
 
-    // Simple opcodes
-    for (int i = 0; simple_ops[i].mnem; i++) {
-        if (strcmp(mnem, simple_ops[i].mnem) == 0) {
-            emit_byte(simple_ops[i].opcode);
-            return;
+    if (!condition_depth) {
+        assembly_on = 1;
+    } else {
+        int top = condition_depth - 1;
+        assembly_on = conditions[top].outer_on &&
+                      (conditions[top].in_else ? !conditions[top].value : conditions[top].value);
+    }
+}
+
+static void start_recording(const Line *line, const Encoding *enc) {
+    uint16_t count = 0;
+    Span name = line->label;
+
+    if (enc->form == FORM_MACRO) {
+        if (!name.len) {
+            error("MACRO needs a name");
+        } else if (find_mnemonic(name) || find_macro(name)) {
+            error("'%.*s' is already defined", (int)name.len, name.ptr);
+            name.len = 0;
         }
+    } else if (!line->op_count || !parse_operand_now(line->ops[0], &count, "REPT")) {
+        error("REPT needs a count");
+    }
+
+    recording = calloc(1, sizeof(Macro));
+    if (!recording) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
     }
+    recording->name = name;
+    record_depth = 0;
+    rept_count = enc->form == FORM_MACRO ? -1 : count;
 
+    if (enc->form == FORM_MACRO) {
+        for (int i = 0; i < line->op_count; i++) {
+            if (line->ops[i].len) recording->params[recording->param_count++] = line->ops[i];
+        }
+    }
+}
+
+// A line read while recording: nested blocks are kept as they are, LOCAL
+// of this block is taken here, the matching ENDM finishes it
+static void record(Line *line, int form) {
+    if (form == FORM_MACRO || form == FORM_REPT) {
+        record_depth++;
+    } else if (form == FORM_ENDM && record_depth > 0) {
+        record_depth--;
+    } else if (form == FORM_ENDM) {
+        Macro *m = recording;
+        recording = NULL;
+        if (rept_count < 0 && m->name.len) {
+            unsigned bucket = hash_name(m->name) % MACRO_BUCKETS;
+            m->next = macro_table[bucket];
+            macro_table[bucket] = m;
+        } else if (rept_count > 0 && m->body_count && push_macro(m, NULL, rept_count - 1)) {
+            inputs[input_depth - 1].owned = 1;
+        } else {
+            free_macro(m);
+        }
+        return;
+    } else if (form == FORM_LOCAL && record_depth == 0) {
+        for (int i = 0; i < line->op_count; i++) {
+            if (!line->ops[i].len) continue;
+            if (recording->local_count == MAX_PARAMS) {
+                error("more than %d LOCAL names", MAX_PARAMS);
+                break;
+            }
+            recording->params[recording->param_count + recording->local_count++] = line->ops[i];
+        }
+        return;
+    }
+    record_line(line);
+}
+
+// Encode an instruction or directive
+static void assemble(const Line *line, const Encoding *enc) {
+    Span op1 = line->op_count > 0 ? line->ops[0] : (Span){ line->mnem.ptr, 0 };
+    Span op2 = line->op_count > 1 ? line->ops[1] : (Span){ line->mnem.ptr, 0 };
     uint16_t val;
     int r, r2, rp;
+    uint8_t op = enc->opcode;
 
-    // MOV dst, src
-    if (strcmp(mnem, "MOV") == 0) {
-        r = reg_num(op1[0]);
-        r2 = reg_num(op2[0]);
-        if (r >= 0 && r2 >= 0) {
-            emit_byte(0x40 | (r << 3) | r2);
+    switch (enc->form) {
+    // Directives
+    case FORM_ORG:
+        parse_operand_now(op1, &val, "ORG");
+        segment_open = 0;
+        current_addr = val;
+        return;
+
+    case FORM_DB:
+    case FORM_DW:
+        if (!line->op_count) break;
+        for (int i = 0; i < line->op_count; i++) {
+            Span s = line->ops[i];
+            if (enc->form == FORM_DB && s.len > 2 && s.ptr[0] == '\'' && s.ptr[s.len - 1] == '\'' &&
+                !memchr(s.ptr + 1, '\'', s.len - 2)) {
+                // A string, one byte per character
+                for (size_t k = 1; k < s.len - 1; k++) emit_byte(s.ptr[k]);
+                continue;
+            }
+            parse_operand(s, &val);
+            emit_value(val, enc->form == FORM_DB ? 1 : 2);
+        }
+        return;
+
+    case FORM_DS:
+        parse_operand_now(op1, &val, "DS");
+        for (int i = 0; i < val; i++) emit_byte(0);
+        return;
+
+    case FORM_EQU:
+        // The label was added with current_addr; give it the value instead
+        if (line->label.len && parse_operand_now(op1, &val, "EQU") && last_label) {
+            last_label->addr = val;
+            last_label->section = SEC_ABS;
+            last_label->flags |= LABEL_EQU;
+        }
+        return;
+
+    case FORM_SECTION:
+        if (op != SEC_ABS && output_format != OUT_OBJ) {
+            error("%s needs object output (-f obj)", enc->name);
             return;
         }
-    }
+        section_addr[section] = current_addr;
+        section = op;
+        current_addr = section_addr[section];
+        segment_open = 0;
+        return;
+
+    case FORM_PUBLIC:
+        if (!line->op_count) break;
+        for (int i = 0; i < line->op_count; i++) add_public(line->ops[i]);
+        return;
+
+    case FORM_EXTRN:
+        if (output_format != OUT_OBJ) {
+            error("EXTRN needs object output (-f obj)");
+            return;
+        }
+        if (!line->op_count) break;
+        for (int i = 0; i < line->op_count; i++) add_extern(line->ops[i]);
+        return;
+
+    case FORM_INCLUDE:
+        if (!line->op_count) break;
+        include_file(op1);
+        return;
+
+    case FORM_ENDM:
+        error("ENDM without MACRO or REPT");
+        return;
+
+    case FORM_LOCAL:
+        error("LOCAL outside a macro");
+        return;
+
+    // Instructions
+    case FORM_NONE:
+        emit_byte(op);
+        return;
+
+    case FORM_REG_HI:
+        r = reg_num(op1);
+        if (r >= 0) { emit_byte(op | (r << 3)); return; }
+        break;
+
+    case FORM_REG_LO:
+        r = reg_num(op1);
+        if (r >= 0) { emit_byte(op | r); return; }
+        break;
 
-    // MVI reg, imm8
-    if (strcmp(mnem, "MVI") == 0) {
-        r = reg_num(op1[0]);
+    case FORM_MOV:
+        r = reg_num(op1);
+        r2 = reg_num(op2);
+        if (r >= 0 && r2 >= 0) { emit_byte(op | (r << 3) | r2); return; }
+        break;
+
+    case FORM_REG_IMM:
+        r = reg_num(op1);
         if (r >= 0 && parse_operand(op2, &val)) {
-            emit_byte(0x06 | (r << 3));
-            emit_byte(val & 0xFF);
+            emit_byte(op | (r << 3));
+            emit_value(val, 1);
             return;
         }
-    }
+        break;
+
+    case FORM_RP:
+        rp = rp_num(op1);
+        if (rp >= 0) { emit_byte(op | (rp << 4)); return; }
+        break;
 
-    // LXI rp, imm16
-    if (strcmp(mnem, "LXI") == 0) {
+    case FORM_RP_BD:
+        rp = rp_num(op1);
+        if (rp >= 0 && rp <= 1) { emit_byte(op | (rp << 4)); return; }
+        break;
+
+    case FORM_RP_IMM:
         rp = rp_num(op1);
         if (rp >= 0 && parse_operand(op2, &val)) {
-            emit_byte(0x01 | (rp << 4));
-            emit_word(val);
+            emit_byte(op | (rp << 4));
+            emit_value(val, 2);
+            return;
+        }
+        break;
+
+    case FORM_IMM:
+        if (parse_operand(op1, &val)) {
+            emit_byte(op);
+            emit_value(val, OP_LENGTHS[op] - 1);
             return;
         }
+        break;
+
+    case FORM_RST:
+        r = op1.len ? op1.ptr[0] - '0' : -1;
+        if (r >= 0 && r <= 7) { emit_byte(op | (r << 3)); return; }
+        break;
     }
 
-    // Register pair ops: PUSH, POP, DAD, INX, DCX
-    if (strcmp(mnem, "PUSH") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0) { emit_byte(0xC5 | (rp << 4)); return; }
+    error("invalid operands for %s", enc->name);
+}
+
+static void process_line(Line *line) {
+    if (!line->label.len && !line->mnem.len) return;  // Blank lines, kept for the listing
+
+    const Encoding *enc = line->mnem.len ? find_mnemonic(line->mnem) : NULL;
+    int form = enc ? enc->form : -1;
+
+    if (recording) {
+        record(line, form);
+        return;
     }
-    if (strcmp(mnem, "POP") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0) { emit_byte(0xC1 | (rp << 4)); return; }
+    if (form == FORM_IF || form == FORM_ELSE || form == FORM_ENDIF) {
+        conditional(line, enc);
+        return;
     }
-    if (strcmp(mnem, "DAD") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0) { emit_byte(0x09 | (rp << 4)); return; }
+    if (!assembly_on) return;
+
+    if (form == FORM_MACRO) {
+        start_recording(line, enc);
+        return;
     }
-    if (strcmp(mnem, "INX") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0) { emit_byte(0x03 | (rp << 4)); return; }
+    if (line->label.len) add_label(line->label);
+    if (form == FORM_REPT) {
+        start_recording(line, enc);
+        return;
     }
-    if (strcmp(mnem, "DCX") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0) { emit_byte(0x0B | (rp << 4)); return; }
+    if (!line->mnem.len) return;
+
+    if (enc) {
+        assemble(line, enc);
+        return;
     }
-    if (strcmp(mnem, "LDAX") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0 && rp <= 1) { emit_byte(0x0A | (rp << 4)); return; }
+    const Macro *m = find_macro(line->mnem);
+    if (m) {
+        push_macro(m, line, 0);
+        return;
     }
-    if (strcmp(mnem, "STAX") == 0) {
-        rp = rp_num(op1);
-        if (rp >= 0 && rp <= 1) { emit_byte(0x02 | (rp << 4)); return; }
+    error("unknown instruction '%.*s'", (int)line->mnem.len, line->mnem.ptr);
+}
+
+// Listing (-l), symbol map (-m) and line table (-g). Lines are recorded only
+// when one of them is wanted, and written after the fixups are applied so
+// the bytes shown are final.
+typedef struct {
+    Span text;
+    size_t offset;  // Bytes emitted: code[offset, offset + len)
+    uint32_t len;
+    uint16_t addr;  // Address, or the value of an EQU
+    uint8_t section;
+    uint8_t flags;
+    uint8_t file;
+    int line;
+} ListLine;
+
+#define LIST_MACRO 0x01  // Expanded from a macro or REPT
+#define LIST_ADDR  0x02  // Emitted code or defined a label
+#define LIST_EQU   0x04
+#define LIST_INSN  0x08  // An instruction, so it has a cycle count
+#define LIST_SPACE 0x10  // DS: the bytes are not worth showing
+#define LIST_PEEP  0x20  // Rewritten by -O
+
+static ListLine *list_lines = NULL;
+static size_t list_count = 0, list_cap = 0;
+
+// Macro lines have no source text of their own; show what they expanded to
+static Span join_fields(const Line *line) {
+    size_t len = line->label.len + line->mnem.len + 3;
+    for (int i = 0; i < line->op_count; i++) len += line->ops[i].len + 2;
+
+    char *buf = arena_alloc(len), *q = buf;
+    memcpy(q, line->label.ptr, line->label.len);
+    q += line->label.len;
+    if (line->label.len) *q++ = ':';
+    *q++ = '\t';
+    memcpy(q, line->mnem.ptr, line->mnem.len);
+    q += line->mnem.len;
+    for (int i = 0; i < line->op_count; i++) {
+        *q++ = i ? ',' : ' ';
+        if (i) *q++ = ' ';
+        memcpy(q, line->ops[i].ptr, line->ops[i].len);
+        q += line->ops[i].len;
+    }
+    return (Span){ buf, q - buf };
+}
+
+// active: the line was assembled, not skipped by IF or recorded as a body
+static void list_line(const Line *line, size_t start, uint16_t addr, int sec, int active) {
+    const Encoding *enc = active && line->mnem.len ? find_mnemonic(line->mnem) : NULL;
+
+    list_lines = grow(list_lines, &list_cap, list_count + 1, sizeof(ListLine));
+    ListLine *l = &list_lines[list_count++];
+    l->text = line_text.ptr ? line_text : join_fields(line);
+    l->offset = start;
+    l->len = code_len - start;
+    l->addr = addr;
+    l->section = sec;
+    l->flags = line_text.ptr ? 0 : LIST_MACRO;
+    l->file = file_index;
+    l->line = line_num;
+
+    if (enc && enc->form == FORM_EQU && last_label) {
+        l->addr = last_label->addr;
+        l->flags |= LIST_EQU;
+    } else if (l->len || (active && line->label.len && !(enc && enc->form == FORM_MACRO))) {
+        l->flags |= LIST_ADDR;
+    }
+    if (enc && enc->form <= FORM_RST && l->len) l->flags |= LIST_INSN;
+    if (enc && enc->form == FORM_DS) l->flags |= LIST_SPACE;
+}
+
+// Peephole optimization (-O). The first pass assembles the source as
+// written; patterns are found in its image, and the source is assembled
+// again with the lines that hold them rewritten. Lines are identified by
+// their place in the stream next_line() returns, which is the same on
+// every pass.
+#define VERIFY_CYCLES 100000000ULL
+
+static const struct {
+    const char *from, *to;  // Mnemonics; to NULL when the line goes
+    uint8_t len;            // Bytes it assembled to, for -V padding
+} PEEP_LINES[PEEP_KINDS] = {
+    [PEEP_ZERO_A]    = { "MVI", "XRA", 2 },
+    [PEEP_JUMP_RET]  = { "JMP", "RET", 3 },
+    [PEEP_TAIL_CALL] = { "CALL", "JMP", 3 },
+    [PEEP_TAIL_RET]  = { "RET", NULL, 1 },
+    [PEEP_MOVE_SELF] = { "MOV", NULL, 1 },
+};
+
+static uint8_t *peep_lines = NULL;  // Rewrite for each line, NULL on the first pass
+static size_t peep_line_count = 0;
+static int peep_pad = 0;            // NOPs keep rewritten lines at their old length
+
+static void rewrite_line(Line *line, int kind) {
+    const char *from = PEEP_LINES[kind].from, *to = PEEP_LINES[kind].to;
+    if (line->mnem.len != strlen(from) || strncasecmp(line->mnem.ptr, from, line->mnem.len) != 0) {
+        error("line changed between passes; assemble without -O");
+        return;
     }
+    line->mnem = (Span){ to ? to : "", to ? strlen(to) : 0 };
+    if (kind == PEEP_ZERO_A) line->ops[0] = (Span){ "A", 1 };
+    if (kind != PEEP_TAIL_CALL) line->op_count = kind == PEEP_ZERO_A;
+}
+
+// A rewritten line lists as written, followed by what it became
+static void list_rewrite(ListLine *l, const Line *before, const Line *after) {
+    Line insn = *after;
+    insn.label.len = 0;
+    Span to = after->mnem.len ? join_fields(&insn) : (Span){ "\t(removed)", 10 };
+
+    if (l->flags & LIST_MACRO) l->text = join_fields(before);
+    char *buf = arena_alloc(l->text.len + to.len + 8);
+    int n = sprintf(buf, "%.*s ; -O: %.*s", (int)l->text.len, l->text.ptr, (int)to.len - 1, to.ptr + 1);
+    l->text = (Span){ buf, n };
+    l->flags |= LIST_PEEP;
+}
 
-    // ALU ops with register: ADD, ADC, SUB, SBB, ANA, XRA, ORA, CMP
-    #define ALU_REG(name, base) \
-        if (strcmp(mnem, name) == 0) { \
-            r = reg_num(op1[0]); \
-            if (r >= 0) { emit_byte(base | r); return; } \
+// Back to the state before the first line, for another pass over the same
+// sources. INCLUDE files stay loaded.
+static void reset_pass(void) {
+    current_addr = 0;
+    line_num = 0;
+    file_name = NULL;
+    file_index = 0;
+    error_count = 0;
+    code_len = 0;
+    segment_count = 0;
+    segment_open = 0;
+    section = SEC_ABS;
+    memset(section_addr, 0, sizeof(section_addr));
+    fixup_count = 0;
+    forward_ref.ptr = NULL;
+    if (labels) memset(labels, 0, label_cap * sizeof(Label));
+    label_count = 0;
+    last_label = NULL;
+    expr_len = 0;
+    expr_sym_count = 0;
+    public_count = 0;
+    for (int i = 0; i < MACRO_BUCKETS; i++) {
+        while (macro_table[i]) {
+            Macro *m = macro_table[i];
+            macro_table[i] = m->next;
+            free_macro(m);
         }
-    ALU_REG("ADD", 0x80) ALU_REG("ADC", 0x88)
-    ALU_REG("SUB", 0x90) ALU_REG("SBB", 0x98)
-    ALU_REG("ANA", 0xA0) ALU_REG("XRA", 0xA8)
-    ALU_REG("ORA", 0xB0) ALU_REG("CMP", 0xB8)
+    }
+    if (recording) free_macro(recording);
+    recording = NULL;
+    local_serial = 0;
+    input_depth = 0;
+    condition_depth = 0;
+    assembly_on = 1;
+    list_count = 0;
+}
 
-    // ALU ops with immediate: ADI, ACI, SUI, SBI, ANI, XRI, ORI, CPI
-    #define ALU_IMM(name, op) \
-        if (strcmp(mnem, name) == 0 && parse_operand(op1, &val)) { \
-            emit_byte(op); emit_byte(val & 0xFF); return; \
+// One pass over the source, fixups applied at the end
+static void assemble_pass(const Source *src, const char *inname) {
+    Line line;
+    size_t seq = 0;
+    push_file(src, inname, NULL, 0);
+    while (next_line(&line)) {
+        if (!keep_lines) {
+            process_line(&line);
+            continue;
         }
-    ALU_IMM("ADI", 0xC6) ALU_IMM("ACI", 0xCE)
-    ALU_IMM("SUI", 0xD6) ALU_IMM("SBI", 0xDE)
-    ALU_IMM("ANI", 0xE6) ALU_IMM("XRI", 0xEE)
-    ALU_IMM("ORI", 0xF6) ALU_IMM("CPI", 0xFE)
+        int kind = seq < peep_line_count ? peep_lines[seq] : PEEP_NONE;
+        size_t start = code_len;
+        uint16_t addr = current_addr;
+        int sec = section, active = assembly_on && !recording;
+        Line before = line;
+        seq++;
+        if (kind) rewrite_line(&line, kind);
+        process_line(&line);
+        while (kind && peep_pad && code_len - start < PEEP_LINES[kind].len) emit_byte(0);
+        list_line(&line, start, addr, sec, active);
+        if (kind) list_rewrite(&list_lines[list_count - 1], &before, &line);
+    }
+    if (condition_depth) error("IF without ENDIF");
+    if (recording) error("%s without ENDM", rept_count < 0 ? "MACRO" : "REPT");
+
+    section_addr[section] = current_addr;
+    mark_publics();
+    if (output_format == OUT_OBJ) build_symbols();
+    apply_fixups();
+}
 
-    // INR, DCR
-    if (strcmp(mnem, "INR") == 0) {
-        r = reg_num(op1[0]);
-        if (r >= 0) { emit_byte(0x04 | (r << 3)); return; }
+// Everything a pass allocated, once its output has been copied out
+static void free_all(void) {
+    reset_pass();
+    free(code);
+    free(segments);
+    free(fixups);
+    free(labels);
+    free(expr_code);
+    free(expr_syms);
+    free(publics);
+    free(list_lines);
+    code = NULL;
+    segments = NULL;
+    fixups = NULL;
+    labels = NULL;
+    expr_code = NULL;
+    expr_syms = NULL;
+    publics = NULL;
+    list_lines = NULL;
+    code_cap = segment_cap = fixup_cap = label_cap = expr_cap = expr_sym_cap = public_cap = list_cap = 0;
+    for (size_t i = 0; i < file_count; i++) free((char *)file_cache[i].src.data);
+    free(file_cache);
+    file_cache = NULL;
+    file_count = file_cap = 0;
+    while (arena_chunk) {
+        char *prev = *(char **)arena_chunk;
+        free(arena_chunk);
+        arena_chunk = prev;
     }
-    if (strcmp(mnem, "DCR") == 0) {
-        r = reg_num(op1[0]);
-        if (r >= 0) { emit_byte(0x05 | (r << 3)); return; }
+    arena_left = 0;
+}
+
+int asm8080_assemble(const char *text, size_t len, image_t *img) {
+    static int ready = 0;
+    if (!ready) {
+        init_mnemonics();
+        ready = 1;
     }
+    Source src = { text, len };
+    output_format = OUT_BIN;
+    keep_lines = 0;
+    reset_pass();
+    current_addr = img->origin;
+    assemble_pass(&src, "");
+
+    img->segments = NULL;
+    img->segment_count = 0;
+    img->data = NULL;
+    img->len = 0;
+    img->errors = error_count;
+    if (!error_count) {
+        img->data = malloc(code_len ? code_len : 1);
+        img->segments = malloc((segment_count ? segment_count : 1) * sizeof(image_segment_t));
+        if (!img->data || !img->segments) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+        memcpy(img->data, code, code_len);
+        img->len = code_len;
+        for (size_t i = 0; i < segment_count; i++) {
+            img->segments[i] = (image_segment_t){ segments[i].addr, segments[i].len,
+                                                  img->data + segments[i].start };
+        }
+        img->segment_count = segment_count;
+    }
+    free_all();
+    return img->errors;
+}
+
+void image_free(image_t *img) {
+    free(img->segments);
+    free(img->data);
+    img->segments = NULL;
+    img->data = NULL;
+    img->segment_count = img->len = 0;
+}
+
+// The command-line tool: files, listings, timing and -O
+#ifndef ASM8080_LIBRARY
+static const char SECTION_MARKS[] = { ' ', '\'', '"', ' ' };
+
+static const char *source_name(int file, const char *main_name) {
+    return file ? file_cache[file - 1].path : main_name;
+}
+
+#define LIST_BYTES 4  // Code bytes per listing line
+
+static int write_listing(const char *name, const char *main_name) {
+    FILE *out = fopen(name, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", name);
+        return -1;
+    }
+
+    fprintf(out, "  Line  Addr  Code         Cycles  Source\n");
+    int file = 0;
+    for (size_t i = 0; i < list_count; i++) {
+        const ListLine *l = &list_lines[i];
+        if (l->file != file) {
+            file = l->file;
+            fprintf(out, "%35s; %s\n", "", source_name(file, main_name));
+        }
+
+        char addr[8] = "", bytes[LIST_BYTES * 3 + 1] = "", cycles[8] = "";
+        if (l->flags & LIST_EQU) snprintf(addr, sizeof(addr), "=%04X", l->addr);
+        else if (l->flags & LIST_ADDR) snprintf(addr, sizeof(addr), "%04X%c", l->addr, SECTION_MARKS[l->section]);
+        for (uint32_t j = 0; j < l->len && j < LIST_BYTES && !(l->flags & LIST_SPACE); j++) {
+            snprintf(bytes + j * 3, 4, "%02X ", code[l->offset + j]);
+        }
+        if (l->flags & LIST_INSN) {
+            uint8_t op = code[l->offset];
+            if (op_is_cond_call_ret(op)) {
+                snprintf(cycles, sizeof(cycles), "%d/%d", OP_CYCLES[op], OP_CYCLES[op] + OP_TAKEN_CYCLES);
+            } else {
+                snprintf(cycles, sizeof(cycles), "%d", OP_CYCLES[op]);
+            }
+        }
+        char head[48];
+        int n = snprintf(head, sizeof(head), "%6d%c %-5s %-12s %6s  ", l->line,
+                         l->flags & LIST_PEEP ? 'O' : l->flags & LIST_MACRO ? '+' : ' ', addr, bytes, cycles);
+        if (!l->text.len) {
+            while (n > 0 && head[n - 1] == ' ') n--;
+        }
+        fprintf(out, "%.*s%.*s\n", n, head, (int)l->text.len, l->text.ptr);
 
-    // Jumps: JMP, JNZ, JZ, JNC, JC, JPO, JPE, JP, JM
-    #define JUMP(name, op) \
-        if (strcmp(mnem, name) == 0 && parse_operand(op1, &val)) { \
-            emit_byte(op); emit_word(val); return; \
+        // DB and DW lines continue below; DS only shows its address
+        for (uint32_t j = LIST_BYTES; j < l->len && !(l->flags & LIST_SPACE); j += LIST_BYTES) {
+            fprintf(out, "%7s %04X%c", "", (uint16_t)(l->addr + j), SECTION_MARKS[l->section]);
+            for (uint32_t k = j; k < l->len && k < j + LIST_BYTES; k++) {
+                fprintf(out, " %02X", code[l->offset + k]);
+            }
+            fputc('\n', out);
         }
-    JUMP("JMP", 0xC3) JUMP("JNZ", 0xC2) JUMP("JZ", 0xCA)
-    JUMP("JNC", 0xD2) JUMP("JC", 0xDA) JUMP("JPO", 0xE2)
-    JUMP("JPE", 0xEA) JUMP("JP", 0xF2) JUMP("JM", 0xFA)
+    }
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", name);
+        return -1;
+    }
+    return 0;
+}
 
-    // Calls: CALL, CNZ, CZ, CNC, CC, CPO, CPE, CP, CM
-    JUMP("CALL", 0xCD) JUMP("CNZ", 0xC4) JUMP("CZ", 0xCC)
-    JUMP("CNC", 0xD4) JUMP("CC", 0xDC) JUMP("CPO", 0xE4)
-    JUMP("CPE", 0xEC) JUMP("CP", 0xF4) JUMP("CM", 0xFC)
+static int compare_map(const void *a, const void *b) {
+    const Label *x = *(const Label *const *)a, *y = *(const Label *const *)b;
+    if (x->section != y->section) return x->section - y->section;
+    if (x->addr != y->addr) return x->addr - y->addr;
+    return strcasecmp(x->name, y->name);
+}
 
-    // LDA, STA, LHLD, SHLD
-    JUMP("LDA", 0x3A) JUMP("STA", 0x32)
-    JUMP("LHLD", 0x2A) JUMP("SHLD", 0x22)
+// Symbols by section and address
+static int write_map(const char *name) {
+    FILE *out = fopen(name, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", name);
+        return -1;
+    }
 
-    // IN, OUT
-    if (strcmp(mnem, "IN") == 0 && parse_operand(op1, &val)) {
-        emit_byte(0xDB); emit_byte(val & 0xFF); return;
+    size_t cap = 0;
+    const Label **sorted = grow(NULL, &cap, label_count, sizeof(Label *));
+    size_t n = 0;
+    for (size_t i = 0; i < label_cap; i++) {
+        if (labels[i].name) sorted[n++] = &labels[i];
     }
-    if (strcmp(mnem, "OUT") == 0 && parse_operand(op1, &val)) {
-        emit_byte(0xD3); emit_byte(val & 0xFF); return;
+    qsort(sorted, n, sizeof(Label *), compare_map);
+
+    static const char *const KINDS[] = { "", "CSEG", "DSEG", "EXTRN" };
+    for (size_t i = 0; i < n; i++) {
+        const Label *l = sorted[i];
+        const char *kind = l->flags & LABEL_EQU ? "EQU" : KINDS[l->section];
+        const char *pub = l->flags & SYM_PUBLIC ? "PUBLIC" : "";
+        if (l->section == SEC_EXTERN) fprintf(out, "----  ");
+        else fprintf(out, "%04X%c ", l->addr, SECTION_MARKS[l->section]);
+        if (*kind || *pub) fprintf(out, "%-16s %s%s%s\n", l->name, kind, *kind && *pub ? " " : "", pub);
+        else fprintf(out, "%s\n", l->name);
     }
+    free(sorted);
 
-    // RST n
-    if (strcmp(mnem, "RST") == 0) {
-        int n = op1[0] - '0';
-        if (n >= 0 && n <= 7) {
-            emit_byte(0xC7 | (n << 3));
-            return;
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static const char **source_names(const char *main_name) {
+    size_t cap = 0;
+    const char **files = grow(NULL, &cap, file_count + 1, sizeof(char *));
+    for (size_t i = 0; i <= file_count; i++) files[i] = source_name(i, main_name);
+    return files;
+}
+
+// Labels that are addresses; EQU values would be mistaken for code
+static ObjSymbol *address_symbols(size_t *count) {
+    size_t cap = 0, n = 0;
+    ObjSymbol *syms = grow(NULL, &cap, label_count, sizeof(ObjSymbol));
+    for (size_t i = 0; i < label_cap; i++) {
+        const Label *l = &labels[i];
+        if (l->name && !(l->flags & LABEL_EQU)) {
+            syms[n++] = (ObjSymbol){ l->name, l->addr, l->section, l->flags };
         }
     }
+    *count = n;
+    return syms;
+}
+
+// Only absolute output has final addresses to map
+static int write_lines(const char *name, const char *main_name) {
+    const char **files = source_names(main_name);
+    size_t nsyms, cap = 0;
+    ObjSymbol *syms = address_symbols(&nsyms);
+
+    LineEntry *lines = grow(NULL, &cap, list_count, sizeof(LineEntry));
+    size_t nlines = 0;
+    for (size_t i = 0; i < list_count; i++) {
+        const ListLine *l = &list_lines[i];
+        if (!l->len) continue;
+        lines[nlines++] = (LineEntry){ l->addr, l->len > 0xFFFF ? 0xFFFF : l->len, l->line, l->file,
+                                       l->flags & LIST_INSN ? LINETAB_LINE_CODE : 0 };
+    }
 
-    fprintf(stderr, "Line %d: unknown instruction '%s'\n", line_num, mnem);
+    int ret = write_linetab(name, files, file_count + 1, syms, nsyms, lines, nlines);
+    free(lines);
+    free(syms);
+    free(files);
+    return ret;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s input.asm [output.hex]\n", argv[0]);
-        return 1;
+// The 64K memory image of absolute output. Output past FFFFh wraps, as it
+// would when loaded.
+static uint8_t *build_image(void) {
+    uint8_t *mem = calloc(0x10000, 1);
+    if (!mem) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
     }
+    for (size_t i = 0; i < segment_count; i++) {
+        for (size_t j = 0; j < segments[i].len; j++) {
+            mem[(uint16_t)(segments[i].addr + j)] = code[segments[i].start + j];
+        }
+    }
+    return mem;
+}
 
-    const char *inname = argv[1];
-    const char *outname = argc > 2 ? argv[2] : "out.hex";
+// Timing analysis (-t, -w) of the assembled image
+#define MAX_WORST_CASES 16
 
-    FILE *infile = fopen(inname, "r");
-    if (!infile) {
-        fprintf(stderr, "Error: cannot open %s\n", inname);
-        return 1;
+// Iteration count from "; @bound N" in a line's comment, 0 if none
+static uint16_t loop_bound(Span text) {
+    const char *p = text.ptr, *end = text.ptr + text.len;
+    int quoted = 0;
+    for (; p < end && (quoted || *p != ';'); p++) {
+        if (*p == '\'') quoted = !quoted;
+    }
+    for (; end - p >= 6; p++) {
+        if (strncasecmp(p, "@bound", 6) != 0) continue;
+        Span num;
+        uint16_t val;
+        get_token(p + 6, end, &num);
+        if (num.len && parse_number(num, &val)) return val;
     }
+    return 0;
+}
 
-    char line[MAX_LINE];
+// A label, or failing that a number
+static int timing_addr(const char *name, uint32_t *addr) {
+    Span s = { name, strlen(name) };
+    const Label *l = s.len ? find_label(s) : NULL;
+    uint16_t val;
+    if (l && !(l->flags & LABEL_EQU)) {
+        *addr = l->addr;
+    } else if (s.len && isdigit((unsigned char)*name) && parse_number(s, &val)) {
+        *addr = val;
+    } else {
+        fprintf(stderr, "Error: '%s' is not a label\n", name);
+        return -1;
+    }
+    return 0;
+}
 
-    // Pass 1: collect labels
-    printf("Pass 1: collecting labels...\n");
-    pass = 1;
-    current_addr = 0;
-    line_num = 0;
-    while (fgets(line, sizeof(line), infile)) {
-        // Remove newline
-        line[strcspn(line, "\r\n")] = '\0';
-        process_line(line);
+// Each -w argument is FROM,TO or a routine name for its cost to return
+static int analyze_timing(const char *report_name, char **worst, int worst_count,
+                          const char *main_name) {
+    WorstCase cases[MAX_WORST_CASES];
+    for (int i = 0; i < worst_count; i++) {
+        char *comma = strchr(worst[i], ',');
+        if (comma) *comma = '\0';
+        cases[i].to = -1;
+        if (timing_addr(worst[i], &cases[i].from) < 0) return -1;
+        if (comma) {
+            uint32_t to;
+            if (timing_addr(comma + 1, &to) < 0) return -1;
+            cases[i].to = to;
+        }
     }
-    printf("Found %d labels\n", label_count);
 
-    // Pass 2: generate code
-    printf("Pass 2: generating code...\n");
-    pass = 2;
-    current_addr = 0;
-    line_num = 0;
-    rewind(infile);
+    uint8_t *mem = build_image();
+    int32_t *last = malloc(0x10000 * sizeof(int32_t));
+    size_t cap = 0, n = 0;
+    TimedInsn *insns = grow(NULL, &cap, 0x10000, sizeof(TimedInsn));
+    if (!last) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    // By address; where code was assembled over, the last instruction wins
+    for (size_t a = 0; a < 0x10000; a++) last[a] = -1;
+    for (size_t i = 0; i < list_count; i++) {
+        if (list_lines[i].flags & LIST_INSN) last[list_lines[i].addr] = i;
+    }
+    for (size_t a = 0; a < 0x10000; a++) {
+        if (last[a] < 0) continue;
+        const ListLine *l = &list_lines[last[a]];
+        insns[n++] = (TimedInsn){ l->addr, loop_bound(l->text), l->line, l->file };
+    }
+    free(last);
+
+    const char **files = source_names(main_name);
+    size_t nsyms;
+    ObjSymbol *syms = address_symbols(&nsyms);
+    TimingInput in = { mem, insns, n, files, syms, nsyms };
+
+    FILE *out = NULL;
+    if (report_name && !(out = fopen(report_name, "w"))) {
+        fprintf(stderr, "Error: cannot create %s\n", report_name);
+        return -1;
+    }
+    if (timing_analyze(out, &in, cases, worst_count) < 0) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    if (out && worst_count) fputc('\n', out);
+    for (int i = 0; i < worst_count; i++) {
+        const WorstCase *w = &cases[i];
+        char result[64];
+        if (w->status == TIMING_OK) {
+            snprintf(result, sizeof(result), "%llu cycles", (unsigned long long)w->cycles);
+        } else {
+            snprintf(result, sizeof(result), "unknown, %s at %04Xh", timing_error(w->status), w->where);
+        }
+        const char *to = w->to >= 0 ? worst[i] + strlen(worst[i]) + 1 : "return";
+        printf("Worst case %s -> %s: %s\n", worst[i], to, result);
+        if (out) fprintf(out, "Worst case %s -> %s: %s\n", worst[i], to, result);
+    }
+
+    int ret = 0;
+    if (out && fclose(out) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", report_name);
+        ret = -1;
+    }
+    free(syms);
+    free(files);
+    free(insns);
+    free(mem);
+    return ret;
+}
+
+// Find the patterns in the first pass, check the rewrite in the emulator
+// if asked (-V), and assemble the final pass with it
+static int optimize(const Source *src, const char *inname, int verify, uint16_t start) {
+    uint8_t *before = build_image();
+    uint8_t *labelled = calloc(0x10000, 1);
+    size_t cap = 0, n = 0;
+    uint16_t *insns = grow(NULL, &cap, list_count, sizeof(uint16_t));
+    cap = 0;
+    size_t *insn_lines = grow(NULL, &cap, list_count, sizeof(size_t));
+    if (!labelled) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < label_cap; i++) {
+        if (labels[i].name && !(labels[i].flags & LABEL_EQU)) labelled[labels[i].addr] = 1;
+    }
+    // Instructions later assembled over are left alone
+    for (size_t i = 0; i < list_count; i++) {
+        const ListLine *l = &list_lines[i];
+        if (!(l->flags & LIST_INSN) || l->addr + l->len > 0x10000 ||
+            memcmp(before + l->addr, code + l->offset, l->len) != 0) {
+            continue;
+        }
+        insn_lines[n] = i;
+        insns[n++] = l->addr;
+    }
+
+    uint8_t *kinds = calloc(n ? n : 1, 1);
+    peep_lines = calloc(list_count ? list_count : 1, 1);
+    if (!kinds || !peep_lines) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    PeepInput in = { before, insns, n, labelled };
+    size_t count[PEEP_KINDS] = { 0 };
+    size_t chosen = peep_plan(&in, kinds);
+    peep_line_count = list_count;
+    for (size_t i = 0; i < n; i++) {
+        peep_lines[insn_lines[i]] = kinds[i];
+        count[kinds[i]]++;
+    }
+    free(kinds);
+    free(insn_lines);
+    free(insns);
+    free(labelled);
+
+    int ret = 0;
+    if (chosen && verify) {
+        peep_pad = 1;
+        reset_pass();
+        assemble_pass(src, inname);
+        peep_pad = 0;
+        if (error_count) {
+            free(before);
+            return 0;
+        }
+        uint8_t *after = build_image();
+        int diff = peep_verify(before, after, start, VERIFY_CYCLES);
+        if (diff == 0) printf("Verify: optimized code leaves the same state\n");
+        else fprintf(stderr, "Error: %s\n", diff > 0 ? "optimized code leaves a different state" : "cannot verify");
+        if (diff) ret = -1;
+        free(after);
+    }
+    free(before);
+    if (ret < 0) return ret;
 
-    outfile = fopen(outname, "w");
-    if (!outfile) {
-        fprintf(stderr, "Error: cannot create %s\n", outname);
-        fclose(infile);
+    if (chosen) {
+        reset_pass();
+        assemble_pass(src, inname);
+    }
+    peep_report(stdout, count);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f hex|bin|com|obj] [-r record_len] [-l listing] [-m map]\n"
+                    "       [-g linetab] [-t timing] [-w from[,to]]... [-O [-V]] input.asm|- [output]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int format = -1;
+    int record_len = 16;
+    const char *list_name = NULL, *map_name = NULL, *lines_name = NULL, *timing_name = NULL;
+    char *worst[MAX_WORST_CASES];
+    int worst_count = 0;
+    int optimizing = 0, verify = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:r:l:m:g:t:w:OV")) != -1) {
+        switch (opt) {
+        case 'f':
+            format = parse_format(optarg);
+            if (format < 0) {
+                fprintf(stderr, "Error: unknown output format '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            record_len = atoi(optarg);
+            if (record_len < 1 || record_len > 255) {
+                fprintf(stderr, "Error: record length must be 1-255\n");
+                return 1;
+            }
+            break;
+        case 'l':
+            list_name = optarg;
+            break;
+        case 'm':
+            map_name = optarg;
+            break;
+        case 'g':
+            lines_name = optarg;
+            break;
+        case 't':
+            timing_name = optarg;
+            break;
+        case 'w':
+            if (worst_count == MAX_WORST_CASES) {
+                fprintf(stderr, "Error: more than %d -w options\n", MAX_WORST_CASES);
+                return 1;
+            }
+            worst[worst_count++] = optarg;
+            break;
+        case 'O':
+            optimizing = 1;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+
+    const char *inname = argv[optind];
+    const char *outname = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    // Without -f the output extension decides; HEX otherwise
+    if (format < 0 && outname) {
+        const char *dot = strrchr(outname, '.');
+        if (dot) format = parse_format(dot + 1);
+    }
+    if (format < 0) format = OUT_HEX;
+    if (!outname) {
+        static const char *const DEFAULT_NAMES[] = { "out.hex", "out.bin", "out.com", "out.obj" };
+        outname = DEFAULT_NAMES[format];
+    }
+    output_format = format;
+    int timing = timing_name || worst_count;
+    if ((lines_name || timing || optimizing) && format == OUT_OBJ) {
+        fprintf(stderr, "Error: -%c needs absolute output, not -f obj\n",
+                lines_name ? 'g' : timing ? 't' : 'O');
+        return 1;
+    }
+    if (verify && !optimizing) {
+        fprintf(stderr, "Error: -V checks -O\n");
+        return 1;
+    }
+    keep_lines = list_name || lines_name || timing || optimizing;
+
+    // Single pass, so the source can be a pipe
+    Source src;
+    if (load_source(inname, &src) < 0) {
+        fprintf(stderr, "Error: cannot open %s\n", inname);
         return 1;
     }
 
-    while (fgets(line, sizeof(line), infile)) {
-        line[strcspn(line, "\r\n")] = '\0';
-        process_line(line);
+    init_mnemonics();
+    printf("Assembling...\n");
+    assemble_pass(&src, inname);
+    if (optimizing && !error_count &&
+        optimize(&src, inname, verify, format == OUT_COM ? 0x100 : 0) < 0) {
+        return 1;
     }
+    printf("Found %zu labels, %zu forward references\n", label_count, fixup_count);
 
-    flush_hex();
-    fprintf(outfile, ":00000001FF\n");  // EOF record
+    if (error_count) {
+        fprintf(stderr, "%d error(s)\n", error_count);
+        return 1;
+    }
 
-    fclose(infile);
-    fclose(outfile);
+    if (format == OUT_OBJ) {
+        Object obj = {
+            code, code_len, segments, segment_count, obj_symbols, label_count,
+            relocs, reloc_count, reloc_expr, reloc_expr_len,
+        };
+        if (obj_write(outname, &obj) < 0) return 1;
+    } else if (write_image(outname, format, record_len, code, segments, segment_count) < 0) {
+        return 1;
+    }
 
     printf("Output: %s\n", outname);
+
+    if (list_name && write_listing(list_name, inname) < 0) return 1;
+    if (map_name && write_map(map_name) < 0) return 1;
+    if (lines_name && write_lines(lines_name, inname) < 0) return 1;
+    if (timing && analyze_timing(timing_name, worst, worst_count, inname) < 0) return 1;
     return 0;
 }
+#endif
@@ -0,0 +1,34 @@
+// The assembler as a library: source text in memory to code in memory, for
+// the host tools and the monitor's a command. Build asm8080.c and obj8080.c
+// with ASM8080_LIBRARY defined.
+#ifndef ASM8080_H
+#define ASM8080_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Code for one ORG, in source order
+typedef struct {
+    uint16_t addr;
+    size_t len;
+    const uint8_t *data;  // Into image_t.data
+} image_segment_t;
+
+typedef struct {
+    uint16_t origin;               // Set by the caller: the address before any ORG
+    image_segment_t *segments;
+    size_t segment_count;
+    uint8_t *data;                 // Every segment's bytes
+    size_t len;
+    int errors;
+} image_t;
+
+// Assemble `len` bytes of source into img, whose origin must be set. Errors
+// go to stderr as "Line N: ...", and no code is kept if there are any.
+// INCLUDE files are read with stdio where it has files, relative to the
+// current directory. Returns the number of errors; free img with
+// image_free() either way. Not thread-safe: the assembler state is global.
+int asm8080_assemble(const char *text, size_t len, image_t *img);
+void image_free(image_t *img);
+
+#endif
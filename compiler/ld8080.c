@@ -0,0 +1,327 @@
+// 8080 Linker - combines asm8080 object files into Intel HEX, raw binary or
+// CP/M .com
+//
+// ASEG code keeps its addresses. The CSEG parts of all modules are placed
+// one after another from the code address, in command line order, then the
+// DSEG parts from the data address (by default right after the code).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "obj8080.h"
+
+typedef struct {
+    const char *name;
+    Object obj;
+    uint32_t base[SEC_COUNT];
+    uint32_t size[SEC_COUNT];
+    size_t code_start;    // Offset of this module's code in the output
+    uint16_t *values;     // Final value of each symbol
+    uint8_t *resolved;    // Whether each symbol has one
+} Module;
+
+typedef struct {
+    const char *name;
+    uint16_t value;
+    const Module *module;
+} Global;
+
+static Module *modules;
+static size_t module_count;
+static Global *globals;
+static size_t global_count;
+static int error_count = 0;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int parse_addr(const char *s, uint32_t *addr) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 16);
+    if (*s == '\0' || (*end != '\0' && strcasecmp(end, "h") != 0) || v > 0xFFFF) return 0;
+    *addr = v;
+    return 1;
+}
+
+static int compare_globals(const void *a, const void *b) {
+    return strcasecmp(((const Global *)a)->name, ((const Global *)b)->name);
+}
+
+static const Global *find_global(const char *name) {
+    Global key = { name, 0, NULL };
+    return bsearch(&key, globals, global_count, sizeof(Global), compare_globals);
+}
+
+// Give every section of every module its base address
+static void place_sections(uint32_t code_addr, uint32_t data_addr, int data_set) {
+    for (size_t i = 0; i < module_count; i++) {
+        Module *m = &modules[i];
+        for (size_t j = 0; j < m->obj.segment_count; j++) {
+            const Segment *seg = &m->obj.segments[j];
+            uint32_t end = seg->addr + seg->len;
+            if (end > m->size[seg->section]) m->size[seg->section] = end;
+        }
+    }
+
+    uint32_t next[SEC_COUNT] = { 0, code_addr, 0 };
+    for (int sec = SEC_CODE; sec <= SEC_DATA; sec++) {
+        if (sec == SEC_DATA) next[sec] = data_set ? data_addr : next[SEC_CODE];
+        for (size_t i = 0; i < module_count; i++) {
+            Module *m = &modules[i];
+            m->base[sec] = next[sec];
+            next[sec] += m->size[sec];
+        }
+        if (next[sec] > 0x10000) {
+            fprintf(stderr, "Error: %s sections run past FFFFh\n", sec == SEC_CODE ? "CSEG" : "DSEG");
+            exit(1);
+        }
+    }
+}
+
+// Values of the symbols each module defines, then the table of PUBLIC ones
+// that resolves the EXTRN symbols of the others
+static void resolve_symbols(void) {
+    for (size_t i = 0; i < module_count; i++) {
+        Module *m = &modules[i];
+        m->values = xmalloc(m->obj.symbol_count * sizeof(uint16_t));
+        m->resolved = xmalloc(m->obj.symbol_count);
+        for (size_t j = 0; j < m->obj.symbol_count; j++) {
+            const ObjSymbol *sym = &m->obj.symbols[j];
+            m->resolved[j] = sym->section != SEC_EXTERN;
+            m->values[j] = m->base[sym->section == SEC_EXTERN ? SEC_ABS : sym->section] + sym->value;
+            if (sym->flags & SYM_PUBLIC) global_count++;
+        }
+    }
+
+    globals = xmalloc(global_count * sizeof(Global));
+    size_t n = 0;
+    for (size_t i = 0; i < module_count; i++) {
+        const Module *m = &modules[i];
+        for (size_t j = 0; j < m->obj.symbol_count; j++) {
+            if (m->obj.symbols[j].flags & SYM_PUBLIC) {
+                globals[n++] = (Global){ m->obj.symbols[j].name, m->values[j], m };
+            }
+        }
+    }
+    qsort(globals, global_count, sizeof(Global), compare_globals);
+    for (size_t i = 1; i < global_count; i++) {
+        if (strcasecmp(globals[i - 1].name, globals[i].name) == 0) {
+            fprintf(stderr, "Error: '%s' is PUBLIC in both %s and %s\n", globals[i].name,
+                    globals[i - 1].module->name, globals[i].module->name);
+            error_count++;
+        }
+    }
+
+    for (size_t i = 0; i < module_count; i++) {
+        Module *m = &modules[i];
+        for (size_t j = 0; j < m->obj.symbol_count; j++) {
+            if (m->resolved[j]) continue;
+            const Global *g = find_global(m->obj.symbols[j].name);
+            if (g) {
+                m->values[j] = g->value;
+                m->resolved[j] = 1;
+            }
+        }
+    }
+}
+
+// Relocation context: the module and line being patched
+typedef struct {
+    const Module *module;
+    uint32_t line;
+} RelocCtx;
+
+static int reloc_sym(void *ctx, uint32_t index, uint16_t *val) {
+    const RelocCtx *rc = ctx;
+    const Module *m = rc->module;
+    if (index >= m->obj.symbol_count) {
+        fprintf(stderr, "%s:%u: bad symbol index\n", m->name, rc->line);
+        return 0;
+    }
+    if (!m->resolved[index]) {
+        fprintf(stderr, "%s:%u: undefined symbol '%s'\n", m->name, rc->line,
+                m->obj.symbols[index].name);
+        return 0;
+    }
+    *val = m->values[index];
+    return 1;
+}
+
+static int reloc_rel(void *ctx, int sec, uint16_t offset, uint16_t *val) {
+    const RelocCtx *rc = ctx;
+    if (sec >= SEC_COUNT) {
+        fprintf(stderr, "%s:%u: bad section\n", rc->module->name, rc->line);
+        return 0;
+    }
+    *val = rc->module->base[sec] + offset;
+    return 1;
+}
+
+// All modules' code in one buffer, segments moved to their final addresses
+static uint8_t *code;
+static Segment *segments;
+static size_t code_len, segment_count;
+
+static void combine(void) {
+    for (size_t i = 0; i < module_count; i++) {
+        code_len += modules[i].obj.code_len;
+        segment_count += modules[i].obj.segment_count;
+    }
+    code = xmalloc(code_len);
+    segments = xmalloc(segment_count * sizeof(Segment));
+
+    size_t pos = 0, n = 0;
+    for (size_t i = 0; i < module_count; i++) {
+        Module *m = &modules[i];
+        m->code_start = pos;
+        memcpy(code + pos, m->obj.code, m->obj.code_len);
+        for (size_t j = 0; j < m->obj.segment_count; j++) {
+            Segment seg = m->obj.segments[j];
+            seg.addr += m->base[seg.section];
+            seg.start += pos;
+            seg.section = SEC_ABS;
+            segments[n++] = seg;
+        }
+        pos += m->obj.code_len;
+
+        for (size_t j = 0; j < m->obj.reloc_count; j++) {
+            const ObjReloc *r = &m->obj.relocs[j];
+            RelocCtx rc = { m, r->line };
+            ExprEnv env = { reloc_sym, reloc_rel, &rc };
+            uint16_t val;
+            int status = expr_eval(m->obj.expr + r->expr, r->expr_len, &env, &val);
+            if (status != EXPR_OK) {
+                // Unresolved operands were reported by the callbacks
+                if (status != EXPR_UNRESOLVED) {
+                    fprintf(stderr, "%s:%u: %s\n", m->name, r->line, expr_error(status));
+                }
+                error_count++;
+                continue;
+            }
+            if (r->size == 1 && !EXPR_FITS_BYTE(val)) {
+                fprintf(stderr, "%s:%u: value %04Xh does not fit in a byte\n", m->name, r->line, val);
+                error_count++;
+            }
+            code[m->code_start + r->offset] = val & 0xFF;
+            if (r->size == 2) code[m->code_start + r->offset + 1] = val >> 8;
+        }
+    }
+}
+
+static int compare_segments(const void *a, const void *b) {
+    const Segment *x = *(const Segment *const *)a, *y = *(const Segment *const *)b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// Two modules writing the same address is almost certainly a layout mistake
+static void check_overlaps(void) {
+    const Segment **sorted = xmalloc(segment_count * sizeof(Segment *));
+    size_t n = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        if (segments[i].len) sorted[n++] = &segments[i];
+    }
+    qsort(sorted, n, sizeof(Segment *), compare_segments);
+    for (size_t i = 1; i < n; i++) {
+        if (sorted[i - 1]->addr + sorted[i - 1]->len > sorted[i]->addr) {
+            fprintf(stderr, "Error: code overlaps at %04Xh\n", sorted[i]->addr);
+            error_count++;
+        }
+    }
+    free(sorted);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f hex|bin|com] [-r record_len] [-C code_addr] [-D data_addr]\n"
+                    "       [-o output] file.obj...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *outname = NULL;
+    int format = -1;
+    int record_len = 16;
+    uint32_t code_addr = 0, data_addr = 0;
+    int code_set = 0, data_set = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:r:C:D:o:")) != -1) {
+        switch (opt) {
+        case 'f':
+            format = parse_format(optarg);
+            if (format < 0 || format == OUT_OBJ) {
+                fprintf(stderr, "Error: unknown output format '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            record_len = atoi(optarg);
+            if (record_len < 1 || record_len > 255) {
+                fprintf(stderr, "Error: record length must be 1-255\n");
+                return 1;
+            }
+            break;
+        case 'C':
+        case 'D':
+            if (!parse_addr(optarg, opt == 'C' ? &code_addr : &data_addr)) {
+                fprintf(stderr, "Error: bad address '%s'\n", optarg);
+                return 1;
+            }
+            if (opt == 'C') code_set = 1;
+            else data_set = 1;
+            break;
+        case 'o':
+            outname = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+
+    // Without -f the output extension decides; HEX otherwise
+    if (format < 0 && outname) {
+        const char *dot = strrchr(outname, '.');
+        if (dot) format = parse_format(dot + 1);
+    }
+    if (format < 0 || format == OUT_OBJ) format = OUT_HEX;
+    if (!outname) {
+        static const char *const DEFAULT_NAMES[] = { "out.hex", "out.bin", "out.com" };
+        outname = DEFAULT_NAMES[format];
+    }
+    if (format == OUT_COM && !code_set) code_addr = COM_BASE;
+
+    module_count = argc - optind;
+    modules = xmalloc(module_count * sizeof(Module));
+    memset(modules, 0, module_count * sizeof(Module));
+    for (size_t i = 0; i < module_count; i++) {
+        modules[i].name = argv[optind + i];
+        if (obj_read(modules[i].name, &modules[i].obj) < 0) return 1;
+    }
+
+    place_sections(code_addr, data_addr, data_set);
+    resolve_symbols();
+    combine();
+    check_overlaps();
+
+    if (error_count) {
+        fprintf(stderr, "%d error(s)\n", error_count);
+        return 1;
+    }
+
+    const Module *last = &modules[module_count - 1];
+    printf("Linked %zu modules: CSEG %04Xh-%04Xh, DSEG %04Xh-%04Xh, %zu public symbols\n",
+           module_count, modules[0].base[SEC_CODE], last->base[SEC_CODE] + last->size[SEC_CODE],
+           modules[0].base[SEC_DATA], last->base[SEC_DATA] + last->size[SEC_DATA], global_count);
+
+    if (write_image(outname, format, record_len, code, segments, segment_count) < 0) return 1;
+    printf("Output: %s\n", outname);
+    return 0;
+}
@@ -0,0 +1,478 @@
+// Object files, expressions and image output shared by asm8080 and ld8080
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "obj8080.h"
+#include "linetab.h"
+
+#define OBJ_MAGIC "O80\x01"
+#define EXPR_STACK 64
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+// Expressions
+
+uint16_t expr_unary(int op, uint16_t a) {
+    switch (op) {
+        case EX_NEG:  return -a;
+        case EX_NOT:  return ~a;
+        case EX_HIGH: return a >> 8;
+        default:      return a & 0xFF;  // EX_LOW
+    }
+}
+
+int expr_binary(int op, uint16_t a, uint16_t b) {
+    switch (op) {
+        case EX_ADD: return (uint16_t)(a + b);
+        case EX_SUB: return (uint16_t)(a - b);
+        case EX_MUL: return (uint16_t)(a * b);
+        case EX_DIV: return b ? a / b : -1;
+        case EX_MOD: return b ? a % b : -1;
+        case EX_AND: return a & b;
+        case EX_OR:  return a | b;
+        case EX_XOR: return a ^ b;
+        case EX_SHL: return b < 16 ? (uint16_t)(a << b) : 0;
+        case EX_SHR: return b < 16 ? a >> b : 0;
+        case EX_EQ:  return a == b ? 0xFFFF : 0;
+        case EX_NE:  return a != b ? 0xFFFF : 0;
+        case EX_LT:  return a < b ? 0xFFFF : 0;
+        case EX_GT:  return a > b ? 0xFFFF : 0;
+        case EX_LE:  return a <= b ? 0xFFFF : 0;
+        default:     return a >= b ? 0xFFFF : 0;  // EX_GE
+    }
+}
+
+// Code read from object files is checked as it runs
+int expr_eval(const uint8_t *code, size_t len, const ExprEnv *env, uint16_t *val) {
+    uint16_t stack[EXPR_STACK];
+    int sp = 0;
+    const uint8_t *pc = code, *end = code + len;
+
+    while (pc < end) {
+        int op = *pc++;
+        if (op > EX_LAST || (size_t)(end - pc) < EX_OPERAND_SIZE(op)) return EXPR_BAD;
+
+        if (op <= EX_REL) {
+            if (sp == EXPR_STACK) return EXPR_BAD;
+            uint16_t *top = &stack[sp++];
+            if (op == EX_PUSH) {
+                *top = pc[0] | (pc[1] << 8);
+            } else if (op == EX_SYM) {
+                uint32_t i = pc[0] | (pc[1] << 8) | (pc[2] << 16) | ((uint32_t)pc[3] << 24);
+                if (!env->sym(env->ctx, i, top)) return EXPR_UNRESOLVED;
+            } else {
+                if (!env->rel(env->ctx, pc[0], pc[1] | (pc[2] << 8), top)) return EXPR_UNRESOLVED;
+            }
+            pc += EX_OPERAND_SIZE(op);
+        } else if (op <= EX_LOW) {
+            if (sp < 1) return EXPR_BAD;
+            stack[sp - 1] = expr_unary(op, stack[sp - 1]);
+        } else {
+            if (sp < 2) return EXPR_BAD;
+            sp--;
+            int r = expr_binary(op, stack[sp - 1], stack[sp]);
+            if (r < 0) return EXPR_DIV_ZERO;
+            stack[sp - 1] = r;
+        }
+    }
+    if (sp != 1) return EXPR_BAD;
+    *val = stack[0];
+    return EXPR_OK;
+}
+
+const char *expr_error(int status) {
+    switch (status) {
+        case EXPR_UNRESOLVED: return "unresolved symbol";
+        case EXPR_DIV_ZERO:   return "division by zero";
+        case EXPR_BAD:        return "malformed expression";
+        default:              return "no error";
+    }
+}
+
+// Object files: a header of counts, then the tables, then the code,
+// expression and name buffers. All fields are little-endian.
+//
+//   magic "O80\1"
+//   u32 code_len, segment_count, symbol_count, reloc_count, expr_len, names_len
+//   segments  { u8 section; u16 addr; u32 start; u32 len; }
+//   symbols   { u32 name; u16 value; u8 section; u8 flags; }   name: into names
+//   relocs    { u32 offset; u32 expr; u32 expr_len; u8 size; u32 line; }
+//   code, expr, names (NUL-terminated strings)
+
+#define SEGMENT_BYTES 11
+#define SYMBOL_BYTES 8
+#define RELOC_BYTES 17
+#define HEADER_BYTES 28
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static int write_file(const char *name, const void *data, size_t len) {
+    FILE *out = fopen(name, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", name);
+        return -1;
+    }
+    if (fwrite(data, 1, len, out) != len || fclose(out) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int obj_write(const char *name, const Object *obj) {
+    size_t names_len = 0;
+    for (size_t i = 0; i < obj->symbol_count; i++) names_len += strlen(obj->symbols[i].name) + 1;
+
+    size_t size = HEADER_BYTES + obj->segment_count * SEGMENT_BYTES +
+                  obj->symbol_count * SYMBOL_BYTES + obj->reloc_count * RELOC_BYTES +
+                  obj->code_len + obj->expr_len + names_len;
+    uint8_t *buf = xmalloc(size);
+    uint8_t *p = buf;
+
+    memcpy(p, OBJ_MAGIC, 4);
+    p += 4;
+    p = put32(p, obj->code_len);
+    p = put32(p, obj->segment_count);
+    p = put32(p, obj->symbol_count);
+    p = put32(p, obj->reloc_count);
+    p = put32(p, obj->expr_len);
+    p = put32(p, names_len);
+
+    for (size_t i = 0; i < obj->segment_count; i++) {
+        const Segment *seg = &obj->segments[i];
+        *p++ = seg->section;
+        p = put16(p, seg->addr);
+        p = put32(p, seg->start);
+        p = put32(p, seg->len);
+    }
+    uint32_t name_off = 0;
+    for (size_t i = 0; i < obj->symbol_count; i++) {
+        const ObjSymbol *sym = &obj->symbols[i];
+        p = put32(p, name_off);
+        p = put16(p, sym->value);
+        *p++ = sym->section;
+        *p++ = sym->flags;
+        name_off += strlen(sym->name) + 1;
+    }
+    for (size_t i = 0; i < obj->reloc_count; i++) {
+        const ObjReloc *r = &obj->relocs[i];
+        p = put32(p, r->offset);
+        p = put32(p, r->expr);
+        p = put32(p, r->expr_len);
+        *p++ = r->size;
+        p = put32(p, r->line);
+    }
+    memcpy(p, obj->code, obj->code_len);
+    p += obj->code_len;
+    memcpy(p, obj->expr, obj->expr_len);
+    p += obj->expr_len;
+    for (size_t i = 0; i < obj->symbol_count; i++) {
+        size_t n = strlen(obj->symbols[i].name) + 1;
+        memcpy(p, obj->symbols[i].name, n);
+        p += n;
+    }
+
+    int ret = write_file(name, buf, size);
+    free(buf);
+    return ret;
+}
+
+// Loads the whole file, then checks every count and offset against it
+int obj_read(const char *name, Object *obj) {
+    FILE *in = fopen(name, "rb");
+    if (!in) {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        return -1;
+    }
+    size_t cap = 65536, size = 0, n;
+    uint8_t *buf = xmalloc(cap);
+    while ((n = fread(buf + size, 1, cap - size, in)) > 0) {
+        size += n;
+        if (size == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf) {
+                fprintf(stderr, "Error: out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    fclose(in);
+
+    memset(obj, 0, sizeof(*obj));
+    if (size < HEADER_BYTES || memcmp(buf, OBJ_MAGIC, 4) != 0) goto bad;
+
+    uint64_t code_len = get32(buf + 4), nseg = get32(buf + 8), nsym = get32(buf + 12);
+    uint64_t nrel = get32(buf + 16), expr_len = get32(buf + 20), names_len = get32(buf + 24);
+    uint64_t need = HEADER_BYTES + nseg * SEGMENT_BYTES + nsym * SYMBOL_BYTES +
+                    nrel * RELOC_BYTES + code_len + expr_len + names_len;
+    if (need != size) goto bad;
+
+    const uint8_t *p = buf + HEADER_BYTES;
+    const uint8_t *tables = p;
+    p += nseg * SEGMENT_BYTES + nsym * SYMBOL_BYTES + nrel * RELOC_BYTES;
+    obj->code = (uint8_t *)p;
+    obj->code_len = code_len;
+    obj->expr = (uint8_t *)p + code_len;
+    obj->expr_len = expr_len;
+    const char *names = (const char *)p + code_len + expr_len;
+    if (names_len && names[names_len - 1] != '\0') goto bad;
+
+    p = tables;
+    obj->segments = xmalloc(nseg * sizeof(Segment));
+    obj->segment_count = nseg;
+    for (size_t i = 0; i < nseg; i++, p += SEGMENT_BYTES) {
+        Segment *seg = &obj->segments[i];
+        seg->section = p[0];
+        seg->addr = get16(p + 1);
+        seg->start = get32(p + 3);
+        seg->len = get32(p + 7);
+        if (seg->section >= SEC_COUNT || seg->start + seg->len > code_len) goto bad;
+    }
+    obj->symbols = xmalloc(nsym * sizeof(ObjSymbol));
+    obj->symbol_count = nsym;
+    for (size_t i = 0; i < nsym; i++, p += SYMBOL_BYTES) {
+        ObjSymbol *sym = &obj->symbols[i];
+        uint32_t off = get32(p);
+        if (off >= names_len || p[6] > SEC_EXTERN) goto bad;
+        sym->name = names + off;
+        sym->value = get16(p + 4);
+        sym->section = p[6];
+        sym->flags = p[7];
+    }
+    obj->relocs = xmalloc(nrel * sizeof(ObjReloc));
+    obj->reloc_count = nrel;
+    for (size_t i = 0; i < nrel; i++, p += RELOC_BYTES) {
+        ObjReloc *r = &obj->relocs[i];
+        r->offset = get32(p);
+        r->expr = get32(p + 4);
+        r->expr_len = get32(p + 8);
+        r->size = p[12];
+        r->line = get32(p + 13);
+        if ((r->size != 1 && r->size != 2) || (uint64_t)r->offset + r->size > code_len ||
+            (uint64_t)r->expr + r->expr_len > expr_len) goto bad;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "Error: %s is not a valid object file\n", name);
+    free(obj->segments);
+    free(obj->symbols);
+    free(obj->relocs);
+    free(buf);
+    return -1;
+}
+
+// Output images
+
+int parse_format(const char *s) {
+    if (strcasecmp(s, "hex") == 0) return OUT_HEX;
+    if (strcasecmp(s, "bin") == 0) return OUT_BIN;
+    if (strcasecmp(s, "com") == 0) return OUT_COM;
+    if (strcasecmp(s, "obj") == 0) return OUT_OBJ;
+    return -1;
+}
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+static char *put_hex8(char *p, uint8_t v) {
+    p[0] = HEX_DIGITS[v >> 4];
+    p[1] = HEX_DIGITS[v & 0xF];
+    return p + 2;
+}
+
+// Intel HEX with up to record_len data bytes per record
+static char *build_hex(int record_len, const uint8_t *code, const Segment *segments,
+                       size_t segment_count, size_t *out_len) {
+    size_t records = 1, bytes = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        records += (segments[i].len + record_len - 1) / record_len;
+        bytes += segments[i].len;
+    }
+    // ":LLAAAATT" + data + "CC\n" per record
+    char *buf = xmalloc(records * 12 + bytes * 2);
+
+    char *p = buf;
+    for (size_t i = 0; i < segment_count; i++) {
+        const Segment *seg = &segments[i];
+        for (size_t pos = 0; pos < seg->len; pos += record_len) {
+            size_t n = seg->len - pos < (size_t)record_len ? seg->len - pos : (size_t)record_len;
+            uint16_t addr = seg->addr + pos;
+            const uint8_t *data = &code[seg->start + pos];
+            uint8_t checksum = n + (addr >> 8) + (addr & 0xFF);
+            *p++ = ':';
+            p = put_hex8(p, n);
+            p = put_hex8(p, addr >> 8);
+            p = put_hex8(p, addr & 0xFF);
+            p = put_hex8(p, 0x00);
+            for (size_t j = 0; j < n; j++) {
+                p = put_hex8(p, data[j]);
+                checksum += data[j];
+            }
+            p = put_hex8(p, ~checksum + 1);
+            *p++ = '\n';
+        }
+    }
+    memcpy(p, ":00000001FF\n", 12);  // EOF record
+    p += 12;
+
+    *out_len = p - buf;
+    return buf;
+}
+
+// Flat memory image from the lowest address used (or from `base`, when
+// fixed_base is set) to the highest. Gaps are zero-filled; where segments
+// overlap, the later one wins, as it would when loading the HEX file.
+static uint8_t *build_image(int fixed_base, uint32_t base, const uint8_t *code,
+                            const Segment *segments, size_t segment_count, size_t *out_len) {
+    uint32_t lo = 0x10000, hi = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        const Segment *seg = &segments[i];
+        if (!seg->len) continue;
+        if (seg->addr + seg->len > 0x10000) {
+            fprintf(stderr, "Error: code at %04Xh runs past FFFFh\n", seg->addr);
+            return NULL;
+        }
+        if (seg->addr < lo) lo = seg->addr;
+        if (seg->addr + seg->len > hi) hi = seg->addr + seg->len;
+    }
+    if (hi == 0) lo = hi = base;
+    if (fixed_base) {
+        if (lo < base) {
+            fprintf(stderr, "Error: code at %04Xh is below the load address %04Xh\n", lo, base);
+            return NULL;
+        }
+        lo = base;
+    }
+
+    uint8_t *image = xmalloc(hi - lo + 1);
+    memset(image, 0, hi - lo + 1);
+    for (size_t i = 0; i < segment_count; i++) {
+        const Segment *seg = &segments[i];
+        memcpy(image + (seg->addr - lo), &code[seg->start], seg->len);
+    }
+    *out_len = hi - lo;
+    return image;
+}
+
+int write_image(const char *name, int format, int record_len,
+                const uint8_t *code, const Segment *segments, size_t segment_count) {
+    size_t len;
+    void *data;
+    switch (format) {
+        case OUT_BIN: data = build_image(0, 0, code, segments, segment_count, &len); break;
+        case OUT_COM: data = build_image(1, COM_BASE, code, segments, segment_count, &len); break;
+        default: data = build_hex(record_len, code, segments, segment_count, &len); break;
+    }
+    if (!data) return -1;
+
+    int ret = write_file(name, data, len);
+    free(data);
+    return ret;
+}
+
+// Line tables
+
+static int compare_lines(const void *a, const void *b) {
+    const LineEntry *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int compare_values(const void *a, const void *b) {
+    const ObjSymbol *x = a, *y = b;
+    if (x->value != y->value) return (x->value > y->value) - (x->value < y->value);
+    return strcasecmp(x->name, y->name);
+}
+
+int write_linetab(const char *name, const char *const *files, size_t file_count,
+                  const ObjSymbol *symbols, size_t symbol_count,
+                  const LineEntry *lines, size_t line_count) {
+    if (file_count > LINETAB_MAX_FILES) {
+        fprintf(stderr, "Error: more than %d source files for %s\n", LINETAB_MAX_FILES, name);
+        return -1;
+    }
+
+    ObjSymbol *syms = xmalloc(symbol_count * sizeof(ObjSymbol));
+    LineEntry *sorted = xmalloc(line_count * sizeof(LineEntry));
+    memcpy(syms, symbols, symbol_count * sizeof(ObjSymbol));
+    memcpy(sorted, lines, line_count * sizeof(LineEntry));
+    qsort(syms, symbol_count, sizeof(ObjSymbol), compare_values);
+    qsort(sorted, line_count, sizeof(LineEntry), compare_lines);
+
+    size_t strings = 0;
+    for (size_t i = 0; i < file_count; i++) strings += strlen(files[i]) + 1;
+    for (size_t i = 0; i < symbol_count; i++) strings += strlen(syms[i].name) + 1;
+
+    size_t size = LINETAB_HEADER_SIZE + file_count * LINETAB_FILE_SIZE +
+                  symbol_count * LINETAB_SYMBOL_SIZE + line_count * LINETAB_LINE_SIZE + strings;
+    uint8_t *buf = xmalloc(size);
+    uint8_t *p = buf;
+
+    memcpy(p, LINETAB_MAGIC, 4);
+    p += 4;
+    p = put16(p, file_count);
+    p = put16(p, 0);
+    p = put32(p, symbol_count);
+    p = put32(p, line_count);
+    p = put32(p, strings);
+
+    uint32_t name_off = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        p = put32(p, name_off);
+        name_off += strlen(files[i]) + 1;
+    }
+    for (size_t i = 0; i < symbol_count; i++) {
+        p = put32(p, name_off);
+        p = put16(p, syms[i].value);
+        p = put16(p, syms[i].flags & SYM_PUBLIC ? LINETAB_SYM_PUBLIC : 0);
+        name_off += strlen(syms[i].name) + 1;
+    }
+    for (size_t i = 0; i < line_count; i++) {
+        p = put16(p, sorted[i].addr);
+        p = put16(p, sorted[i].len);
+        p = put32(p, sorted[i].line);
+        *p++ = sorted[i].file;
+        *p++ = sorted[i].flags;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        size_t n = strlen(files[i]) + 1;
+        memcpy(p, files[i], n);
+        p += n;
+    }
+    for (size_t i = 0; i < symbol_count; i++) {
+        size_t n = strlen(syms[i].name) + 1;
+        memcpy(p, syms[i].name, n);
+        p += n;
+    }
+
+    int ret = write_file(name, buf, size);
+    free(buf);
+    free(sorted);
+    free(syms);
+    return ret;
+}
@@ -0,0 +1,120 @@
+// Object files, expressions and image output shared by asm8080 and ld8080
+#ifndef OBJ8080_H
+#define OBJ8080_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sections. ASEG code sits at the address it was assembled for; CSEG and
+// DSEG code is placed by the linker. EXTERN marks an imported symbol.
+enum { SEC_ABS, SEC_CODE, SEC_DATA, SEC_EXTERN };
+#define SEC_COUNT 3
+
+// Assembled bytes in emission order, split into segments at each ORG or
+// section change. addr is relative to the section's base.
+typedef struct {
+    uint16_t addr;
+    uint8_t section;
+    size_t start;  // Offset into the code buffer
+    size_t len;
+} Segment;
+
+#define SYM_PUBLIC 1
+
+typedef struct {
+    const char *name;
+    uint16_t value;   // Offset into the section, or the value for SEC_ABS
+    uint8_t section;
+    uint8_t flags;
+} ObjSymbol;
+
+// A value the linker computes and patches in: the expression's postfix
+// code refers to symbols by their index in the object's symbol table
+typedef struct {
+    uint32_t offset;  // Into the code buffer
+    uint32_t expr;    // Into the expression buffer
+    uint32_t expr_len;
+    uint8_t size;     // 1 or 2 bytes
+    uint32_t line;    // Source line, for messages
+} ObjReloc;
+
+typedef struct {
+    uint8_t *code;
+    size_t code_len;
+    Segment *segments;
+    size_t segment_count;
+    ObjSymbol *symbols;
+    size_t symbol_count;
+    ObjReloc *relocs;
+    size_t reloc_count;
+    uint8_t *expr;
+    size_t expr_len;
+} Object;
+
+// Write or read an object file; both report errors themselves and return -1
+int obj_write(const char *name, const Object *obj);
+int obj_read(const char *name, Object *obj);
+
+// Postfix expression code. Operators pop their operands and push the result.
+enum {
+    EX_PUSH,  // Followed by a 16-bit value, low byte first
+    EX_SYM,   // Followed by a 32-bit symbol index
+    EX_REL,   // Followed by a section and a 16-bit offset into it
+    EX_NEG, EX_NOT, EX_HIGH, EX_LOW,
+    EX_ADD, EX_SUB, EX_MUL, EX_DIV, EX_MOD,
+    EX_AND, EX_OR, EX_XOR, EX_SHL, EX_SHR,
+    EX_EQ, EX_NE, EX_LT, EX_GT, EX_LE, EX_GE,  // True is FFFFh
+};
+
+#define EX_LAST EX_GE
+
+// Operand bytes that follow each operator
+#define EX_OPERAND_SIZE(op) ((op) == EX_PUSH ? 2 : (op) == EX_SYM ? 4 : (op) == EX_REL ? 3 : 0)
+
+// Resolves EX_SYM and EX_REL operands; return 0 if the value is not known
+typedef struct {
+    int (*sym)(void *ctx, uint32_t index, uint16_t *val);
+    int (*rel)(void *ctx, int section, uint16_t offset, uint16_t *val);
+    void *ctx;
+} ExprEnv;
+
+enum { EXPR_OK, EXPR_UNRESOLVED, EXPR_DIV_ZERO, EXPR_BAD };
+
+uint16_t expr_unary(int op, uint16_t a);
+// Returns -1 on division by zero
+int expr_binary(int op, uint16_t a, uint16_t b);
+int expr_eval(const uint8_t *code, size_t len, const ExprEnv *env, uint16_t *val);
+const char *expr_error(int status);
+
+// Byte operands: 0 to FFh, or -100h to -1 as 16-bit two's complement
+#define EXPR_FITS_BYTE(v) ((v) <= 0xFF || (v) >= 0xFF00)
+
+// Output images. The whole file is built in memory and written at once.
+enum { OUT_HEX, OUT_BIN, OUT_COM, OUT_OBJ };
+
+#define COM_BASE 0x100  // CP/M loads .com files at 0100h
+
+// Format from a -f argument or a file extension, -1 if unknown
+int parse_format(const char *s);
+
+// Write segments with absolute addresses as HEX, .bin or .com; returns -1
+// after reporting an error
+int write_image(const char *name, int format, int record_len,
+                const uint8_t *code, const Segment *segments, size_t segment_count);
+
+// Address-to-line table for the emulator tools (format in linetab.h). Lines
+// and symbols are sorted by address here; symbols must be absolute. Returns
+// -1 after reporting an error.
+typedef struct {
+    uint16_t addr;
+    uint16_t len;
+    uint32_t line;
+    uint8_t file;
+    uint8_t flags;  // LINETAB_LINE_CODE for instructions
+} LineEntry;
+
+int write_linetab(const char *name, const char *const *files, size_t file_count,
+                  const ObjSymbol *symbols, size_t symbol_count,
+                  const LineEntry *lines, size_t line_count);
+
+#endif
@@ -0,0 +1,276 @@
+// Peephole optimization. Patterns are matched on the bytes of a finished
+// pass, where every operand is known; the assembler then reassembles with
+// the chosen lines rewritten, so labels move with the code.
+#include <stdlib.h>
+#include <string.h>
+#include "opcodes.h"
+#include "machine.h"
+#include "peep8080.h"
+
+// 8080 flag bits, as in the PSW
+#define FLAG_S   0x80
+#define FLAG_Z   0x40
+#define FLAG_AC  0x10
+#define FLAG_P   0x04
+#define FLAG_CY  0x01
+#define FLAGS_ALL (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
+
+// Instructions followed when deciding whether flags are still wanted;
+// past this they are assumed to be
+#define LIVE_STEPS 64
+
+static const uint8_t COND_FLAGS[8] = {
+    FLAG_Z, FLAG_Z, FLAG_CY, FLAG_CY, FLAG_P, FLAG_P, FLAG_S, FLAG_S,
+};
+
+// Flags an instruction other than a jump, call or return reads and sets
+static void flag_use(uint8_t op, uint8_t *reads, uint8_t *writes) {
+    *reads = *writes = 0;
+    if ((op >= 0x80 && op <= 0xBF) || (op & 0xC7) == 0xC6) {
+        *writes = FLAGS_ALL;
+        if ((op & 0xE8) == 0x88 || op == 0xCE || op == 0xDE) *reads = FLAG_CY;  // ADC, SBB, ACI, SBI
+    } else if (op < 0x40 && ((op & 0x07) == 0x04 || (op & 0x07) == 0x05)) {
+        *writes = FLAG_S | FLAG_Z | FLAG_AC | FLAG_P;  // INR, DCR
+    } else if ((op & 0xCF) == 0x09 || op == 0x07 || op == 0x0F || op == 0x37) {
+        *writes = FLAG_CY;  // DAD, RLC, RRC, STC
+    } else if (op == 0x17 || op == 0x1F || op == 0x3F) {
+        *reads = *writes = FLAG_CY;  // RAL, RAR, CMC
+    } else if (op == 0x27) {
+        *reads = FLAG_CY | FLAG_AC;  // DAA
+        *writes = FLAGS_ALL;
+    } else if (op == 0xF5) {
+        *reads = FLAGS_ALL;  // PUSH PSW
+    } else if (op == 0xF1) {
+        *writes = FLAGS_ALL;  // POP PSW
+    }
+}
+
+// Whether a flag value set just before `addr` can still be read. Paths are
+// followed through jumps and both ways at conditional ones; calls, returns,
+// HLT and anything that is not a known instruction count as reading them.
+static int flags_live(const PeepInput *in, const uint8_t *is_insn, uint16_t addr) {
+    struct { uint16_t addr; uint8_t need; } paths[LIVE_STEPS];
+    int depth = 0, steps = 0;
+    paths[depth].addr = addr;
+    paths[depth++].need = FLAGS_ALL;
+
+    while (depth) {
+        uint16_t a = paths[--depth].addr;
+        uint8_t need = paths[depth].need;
+        while (need) {
+            if (++steps > LIVE_STEPS || !is_insn[a]) return 1;
+            uint8_t op = in->mem[a];
+            uint16_t target = in->mem[(uint16_t)(a + 1)] | (in->mem[(uint16_t)(a + 2)] << 8);
+            if (op == 0xC3) {
+                a = target;
+                continue;
+            }
+            if ((op & 0xC7) == 0xC2) {  // Jcc
+                if (COND_FLAGS[(op >> 3) & 7] & need) return 1;
+                if (depth == LIVE_STEPS) return 1;
+                paths[depth].addr = target;
+                paths[depth++].need = need;
+            } else if (op == 0xCD || op == 0xC9 || op == 0xE9 || op == 0x76 || (op & 0xC7) == 0xC0 ||
+                       (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7) {
+                return 1;
+            } else {
+                uint8_t reads, writes;
+                flag_use(op, &reads, &writes);
+                if (reads & need) return 1;
+                need &= ~writes;
+            }
+            a += OP_LENGTHS[op];
+        }
+    }
+    return 0;
+}
+
+static int is_move_self(uint8_t op) {
+    return op >= 0x40 && op < 0x80 && op != 0x76 && ((op >> 3) & 7) == (op & 7);
+}
+
+size_t peep_plan(const PeepInput *in, uint8_t *kinds) {
+    const uint8_t *mem = in->mem;
+    uint8_t *is_insn = calloc(0x10000, 1);
+    uint8_t *target = malloc(0x10000);
+    size_t chosen = 0;
+    if (!is_insn || !target) {
+        free(is_insn);
+        free(target);
+        return 0;
+    }
+
+    // A RET anything jumps to must stay
+    memcpy(target, in->labels, 0x10000);
+    for (size_t i = 0; i < in->insn_count; i++) {
+        uint16_t a = in->insns[i];
+        uint8_t op = mem[a];
+        is_insn[a] = 1;
+        if (op == 0xC3 || op == 0xCD || (op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4) {
+            target[mem[(uint16_t)(a + 1)] | (mem[(uint16_t)(a + 2)] << 8)] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < in->insn_count; i++) {
+        uint16_t a = in->insns[i];
+        uint8_t op = mem[a];
+        uint16_t next = a + OP_LENGTHS[op];
+        uint16_t dest = mem[(uint16_t)(a + 1)] | (mem[(uint16_t)(a + 2)] << 8);
+        if (kinds[i]) continue;
+
+        if (op == 0x3E && mem[(uint16_t)(a + 1)] == 0 && !flags_live(in, is_insn, next)) {
+            kinds[i] = PEEP_ZERO_A;
+        } else if (op == 0xC3 && is_insn[dest] && mem[dest] == 0xC9) {
+            kinds[i] = PEEP_JUMP_RET;
+        } else if (op == 0xCD && i + 1 < in->insn_count && in->insns[i + 1] == next &&
+                   mem[next] == 0xC9 && !target[next]) {
+            kinds[i] = PEEP_TAIL_CALL;
+            kinds[i + 1] = PEEP_TAIL_RET;
+        } else if (is_move_self(op)) {
+            kinds[i] = PEEP_MOVE_SELF;
+        } else {
+            continue;
+        }
+        chosen++;
+    }
+
+    free(is_insn);
+    free(target);
+    return chosen;
+}
+
+void peep_report(FILE *out, const size_t count[PEEP_KINDS]) {
+    static const struct {
+        const char *name;
+        uint8_t before[2], after;  // Opcodes run, 0 for none
+    } PATTERNS[PEEP_KINDS] = {
+        [PEEP_ZERO_A]    = { "MVI A,0 -> XRA A",  { 0x3E, 0 }, 0xAF },
+        [PEEP_JUMP_RET]  = { "JMP to RET -> RET", { 0xC3, 0 }, 0 },
+        [PEEP_TAIL_CALL] = { "CALL; RET -> JMP",  { 0xCD, 0xC9 }, 0xC3 },
+        [PEEP_MOVE_SELF] = { "MOV r,r removed",   { 0x7F, 0 }, 0 },
+    };
+    size_t total = 0, total_bytes = 0, total_cycles = 0;
+
+    fprintf(out, "Optimized              Count   Bytes  Cycles\n");
+    for (int k = 0; k < PEEP_KINDS; k++) {
+        if (!PATTERNS[k].name || !count[k]) continue;
+        int bytes = 0, cycles = 0;
+        for (int j = 0; j < 2; j++) {
+            uint8_t op = PATTERNS[k].before[j];
+            if (op) {
+                bytes += OP_LENGTHS[op];
+                cycles += OP_CYCLES[op];
+            }
+        }
+        if (PATTERNS[k].after) {
+            bytes -= OP_LENGTHS[PATTERNS[k].after];
+            cycles -= OP_CYCLES[PATTERNS[k].after];
+        }
+        // The RET a jump now stands for runs either way, so only the JMP is saved
+        if (k == PEEP_JUMP_RET) bytes -= OP_LENGTHS[0xC9];
+        fprintf(out, "  %-20s %5zu  %6zu  %6zu\n", PATTERNS[k].name, count[k], count[k] * bytes,
+                count[k] * cycles);
+        total += count[k];
+        total_bytes += count[k] * bytes;
+        total_cycles += count[k] * cycles;
+    }
+    fprintf(out, "  %-20s %5zu  %6zu  %6zu\n", "Total", total, total_bytes, total_cycles);
+}
+
+// Serial output of one run
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} Output;
+
+static int no_input(void *ctx) {
+    (void)ctx;
+    return -1;
+}
+
+static void capture(void *ctx, uint8_t ch) {
+    Output *o = ctx;
+    if (o->len == o->cap) {
+        size_t cap = o->cap ? o->cap * 2 : 256;
+        uint8_t *data = realloc(o->data, cap);
+        if (!data) return;
+        o->data = data;
+        o->cap = cap;
+    }
+    o->data[o->len++] = ch;
+}
+
+// Stack addresses run from 0 down, so an empty stack at 0 is 10000h
+static uint32_t stack_top(uint16_t sp) {
+    return sp ? sp : 0x10000;
+}
+
+// Returns the lowest stack pointer seen, or 0 if the run did not halt
+static uint32_t run(machine_t *m, const uint8_t *image, uint16_t start, uint64_t budget, Output *out) {
+    machine_init(m, no_input, capture, out);
+    mem_load(m, 0, image, 0x10000);
+    m->cpu.pc = start;
+    uint32_t low = stack_top(m->cpu.sp);
+    while (!m->cpu.halted && m->cpu.cycles < budget) {
+        cpu_step(m);
+        if (stack_top(m->cpu.sp) < low) low = stack_top(m->cpu.sp);
+    }
+    return m->cpu.halted ? low : 0;
+}
+
+#define MAX_REPORTED 8
+
+int peep_verify(const uint8_t *before, const uint8_t *after, uint16_t start, uint64_t budget) {
+    static machine_t ma, mb;
+    Output oa = { 0 }, ob = { 0 };
+    uint32_t low_a = run(&ma, before, start, budget, &oa);
+    uint32_t low_b = run(&mb, after, start, budget, &ob);
+    int diffs = 0;
+
+    if (!low_a || !low_b) {
+        fprintf(stderr, "Verify: %s did not halt within %llu cycles\n", !low_a ? "original" : "optimized",
+                (unsigned long long)budget);
+        free(oa.data);
+        free(ob.data);
+        return -1;
+    }
+
+    const cpu_8080_t *a = &ma.cpu, *b = &mb.cpu;
+    const struct { const char *name; unsigned va, vb; } regs[] = {
+        { "A", a->a, b->a }, { "flags", a->f.byte, b->f.byte }, { "BC", a->bc.word, b->bc.word },
+        { "DE", a->de.word, b->de.word }, { "HL", a->hl.word, b->hl.word }, { "SP", a->sp, b->sp },
+        { "PC", a->pc, b->pc }, { "INTE", a->inte, b->inte },
+    };
+    for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+        if (regs[i].va == regs[i].vb) continue;
+        fprintf(stderr, "Verify: %s is %04X, optimized %04X\n", regs[i].name, regs[i].va, regs[i].vb);
+        diffs++;
+    }
+
+    if (oa.len != ob.len || (oa.len && memcmp(oa.data, ob.data, oa.len) != 0)) {
+        size_t i = 0;
+        while (i < oa.len && i < ob.len && oa.data[i] == ob.data[i]) i++;
+        fprintf(stderr, "Verify: serial output differs from byte %zu (%zu bytes, optimized %zu)\n", i,
+                oa.len, ob.len);
+        diffs++;
+    }
+
+    // Below the final stack pointer is space the program pushed and popped
+    uint32_t low = low_a < low_b ? low_a : low_b;
+    uint32_t top = stack_top(a->sp);
+    int reported = 0;
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        if (before[addr] != after[addr] || (addr >= low && addr < top)) continue;
+        if (ma.mem.ram[addr] == mb.mem.ram[addr]) continue;
+        if (reported++ < MAX_REPORTED) {
+            fprintf(stderr, "Verify: memory %04X is %02X, optimized %02X\n", addr, ma.mem.ram[addr],
+                    mb.mem.ram[addr]);
+        }
+        diffs++;
+    }
+    if (reported > MAX_REPORTED) fprintf(stderr, "Verify: ... %d more memory differences\n", reported - MAX_REPORTED);
+
+    free(oa.data);
+    free(ob.data);
+    return diffs ? 1 : 0;
+}
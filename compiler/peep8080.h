@@ -0,0 +1,42 @@
+// Peephole optimization for asm8080 -O: slow idioms found in an assembled
+// image, each instruction's rewrite, and a check that runs the program
+// before and after in the emulator core
+#ifndef PEEP8080_H
+#define PEEP8080_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+enum {
+    PEEP_NONE,
+    PEEP_ZERO_A,     // MVI A,0 -> XRA A, where no flag it sets is read
+    PEEP_JUMP_RET,   // JMP to a RET -> RET
+    PEEP_TAIL_CALL,  // CALL X; RET -> JMP X ...
+    PEEP_TAIL_RET,   // ... and the RET goes
+    PEEP_MOVE_SELF,  // MOV r,r goes
+    PEEP_KINDS,
+};
+
+typedef struct {
+    const uint8_t *mem;      // 64K image holding the code
+    const uint16_t *insns;   // Instruction addresses, in source order
+    size_t insn_count;
+    const uint8_t *labels;   // 64K, nonzero where a label points
+} PeepInput;
+
+// Choose a rewrite for each instruction: kinds[i] for insns[i]. Returns the
+// number chosen.
+size_t peep_plan(const PeepInput *in, uint8_t *kinds);
+
+// Bytes and cycles saved per rewrite of each kind, summed over count[]
+void peep_report(FILE *out, const size_t count[PEEP_KINDS]);
+
+// Run two images from `start` until HLT and compare the state they leave:
+// registers, flags, serial output and memory, except bytes that already
+// differ in the images and stack space popped by the end. The images must
+// have the same layout. Returns 0 if they match, 1 if not, -1 if either
+// did not halt within `budget` cycles; differences go to stderr.
+int peep_verify(const uint8_t *before, const uint8_t *after, uint16_t start, uint64_t budget);
+
+#endif
@@ -0,0 +1,447 @@
+// Static timing analysis. The code is split into basic blocks; an edge to
+// the same or a lower address closes a loop over that address range, so
+// with those back edges left out the blocks form a DAG in address order and
+// the worst case is a longest-path pass over it. Blocks inside loops count
+// once per iteration of every enclosing loop, which needs a bound.
+#include <stdlib.h>
+#include <string.h>
+#include "opcodes.h"
+#include "timing8080.h"
+
+enum {
+    FLOW_NEXT,      // Falls through
+    FLOW_JUMP,      // JMP
+    FLOW_BRANCH,    // Jcc: target or fall through
+    FLOW_CALL,      // CALL, RST
+    FLOW_COND_CALL, // Ccc
+    FLOW_RET,       // RET
+    FLOW_COND_RET,  // Rcc: return or fall through
+    FLOW_HALT,
+    FLOW_INDIRECT,  // PCHL
+};
+
+static int flow_of(uint8_t op) {
+    if (op == 0xC3 || op == 0xCB) return FLOW_JUMP;
+    if (op == 0xCD || op == 0xDD || op == 0xED || op == 0xFD) return FLOW_CALL;
+    if (op == 0xC9 || op == 0xD9) return FLOW_RET;
+    if (op == 0x76) return FLOW_HALT;
+    if (op == 0xE9) return FLOW_INDIRECT;
+    switch (op & 0xC7) {
+        case 0xC2: return FLOW_BRANCH;
+        case 0xC4: return FLOW_COND_CALL;
+        case 0xC0: return FLOW_COND_RET;
+        case 0xC7: return FLOW_CALL;  // RST
+        default:   return FLOW_NEXT;
+    }
+}
+
+typedef struct {
+    size_t first, last;  // Instructions
+    uint64_t cycles;     // Own instructions, not-taken timings
+    int succ[2];         // Blocks, -1 for none
+    int loop;            // Innermost loop holding the block, -1 for none
+} Block;
+
+typedef struct {
+    int head;            // Block
+    uint16_t start, end; // Address range, end inclusive
+    uint32_t bound;      // 0 if not annotated
+    int parent;
+} Loop;
+
+// Result of a longest-path search
+typedef struct {
+    uint64_t cycles;
+    int status;
+    uint16_t where;
+} Cost;
+
+// Routine costs, memoized by entry address
+typedef struct {
+    uint8_t state;  // 0 not done, 1 in progress, 2 done
+    Cost cost;
+} Routine;
+
+static const TimingInput *input;
+static int *insn_at;  // Instruction index for each address, -1 if none
+static Block *blocks;
+static size_t block_count;
+static int *block_of;  // Block for each instruction
+static Loop *loops;
+static size_t loop_count;
+static Routine *routines;  // By address
+
+static uint16_t insn_addr(size_t i) {
+    return input->insns[i].addr;
+}
+
+static uint8_t insn_op(size_t i) {
+    return input->mem[insn_addr(i)];
+}
+
+static uint16_t insn_target(size_t i) {
+    uint16_t a = insn_addr(i);
+    uint8_t op = input->mem[a];
+    if ((op & 0xC7) == 0xC7) return op & 0x38;  // RST
+    return input->mem[(uint16_t)(a + 1)] | (input->mem[(uint16_t)(a + 2)] << 8);
+}
+
+static int insn_next(size_t i) {
+    uint32_t end = insn_addr(i) + OP_LENGTHS[insn_op(i)];
+    return end < 0x10000 ? insn_at[end] : -1;
+}
+
+static uint16_t block_start(int b) {
+    return insn_addr(blocks[b].first);
+}
+
+static uint16_t block_end(int b) {
+    size_t last = blocks[b].last;
+    return insn_addr(last) + OP_LENGTHS[insn_op(last)] - 1;
+}
+
+static int loop_holds(const Loop *l, uint16_t addr) {
+    return addr >= l->start && addr <= l->end;
+}
+
+static int build(const WorstCase *cases, size_t case_count) {
+    size_t n = input->insn_count;
+    uint8_t *leader = calloc(n ? n : 1, 1);
+    insn_at = malloc(0x10000 * sizeof(int));
+    block_of = malloc((n ? n : 1) * sizeof(int));
+    if (!leader || !insn_at || !block_of) return -1;
+
+    for (size_t i = 0; i < 0x10000; i++) insn_at[i] = -1;
+    for (size_t i = n; i-- > 0;) insn_at[insn_addr(i)] = i;
+
+    for (size_t i = 0; i < n; i++) {
+        int flow = flow_of(insn_op(i));
+        int next = insn_next(i);
+        if (i == 0) leader[i] = 1;
+        if (next >= 0 && flow != FLOW_NEXT && flow != FLOW_CALL && flow != FLOW_COND_CALL) {
+            leader[next] = 1;
+        }
+        if (flow == FLOW_JUMP || flow == FLOW_BRANCH || flow == FLOW_CALL || flow == FLOW_COND_CALL) {
+            int t = insn_at[insn_target(i)];
+            if (t >= 0) leader[t] = 1;
+        }
+        if (i + 1 < n && next != (int)i + 1) leader[i + 1] = 1;
+    }
+    for (size_t i = 0; i < case_count; i++) {
+        if (cases[i].from < 0x10000 && insn_at[cases[i].from] >= 0) leader[insn_at[cases[i].from]] = 1;
+        if (cases[i].to >= 0 && insn_at[cases[i].to] >= 0) leader[insn_at[cases[i].to]] = 1;
+    }
+
+    blocks = malloc((n ? n : 1) * sizeof(Block));
+    if (!blocks) return -1;
+    block_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (leader[i]) {
+            blocks[block_count++] = (Block){ i, i, 0, { -1, -1 }, -1 };
+        }
+        Block *b = &blocks[block_count - 1];
+        b->last = i;
+        b->cycles += OP_CYCLES[insn_op(i)];
+        block_of[i] = block_count - 1;
+    }
+    free(leader);
+
+    for (size_t b = 0; b < block_count; b++) {
+        size_t last = blocks[b].last;
+        int flow = flow_of(insn_op(last));
+        int next = insn_next(last);
+        int target = insn_at[insn_target(last)];
+        int k = 0;
+        if ((flow == FLOW_JUMP || flow == FLOW_BRANCH) && target >= 0) blocks[b].succ[k++] = block_of[target];
+        if (flow != FLOW_JUMP && flow != FLOW_RET && flow != FLOW_HALT && flow != FLOW_INDIRECT &&
+            next >= 0) {
+            blocks[b].succ[k++] = block_of[next];
+        }
+    }
+
+    // Back edges make loops; two closing the same head make one loop
+    loops = malloc((block_count ? block_count : 1) * sizeof(Loop));
+    if (!loops) return -1;
+    loop_count = 0;
+    for (size_t b = 0; b < block_count; b++) {
+        for (int k = 0; k < 2; k++) {
+            int h = blocks[b].succ[k];
+            if (h < 0 || h > (int)b) continue;
+            uint32_t bound = input->insns[blocks[b].last].bound;
+            size_t j;
+            for (j = 0; j < loop_count && loops[j].head != h; j++) {}
+            if (j == loop_count) {
+                loops[loop_count++] = (Loop){ h, block_start(h), block_end(b), bound, -1 };
+            } else {
+                loops[j].end = block_end(b);
+                if (!loops[j].bound) loops[j].bound = bound;
+            }
+        }
+    }
+
+    // Parent: the smallest other loop whose range holds this one
+    for (size_t i = 0; i < loop_count; i++) {
+        for (size_t j = 0; j < loop_count; j++) {
+            if (i == j || !loop_holds(&loops[j], loops[i].start) || !loop_holds(&loops[j], loops[i].end)) {
+                continue;
+            }
+            int p = loops[i].parent;
+            if (p < 0 || loops[j].end - loops[j].start < loops[p].end - loops[p].start) loops[i].parent = j;
+        }
+    }
+    for (size_t b = 0; b < block_count; b++) {
+        for (size_t j = 0; j < loop_count; j++) {
+            if (!loop_holds(&loops[j], block_start(b))) continue;
+            int cur = blocks[b].loop;
+            if (cur < 0 || loops[j].end - loops[j].start < loops[cur].end - loops[cur].start) {
+                blocks[b].loop = j;
+            }
+        }
+    }
+
+    routines = calloc(0x10000, sizeof(Routine));
+    return routines ? 0 : -1;
+}
+
+static Cost routine_cost(uint16_t entry);
+
+enum { END_AT_BLOCK, END_AT_RETURN, END_AT_BACK_EDGE };
+
+// How often a block runs per search from `anchor`: the product of its
+// loops' bounds. Measuring one iteration of the loop headed by the anchor
+// leaves out that loop and those around it, and a path to `stop` ends on
+// first arrival, so loops around stop do not repeat.
+static Cost block_times(int b, int mode, uint16_t anchor, uint16_t stop) {
+    Cost c = { 1, TIMING_OK, 0 };
+    for (int l = blocks[b].loop; l >= 0; l = loops[l].parent) {
+        if (mode == END_AT_BACK_EDGE && loop_holds(&loops[l], anchor)) continue;
+        if (mode == END_AT_BLOCK && loop_holds(&loops[l], stop)) continue;
+        if (!loops[l].bound) return (Cost){ 0, TIMING_UNBOUNDED, loops[l].start };
+        c.cycles *= loops[l].bound;
+    }
+    return c;
+}
+
+// A block's own cycles plus the routines it calls
+static Cost block_cost(int b) {
+    Cost c = { blocks[b].cycles, TIMING_OK, 0 };
+    for (size_t i = blocks[b].first; i <= blocks[b].last; i++) {
+        int flow = flow_of(insn_op(i));
+        if (flow != FLOW_CALL && flow != FLOW_COND_CALL) continue;
+        Cost callee = routine_cost(insn_target(i));
+        if (callee.status != TIMING_OK) return callee;
+        c.cycles += callee.cycles + (flow == FLOW_COND_CALL ? OP_TAKEN_CYCLES : 0);
+    }
+    return c;
+}
+
+// Longest path from block `from` to the start of block `to`, to a return,
+// or around the loop headed by `from`
+static Cost longest(int from, int mode, int to) {
+    uint16_t anchor = block_start(from);
+    uint16_t stop = mode == END_AT_BLOCK ? block_start(to) : 0;
+    int64_t *dist = malloc(block_count * sizeof(int64_t));
+    uint8_t *useful = calloc(block_count, 1);
+    if (!dist || !useful) {
+        free(dist);
+        free(useful);
+        return (Cost){ 0, TIMING_UNKNOWN, anchor };
+    }
+
+    // Blocks from which the end can be reached, walking back over the DAG
+    for (int b = block_count - 1; b >= from; b--) {
+        size_t last = blocks[b].last;
+        int flow = flow_of(insn_op(last));
+        if (mode == END_AT_BLOCK && b == to) useful[b] = 1;
+        if (mode == END_AT_RETURN && (flow == FLOW_RET || flow == FLOW_COND_RET || flow == FLOW_HALT ||
+                                      flow == FLOW_INDIRECT)) {
+            useful[b] = 1;
+        }
+        for (int k = 0; k < 2; k++) {
+            int s = blocks[b].succ[k];
+            if (s < 0) continue;
+            if (s > b && useful[s]) useful[b] = 1;
+            if (mode == END_AT_BACK_EDGE && s == from) useful[b] = 1;
+        }
+    }
+
+    Cost best = { 0, TIMING_UNREACHABLE, mode == END_AT_BLOCK ? block_start(to) : anchor };
+    int found = 0;
+    for (size_t b = 0; b < block_count; b++) dist[b] = -1;
+    dist[from] = 0;
+
+    for (int b = from; b < (int)block_count; b++) {
+        if (dist[b] < 0 || !useful[b]) continue;
+        if (mode == END_AT_BLOCK && b == to) {
+            if (!found || (uint64_t)dist[b] > best.cycles) best = (Cost){ dist[b], TIMING_OK, 0 };
+            found = 1;
+            continue;
+        }
+
+        Cost times = block_times(b, mode, anchor, stop);
+        Cost own = block_cost(b);
+        if (times.status != TIMING_OK || own.status != TIMING_OK) {
+            best = times.status != TIMING_OK ? times : own;
+            found = -1;
+            break;
+        }
+        int64_t end = dist[b] + own.cycles * times.cycles;
+
+        int flow = flow_of(insn_op(blocks[b].last));
+        int64_t out = -1;
+        if (mode == END_AT_RETURN && flow == FLOW_INDIRECT) {
+            best = (Cost){ 0, TIMING_INDIRECT, insn_addr(blocks[b].last) };
+            found = -1;
+            break;
+        }
+        if (mode == END_AT_RETURN && (flow == FLOW_RET || flow == FLOW_HALT)) out = end;
+        if (mode == END_AT_RETURN && flow == FLOW_COND_RET) out = end + OP_TAKEN_CYCLES;
+        for (int k = 0; k < 2; k++) {
+            int s = blocks[b].succ[k];
+            if (mode == END_AT_BACK_EDGE && s == from) out = out > end ? out : end;
+            if (s > b && useful[s] && dist[s] < end) dist[s] = end;
+        }
+        if (out >= 0 && (!found || (uint64_t)out > best.cycles)) {
+            best = (Cost){ out, TIMING_OK, 0 };
+            found = 1;
+        }
+    }
+
+    free(dist);
+    free(useful);
+    return best;
+}
+
+static Cost routine_cost(uint16_t entry) {
+    Routine *r = &routines[entry];
+    if (r->state == 1) return (Cost){ 0, TIMING_RECURSIVE, entry };
+    if (r->state == 2) return r->cost;
+    if (insn_at[entry] < 0) return (Cost){ 0, TIMING_UNKNOWN, entry };
+    r->state = 1;
+    Cost c = longest(block_of[insn_at[entry]], END_AT_RETURN, 0);
+    r->state = 2;
+    r->cost = c;
+    return c;
+}
+
+const char *timing_error(int status) {
+    switch (status) {
+        case TIMING_OK:          return "ok";
+        case TIMING_UNREACHABLE: return "not reachable";
+        case TIMING_UNBOUNDED:   return "loop without @bound";
+        case TIMING_INDIRECT:    return "indirect jump (PCHL)";
+        case TIMING_RECURSIVE:   return "recursive call";
+        default:                 return "not an instruction";
+    }
+}
+
+// "LABEL" or "LABEL+n", or the bare address before the first label
+static void name_addr(char *buf, size_t size, uint16_t addr) {
+    const ObjSymbol *best = NULL;
+    for (size_t i = 0; i < input->symbol_count; i++) {
+        const ObjSymbol *s = &input->symbols[i];
+        if (s->value <= addr && (!best || s->value > best->value)) best = s;
+    }
+    if (!best) snprintf(buf, size, "%04X", addr);
+    else if (best->value == addr) snprintf(buf, size, "%s", best->name);
+    else snprintf(buf, size, "%s+%u", best->name, addr - best->value);
+}
+
+static void print_cost(FILE *out, Cost c) {
+    if (c.status == TIMING_OK) fprintf(out, "%llu", (unsigned long long)c.cycles);
+    else fprintf(out, "? (%s at %04X)", timing_error(c.status), c.where);
+}
+
+static void report(FILE *out) {
+    char name[64];
+
+    fprintf(out, "Blocks\n  Start-End   Cycles  Source           Label\n");
+    for (size_t b = 0; b < block_count; b++) {
+        const TimedInsn *first = &input->insns[blocks[b].first];
+        const TimedInsn *last = &input->insns[blocks[b].last];
+        char where[64];
+        snprintf(where, sizeof(where), "%s:%u", input->files[first->file], first->line);
+        if (last->line != first->line || last->file != first->file) {
+            snprintf(where + strlen(where), sizeof(where) - strlen(where), "-%u", last->line);
+        }
+        name_addr(name, sizeof(name), block_start(b));
+        fprintf(out, "  %04X-%04X %7llu  %-16s %s", block_start(b), block_end(b),
+                (unsigned long long)blocks[b].cycles, where, name);
+        for (size_t i = blocks[b].first; i <= blocks[b].last; i++) {
+            int flow = flow_of(insn_op(i));
+            if (flow != FLOW_CALL && flow != FLOW_COND_CALL) continue;
+            name_addr(name, sizeof(name), insn_target(i));
+            fprintf(out, "  +%s", name);
+        }
+        fputc('\n', out);
+    }
+
+    if (loop_count) fprintf(out, "\nLoops\n  Start-End   Bound  Per iteration     Label\n");
+    for (size_t l = 0; l < loop_count; l++) {
+        char bound[16] = "?";
+        if (loops[l].bound) snprintf(bound, sizeof(bound), "%u", loops[l].bound);
+        name_addr(name, sizeof(name), loops[l].start);
+        fprintf(out, "  %04X-%04X %6s  ", loops[l].start, loops[l].end, bound);
+        Cost c = longest(loops[l].head, END_AT_BACK_EDGE, 0);
+        if (c.status == TIMING_OK) {
+            fprintf(out, "%-16llu  %s", (unsigned long long)c.cycles, name);
+            if (loops[l].bound) {
+                fprintf(out, " (%llu total)", (unsigned long long)c.cycles * loops[l].bound);
+            }
+        } else {
+            print_cost(out, c);
+            fprintf(out, "  %s", name);
+        }
+        fputc('\n', out);
+    }
+
+    // Everything that is called, cost to its return
+    uint8_t *listed = calloc(0x10000, 1);
+    int header = 0;
+    if (!listed) return;
+    for (size_t i = 0; i < input->insn_count; i++) {
+        int flow = flow_of(insn_op(i));
+        if (flow != FLOW_CALL && flow != FLOW_COND_CALL) continue;
+        uint16_t entry = insn_target(i);
+        if (listed[entry]) continue;
+        listed[entry] = 1;
+        if (!header++) fprintf(out, "\nRoutines (worst case to return)\n");
+        name_addr(name, sizeof(name), entry);
+        fprintf(out, "  %04X  %-16s ", entry, name);
+        print_cost(out, routine_cost(entry));
+        fputc('\n', out);
+    }
+    free(listed);
+}
+
+int timing_analyze(FILE *out, const TimingInput *in, WorstCase *cases, size_t case_count) {
+    input = in;
+    int ret = build(cases, case_count);
+    if (ret == 0) {
+        if (out) report(out);
+        for (size_t i = 0; i < case_count; i++) {
+            WorstCase *w = &cases[i];
+            int from = w->from < 0x10000 ? insn_at[w->from] : -1;
+            int to = w->to >= 0 ? insn_at[w->to] : -1;
+            Cost c;
+            if (from < 0) c = (Cost){ 0, TIMING_UNKNOWN, w->from };
+            else if (w->to >= 0 && to < 0) c = (Cost){ 0, TIMING_UNKNOWN, w->to };
+            else if (w->to < 0) c = routine_cost(w->from);
+            else c = longest(block_of[from], END_AT_BLOCK, block_of[to]);
+            w->cycles = c.cycles;
+            w->status = c.status;
+            w->where = c.where;
+        }
+    }
+
+    free(insn_at);
+    free(block_of);
+    free(blocks);
+    free(loops);
+    free(routines);
+    insn_at = block_of = NULL;
+    blocks = NULL;
+    loops = NULL;
+    routines = NULL;
+    return ret;
+}
@@ -0,0 +1,54 @@
+// Static cycle counts for assembled code: basic blocks, loops and the
+// worst case between two addresses, from the emulator's OP_CYCLES table
+#ifndef TIMING8080_H
+#define TIMING8080_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "obj8080.h"
+
+// One assembled instruction. bound is the iteration count annotated on a
+// loop's closing branch ("; @bound N"), 0 if none.
+typedef struct {
+    uint16_t addr;
+    uint16_t bound;
+    uint32_t line;
+    uint8_t file;
+} TimedInsn;
+
+typedef struct {
+    const uint8_t *mem;          // 64K image holding the code
+    const TimedInsn *insns;      // Sorted by address
+    size_t insn_count;
+    const char *const *files;    // Source names by TimedInsn.file
+    const ObjSymbol *symbols;    // Absolute addresses, for naming blocks
+    size_t symbol_count;
+} TimingInput;
+
+// Worst-case cycles to get from one address to another (the instruction at
+// `to` is not counted), or from `from` to its return when `to` is -1
+typedef struct {
+    uint32_t from;
+    int32_t to;
+    uint64_t cycles;
+    int status;  // TIMING_*
+    uint16_t where;  // Address the status refers to
+} WorstCase;
+
+enum {
+    TIMING_OK,
+    TIMING_UNREACHABLE,  // to cannot be reached from from
+    TIMING_UNBOUNDED,    // A loop on the way has no @bound
+    TIMING_INDIRECT,     // PCHL on the way
+    TIMING_RECURSIVE,    // A called routine calls itself
+    TIMING_UNKNOWN,      // Not an instruction address
+};
+
+const char *timing_error(int status);
+
+// Write the block and loop report to out (if not NULL) and work out each of
+// the requested worst cases. Returns -1 when out of memory.
+int timing_analyze(FILE *out, const TimingInput *in, WorstCase *cases, size_t case_count);
+
+#endif
@@ -0,0 +1,751 @@
+#include "batch.h"
+#include "opcodes.h"
+#include <string.h>
+
+// Flag register bits (see flags_t in cpu.h)
+#define FLAG_C   0x01
+#define FLAG_P   0x04
+#define FLAG_AC  0x10
+#define FLAG_Z   0x40
+#define FLAG_S   0x80
+#define FLAG_FIXED 0x2A  // Bits 1, 3, 5: never changed by ALU ops
+
+#define REG_A 7
+
+// ---------------------------------------------------------------------------
+// Byte-vector layer. Each backend provides VLANES lanes of uint8_t; the
+// scalar fallback is a one-lane "vector" so the kernels below are written
+// once. V_SRL16 shifts 16-bit elements: callers always mask the result so
+// bits pulled in from the neighbouring byte are discarded. V_MOVEMASK
+// gathers the top bit of each lane.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i vec_t;
+#define VLANES          32
+#define V_LOAD(p)       _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p, v)   _mm256_storeu_si256((__m256i *)(p), (v))
+#define V_SET1(x)       _mm256_set1_epi8((char)(x))
+#define V_ADD(a, b)     _mm256_add_epi8((a), (b))
+#define V_SUB(a, b)     _mm256_sub_epi8((a), (b))
+#define V_AND(a, b)     _mm256_and_si256((a), (b))
+#define V_OR(a, b)      _mm256_or_si256((a), (b))
+#define V_XOR(a, b)     _mm256_xor_si256((a), (b))
+#define V_EQ(a, b)      _mm256_cmpeq_epi8((a), (b))
+#define V_MAXU(a, b)    _mm256_max_epu8((a), (b))
+#define V_SRL16(v, n)   _mm256_srli_epi16((v), (n))
+#define V_MOVEMASK(v)   ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i vec_t;
+#define VLANES          16
+#define V_LOAD(p)       _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p, v)   _mm_storeu_si128((__m128i *)(p), (v))
+#define V_SET1(x)       _mm_set1_epi8((char)(x))
+#define V_ADD(a, b)     _mm_add_epi8((a), (b))
+#define V_SUB(a, b)     _mm_sub_epi8((a), (b))
+#define V_AND(a, b)     _mm_and_si128((a), (b))
+#define V_OR(a, b)      _mm_or_si128((a), (b))
+#define V_XOR(a, b)     _mm_xor_si128((a), (b))
+#define V_EQ(a, b)      _mm_cmpeq_epi8((a), (b))
+#define V_MAXU(a, b)    _mm_max_epu8((a), (b))
+#define V_SRL16(v, n)   _mm_srli_epi16((v), (n))
+#define V_MOVEMASK(v)   ((uint32_t)_mm_movemask_epi8(v))
+#else
+typedef uint8_t vec_t;
+#define VLANES          1
+#define V_LOAD(p)       (*(const uint8_t *)(p))
+#define V_STORE(p, v)   (*(uint8_t *)(p) = (v))
+#define V_SET1(x)       ((uint8_t)(x))
+#define V_ADD(a, b)     ((uint8_t)((a) + (b)))
+#define V_SUB(a, b)     ((uint8_t)((a) - (b)))
+#define V_AND(a, b)     ((uint8_t)((a) & (b)))
+#define V_OR(a, b)      ((uint8_t)((a) | (b)))
+#define V_XOR(a, b)     ((uint8_t)((a) ^ (b)))
+#define V_EQ(a, b)      ((uint8_t)((a) == (b) ? 0xFF : 0x00))
+#define V_MAXU(a, b)    ((uint8_t)((a) > (b) ? (a) : (b)))
+#define V_SRL16(v, n)   ((uint8_t)((v) >> (n)))
+#define V_MOVEMASK(v)   ((uint32_t)(v) >> 7)
+#endif
+
+_Static_assert(BATCH_MAX % VLANES == 0, "BATCH_MAX must be a multiple of VLANES");
+
+static inline vec_t v_not(vec_t x) {
+    return V_XOR(x, V_SET1(0xFF));
+}
+
+// mask ? a : b, per lane (mask lanes are 0x00 or 0xFF)
+static inline vec_t v_select(vec_t mask, vec_t a, vec_t b) {
+    return V_OR(V_AND(mask, a), V_AND(v_not(mask), b));
+}
+
+// S, Z and P flags of a result
+static inline vec_t v_szp(vec_t res) {
+    vec_t s = V_AND(res, V_SET1(FLAG_S));
+    vec_t z = V_AND(V_EQ(res, V_SET1(0)), V_SET1(FLAG_Z));
+
+    // Fold the byte's parity into bit 0, then invert for even parity
+    vec_t t = V_XOR(res, V_AND(V_SRL16(res, 4), V_SET1(0x0F)));
+    t = V_XOR(t, V_AND(V_SRL16(t, 2), V_SET1(0x03)));
+    t = V_XOR(t, V_AND(V_SRL16(t, 1), V_SET1(0x01)));
+    vec_t p = V_AND(v_not(t), V_SET1(0x01));
+    p = V_ADD(p, p);
+    p = V_ADD(p, p);  // bit 0 -> bit 2
+
+    return V_OR(V_OR(s, z), p);
+}
+
+// ALU group (ADD ADC SUB SBB ANA XRA ORA CMP) on A with src, flags as cpu.c
+static void k_alu(batch_t *b, int aluop, const uint8_t *src, const uint8_t *mask) {
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t a = V_LOAD(&b->reg[REG_A][i]);
+        vec_t f = V_LOAD(&b->f[i]);
+        vec_t v = V_LOAD(&src[i]);
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t zero = V_SET1(0);
+        vec_t res, c, ac;
+
+        switch (aluop) {
+        case 0: case 1: case 2: case 3: {  // ADD ADC SUB SBB
+            bool sub = aluop & 2;
+            vec_t cy = (aluop & 1) ? V_AND(f, V_SET1(FLAG_C)) : zero;
+            if (sub) {
+                v = v_not(v);
+                cy = V_XOR(cy, V_SET1(1));
+            }
+            vec_t sum = V_ADD(a, v);
+            vec_t c1 = v_not(V_EQ(V_MAXU(sum, a), sum));       // a + v > 255
+            res = V_ADD(sum, cy);
+            vec_t c2 = V_AND(V_EQ(sum, V_SET1(0xFF)), V_EQ(cy, V_SET1(1)));
+            c = V_AND(V_OR(c1, c2), V_SET1(FLAG_C));
+            if (sub) c = V_XOR(c, V_SET1(FLAG_C));
+            ac = V_AND(V_XOR(V_XOR(a, v), res), V_SET1(FLAG_AC));
+            break;
+        }
+        case 4:  // ANA
+            res = V_AND(a, v);
+            c = zero;
+            ac = V_AND(V_OR(a, v), V_SET1(0x08));
+            ac = V_ADD(ac, ac);  // bit 3 -> bit 4
+            break;
+        case 5:  // XRA
+            res = V_XOR(a, v);
+            c = ac = zero;
+            break;
+        case 6:  // ORA
+            res = V_OR(a, v);
+            c = ac = zero;
+            break;
+        default:  // CMP
+            res = V_SUB(a, v);
+            c = V_AND(v_not(V_EQ(V_MAXU(a, v), a)), V_SET1(FLAG_C));  // a < v
+            ac = V_AND(v_not(V_XOR(V_XOR(a, res), v)), V_SET1(FLAG_AC));
+            break;
+        }
+
+        vec_t nf = V_OR(V_OR(v_szp(res), V_OR(c, ac)), V_AND(f, V_SET1(FLAG_FIXED)));
+        V_STORE(&b->f[i], v_select(m, nf, f));
+        if (aluop != 7) V_STORE(&b->reg[REG_A][i], v_select(m, res, a));
+    }
+}
+
+// INR/DCR r: carry is preserved
+static void k_incdec(batch_t *b, int r, bool dec, const uint8_t *mask) {
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t v = V_LOAD(&b->reg[r][i]);
+        vec_t f = V_LOAD(&b->f[i]);
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t lo;
+
+        vec_t res = dec ? V_SUB(v, V_SET1(1)) : V_ADD(v, V_SET1(1));
+        lo = V_AND(res, V_SET1(0x0F));
+        vec_t ac = dec ? v_not(V_EQ(lo, V_SET1(0x0F))) : V_EQ(lo, V_SET1(0));
+        ac = V_AND(ac, V_SET1(FLAG_AC));
+
+        vec_t nf = V_OR(V_OR(v_szp(res), ac), V_AND(f, V_SET1(FLAG_FIXED | FLAG_C)));
+        V_STORE(&b->f[i], v_select(m, nf, f));
+        V_STORE(&b->reg[r][i], v_select(m, res, v));
+    }
+}
+
+// dst = mask ? src : dst
+static void k_move(const batch_t *b, uint8_t *dst, const uint8_t *src, const uint8_t *mask) {
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        V_STORE(&dst[i], v_select(m, V_LOAD(&src[i]), V_LOAD(&dst[i])));
+    }
+}
+
+// Exchange two registers
+static void k_swap(const batch_t *b, uint8_t *x, uint8_t *y, const uint8_t *mask) {
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t vx = V_LOAD(&x[i]);
+        vec_t vy = V_LOAD(&y[i]);
+        V_STORE(&x[i], v_select(m, vy, vx));
+        V_STORE(&y[i], v_select(m, vx, vy));
+    }
+}
+
+// INX/DCX on a register pair held as high and low byte planes
+static void k_incdec16(batch_t *b, int rp, bool dec, const uint8_t *mask) {
+    uint8_t *hi = b->reg[rp * 2], *lo = b->reg[rp * 2 + 1];
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t h = V_LOAD(&hi[i]);
+        vec_t l = V_LOAD(&lo[i]);
+        vec_t nl, nh;
+        if (dec) {
+            nl = V_SUB(l, V_SET1(1));
+            nh = V_ADD(h, V_EQ(l, V_SET1(0)));   // Borrow: add 0xFF
+        } else {
+            nl = V_ADD(l, V_SET1(1));
+            nh = V_SUB(h, V_EQ(nl, V_SET1(0)));  // Carry: subtract 0xFF
+        }
+        V_STORE(&hi[i], v_select(m, nh, h));
+        V_STORE(&lo[i], v_select(m, nl, l));
+    }
+}
+
+// DAD B/D/H: HL += pair, carry out of bit 15 into C
+static void k_dad(batch_t *b, int rp, const uint8_t *mask) {
+    uint8_t *hi = b->reg[4], *lo = b->reg[5];
+    const uint8_t *shi = b->reg[rp * 2], *slo = b->reg[rp * 2 + 1];
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t h = V_LOAD(&hi[i]);
+        vec_t l = V_LOAD(&lo[i]);
+        vec_t f = V_LOAD(&b->f[i]);
+        vec_t nl = V_ADD(l, V_LOAD(&slo[i]));
+        vec_t c0 = v_not(V_EQ(V_MAXU(nl, l), nl));  // Low byte carried
+        vec_t sum = V_ADD(h, V_LOAD(&shi[i]));
+        vec_t c1 = v_not(V_EQ(V_MAXU(sum, h), sum));
+        vec_t nh = V_SUB(sum, c0);
+        vec_t c2 = V_AND(c0, V_EQ(sum, V_SET1(0xFF)));
+        vec_t nf = V_OR(V_AND(f, V_SET1(~FLAG_C)), V_AND(V_OR(c1, c2), V_SET1(FLAG_C)));
+        V_STORE(&hi[i], v_select(m, nh, h));
+        V_STORE(&lo[i], v_select(m, nl, l));
+        V_STORE(&b->f[i], v_select(m, nf, f));
+    }
+}
+
+// RLC RRC RAL RAR CMA STC CMC (rot = op >> 3)
+static void k_rotate(batch_t *b, int rot, const uint8_t *mask) {
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t a = V_LOAD(&b->reg[REG_A][i]);
+        vec_t f = V_LOAD(&b->f[i]);
+        vec_t cin = V_AND(f, V_SET1(FLAG_C));
+        vec_t top = V_AND(V_SRL16(a, 7), V_SET1(0x01));  // Bit 7 as 0/1
+        vec_t bottom = V_AND(a, V_SET1(0x01));
+        vec_t shl = V_ADD(a, a);
+        vec_t shr = V_AND(V_SRL16(a, 1), V_SET1(0x7F));
+        vec_t na = a, c = cin;
+
+        switch (rot) {
+        case 0: na = V_OR(shl, top); c = top; break;                                          // RLC
+        case 1: na = V_OR(shr, V_AND(V_SUB(V_SET1(0), bottom), V_SET1(0x80))); c = bottom; break;  // RRC
+        case 2: na = V_OR(shl, cin); c = top; break;                                          // RAL
+        case 3: na = V_OR(shr, V_AND(V_SUB(V_SET1(0), cin), V_SET1(0x80))); c = bottom; break;     // RAR
+        case 5: na = v_not(a); break;                                                         // CMA
+        case 6: c = V_SET1(FLAG_C); break;                                                    // STC
+        case 7: c = V_XOR(cin, V_SET1(FLAG_C)); break;                                        // CMC
+        default: break;
+        }
+
+        V_STORE(&b->reg[REG_A][i], v_select(m, na, a));
+        V_STORE(&b->f[i], v_select(m, V_OR(V_AND(f, V_SET1(~FLAG_C)), c), f));
+    }
+}
+
+// Lanes in mask whose flags meet condition cc (the Jcc/Ccc/Rcc field)
+static uint32_t k_cond(const batch_t *b, int cc, const uint8_t *mask, int *count) {
+    static const uint8_t cond_flag[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
+    uint8_t flag = cond_flag[cc >> 1];
+    vec_t want = V_SET1((cc & 1) ? flag : 0);
+    uint32_t taken = 0;
+    *count = 0;
+    for (int i = 0; i < b->width; i += VLANES) {
+        vec_t m = V_LOAD(&mask[i]);
+        vec_t t = V_AND(V_EQ(V_AND(V_LOAD(&b->f[i]), V_SET1(flag)), want), m);
+        taken |= V_MOVEMASK(t) << i;
+        *count += __builtin_popcount(V_MOVEMASK(m));
+    }
+    return taken;
+}
+
+// ---------------------------------------------------------------------------
+// Lane transfer between the SoA register file and the lane's machine
+
+static void lane_load(batch_t *b, int i) {
+    const cpu_8080_t *cpu = &b->lane[i]->cpu;
+    b->reg[0][i] = cpu->bc.hi;
+    b->reg[1][i] = cpu->bc.lo;
+    b->reg[2][i] = cpu->de.hi;
+    b->reg[3][i] = cpu->de.lo;
+    b->reg[4][i] = cpu->hl.hi;
+    b->reg[5][i] = cpu->hl.lo;
+    b->reg[REG_A][i] = cpu->a;
+    b->f[i] = cpu->f.byte;
+    b->sp[i] = cpu->sp;
+    b->pc[i] = cpu->pc;
+    b->cycles[i] = cpu->cycles;
+}
+
+static void lane_store(batch_t *b, int i) {
+    cpu_8080_t *cpu = &b->lane[i]->cpu;
+    cpu->bc.hi = b->reg[0][i];
+    cpu->bc.lo = b->reg[1][i];
+    cpu->de.hi = b->reg[2][i];
+    cpu->de.lo = b->reg[3][i];
+    cpu->hl.hi = b->reg[4][i];
+    cpu->hl.lo = b->reg[5][i];
+    cpu->a = b->reg[REG_A][i];
+    cpu->f.byte = b->f[i];
+    cpu->sp = b->sp[i];
+    cpu->pc = b->pc[i];
+    cpu->cycles = b->cycles[i];
+}
+
+static inline uint16_t get_rp(const batch_t *b, int rp, int i) {
+    if (rp == 3) return b->sp[i];
+    return (b->reg[rp * 2][i] << 8) | b->reg[rp * 2 + 1][i];
+}
+
+static inline void set_rp(batch_t *b, int rp, int i, uint16_t val) {
+    if (rp == 3) {
+        b->sp[i] = val;
+    } else {
+        b->reg[rp * 2][i] = val >> 8;
+        b->reg[rp * 2 + 1][i] = val & 0xFF;
+    }
+}
+
+static void lane_check(batch_t *b, int i) {
+    if (b->lane[i]->cpu.halted || b->cycles[i] >= b->cycle_limit) b->active[i] = 0;
+}
+
+static inline bool code_ok(const batch_t *b, uint16_t addr) {
+    return b->code_ok[addr >> 3] & (1 << (addr & 7));
+}
+
+// Forget verified instructions overlapping the bytes m's next instruction
+// may store to (the instruction itself and up to two preceding ones whose
+// operands reach into them)
+static void invalidate_stores(batch_t *b, machine_t *m) {
+    const cpu_8080_t *cpu = &m->cpu;
+    uint8_t op = mem_read(m, cpu->pc);
+    uint16_t addr;
+    int len = 1;
+
+    if (((op & 0xF8) == 0x70 && op != 0x76) || op == 0x34 || op == 0x35 || op == 0x36) {
+        addr = cpu->hl.word;                              // MOV M,r / INR M / DCR M / MVI M
+    } else if (op == 0x02 || op == 0x12) {
+        addr = op == 0x02 ? cpu->bc.word : cpu->de.word;  // STAX
+    } else if (op == 0x32 || op == 0x22) {
+        addr = mem_read16(m, cpu->pc + 1);                // STA / SHLD
+        len = op == 0x22 ? 2 : 1;
+    } else if ((op & 0xCF) == 0xC5 || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7 ||
+               (op & 0xCF) == 0xCD || op == 0xE3) {
+        addr = cpu->sp - 2;                               // PUSH / CALL / RST / XTHL
+        len = 4;
+    } else {
+        return;
+    }
+
+    for (int k = -2; k < len; k++) {
+        uint16_t a = addr + k;
+        b->code_ok[a >> 3] &= ~(1 << (a & 7));
+    }
+}
+
+// One cpu_step of a lane whose registers are in its machine
+static inline void lane_step(batch_t *b, machine_t *m) {
+    invalidate_stores(b, m);
+    cpu_step(m);
+    if (m->mem.dma_len) {
+        // A disk transfer (an OUT) or a hooked CALL wrote memory behind the
+        // interpreter's back
+        for (uint32_t k = 0; k < m->mem.dma_len + 2; k++) {
+            uint16_t a = m->mem.dma_addr - 2 + k;
+            b->code_ok[a >> 3] &= ~(1 << (a & 7));
+        }
+        m->mem.dma_len = 0;
+    }
+}
+
+static void scalar_step(batch_t *b, int i) {
+    lane_store(b, i);
+    lane_step(b, b->lane[i]);
+    lane_load(b, i);
+    lane_check(b, i);
+    b->scalar_steps++;
+}
+
+static inline bool waiting_at(const batch_t *b, uint16_t addr) {
+    return b->wait_at[addr >> 3] & (1 << (addr & 7));
+}
+
+// Run a group too small to pay for the lockstep kernels one lane at a time
+// through cpu_step, each lane until it halts, reaches the cycle limit or
+// arrives at a PC where a lane outside the group waits, so that it joins
+// that lane's group there
+static void solo_run(batch_t *b, const uint8_t *mask) {
+    for (int i = 0; i < b->count; i++) {
+        if (b->active[i] && !mask[i]) b->wait_at[b->pc[i] >> 3] |= 1 << (b->pc[i] & 7);
+    }
+
+    for (int i = 0; i < b->count; i++) {
+        if (!mask[i]) continue;
+        machine_t *m = b->lane[i];
+        uint64_t steps = 0;
+        lane_store(b, i);
+        do {
+            lane_step(b, m);
+            steps++;
+        } while (!m->cpu.halted && m->cpu.cycles < b->cycle_limit && !waiting_at(b, m->cpu.pc));
+        lane_load(b, i);
+        lane_check(b, i);
+        b->scalar_steps += steps;
+    }
+
+    for (int i = 0; i < b->count; i++) {
+        if (b->active[i] && !mask[i]) b->wait_at[b->pc[i] >> 3] &= ~(1 << (b->pc[i] & 7));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Lockstep execution
+
+#define DETOUR_STEPS 12  // Longest branch arm run to a join before the other
+
+#define JOIN_FOUND 1
+#define JOIN_NEXT  2     // The fall-through arm runs to the join
+#define JOIN_TAKEN 4     // The taken arm runs to the join
+
+// Instructions that only touch registers, flags and PC
+static bool vectorizable(uint8_t op) {
+    if (op >= 0x40 && op <= 0x7F) return (op & 7) != 6 && ((op >> 3) & 7) != 6;  // MOV, not M/HLT
+    if (op >= 0x80 && op <= 0xBF) return (op & 7) != 6;                           // ALU r
+    if ((op & 0xC7) == 0xC6) return true;                                          // ALU imm
+    if ((op & 0xC7) == 0xC2) return true;                                          // Jcc
+    if (op < 0x40) {
+        int r = (op >> 3) & 7;
+        switch (op & 7) {
+        case 0: return true;                           // NOP
+        case 1: case 3: return true;                   // LXI/DAD, INX/DCX
+        case 4: case 5: case 6: return r != 6;         // INR, DCR, MVI (not M)
+        case 7: return op != 0x27;                     // Rotates, CMA, STC, CMC (not DAA)
+        default: return false;                         // Memory loads/stores
+        }
+    }
+    switch (op) {
+    case 0xC3: case 0xCB:  // JMP
+    case 0xE9:             // PCHL
+    case 0xF9:             // SPHL
+    case 0xEB:             // XCHG
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Execute op for every lane in mask. The group shares *pc, which is
+// advanced; returns false if the lanes diverged, in which case each lane's
+// own pc[] has been written instead.
+static bool vector_exec(batch_t *b, uint8_t op, uint8_t lo, uint8_t hi,
+                        const uint8_t *mask, uint16_t *pc) {
+    uint8_t len = OP_LENGTHS[op];
+    uint16_t imm16 = (hi << 8) | lo;
+    int r = (op >> 3) & 7;
+    int rp = (op >> 4) & 3;
+
+    if (op >= 0x40 && op <= 0x7F) {
+        k_move(b, b->reg[r], b->reg[op & 7], mask);
+    } else if (op >= 0x80 && op <= 0xBF) {
+        k_alu(b, r, b->reg[op & 7], mask);
+    } else if ((op & 0xC7) == 0xC6) {
+        uint8_t imm[BATCH_MAX];
+        memset(imm, lo, sizeof(imm));
+        k_alu(b, r, imm, mask);
+    } else if ((op & 0xC7) == 0x06) {  // MVI
+        uint8_t imm[BATCH_MAX];
+        memset(imm, lo, sizeof(imm));
+        k_move(b, b->reg[r], imm, mask);
+    } else if ((op & 0xC7) == 0x04 || (op & 0xC7) == 0x05) {
+        k_incdec(b, r, op & 1, mask);
+    } else if ((op & 0xC7) == 0xC2) {  // Jcc
+        int count;
+        uint32_t taken = k_cond(b, r, mask, &count);
+        if (taken == 0 || __builtin_popcount(taken) == count) {  // Uniform branch
+            *pc = taken ? imm16 : (uint16_t)(*pc + len);
+            return true;
+        }
+        for (int i = 0; i < b->count; i++) {
+            if (mask[i]) b->pc[i] = (taken >> i) & 1 ? imm16 : (uint16_t)(*pc + len);
+        }
+        return false;
+    } else if ((op & 0xC7) == 0x07) {
+        k_rotate(b, r, mask);
+    } else if ((op & 0xC7) == 0x03 && rp != 3) {
+        k_incdec16(b, rp, op & 0x08, mask);
+    } else if ((op & 0xCF) == 0x09 && rp != 3) {
+        k_dad(b, rp, mask);
+    } else if ((op & 0xCF) == 0x01 && rp != 3) {  // LXI
+        uint8_t imm[BATCH_MAX];
+        memset(imm, hi, sizeof(imm));
+        k_move(b, b->reg[rp * 2], imm, mask);
+        memset(imm, lo, sizeof(imm));
+        k_move(b, b->reg[rp * 2 + 1], imm, mask);
+    } else if (op == 0xEB) {  // XCHG
+        k_swap(b, b->reg[2], b->reg[4], mask);
+        k_swap(b, b->reg[3], b->reg[5], mask);
+    } else if (op == 0xC3 || op == 0xCB) {  // JMP
+        *pc = imm16;
+        return true;
+    } else if ((op & 0xC7) != 0x00) {  // Not NOP
+        // The stack pointer is 16 bits wide in one array: LXI/INX/DCX/DAD
+        // SP, SPHL and PCHL go lane by lane
+        for (int i = 0; i < b->count; i++) {
+            if (!mask[i]) continue;
+            switch (op) {
+            case 0x31: b->sp[i] = imm16; break;
+            case 0x33: b->sp[i]++; break;
+            case 0x3B: b->sp[i]--; break;
+            case 0x39: {  // DAD SP
+                uint32_t res = get_rp(b, 2, i) + b->sp[i];
+                set_rp(b, 2, i, res & 0xFFFF);
+                b->f[i] = (b->f[i] & ~FLAG_C) | ((res >> 16) & 1);
+                break;
+            }
+            case 0xF9: b->sp[i] = get_rp(b, 2, i); break;  // SPHL
+            case 0xE9: b->pc[i] = get_rp(b, 2, i); break;  // PCHL
+            default: break;
+            }
+        }
+        if (op == 0xE9) return false;
+    }
+
+    *pc += len;
+    return true;
+}
+
+// The PCs the lockstep path from `from` passes through, up to DETOUR_STEPS
+// instructions on and stopping at a conditional branch (JMPs are followed)
+static int trace(const batch_t *b, machine_t *m, uint16_t from, uint16_t *path) {
+    int n = 0;
+    for (;;) {
+        path[n++] = from;
+        uint8_t op = mem_read(m, from);
+        if (n > DETOUR_STEPS || !b->vec_ok[op] || (op & 0xC7) == 0xC2 || op == 0xE9) return n;
+        from = op == 0xC3 || op == 0xCB ? mem_read16(m, from + 1) : from + OP_LENGTHS[op];
+    }
+}
+
+// A branch split the group between `next` and `taken`. If both arms soon
+// arrive at a common PC (an if/else whose arms jump back to the top of a
+// loop, or to a shared tail), plan to run each arm up to it in turn so the
+// lanes merge there; the lowest-PC order alone would run one arm on around
+// the loop, shedding lanes on every pass. Returns the number of plan
+// entries, each an arm's PC and the PC where it stops.
+//
+// The join is cached per branch address. Plans only order the groups, so
+// one left stale by self-modifying code costs speed, not correctness.
+static int plan_arms(batch_t *b, machine_t *m, uint16_t branch, uint16_t next, uint16_t taken,
+                     uint32_t plan[2][2]) {
+    join_t *e = &b->joins[branch % JOIN_CACHE];
+    if (!e->valid || e->branch != branch) {
+        uint16_t a[DETOUR_STEPS + 1], c[DETOUR_STEPS + 1];
+        int na = trace(b, m, next, a), nc = trace(b, m, taken, c);
+        e->branch = branch;
+        e->valid = true;
+        e->arms = 0;
+        for (int i = 0; i < na && !e->arms; i++) {
+            for (int j = 0; j < nc; j++) {
+                if (a[i] != c[j]) continue;
+                e->pc = a[i];
+                e->arms = JOIN_FOUND | (i ? JOIN_NEXT : 0) | (j ? JOIN_TAKEN : 0);
+                break;
+            }
+        }
+    }
+
+    int k = 0;
+    if (e->arms & JOIN_NEXT) {
+        plan[k][0] = next;
+        plan[k++][1] = e->pc;
+    }
+    if (e->arms & JOIN_TAKEN) {
+        plan[k][0] = taken;
+        plan[k++][1] = e->pc;
+    }
+    return k;
+}
+
+// Choose the lanes to advance: all active lanes at the lowest PC, or at
+// `want` if any lane is there. Lanes ahead wait, which lets diverged lanes
+// re-converge after a loop exits. *wait is the lowest PC a lane outside the
+// group waits at (0x10000 if none or if `want` was chosen); the group is
+// chosen again once its PC reaches it. Returns the group as a lane bitmap.
+static uint32_t select_group(batch_t *b, uint8_t *mask, int *leader, uint32_t *wait, uint32_t want) {
+    uint32_t group = 0;
+    *wait = 0x10000;
+    if (want < 0x10000) {
+        for (int i = 0; i < b->count; i++) group |= (uint32_t)(b->pc[i] == want && b->active[i]) << i;
+    }
+
+    if (!group) {
+        // PCs biased into int16_t, which SSE2 compares and takes minimums
+        // of; inactive lanes sort last. A lane really at FFFFh ties with
+        // them, so the group is masked with the active lanes.
+        int16_t key[BATCH_MAX];
+        int16_t min_key = INT16_MAX, next_key = INT16_MAX;
+        uint32_t live = 0;
+        for (int i = 0; i < b->count; i++) {
+            key[i] = b->active[i] ? (int16_t)(b->pc[i] ^ 0x8000) : INT16_MAX;
+            min_key = key[i] < min_key ? key[i] : min_key;
+            live |= (uint32_t)(b->active[i] & 1) << i;
+        }
+        if (!live) return 0;
+        for (int i = 0; i < b->count; i++) {
+            int16_t k = key[i] > min_key ? key[i] : INT16_MAX;
+            next_key = k < next_key ? k : next_key;
+            group |= (uint32_t)(key[i] == min_key) << i;
+        }
+        group &= live;
+        if (next_key != INT16_MAX) *wait = (uint16_t)next_key ^ 0x8000;
+    }
+
+    for (int i = 0; i < BATCH_MAX; i += 8) memcpy(&mask[i], b->expand[(group >> i) & 0xFF], 8);
+    *leader = __builtin_ctz(group);
+    return group;
+}
+
+void batch_init(batch_t *b, machine_t **lanes, int count, uint64_t cycle_limit) {
+    memset(b, 0, sizeof(*b));
+    if (count > BATCH_MAX) count = BATCH_MAX;
+    b->count = count;
+    b->width = (count + VLANES - 1) / VLANES * VLANES;
+    b->cycle_limit = cycle_limit;
+    for (int op = 0; op < 256; op++) b->vec_ok[op] = vectorizable(op);
+    for (int bits = 0; bits < 256; bits++) {
+        for (int k = 0; k < 8; k++) b->expand[bits][k] = -((bits >> k) & 1);
+    }
+    for (int i = 0; i < count; i++) {
+        b->lane[i] = lanes[i];
+        lane_load(b, i);
+        b->active[i] = 0xFF;
+        lane_check(b, i);
+    }
+}
+
+// Write the group's shared PC and accumulated cycles back to its lanes
+static void group_flush(batch_t *b, uint32_t group, const uint16_t *pc, uint32_t cycles) {
+    for (; group; group &= group - 1) {
+        int i = __builtin_ctz(group);
+        if (pc) b->pc[i] = *pc;
+        b->cycles[i] += cycles;
+    }
+}
+
+void batch_run(batch_t *b) {
+    uint8_t mask[BATCH_MAX];
+    uint32_t group = 0;   // Lanes in the current group, 0 = choose a new group
+    int leader = 0;
+    int n = 0;
+    uint16_t pc = 0;      // Group PC while in lockstep
+    uint32_t pending = 0; // Cycles not yet added to the group's lanes
+    uint64_t headroom = 0;
+    uint32_t wait = 0;    // Lowest PC another group waits at
+    uint32_t join = 0x10000;  // PC where a branch arm rejoins the other
+    uint32_t plan[2][2];      // Branch arms to run next: PC, join
+    int plans = 0;
+
+    for (;;) {
+        if (!group) {
+            uint32_t want = plans ? plan[0][0] : 0x10000;
+            group = select_group(b, mask, &leader, &wait, want);
+            if (!group) break;
+            join = b->pc[leader] == want ? plan[0][1] : 0x10000;
+            if (plans && --plans) {
+                plan[0][0] = plan[1][0];
+                plan[0][1] = plan[1][1];
+            }
+            n = __builtin_popcount(group);
+            if (n < BATCH_SOLO_LANES) {
+                solo_run(b, mask);
+                group = 0;
+                continue;
+            }
+            pc = b->pc[leader];
+            pending = 0;
+
+            // Cycles the group can run before its first lane hits the limit
+            uint64_t most = 0;
+            for (uint32_t g = group; g; g &= g - 1) {
+                int i = __builtin_ctz(g);
+                if (b->cycles[i] > most) most = b->cycles[i];
+            }
+            headroom = b->cycle_limit - most;
+        }
+
+        machine_t *lm = b->lane[leader];
+        uint8_t op = mem_read(lm, pc);
+
+        if (!b->vec_ok[op]) {
+            group_flush(b, group, &pc, pending);
+            for (; group; group &= group - 1) scalar_step(b, __builtin_ctz(group));
+            continue;
+        }
+
+        // Lanes whose code bytes differ from the leader's step on their own
+        uint8_t len = OP_LENGTHS[op];
+        uint8_t lo = mem_read(lm, pc + 1);
+        uint8_t hi = mem_read(lm, pc + 2);
+        bool regroup = false;
+        // (lanes outside the group are compared too, so that the address
+        // is verified once for every lane)
+        if (!code_ok(b, pc)) {
+            bool same = true;
+            for (int i = 0; i < b->count; i++) {
+                if (!b->active[i] || i == leader) continue;
+                machine_t *m = b->lane[i];
+                if (mem_read(m, pc) == op &&
+                    (len < 2 || mem_read(m, pc + 1) == lo) &&
+                    (len < 3 || mem_read(m, pc + 2) == hi)) continue;
+                same = false;
+                if (!mask[i]) continue;
+                b->pc[i] = pc;
+                b->cycles[i] += pending;
+                mask[i] = 0;
+                group &= ~(1u << i);
+                n--;
+                scalar_step(b, i);
+                regroup = true;
+            }
+            if (same) b->code_ok[pc >> 3] |= 1 << (pc & 7);
+        }
+
+        uint16_t from = pc;
+        bool together = vector_exec(b, op, lo, hi, mask, &pc);
+        b->vector_steps += n;
+        b->vector_passes++;
+        pending += OP_CYCLES[op];
+
+        if (!together && (op & 0xC7) == 0xC2) {
+            plans = plan_arms(b, lm, from, from + len, (hi << 8) | lo, plan);
+        }
+
+        // Jumping or stepping onto or past a waiting group yields to it, so
+        // groups at the same PC merge and the lowest PC still runs first
+        if (!together || regroup || pending >= headroom || pc >= wait || pc == join) {
+            group_flush(b, group, together ? &pc : NULL, pending);
+            if (pending >= headroom) {  // HLT and I/O never run in lockstep
+                for (; group; group &= group - 1) lane_check(b, __builtin_ctz(group));
+            }
+            group = 0;
+        }
+    }
+
+    for (int i = 0; i < b->count; i++) lane_store(b, i);
+}
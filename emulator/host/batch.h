@@ -0,0 +1,66 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "machine.h"
+
+// Lockstep batch interpreter.
+//
+// Runs up to BATCH_MAX machines executing the same program. While running,
+// the registers of all lanes live here in structure-of-arrays form so that
+// register and immediate instructions (MOV, MVI, ALU, INR/DCR, rotates,
+// 16-bit arithmetic, jumps) execute for every lane at once with SIMD
+// kernels. Instructions that touch memory, the stack or I/O fall back to
+// cpu_step per lane. Lanes whose PC has diverged form groups per PC; a
+// group of fewer than BATCH_SOLO_LANES lanes runs each lane through
+// cpu_step until it reaches a PC where another group waits.
+
+#define BATCH_MAX 32
+#define BATCH_SOLO_LANES 4
+#define JOIN_CACHE 64  // Conditional branches whose arms' join is cached
+
+// Where the two arms of a conditional branch meet again
+typedef struct {
+    uint16_t branch;  // Address of the branch
+    uint16_t pc;      // First PC both arms reach
+    uint8_t arms;     // JOIN_* flags from batch.c
+    bool valid;
+} join_t;
+
+typedef struct {
+    int count;
+    int width;  // count rounded up to whole SIMD vectors
+    machine_t *lane[BATCH_MAX];
+    uint64_t cycle_limit;
+
+    // Register file, indexed like the opcode reg field: B C D E H L - A
+    uint8_t reg[8][BATCH_MAX];
+    uint8_t f[BATCH_MAX];
+    uint16_t sp[BATCH_MAX];
+    uint16_t pc[BATCH_MAX];
+    uint64_t cycles[BATCH_MAX];
+    uint8_t active[BATCH_MAX];  // 0xFF while the lane is running
+
+    // Addresses whose instruction bytes are known to match in every lane.
+    // Cleared for bytes a scalar step may store to.
+    uint8_t code_ok[MEMORY_SIZE / 8];
+    uint8_t vec_ok[256];        // Opcode has a lockstep implementation
+    uint8_t wait_at[MEMORY_SIZE / 8];  // PCs of lanes outside a solo run
+    join_t joins[JOIN_CACHE];
+    uint8_t expand[256][8];     // 8 lane bits to 8 mask bytes
+
+    // Statistics: lane-instructions executed by each path, and lockstep
+    // kernel passes (each covers vector_steps / vector_passes lanes)
+    uint64_t vector_steps;
+    uint64_t scalar_steps;
+    uint64_t vector_passes;
+} batch_t;
+
+// Take over `count` initialized machines. Each runs until HLT or until its
+// cycle counter reaches cycle_limit.
+void batch_init(batch_t *b, machine_t **lanes, int count, uint64_t cycle_limit);
+
+// Run all lanes to completion and write registers back to the machines
+void batch_run(batch_t *b);
+
+#endif
@@ -0,0 +1,665 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cpm.h"
+
+#define CPM_BIOS_STUBS  (CPM_BIOS + 0x40)  // HLT; RET per jump table entry
+#define CPM_BIOS_COUNT  17
+#define CPM_DPB         (CPM_BDOS_BASE + 0x10)
+#define CPM_ALLOC       (CPM_BDOS_BASE + 0x20)
+
+#define FCB1            0x005C
+#define FCB2            0x006C
+#define DEFAULT_DMA     0x0080
+
+// FCB fields
+#define FCB_DR  0
+#define FCB_EX  12
+#define FCB_S2  14
+#define FCB_RC  15
+#define FCB_CR  32
+#define FCB_R0  33
+#define FCB_SIZE        36
+#define FCB_SEQ_SIZE    33  // Sequential calls must not touch r0-r2
+
+#define CTRL_Z  0x1A
+
+// ---------------------------------------------------------------------------
+// Memory setup
+
+// "D:NAME.EXT" (with * wildcards) into the 16 bytes of a default FCB
+static const char *parse_fcb(const char *s, uint8_t *fcb) {
+    memset(fcb, 0, 16);
+    memset(fcb + 1, ' ', 11);
+    while (*s == ' ') s++;
+    if (s[0] && s[1] == ':') {
+        fcb[FCB_DR] = toupper((unsigned char)s[0]) - 'A' + 1;
+        s += 2;
+    }
+    for (int field = 0; field < 2; field++) {
+        int start = field ? 9 : 1, len = field ? 3 : 8;
+        for (int i = 0; *s && *s != ' ' && *s != '.';) {
+            if (*s == '*') {
+                while (i < len) fcb[start + i++] = '?';
+            } else if (i < len) {
+                fcb[start + i++] = toupper((unsigned char)*s);
+            }
+            s++;
+        }
+        if (*s == '.') s++;
+    }
+    return s;
+}
+
+void cpm_setup_memory(machine_t *m, const char *tail) {
+    static const uint8_t DPB[15] = {
+        32, 0,      // Sectors per track
+        5, 31, 3,   // 4K blocks, extent mask for fewer than 256 blocks
+        255, 0,     // 256 blocks
+        127, 0,     // 128 directory entries
+        0xF0, 0,    // Blocks the directory takes
+        0, 0, 0, 0, // No check vector, no reserved tracks
+    };
+    uint8_t *ram = m->mem.ram;
+    mem_fault_range(m, 0, MEMORY_SIZE);
+
+    uint8_t page0[8] = { 0xC3, (CPM_BIOS + 3) & 0xFF, (CPM_BIOS + 3) >> 8, 0, 0,
+                         0xC3, CPM_BDOS_ENTRY & 0xFF, CPM_BDOS_ENTRY >> 8 };
+    memcpy(ram, page0, sizeof(page0));
+    memset(&ram[CPM_BDOS_BASE], 0, MEMORY_SIZE - CPM_BDOS_BASE);
+    ram[CPM_BDOS_ENTRY] = 0x76;
+    ram[CPM_BDOS_ENTRY + 1] = 0xC9;
+    memcpy(&ram[CPM_DPB], DPB, sizeof(DPB));
+    for (int i = 0; i < CPM_BIOS_COUNT; i++) {
+        uint16_t stub = CPM_BIOS_STUBS + 2 * i;
+        ram[CPM_BIOS + 3 * i] = 0xC3;
+        ram[CPM_BIOS + 3 * i + 1] = stub & 0xFF;
+        ram[CPM_BIOS + 3 * i + 2] = stub >> 8;
+        ram[stub] = 0x76;
+        ram[stub + 1] = 0xC9;
+    }
+
+    // The CCP passes the tail upper-cased after a space, and its first two
+    // words as FCBs
+    const char *s = parse_fcb(tail, &ram[FCB1]);
+    parse_fcb(s, &ram[FCB2]);
+    ram[FCB1 + FCB_CR] = 0;
+    size_t len = 0;
+    if (*tail) ram[DEFAULT_DMA + 1 + len++] = ' ';
+    for (; *tail && len < 127; tail++) ram[DEFAULT_DMA + 1 + len++] = toupper((unsigned char)*tail);
+    ram[DEFAULT_DMA] = len;
+}
+
+void cpm_init(cpm_t *c, const char *const *dirs, int drive_count, machine_t *m) {
+    memset(c, 0, sizeof(*c));
+    for (int i = 0; i < drive_count && i < CPM_DRIVES; i++) c->dirs[i] = dirs[i];
+    c->dma = DEFAULT_DMA;
+    m->cpu.pc = CPM_TPA;
+    m->cpu.sp = CPM_BDOS_BASE - 2;
+    mem_write16(m, m->cpu.sp, 0x0000);
+}
+
+// ---------------------------------------------------------------------------
+// Host files
+
+// A host file name in FCB form, if it is a valid 8.3 name
+static bool host_to_fcb(const char *host, char name[11]) {
+    const char *dot = strrchr(host, '.');
+    size_t base = dot ? (size_t)(dot - host) : strlen(host);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base < 1 || base > 8 || ext > 3) return false;
+    memset(name, ' ', 11);
+    for (size_t i = 0; host[i]; i++) {
+        unsigned char ch = host[i];
+        if (&host[i] == dot) continue;
+        if (ch <= ' ' || ch >= 0x7F || strchr("<>.,;:=?*[]", ch)) return false;
+        name[i < base ? i : 8 + (i - base - 1)] = toupper(ch);
+    }
+    return true;
+}
+
+static bool name_match(const char pattern[11], const char name[11]) {
+    for (int i = 0; i < 11; i++) {
+        if (pattern[i] != '?' && pattern[i] != name[i]) return false;
+    }
+    return true;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return memcmp(a, b, 11);
+}
+
+// All files in the drive's directory matching pattern, sorted. Returns the
+// count, or -1 if the directory cannot be read.
+static int scan_dir(const cpm_t *c, int drive, const char pattern[11], char (**found)[11]) {
+    DIR *dir = opendir(c->dirs[drive]);
+    if (!dir) return -1;
+    size_t count = 0, cap = 0;
+    char (*list)[11] = NULL;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        char name[11];
+        if (!host_to_fcb(e->d_name, name) || !name_match(pattern, name)) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char (*grown)[11] = realloc(list, cap * sizeof(*list));
+            if (!grown) break;
+            list = grown;
+        }
+        memcpy(list[count++], name, 11);
+    }
+    closedir(dir);
+    qsort(list, count, sizeof(*list), compare_names);
+    *found = list;
+    return count;
+}
+
+// Path of the existing host file with this name, whatever its case
+static bool find_host(const cpm_t *c, int drive, const char name[11], char *path, size_t size) {
+    DIR *dir = opendir(c->dirs[drive]);
+    if (!dir) return false;
+    struct dirent *e;
+    bool found = false;
+    while (!found && (e = readdir(dir))) {
+        char host[11];
+        if (host_to_fcb(e->d_name, host) && memcmp(host, name, 11) == 0) {
+            snprintf(path, size, "%s/%s", c->dirs[drive], e->d_name);
+            found = true;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// Path for a new file: the name in lower case
+static void new_host_path(const cpm_t *c, int drive, const char name[11], char *path, size_t size) {
+    char host[13];
+    size_t n = 0;
+    for (int i = 0; i < 8 && name[i] != ' '; i++) host[n++] = tolower((unsigned char)name[i]);
+    if (name[8] != ' ') host[n++] = '.';
+    for (int i = 8; i < 11 && name[i] != ' '; i++) host[n++] = tolower((unsigned char)name[i]);
+    host[n] = 0;
+    snprintf(path, size, "%s/%s", c->dirs[drive], host);
+}
+
+static void file_forget(cpm_t *c, int drive, const char name[11]) {
+    for (int i = 0; i < CPM_OPEN_FILES; i++) {
+        cpm_file_t *f = &c->files[i];
+        if (f->f && f->drive == drive && memcmp(f->name, name, 11) == 0) {
+            fclose(f->f);
+            f->f = NULL;
+        }
+    }
+}
+
+// The open host file for an FCB name, opened on first use. With `create`
+// the file is created, or emptied if it exists.
+static FILE *file_get(cpm_t *c, int drive, const char name[11], bool create) {
+    if (create) {
+        file_forget(c, drive, name);
+    } else {
+        for (int i = 0; i < CPM_OPEN_FILES; i++) {
+            cpm_file_t *f = &c->files[i];
+            if (f->f && f->drive == drive && memcmp(f->name, name, 11) == 0) return f->f;
+        }
+    }
+
+    char path[4096];
+    FILE *fp;
+    if (create) {
+        if (!find_host(c, drive, name, path, sizeof(path))) new_host_path(c, drive, name, path, sizeof(path));
+        fp = fopen(path, "w+b");
+    } else {
+        if (!find_host(c, drive, name, path, sizeof(path))) return NULL;
+        fp = fopen(path, "r+b");
+        if (!fp) fp = fopen(path, "rb");
+    }
+    if (!fp) return NULL;
+
+    cpm_file_t *slot = &c->files[c->next_slot];
+    c->next_slot = (c->next_slot + 1) % CPM_OPEN_FILES;
+    if (slot->f) fclose(slot->f);
+    memcpy(slot->name, name, 11);
+    slot->drive = drive;
+    slot->f = fp;
+    return fp;
+}
+
+static uint32_t file_records(FILE *f) {
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    return size > 0 ? (size + CPM_RECORD - 1) / CPM_RECORD : 0;
+}
+
+void cpm_close(cpm_t *c) {
+    for (int i = 0; i < CPM_OPEN_FILES; i++) {
+        if (c->files[i].f) fclose(c->files[i].f);
+        c->files[i].f = NULL;
+    }
+    free(c->found);
+    c->found = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// FCBs
+
+static void fcb_load(machine_t *m, uint16_t addr, uint8_t *fcb) {
+    for (int i = 0; i < FCB_SIZE; i++) fcb[i] = mem_read(m, addr + i);
+}
+
+static void fcb_store(machine_t *m, uint16_t addr, const uint8_t *fcb, int len) {
+    for (int i = 0; i < len; i++) mem_write(m, addr + i, fcb[i]);
+}
+
+static void fcb_name(const uint8_t *fcb, char name[11]) {
+    for (int i = 0; i < 11; i++) name[i] = toupper(fcb[1 + i] & 0x7F);
+}
+
+// Drive an FCB refers to, -1 if it has no directory
+static int fcb_drive(const cpm_t *c, const uint8_t *fcb) {
+    int drive = fcb[FCB_DR] && fcb[FCB_DR] != '?' ? (fcb[FCB_DR] & 0x1F) - 1 : c->drive;
+    return drive >= 0 && drive < CPM_DRIVES && c->dirs[drive] ? drive : -1;
+}
+
+// Sequential position: extent (s2 and ex) and current record
+static uint32_t fcb_record(const uint8_t *fcb) {
+    return ((fcb[FCB_S2] & 0x3F) * 32u + (fcb[FCB_EX] & 0x1F)) * CPM_RECORD + fcb[FCB_CR];
+}
+
+// Move the sequential position and set rc to the records in that extent
+static void fcb_seek(uint8_t *fcb, uint32_t record, uint32_t file_records) {
+    fcb[FCB_CR] = record & 0x7F;
+    fcb[FCB_EX] = (record >> 7) & 0x1F;
+    fcb[FCB_S2] = (record >> 12) & 0x3F;
+    uint32_t extent = record & ~0x7Fu;
+    uint32_t in_extent = file_records > extent ? file_records - extent : 0;
+    fcb[FCB_RC] = in_extent < CPM_RECORD ? in_extent : CPM_RECORD;
+}
+
+static uint32_t fcb_random(const uint8_t *fcb) {
+    return fcb[FCB_R0] | (fcb[FCB_R0 + 1] << 8) | ((uint32_t)fcb[FCB_R0 + 2] << 16);
+}
+
+static void fcb_set_random(uint8_t *fcb, uint32_t record) {
+    fcb[FCB_R0] = record & 0xFF;
+    fcb[FCB_R0 + 1] = (record >> 8) & 0xFF;
+    fcb[FCB_R0 + 2] = record >> 16;
+}
+
+// Read one record into the DMA buffer, ^Z-padding a short last one.
+// Returns 0, or 1 past the end of the file.
+static uint8_t read_record(cpm_t *c, machine_t *m, FILE *f, uint32_t record) {
+    uint8_t buf[CPM_RECORD];
+    if (fseek(f, (long)record * CPM_RECORD, SEEK_SET) != 0) return 1;
+    size_t n = fread(buf, 1, CPM_RECORD, f);
+    if (n == 0) return 1;
+    memset(buf + n, CTRL_Z, CPM_RECORD - n);
+    mem_dma_write(m, c->dma, buf, CPM_RECORD);
+    return 0;
+}
+
+// Write the DMA buffer as one record. Returns 0, or 2 (disk full) if the
+// host write fails.
+static uint8_t write_record(cpm_t *c, machine_t *m, FILE *f, uint32_t record) {
+    uint8_t buf[CPM_RECORD];
+    mem_dma_read(m, c->dma, buf, CPM_RECORD);
+    if (fseek(f, (long)record * CPM_RECORD, SEEK_SET) != 0 || fwrite(buf, 1, CPM_RECORD, f) != CPM_RECORD) {
+        return 2;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Console
+
+static bool con_ready(machine_t *m) {
+    return io_read(m, PORT_SERIAL_STATUS) & 0x01;
+}
+
+// Next input byte with LF as CR, ^Z once input has run out
+static uint8_t con_in(machine_t *m) {
+    if (!con_ready(m)) return CTRL_Z;
+    uint8_t ch = io_read(m, PORT_SERIAL_DATA);
+    return ch == '\n' ? '\r' : ch;
+}
+
+static void con_out(machine_t *m, uint8_t ch) {
+    io_write(m, PORT_SERIAL_DATA, ch);
+}
+
+// Function 10: line into the buffer at addr (max length, count, text)
+static void con_read_line(machine_t *m, uint16_t addr) {
+    uint8_t max = mem_read(m, addr);
+    uint8_t len = 0;
+    while (len < max && con_ready(m)) {
+        uint8_t ch = con_in(m);
+        if (ch == '\r') break;
+        if (ch == 0x08 || ch == 0x7F) {
+            if (len) len--;
+            continue;
+        }
+        con_out(m, ch);
+        mem_write(m, addr + 2 + len++, ch);
+    }
+    con_out(m, '\r');
+    mem_write(m, addr + 1, len);
+}
+
+// ---------------------------------------------------------------------------
+// BDOS
+
+// One directory entry for a search result, at the DMA address
+static void put_dir_entry(cpm_t *c, machine_t *m, const char name[11]) {
+    uint8_t entry[32] = { 0 };
+    memcpy(&entry[1], name, 11);
+    char path[4096];
+    FILE *f = NULL;
+    if (find_host(c, c->found_drive, name, path, sizeof(path))) f = fopen(path, "rb");
+    uint32_t records = f ? file_records(f) : 0;
+    if (f) fclose(f);
+    uint32_t extents = records ? (records - 1) / CPM_RECORD : 0;
+    entry[FCB_EX] = extents & 0x1F;
+    entry[FCB_S2] = extents >> 5;
+    entry[FCB_RC] = records - extents * CPM_RECORD;
+    for (uint32_t i = 0; i < 16 && i * 32 < records; i++) entry[16 + i] = i + 1;  // One 4K block each
+    mem_dma_write(m, c->dma, entry, sizeof(entry));
+}
+
+static uint8_t search_next(cpm_t *c, machine_t *m) {
+    if (c->found_next >= c->found_count) return 0xFF;
+    put_dir_entry(c, m, c->found[c->found_next++]);
+    return 0;
+}
+
+// File functions on the FCB at DE; A (and for some HL) as the BDOS returns
+static uint16_t bdos_file(cpm_t *c, machine_t *m, uint8_t fn, uint16_t addr) {
+    uint8_t fcb[FCB_SIZE];
+    char name[11];
+    fcb_load(m, addr, fcb);
+    fcb_name(fcb, name);
+    int drive = fcb_drive(c, fcb);
+    if (drive < 0) return 0xFF;
+
+    switch (fn) {
+    case 15: {  // Open
+        char (*found)[11];
+        int n = scan_dir(c, drive, name, &found);
+        if (n <= 0) {
+            free(found);
+            return 0xFF;
+        }
+        memcpy(name, found[0], 11);
+        free(found);
+        FILE *f = file_get(c, drive, name, false);
+        if (!f) return 0xFF;
+        memcpy(&fcb[1], name, 11);
+        uint8_t cr = fcb[FCB_CR];
+        fcb_seek(fcb, fcb_record(fcb) - cr, file_records(f));
+        fcb[FCB_CR] = cr;
+        fcb_store(m, addr, fcb, FCB_SEQ_SIZE);
+        return 0;
+    }
+
+    case 16:  // Close: buffered data goes to the host file
+        for (int i = 0; i < CPM_OPEN_FILES; i++) {
+            cpm_file_t *f = &c->files[i];
+            if (f->f && f->drive == drive && memcmp(f->name, name, 11) == 0) fflush(f->f);
+        }
+        return 0;
+
+    case 17: {  // Search first
+        free(c->found);
+        c->found = NULL;
+        int n = scan_dir(c, drive, name, &c->found);
+        c->found_count = n > 0 ? n : 0;
+        c->found_next = 0;
+        c->found_drive = drive;
+        return search_next(c, m);
+    }
+
+    case 19: {  // Delete
+        char (*found)[11];
+        int n = scan_dir(c, drive, name, &found);
+        int deleted = 0;
+        for (int i = 0; i < n; i++) {
+            char path[4096];
+            file_forget(c, drive, found[i]);
+            if (find_host(c, drive, found[i], path, sizeof(path)) && remove(path) == 0) deleted++;
+        }
+        free(found);
+        return deleted ? 0 : 0xFF;
+    }
+
+    case 20:    // Read sequential
+    case 21: {  // Write sequential
+        FILE *f = file_get(c, drive, name, false);
+        if (!f) return fn == 20 ? 1 : 2;
+        uint32_t record = fcb_record(fcb);
+        uint8_t rc = fn == 20 ? read_record(c, m, f, record) : write_record(c, m, f, record);
+        if (rc == 0) fcb_seek(fcb, record + 1, file_records(f));
+        fcb_store(m, addr, fcb, FCB_SEQ_SIZE);
+        return rc;
+    }
+
+    case 22: {  // Make
+        for (int i = 0; i < 11; i++) {
+            if (name[i] == '?') return 0xFF;
+        }
+        if (!file_get(c, drive, name, true)) return 0xFF;
+        fcb_seek(fcb, fcb_record(fcb) - fcb[FCB_CR], 0);
+        fcb_store(m, addr, fcb, FCB_SEQ_SIZE);
+        return 0;
+    }
+
+    case 23: {  // Rename to the name in the second half of the FCB
+        char to[11], from_path[4096], to_path[4096];
+        uint8_t second[FCB_SIZE];
+        fcb_load(m, addr + 16, second);
+        fcb_name(second, to);
+        if (!find_host(c, drive, name, from_path, sizeof(from_path)) ||
+            find_host(c, drive, to, to_path, sizeof(to_path))) {
+            return 0xFF;
+        }
+        file_forget(c, drive, name);
+        new_host_path(c, drive, to, to_path, sizeof(to_path));
+        return rename(from_path, to_path) == 0 ? 0 : 0xFF;
+    }
+
+    case 33:    // Read random
+    case 34:    // Write random
+    case 40: {  // Write random with zero fill (the host fills gaps anyway)
+        uint32_t record = fcb_random(fcb);
+        if (record > 0xFFFF) return 6;
+        FILE *f = file_get(c, drive, name, false);
+        if (!f) return fn == 33 ? 1 : 2;
+        uint8_t rc = fn == 33 ? read_record(c, m, f, record) : write_record(c, m, f, record);
+        fcb_seek(fcb, record, file_records(f));
+        fcb_store(m, addr, fcb, FCB_SIZE);
+        return rc;
+    }
+
+    case 35: {  // File size
+        FILE *f = file_get(c, drive, name, false);
+        if (!f) return 0xFF;
+        fcb_set_random(fcb, file_records(f));
+        fcb_store(m, addr, fcb, FCB_SIZE);
+        return 0;
+    }
+
+    case 36:  // Random record from the sequential position
+        fcb_set_random(fcb, fcb_record(fcb));
+        fcb_store(m, addr, fcb, FCB_SIZE);
+        return 0;
+    }
+    return 0xFF;
+}
+
+static uint16_t bdos(cpm_t *c, machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint8_t e = cpu->de.lo;
+    uint16_t de = cpu->de.word;
+
+    switch (cpu->bc.lo) {
+    case 0:  // System reset
+        c->exited = true;
+        return 0;
+    case 1: {
+        uint8_t ch = con_in(m);
+        con_out(m, ch);
+        return ch;
+    }
+    case 2:
+        con_out(m, e);
+        return 0;
+    case 3:  // Reader
+        return CTRL_Z;
+    case 4:  // Punch and list output go nowhere
+    case 5:
+        return 0;
+    case 6:  // Direct console I/O
+        if (e == 0xFF) return con_ready(m) ? con_in(m) : 0;
+        if (e == 0xFE) return con_ready(m) ? 0xFF : 0;
+        if (e == 0xFD) return con_in(m);
+        con_out(m, e);
+        return 0;
+    case 7:  // IOBYTE
+        return mem_read(m, 0x0003);
+    case 8:
+        mem_write(m, 0x0003, e);
+        return 0;
+    case 9:
+        for (uint32_t i = 0; i < MEMORY_SIZE; i++) {
+            uint8_t ch = mem_read(m, de + i);
+            if (ch == '$') break;
+            con_out(m, ch);
+        }
+        return 0;
+    case 10:
+        con_read_line(m, de);
+        return 0;
+    case 11:
+        return con_ready(m) ? 0xFF : 0;
+    case 12:  // Version: CP/M 2.2
+        return 0x0022;
+    case 13:  // Reset disks
+        c->drive = 0;
+        c->dma = DEFAULT_DMA;
+        return 0;
+    case 14:
+        if (e >= CPM_DRIVES || !c->dirs[e]) return 0xFF;
+        c->drive = e;
+        mem_write(m, 0x0004, (c->user << 4) | e);
+        return 0;
+    case 18:
+        return search_next(c, m);
+    case 24: {  // Login vector
+        uint16_t v = 0;
+        for (int i = 0; i < CPM_DRIVES; i++) {
+            if (c->dirs[i]) v |= 1 << i;
+        }
+        return v;
+    }
+    case 25:
+        return c->drive;
+    case 26:
+        c->dma = de;
+        return 0;
+    case 27:
+        return CPM_ALLOC;
+    case 28:  // Write protect, read-only vector and attributes: accepted, no effect
+    case 29:
+    case 30:
+        return 0;
+    case 31:
+        return CPM_DPB;
+    case 32:
+        if (e == 0xFF) return c->user;
+        c->user = e & 0x0F;
+        return 0;
+    case 37:  // Reset drives
+        return 0;
+    case 15: case 16: case 17: case 19: case 20: case 21: case 22: case 23:
+    case 33: case 34: case 35: case 36: case 40:
+        return bdos_file(c, m, cpu->bc.lo, de);
+    default:
+        return 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// BIOS: console entries; the disk entries report no disks, since files go
+// through the BDOS to host directories
+
+static void bios(cpm_t *c, machine_t *m, int entry) {
+    cpu_8080_t *cpu = &m->cpu;
+    switch (entry) {
+    case 0:  // BOOT, WBOOT
+    case 1:
+        c->exited = true;
+        break;
+    case 2:  // CONST
+        cpu->a = con_ready(m) ? 0xFF : 0;
+        break;
+    case 3:  // CONIN
+        cpu->a = con_in(m);
+        break;
+    case 4:  // CONOUT
+        con_out(m, cpu->bc.lo);
+        break;
+    case 7:  // READER
+        cpu->a = CTRL_Z;
+        break;
+    case 9:  // SELDSK: no disk parameter header
+        cpu->hl.word = 0;
+        break;
+    case 12:  // SETDMA
+        c->dma = cpu->bc.word;
+        break;
+    case 13:  // READ, WRITE fail
+    case 14:
+        cpu->a = 1;
+        break;
+    case 15:  // LISTST: always ready
+        cpu->a = 0xFF;
+        break;
+    case 16:  // SECTRAN: no skew
+        cpu->hl.word = cpu->bc.word;
+        break;
+    default:  // LIST, PUNCH, HOME, SETTRK, SETSEC
+        break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Run loop
+
+// Service the HLT just executed if it is a BDOS or BIOS trap; false for a
+// HLT of the program's own
+static bool trap(cpm_t *c, machine_t *m) {
+    uint16_t at = m->cpu.pc - 1;
+    if (at == CPM_BDOS_ENTRY) {
+        uint16_t result = bdos(c, m);
+        m->cpu.hl.word = result;
+        m->cpu.a = result & 0xFF;
+        m->cpu.bc.hi = result >> 8;
+    } else if (at >= CPM_BIOS_STUBS && at < CPM_BIOS_STUBS + 2 * CPM_BIOS_COUNT && !(at & 1)) {
+        bios(c, m, (at - CPM_BIOS_STUBS) / 2);
+    } else {
+        return false;
+    }
+    if (!c->exited) m->cpu.halted = false;
+    return true;
+}
+
+uint64_t cpm_run(cpm_t *c, machine_t *m, uint64_t budget) {
+    uint64_t start = m->cpu.cycles;
+    while (!c->exited) {
+        uint64_t used = m->cpu.cycles - start;
+        if (used >= budget) break;
+        machine_run(m, budget - used);
+        if (!m->cpu.halted || !trap(c, m)) break;
+    }
+    return m->cpu.cycles - start;
+}
@@ -0,0 +1,70 @@
+#ifndef CPM_H
+#define CPM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "machine.h"
+
+// CP/M 2.2 high-level emulation for .COM programs.
+//
+// There is no CCP, BDOS or BIOS code in the guest. The BDOS entry and each
+// BIOS jump table entry lead to a HLT followed by a RET. machine_run stops
+// at the HLT, cpm_run services the call natively (console I/O through the
+// machine's serial port, files in host directories) and clears the halt,
+// and the RET returns to the program. Nothing is checked per instruction.
+//
+// Memory: the program at 0100h, the BDOS entry at CPM_BDOS_ENTRY (which
+// 0006h points to, so programs size the TPA from it) and the BIOS jump
+// table at CPM_BIOS. Console input has LF turned into CR; input that has
+// run out reads as ^Z. Drives A: to P: are host directories; file names
+// are 8.3 and matched case-insensitively, new files are created in lower
+// case. A directory search returns one entry per file.
+
+#define CPM_TPA         0x0100
+#define CPM_BDOS_BASE   0xFE00  // Serial number, then the entry point
+#define CPM_BDOS_ENTRY  0xFE06
+#define CPM_BIOS        0xFF00
+#define CPM_DRIVES      16
+#define CPM_OPEN_FILES  16
+#define CPM_RECORD      128
+
+typedef struct {
+    char name[11];    // FCB form: space padded, upper case
+    int drive;
+    FILE *f;
+} cpm_file_t;
+
+typedef struct {
+    const char *dirs[CPM_DRIVES];  // Host directory per drive, NULL if none
+    int drive;                     // Current drive
+    uint8_t user;
+    uint16_t dma;
+    bool exited;                   // Warm boot or BDOS function 0
+
+    cpm_file_t files[CPM_OPEN_FILES];  // Host files kept open by FCB name
+    int next_slot;
+
+    // Directory search (functions 17 and 18)
+    char (*found)[11];
+    size_t found_count, found_next;
+    int found_drive;
+} cpm_t;
+
+// Write page zero, the BDOS entry and the BIOS into m's memory for a
+// program already loaded at CPM_TPA, and parse the command tail into the
+// default FCBs and buffer as the CCP would
+void cpm_setup_memory(machine_t *m, const char *tail);
+
+// Prepare a run with the given directories as A:, B:, ... and point m's
+// CPU at the program, with a return address of 0000h (warm boot) stacked
+void cpm_init(cpm_t *c, const char *const *dirs, int drive_count, machine_t *m);
+
+// Run until the program exits, executes a HLT of its own or `budget` more
+// cycles have elapsed. Returns cycles executed.
+uint64_t cpm_run(cpm_t *c, machine_t *m, uint64_t budget);
+
+// Close the host files left open
+void cpm_close(cpm_t *c);
+
+#endif
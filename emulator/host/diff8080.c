@@ -0,0 +1,411 @@
+// diff8080 - differential tester for the CPU core
+//
+// Runs the interpreter in src/cpu.c and the reference model in ref8080.c
+// side by side and compares registers, flags, cycle counts, stores and port
+// output after every instruction. Stops at the first divergence and prints
+// the instruction with cpu_disasm and both resulting states.
+//
+// With no program arguments it runs random trials: memory and registers are
+// filled from a seeded generator and both CPUs execute whatever they find.
+// Given CP/M .COM files (such as the 8080PRE, TST8080, CPUTEST and 8080EXM
+// exercisers) it loads each at 0100h under a minimal BDOS shim that handles
+// console output (functions 2 and 9) and ends the run on warm boot.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "machine.h"
+#include "ref8080.h"
+
+#define DEFAULT_TRIALS 1000
+#define DEFAULT_STEPS  10000
+
+#define CPM_TPA   0x0100
+#define CPM_BDOS  0x0005
+#define CPM_TOP   0xFE00   // Reported as the BDOS base at 0006h
+
+#define FLAG_MASK 0xD5     // S Z AC P C; the fixed bits are not state
+
+typedef struct {
+    machine_t core;
+    ref8080_t ref;
+    uint8_t ref_mem[MEMORY_SIZE];
+
+    // Port output seen by each side
+    uint64_t core_out_count, ref_out_count;
+    uint8_t core_out_last, ref_out_last;
+
+    // Registers of the reference's block device, indexed from
+    // PORT_BLK_COMMAND (the status of the last command first)
+    uint8_t ref_blk[6];
+
+    uint64_t steps;
+} pair_t;
+
+static pair_t pair;
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Core serial backend: no input, output counted
+static int core_getc(void *ctx) {
+    (void)ctx;
+    return -1;
+}
+
+static void core_putc(void *ctx, uint8_t ch) {
+    pair_t *p = ctx;
+    p->core_out_count++;
+    p->core_out_last = ch;
+}
+
+// The reference model sees the same ports as io.c with nothing connected:
+// an 88-DCDD with no drive selected reads FFh, and the block device keeps
+// its registers and fails every transfer for want of a disk
+static uint8_t ref_in(void *ctx, uint8_t port) {
+    pair_t *p = ctx;
+    switch (port) {
+    case PORT_SERIAL_STATUS: return 0x02;
+    case PORT_SERIAL_DATA:   return 0x00;
+    case PORT_SENSE_SW_HI:
+    case PORT_SENSE_SW_LO:   return 0x00;
+    default:
+        if (port >= PORT_BLK_COMMAND && port <= PORT_BLK_BLOCK_HI) return p->ref_blk[port - PORT_BLK_COMMAND];
+        return 0xFF;
+    }
+}
+
+static void ref_out(void *ctx, uint8_t port, uint8_t val) {
+    pair_t *p = ctx;
+    if (port == PORT_SERIAL_DATA) {
+        p->ref_out_count++;
+        p->ref_out_last = val;
+    } else if (port == PORT_BLK_COMMAND) {
+        p->ref_blk[0] = val == BLK_READ || val == BLK_WRITE ? BLK_ERR_DRIVE : BLK_ERR_COMMAND;
+    } else if (port > PORT_BLK_COMMAND && port <= PORT_BLK_BLOCK_HI) {
+        p->ref_blk[port - PORT_BLK_COMMAND] = val;
+    }
+}
+
+static void pair_init(pair_t *p) {
+    machine_init(&p->core, core_getc, core_putc, p);
+    memset(&p->ref, 0, sizeof(p->ref));
+    memset(p->ref_mem, 0, sizeof(p->ref_mem));
+    p->ref.mem = p->ref_mem;
+    p->ref.in = ref_in;
+    p->ref.out = ref_out;
+    p->ref.io_ctx = p;
+    p->core_out_count = p->ref_out_count = 0;
+    memset(p->ref_blk, 0, sizeof(p->ref_blk));
+    p->steps = 0;
+}
+
+// Copy the core's registers into the reference model
+static void pair_sync_regs(pair_t *p) {
+    const cpu_8080_t *c = &p->core.cpu;
+    ref8080_t *r = &p->ref;
+    r->reg[REF_B] = c->bc.hi;
+    r->reg[REF_C] = c->bc.lo;
+    r->reg[REF_D] = c->de.hi;
+    r->reg[REF_E] = c->de.lo;
+    r->reg[REF_H] = c->hl.hi;
+    r->reg[REF_L] = c->hl.lo;
+    r->reg[REF_A] = c->a;
+    ref_set_flags(r, c->f.byte);
+    r->sp = c->sp;
+    r->pc = c->pc;
+    r->inte = c->inte;
+    r->halted = c->halted;
+    r->cycles = c->cycles;
+}
+
+static void print_regs(const char *label, uint8_t a, uint8_t f, uint16_t bc, uint16_t de,
+                       uint16_t hl, uint16_t sp, uint16_t pc, uint64_t cycles) {
+    printf("  %-10s A=%02X F=%02X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X CYC=%llu\n",
+           label, a, f & FLAG_MASK, bc, de, hl, sp, pc, (unsigned long long)cycles);
+}
+
+static void print_core(const char *label, const cpu_8080_t *c) {
+    print_regs(label, c->a, c->f.byte, c->bc.word, c->de.word, c->hl.word,
+               c->sp, c->pc, c->cycles);
+}
+
+static void print_ref(const char *label, const ref8080_t *r) {
+    print_regs(label, r->reg[REF_A], ref_flags(r),
+               (uint16_t)(r->reg[REF_B] << 8 | r->reg[REF_C]),
+               (uint16_t)(r->reg[REF_D] << 8 | r->reg[REF_E]),
+               (uint16_t)(r->reg[REF_H] << 8 | r->reg[REF_L]),
+               r->sp, r->pc, r->cycles);
+}
+
+// Describe the first difference between the two sides, or return NULL
+static const char *pair_compare(pair_t *p, char *buf, size_t size) {
+    const cpu_8080_t *c = &p->core.cpu;
+    const ref8080_t *r = &p->ref;
+    const uint8_t regs[8] = { c->bc.hi, c->bc.lo, c->de.hi, c->de.lo, c->hl.hi, c->hl.lo, 0, c->a };
+    static const char NAMES[] = "BCDEHLMA";
+
+    for (int i = 0; i < 8; i++) {
+        if (i != REF_M && regs[i] != r->reg[i]) {
+            snprintf(buf, size, "register %c: core %02X, reference %02X", NAMES[i], regs[i], r->reg[i]);
+            return buf;
+        }
+    }
+    if ((c->f.byte & FLAG_MASK) != (ref_flags(r) & FLAG_MASK)) {
+        snprintf(buf, size, "flags: core %02X, reference %02X",
+                 c->f.byte & FLAG_MASK, ref_flags(r) & FLAG_MASK);
+        return buf;
+    }
+    if (c->sp != r->sp || c->pc != r->pc) {
+        snprintf(buf, size, "SP/PC: core %04X/%04X, reference %04X/%04X", c->sp, c->pc, r->sp, r->pc);
+        return buf;
+    }
+    if (c->cycles != r->cycles) {
+        snprintf(buf, size, "cycles: core %llu, reference %llu",
+                 (unsigned long long)c->cycles, (unsigned long long)r->cycles);
+        return buf;
+    }
+    if (c->inte != r->inte || c->halted != r->halted) {
+        snprintf(buf, size, "INTE/HLT: core %d/%d, reference %d/%d", c->inte, c->halted, r->inte, r->halted);
+        return buf;
+    }
+    for (int i = 0; i < r->store_count; i++) {
+        uint16_t addr = r->stores[i];
+        if (mem_read(&p->core, addr) != r->mem[addr]) {
+            snprintf(buf, size, "memory %04X: core %02X, reference %02X",
+                     addr, mem_read(&p->core, addr), r->mem[addr]);
+            return buf;
+        }
+    }
+    if (p->core_out_count != p->ref_out_count || p->core_out_last != p->ref_out_last) {
+        snprintf(buf, size, "serial output: core %llu bytes (last %02X), reference %llu bytes (last %02X)",
+                 (unsigned long long)p->core_out_count, p->core_out_last,
+                 (unsigned long long)p->ref_out_count, p->ref_out_last);
+        return buf;
+    }
+    return NULL;
+}
+
+// Full memory comparison, used at the end of a run to catch stores the
+// reference model did not make
+static const char *pair_compare_memory(pair_t *p, char *buf, size_t size) {
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (p->core.mem.ram[addr] != p->ref_mem[addr]) {
+            snprintf(buf, size, "memory %04zX: core %02X, reference %02X",
+                     addr, p->core.mem.ram[addr], p->ref_mem[addr]);
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+// Step both sides once; on divergence print a report and return false
+static bool pair_step(pair_t *p) {
+    cpu_8080_t before = p->core.cpu;
+    uint8_t bytes[3];
+    for (int i = 0; i < 3; i++) bytes[i] = mem_read(&p->core, before.pc + i);
+
+    cpu_step(&p->core);
+    ref_step(&p->ref);
+    p->steps++;
+
+    char why[128];
+    if (!pair_compare(p, why, sizeof(why))) return true;
+
+    // Disassemble from the bytes as they were before the step, in case the
+    // instruction overwrote itself
+    static machine_t scratch;
+    for (int i = 0; i < 3; i++) scratch.mem.ram[(uint16_t)(before.pc + i)] = bytes[i];
+    char text[32];
+    int len = cpu_disasm(&scratch, before.pc, text, sizeof(text));
+
+    printf("Divergence after %llu instructions: %s\n", (unsigned long long)p->steps, why);
+    printf("  %04X: ", before.pc);
+    for (int i = 0; i < 3; i++) {
+        if (i < len) printf("%02X ", bytes[i]);
+        else printf("   ");
+    }
+    printf(" %s\n", text);
+    print_core("before", &before);
+    print_core("core", &p->core.cpu);
+    print_ref("reference", &p->ref);
+    return false;
+}
+
+static bool run_random_trial(uint64_t seed, uint64_t steps) {
+    pair_t *p = &pair;
+    pair_init(p);
+    rng_state = seed;
+
+    for (size_t i = 0; i < MEMORY_SIZE; i += 8) {
+        uint64_t v = rng();
+        memcpy(&p->core.mem.ram[i], &v, 8);
+    }
+    memcpy(p->ref_mem, p->core.mem.ram, MEMORY_SIZE);
+
+    cpu_8080_t *c = &p->core.cpu;
+    uint64_t v = rng();
+    c->a = v;
+    c->f.byte = (v >> 8 & FLAG_MASK) | 0x02;
+    c->bc.word = v >> 16;
+    c->de.word = v >> 32;
+    c->hl.word = v >> 48;
+    v = rng();
+    c->sp = v;
+    c->pc = v >> 16;
+    pair_sync_regs(p);
+
+    for (uint64_t i = 0; i < steps && !c->halted; i++) {
+        if (!pair_step(p)) {
+            printf("Trial seed %llu\n", (unsigned long long)seed);
+            return false;
+        }
+    }
+
+    char why[128];
+    if (pair_compare_memory(p, why, sizeof(why))) {
+        printf("Divergence by end of trial seed %llu (%llu instructions): %s\n",
+               (unsigned long long)seed, (unsigned long long)p->steps, why);
+        return false;
+    }
+    return true;
+}
+
+// Console output for BDOS calls, printed once from the core's state
+static void bdos_call(machine_t *m) {
+    cpu_8080_t *c = &m->cpu;
+    switch (c->bc.lo) {
+    case 2:
+        putchar(c->de.lo);
+        break;
+    case 9:
+        for (uint32_t i = 0; i < MEMORY_SIZE; i++) {
+            uint8_t ch = mem_read(m, c->de.word + i);
+            if (ch == '$') break;
+            putchar(ch);
+        }
+        break;
+    }
+    fflush(stdout);
+}
+
+static bool run_cpm(const char *name, uint64_t limit) {
+    pair_t *p = &pair;
+    pair_init(p);
+
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        exit(1);
+    }
+    size_t len = fread(&p->core.mem.ram[CPM_TPA], 1, CPM_TOP - CPM_TPA, f);
+    fclose(f);
+
+    // 0000h: warm boot ends the run. 0005h: BDOS entry, handled here and
+    // then returned from. The stack holds a return address of 0000h.
+    uint8_t *ram = p->core.mem.ram;
+    ram[0x0000] = 0x76;
+    ram[CPM_BDOS] = 0xC9;
+    ram[CPM_BDOS + 1] = CPM_TOP & 0xFF;
+    ram[CPM_BDOS + 2] = CPM_TOP >> 8;
+    memcpy(p->ref_mem, ram, MEMORY_SIZE);
+
+    p->core.cpu.pc = CPM_TPA;
+    p->core.cpu.sp = CPM_TOP - 2;
+    pair_sync_regs(p);
+
+    printf("%s: %zu bytes\n", name, len);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (p->core.cpu.pc != 0x0000) {
+        if (p->core.cpu.pc == CPM_BDOS) bdos_call(&p->core);
+        if (!pair_step(p)) return false;
+        if (p->core.cpu.halted) {
+            printf("\n%s: halted at %04X\n", name, p->core.cpu.pc - 1);
+            return false;
+        }
+        if (limit && p->steps >= limit) {
+            printf("\n%s: stopped after %llu instructions\n", name, (unsigned long long)p->steps);
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    char why[128];
+    if (pair_compare_memory(p, why, sizeof(why))) {
+        printf("\n%s: divergence by end of run: %s\n", name, why);
+        return false;
+    }
+    printf("\n%s: %llu instructions, %llu cycles matched in %.1f s\n", name,
+           (unsigned long long)p->steps, (unsigned long long)p->core.cpu.cycles, secs);
+    return true;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [program.com...]\n"
+            "  -n N    random trials (default %d, 0 = until -T or forever)\n"
+            "  -k N    instructions per random trial (default %d)\n"
+            "  -s N    seed of the first random trial\n"
+            "  -T SEC  stop random trials after SEC seconds\n"
+            "  -l N    stop each .COM program after N instructions\n"
+            "Without programs, runs random trials; otherwise runs each CP/M\n"
+            "program under a minimal BDOS. Exits 1 on the first divergence.\n",
+            prog, DEFAULT_TRIALS, DEFAULT_STEPS);
+}
+
+int main(int argc, char **argv) {
+    uint64_t trials = DEFAULT_TRIALS;
+    uint64_t steps = DEFAULT_STEPS;
+    uint64_t seed = 1;
+    double max_time = 0;
+    uint64_t limit = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:s:T:l:h")) != -1) {
+        switch (opt) {
+        case 'n': trials = strtoull(optarg, NULL, 0); break;
+        case 'k': steps = strtoull(optarg, NULL, 0); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'T': max_time = strtod(optarg, NULL); break;
+        case 'l': limit = strtoull(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            if (!run_cpm(argv[i], limit)) return 1;
+        }
+        return 0;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t total = 0;
+    uint64_t n;
+    for (n = 0; !trials || n < trials; n++) {
+        if (!run_random_trial(seed + n, steps)) return 1;
+        total += pair.steps;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (max_time > 0 && secs >= max_time) {
+            n++;
+            break;
+        }
+    }
+    printf("%llu random trials, %llu instructions matched\n",
+           (unsigned long long)n, (unsigned long long)total);
+    return 0;
+}
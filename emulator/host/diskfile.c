@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "diskfile.h"
+
+int disk_map(const char *name, bool shared, disk_media_t *media) {
+    bool read_only = false;
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        fd = open(name, O_RDONLY);
+        read_only = true;
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "Error: %s is empty\n", name);
+        close(fd);
+        return -1;
+    }
+    // A private mapping can be written even when the file cannot
+    int prot = read_only && shared ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, st.st_size, prot, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s\n", name);
+        return -1;
+    }
+    media->data = map;
+    media->size = st.st_size;
+    media->read_only = read_only && shared;
+    return 0;
+}
+
+void disk_unmap(disk_media_t *media) {
+    if (media->data) munmap(media->data, media->size);
+    media->data = NULL;
+}
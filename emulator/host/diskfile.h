@@ -0,0 +1,16 @@
+#ifndef DISKFILE_H
+#define DISKFILE_H
+
+#include <stdbool.h>
+#include "disk.h"
+
+// Map a disk image file for the disk controllers (disk.h). A shared mapping
+// writes guest changes back to the file through the page cache; a private
+// one keeps them in this mapping only, so several machines can run from
+// one image. Files that cannot be opened for writing are mapped read-only.
+// Errors are reported on stderr and return -1.
+int disk_map(const char *name, bool shared, disk_media_t *media);
+
+void disk_unmap(disk_media_t *media);
+
+#endif
@@ -0,0 +1,488 @@
+// fuzz8080 - coverage-guided fuzzer for 8080 guest programs
+//
+// Boots an Intel HEX image until it first polls the serial port with no
+// input waiting and keeps that machine as a snapshot. Every execution
+// restores the snapshot, feeds one input through the serial receive path and
+// runs until the guest asks for input past the end, or until it halts,
+// leaves the loaded image or runs out of cycles. The core is built with
+// CPU_COVERAGE so its branch helpers report edges; inputs that reach new
+// edges join the corpus, inputs that fail are written out as artifacts.
+//
+// One process fuzzes on one core. Run several with different -s seeds and a
+// shared corpus directory to use more.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include "machine.h"
+#include "hexfile.h"
+
+#define MAP_SIZE 65536
+
+#define DEFAULT_EXEC_CYCLES  1000000ULL
+#define DEFAULT_BOOT_CYCLES  100000000ULL
+#define DEFAULT_MAX_LEN      256
+#define MAX_DICT             256
+#define MAX_CRASH_SITES      64
+
+typedef enum {
+    RUN_OK,      // Guest consumed the input and waits for more
+    RUN_HALT,    // HLT (a failure only with -H)
+    RUN_TIMEOUT, // Cycle budget exhausted
+    RUN_WILD,    // PC left the pages loaded from the image
+} outcome_t;
+
+static const char *const OUTCOME_NAMES[] = { "ok", "halt", "timeout", "wild-pc" };
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} input_t;
+
+// Serial receive feed for the current execution
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    bool idle;   // Guest polled with nothing left to read
+} feed_t;
+
+static machine_t machine;
+static machine_t snapshot;
+static feed_t feed;
+static uint8_t image_pages[MEM_PAGES];
+static bool allow_wild;
+
+// Hit counts for the current execution, and the hit-count buckets seen by
+// any execution so far
+static uint8_t coverage[MAP_SIZE];
+static uint8_t seen[MAP_SIZE];
+static unsigned edges;
+
+static input_t *corpus;
+static size_t corpus_len, corpus_cap;
+
+static input_t dict[MAX_DICT];
+static int dict_len;
+
+static struct {
+    outcome_t outcome;
+    uint16_t pc;
+} crash_sites[MAX_CRASH_SITES];
+static int crash_count;
+
+static uint64_t rng_state = 0x853C49E6748FEA9BULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_below(size_t n) {
+    return n ? rng() % n : 0;
+}
+
+void cpu_cover(machine_t *m, uint16_t from, uint16_t to) {
+    (void)m;
+    uint8_t *c = &coverage[(uint16_t)(from * 0x9E37u) ^ to];
+    *c += *c != 0xFF;
+}
+
+static int feed_getc(void *ctx) {
+    feed_t *f = ctx;
+    if (f->pos >= f->len) {
+        f->idle = true;
+        return -1;
+    }
+    return f->data[f->pos++];
+}
+
+static void discard_putc(void *ctx, uint8_t ch) {
+    (void)ctx;
+    (void)ch;
+}
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Run until the guest idles on serial input, halts, leaves the image or
+// exceeds `budget` cycles
+static outcome_t run_machine(uint64_t budget) {
+    cpu_8080_t *cpu = &machine.cpu;
+    uint64_t end = cpu->cycles + budget;
+
+    while (!feed.idle) {
+        if (cpu->halted) return RUN_HALT;
+        if (cpu->cycles >= end) return RUN_TIMEOUT;
+        if (!allow_wild && !image_pages[cpu->pc >> MEM_PAGE_SHIFT]) return RUN_WILD;
+        cpu_step(&machine);
+        if (cpu->cycles >= machine.sched.next) sched_dispatch(&machine, cpu->cycles);
+    }
+    return RUN_OK;
+}
+
+static outcome_t execute(const uint8_t *data, size_t len, uint64_t budget) {
+    machine = snapshot;
+    feed = (feed_t){ .data = data, .len = len };
+    memset(coverage, 0, sizeof(coverage));
+    return run_machine(budget);
+}
+
+// Hit counts are compared in power-of-two buckets, so a loop running more
+// often counts as new behaviour but not every extra iteration does
+static uint8_t bucket(uint8_t count) {
+    if (count <= 3) return count == 3 ? 0x04 : count;
+    if (count <= 7) return 0x08;
+    if (count <= 15) return 0x10;
+    if (count <= 31) return 0x20;
+    if (count <= 127) return 0x40;
+    return 0x80;
+}
+
+// Merge this execution's coverage; true if anything new was seen
+static bool merge_coverage(void) {
+    bool fresh = false;
+    const uint64_t *words = (const uint64_t *)coverage;
+    for (size_t w = 0; w < MAP_SIZE / 8; w++) {
+        if (!words[w]) continue;
+        for (size_t i = w * 8; i < w * 8 + 8; i++) {
+            if (!coverage[i]) continue;
+            uint8_t b = bucket(coverage[i]);
+            if (b & ~seen[i]) {
+                if (!seen[i]) edges++;
+                seen[i] |= b;
+                fresh = true;
+            }
+        }
+    }
+    return fresh;
+}
+
+static uint64_t fnv1a(const uint8_t *data, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static void write_input(const char *dir, const char *prefix,
+                        const uint8_t *data, size_t len) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s%016llx", dir, *dir ? "/" : "", prefix,
+             (unsigned long long)fnv1a(data, len));
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(data, 1, len, f) != len) {
+        fprintf(stderr, "Error: cannot write %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+}
+
+static void corpus_add(const uint8_t *data, size_t len) {
+    if (corpus_len == corpus_cap) {
+        corpus_cap = corpus_cap ? corpus_cap * 2 : 64;
+        corpus = realloc(corpus, corpus_cap * sizeof(*corpus));
+    }
+    uint8_t *copy = malloc(len ? len : 1);
+    if (!corpus || !copy) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    memcpy(copy, data, len);
+    corpus[corpus_len++] = (input_t){ copy, len };
+}
+
+// Failures are deduplicated by kind and the PC where they were detected
+static bool crash_is_new(outcome_t outcome, uint16_t pc) {
+    for (int i = 0; i < crash_count; i++) {
+        if (crash_sites[i].outcome == outcome && crash_sites[i].pc == pc) return false;
+    }
+    if (crash_count < MAX_CRASH_SITES) {
+        crash_sites[crash_count].outcome = outcome;
+        crash_sites[crash_count].pc = pc;
+        crash_count++;
+    }
+    return true;
+}
+
+static int read_input(const char *path, input_t *in) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    size_t cap = 256;
+    in->data = malloc(cap);
+    in->len = 0;
+    size_t n;
+    while ((n = fread(in->data + in->len, 1, cap - in->len, f)) > 0) {
+        in->len += n;
+        if (in->len == cap) in->data = realloc(in->data, cap *= 2);
+    }
+    fclose(f);
+    return 0;
+}
+
+// Dictionary: one token per line, as in the guest's command syntax
+static int load_dict(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    while (dict_len < MAX_DICT && fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        if (!len) continue;
+        dict[dict_len].data = malloc(len);
+        memcpy(dict[dict_len].data, line, len);
+        dict[dict_len].len = len;
+        dict_len++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static size_t insert_bytes(uint8_t *buf, size_t len, size_t max_len,
+                           size_t at, const uint8_t *src, size_t n) {
+    if (len + n > max_len) n = max_len - len;
+    memmove(buf + at + n, buf + at, len - at);
+    memcpy(buf + at, src, n);
+    return len + n;
+}
+
+// Apply a small stack of random edits. buf holds max_len bytes.
+static size_t mutate(uint8_t *buf, size_t len, size_t max_len) {
+    static const uint8_t INTERESTING[] = {
+        0x00, 0x01, 0x7F, 0x80, 0xFF, '\r', '\n', ' ', '0', '9', 'A', 'F', 'Z', 'a', 'z', ':',
+    };
+    int ops = 1 << rng_below(4);
+
+    for (int i = 0; i < ops; i++) {
+        size_t at = rng_below(len);
+        switch (rng_below(9)) {
+        case 0:  // Flip a bit
+            if (len) buf[at] ^= 1 << rng_below(8);
+            break;
+        case 1:  // Random byte
+            if (len) buf[at] = rng();
+            break;
+        case 2:  // Interesting byte
+            if (len) buf[at] = INTERESTING[rng_below(sizeof(INTERESTING))];
+            break;
+        case 3:  // Small add/subtract
+            if (len) buf[at] += (int)rng_below(33) - 16;
+            break;
+        case 4: {  // Insert random bytes
+            uint8_t tmp[8];
+            size_t n = 1 + rng_below(sizeof(tmp));
+            for (size_t j = 0; j < n; j++) tmp[j] = rng();
+            len = insert_bytes(buf, len, max_len, rng_below(len + 1), tmp, n);
+            break;
+        }
+        case 5: {  // Delete a range
+            if (!len) break;
+            size_t n = 1 + rng_below(len - at < 16 ? len - at : 16);
+            memmove(buf + at, buf + at + n, len - at - n);
+            len -= n;
+            break;
+        }
+        case 6: {  // Duplicate a chunk
+            if (!len) break;
+            uint8_t tmp[32];
+            size_t n = 1 + rng_below(len - at < sizeof(tmp) ? len - at : sizeof(tmp));
+            memcpy(tmp, buf + at, n);
+            len = insert_bytes(buf, len, max_len, rng_below(len + 1), tmp, n);
+            break;
+        }
+        case 7: {  // Splice in part of another corpus entry
+            const input_t *other = &corpus[rng_below(corpus_len)];
+            if (!other->len) break;
+            size_t from = rng_below(other->len);
+            size_t n = 1 + rng_below(other->len - from);
+            len = insert_bytes(buf, len, max_len, rng_below(len + 1), other->data + from, n);
+            break;
+        }
+        case 8:  // Insert a dictionary token
+            if (dict_len) {
+                const input_t *tok = &dict[rng_below(dict_len)];
+                len = insert_bytes(buf, len, max_len, rng_below(len + 1), tok->data, tok->len);
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static void load_corpus_dir(const char *dir, uint64_t budget) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Error: cannot open corpus directory %s\n", dir);
+        exit(1);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (ent->d_name[0] == '.') continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        input_t in;
+        if (read_input(path, &in) < 0) continue;
+        execute(in.data, in.len, budget);
+        if (merge_coverage()) corpus_add(in.data, in.len);
+        free(in.data);
+    }
+    closedir(d);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] program.hex [corpus_dir]\n"
+            "       %s -R [options] program.hex input...\n"
+            "  -r N     stop after N executions (default: run until -T or forever)\n"
+            "  -T SEC   stop after SEC seconds\n"
+            "  -c N     cycle budget per execution (default %llu)\n"
+            "  -B N     cycle budget for booting to the first serial poll (default %llu)\n"
+            "  -m N     maximum input length (default %d)\n"
+            "  -s N     random seed\n"
+            "  -a DIR   directory for crash/timeout artifacts (default .)\n"
+            "  -x FILE  dictionary, one token per line\n"
+            "  -H       treat HLT as a failure\n"
+            "  -p       allow PC outside the pages loaded from the image\n"
+            "  -R       replay the given inputs and report their outcome\n",
+            prog, prog, DEFAULT_EXEC_CYCLES, DEFAULT_BOOT_CYCLES, DEFAULT_MAX_LEN);
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_runs = 0;
+    double max_time = 0;
+    uint64_t budget = DEFAULT_EXEC_CYCLES;
+    uint64_t boot_budget = DEFAULT_BOOT_CYCLES;
+    size_t max_len = DEFAULT_MAX_LEN;
+    const char *artifact_dir = "";
+    bool halt_fails = false;
+    bool replay = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:T:c:B:m:s:a:x:HpRh")) != -1) {
+        switch (opt) {
+        case 'r': max_runs = strtoull(optarg, NULL, 0); break;
+        case 'T': max_time = strtod(optarg, NULL); break;
+        case 'c': budget = strtoull(optarg, NULL, 0); break;
+        case 'B': boot_budget = strtoull(optarg, NULL, 0); break;
+        case 'm': max_len = strtoul(optarg, NULL, 0); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        case 'a': artifact_dir = optarg; break;
+        case 'x':
+            if (load_dict(optarg) < 0) {
+                fprintf(stderr, "Error: cannot read %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H': halt_fails = true; break;
+        case 'p': allow_wild = true; break;
+        case 'R': replay = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || max_len < 1 || (!replay && argc - optind > 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    uint16_t entry;
+    machine_init(&machine, feed_getc, discard_putc, &feed);
+    if (hex_load(argv[optind], &machine, &entry, image_pages) < 0) return 1;
+    machine.cpu.pc = entry;
+
+    // Boot with an empty feed: the first poll that finds nothing waiting is
+    // where every execution starts
+    outcome_t boot = run_machine(boot_budget);
+    if (boot != RUN_OK) {
+        fprintf(stderr, "Error: guest did not reach a serial poll while booting (%s at %04X)\n",
+                OUTCOME_NAMES[boot], machine.cpu.pc);
+        return 1;
+    }
+    snapshot = machine;
+    fprintf(stderr, "Booted to %04X after %llu cycles\n",
+            machine.cpu.pc, (unsigned long long)machine.cpu.cycles);
+
+    if (replay) {
+        int failures = 0;
+        for (int i = optind + 1; i < argc; i++) {
+            input_t in;
+            if (read_input(argv[i], &in) < 0) {
+                fprintf(stderr, "Error: cannot read %s\n", argv[i]);
+                return 1;
+            }
+            outcome_t outcome = execute(in.data, in.len, budget);
+            merge_coverage();
+            printf("%s: %s at %04X after %llu cycles, %zu/%zu bytes read\n", argv[i],
+                   OUTCOME_NAMES[outcome], machine.cpu.pc,
+                   (unsigned long long)(machine.cpu.cycles - snapshot.cpu.cycles),
+                   feed.pos, in.len);
+            if (outcome == RUN_TIMEOUT || outcome == RUN_WILD || (halt_fails && outcome == RUN_HALT)) {
+                failures++;
+            }
+            free(in.data);
+        }
+        printf("%u edges covered\n", edges);
+        return failures ? 1 : 0;
+    }
+
+    const char *corpus_dir = optind + 1 < argc ? argv[optind + 1] : NULL;
+    if (corpus_dir) load_corpus_dir(corpus_dir, budget);
+    if (!corpus_len) {
+        execute(NULL, 0, budget);
+        merge_coverage();
+        corpus_add(NULL, 0);
+    }
+    fprintf(stderr, "#0\tINITED cov: %u corp: %zu\n", edges, corpus_len);
+
+    uint8_t *buf = malloc(max_len);
+    double start = now_seconds();
+    uint64_t runs = 0;
+    uint64_t next_report = 1024;
+
+    while (!max_runs || runs < max_runs) {
+        const input_t *parent = &corpus[rng_below(corpus_len)];
+        size_t len = parent->len < max_len ? parent->len : max_len;
+        memcpy(buf, parent->data, len);
+        len = mutate(buf, len, max_len);
+
+        outcome_t outcome = execute(buf, len, budget);
+        runs++;
+        bool fresh = merge_coverage();
+
+        if (outcome == RUN_TIMEOUT || outcome == RUN_WILD || (halt_fails && outcome == RUN_HALT)) {
+            if (crash_is_new(outcome, machine.cpu.pc)) {
+                write_input(artifact_dir, outcome == RUN_TIMEOUT ? "timeout-" : "crash-", buf, len);
+                fprintf(stderr, "#%llu\t%s at %04X (%zu bytes)\n", (unsigned long long)runs,
+                        OUTCOME_NAMES[outcome], machine.cpu.pc, len);
+            }
+        } else if (fresh) {
+            corpus_add(buf, len);
+            if (corpus_dir) write_input(corpus_dir, "", buf, len);
+            fprintf(stderr, "#%llu\tNEW    cov: %u corp: %zu len: %zu\n",
+                    (unsigned long long)runs, edges, corpus_len, len);
+        }
+
+        if (runs == next_report) {
+            double secs = now_seconds() - start;
+            fprintf(stderr, "#%llu\tpulse  cov: %u corp: %zu exec/s: %.0f\n",
+                    (unsigned long long)runs, edges, corpus_len, runs / secs);
+            next_report *= 2;
+        }
+        if (max_time > 0 && (runs & 1023) == 0 && now_seconds() - start >= max_time) break;
+    }
+
+    double secs = now_seconds() - start;
+    fprintf(stderr, "Done %llu runs in %.1f s (%.0f exec/s), cov: %u corp: %zu failures: %d\n",
+            (unsigned long long)runs, secs, secs > 0 ? runs / secs : 0.0, edges, corpus_len,
+            crash_count);
+    free(buf);
+    return crash_count ? 1 : 0;
+}
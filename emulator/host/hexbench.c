@@ -0,0 +1,221 @@
+// hexbench - Intel HEX decoding benchmark
+//
+// Parses a HEX file (or a generated one of the given size, with extended
+// linear address records past 64K) several times with ihex_parse(), and
+// decodes the record payloads with the vector decoder, the table decoder
+// and a per-digit branching loop like the one ihex.c replaced. The
+// decoders' output is compared.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include "ihex.h"
+
+#define PASSES 5
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} text_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void append(text_t *t, const char *s, size_t len) {
+    if (t->len + len > t->cap) {
+        t->cap = (t->len + len) * 2;
+        t->data = realloc(t->data, t->cap);
+        if (!t->data) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+}
+
+static void add_record(text_t *t, uint8_t type, uint16_t addr, const uint8_t *data, int len) {
+    static const char DIGITS[] = "0123456789ABCDEF";
+    char line[IHEX_LINE_MAX + 2];
+    uint8_t head[4] = { len, addr >> 8, addr & 0xFF, type };
+    uint8_t sum = 0;
+    int n = 0;
+    line[n++] = ':';
+    for (int i = 0; i < 4 + len; i++) {
+        uint8_t b = i < 4 ? head[i] : data[i - 4];
+        sum += b;
+        line[n++] = DIGITS[b >> 4];
+        line[n++] = DIGITS[b & 15];
+    }
+    sum = -sum;
+    line[n++] = DIGITS[sum >> 4];
+    line[n++] = DIGITS[sum & 15];
+    line[n++] = '\n';
+    append(t, line, n);
+}
+
+static void generate(text_t *t, size_t size, int record_len) {
+    uint8_t data[255];
+    uint32_t addr = 0;
+    srand(8080);
+    while (t->len < size) {
+        if ((addr & 0xFFFF) == 0) {
+            uint8_t base[2] = { addr >> 24, addr >> 16 };
+            add_record(t, IHEX_LINEAR_BASE, 0, base, 2);
+        }
+        int len = record_len;
+        if ((addr & 0xFFFF) + len > 0x10000) len = 0x10000 - (addr & 0xFFFF);
+        for (int i = 0; i < len; i++) data[i] = rand();
+        add_record(t, IHEX_DATA, addr & 0xFFFF, data, len);
+        addr += len;
+    }
+    add_record(t, IHEX_EOF, 0, NULL, 0);
+}
+
+static int read_file(const char *name, text_t *t) {
+    FILE *f = fopen(name, "rb");
+    if (!f) return -1;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) append(t, buf, n);
+    fclose(f);
+    return 0;
+}
+
+// What the loaders did before: toupper and a branch per digit
+static int decode_branchy(const char *hex, size_t n, uint8_t *out) {
+    for (size_t i = 0; i < n * 2; i++) {
+        int c = toupper((unsigned char)hex[i]), v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+        else return -1;
+        if (i & 1) out[i / 2] |= v;
+        else out[i / 2] = v << 4;
+    }
+    return 0;
+}
+
+typedef struct {
+    size_t offset;  // Of the payload digits
+    uint16_t len;   // Data and checksum bytes
+} payload_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [file.hex]\n"
+            "  -s MB   size of the generated file (default 8)\n"
+            "  -r N    data bytes per generated record (default 32)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    double megabytes = 8;
+    int record_len = 32;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:h")) != -1) {
+        switch (opt) {
+        case 's': megabytes = strtod(optarg, NULL); break;
+        case 'r': record_len = strtol(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 1 < argc || megabytes <= 0 || record_len < 1 || record_len > 255) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    text_t text = { 0 };
+    if (optind < argc) {
+        if (read_file(argv[optind], &text) < 0) {
+            fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        generate(&text, megabytes * 1024 * 1024, record_len);
+    }
+
+    // Parse everything PASSES times; the first pass also notes where each
+    // payload is, so the decoders below are timed on digits alone
+    size_t count = 0, cap = 0, data_bytes = 0;
+    payload_t *payloads = NULL;
+    ihex_record_t rec;
+    double parse_time = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        double start = now_seconds();
+        for (size_t pos = 0; pos < text.len;) {
+            const char *line = text.data + pos;
+            const char *nl = memchr(line, '\n', text.len - pos);
+            size_t len = nl ? (size_t)(nl - line) : text.len - pos;
+            pos += len + 1;
+            if (len && line[len - 1] == '\r') len--;
+            if (!len) continue;
+            int err = ihex_parse(line, len, &rec);
+            if (err != IHEX_OK) {
+                fprintf(stderr, "Error: %s at offset %zu\n", ihex_error(err), (size_t)(line - text.data));
+                return 1;
+            }
+            if (pass == 0) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 4096;
+                    payloads = realloc(payloads, cap * sizeof(*payloads));
+                    if (!payloads) {
+                        fprintf(stderr, "Error: out of memory\n");
+                        return 1;
+                    }
+                }
+                payloads[count].offset = line + 9 - text.data;
+                payloads[count++].len = rec.len + 1;
+                data_bytes += rec.len + 1;
+            }
+        }
+        parse_time += now_seconds() - start;
+    }
+
+    static const struct {
+        const char *name;
+        int (*decode)(const char *, size_t, uint8_t *);
+    } DECODERS[] = {
+        { "branching", decode_branchy },
+        { "table", ihex_decode_scalar },
+        { "vector", ihex_decode },
+    };
+    enum { DECODER_COUNT = sizeof(DECODERS) / sizeof(DECODERS[0]) };
+    uint8_t *out[DECODER_COUNT];
+    double seconds[DECODER_COUNT] = { 0 };
+    for (int d = 0; d < DECODER_COUNT; d++) {
+        out[d] = malloc(data_bytes);
+        if (!out[d]) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+        for (int pass = 0; pass < PASSES; pass++) {
+            double start = now_seconds();
+            uint8_t *o = out[d];
+            for (size_t i = 0; i < count; i++) {
+                DECODERS[d].decode(text.data + payloads[i].offset, payloads[i].len, o);
+                o += payloads[i].len;
+            }
+            seconds[d] += now_seconds() - start;
+        }
+    }
+
+    double mb = text.len / (1024.0 * 1024.0);
+    printf("%.1f MB, %zu records, %zu payload bytes\n", mb, count, data_bytes);
+    printf("  %-10s %8.1f MB/s\n", "parse", mb * PASSES / parse_time);
+    for (int d = 0; d < DECODER_COUNT; d++) {
+        double digits_mb = data_bytes * 2 / (1024.0 * 1024.0);
+        int same = memcmp(out[d], out[0], data_bytes) == 0;
+        printf("  %-10s %8.1f MB/s of digits%s\n", DECODERS[d].name, digits_mb * PASSES / seconds[d],
+               same ? "" : "  MISMATCH");
+        if (!same) return 1;
+    }
+    return 0;
+}
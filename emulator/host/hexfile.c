@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hexfile.h"
+#include "cpm.h"
+#include "asm8080.h"
+#include "ihex.h"
+
+// Read a whole file into a malloc'd buffer
+static int read_file(const char *name, char **text, size_t *len) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        return -1;
+    }
+    char *buf = NULL;
+    size_t used = 0, cap = 0, n;
+    do {
+        if (used == cap) {
+            cap = cap ? cap * 2 : 65536;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                fprintf(stderr, "Error: out of memory\n");
+                free(buf);
+                fclose(f);
+                return -1;
+            }
+            buf = grown;
+        }
+        n = fread(buf + used, 1, cap - used, f);
+        used += n;
+    } while (n);
+    fclose(f);
+    *text = buf;
+    *len = used;
+    return 0;
+}
+
+// Assembly source goes straight to memory through the assembler library
+static int asm_load(const char *name, machine_t *m, uint16_t *entry, uint8_t *pages) {
+    char *text;
+    size_t len;
+    if (read_file(name, &text, &len) < 0) return -1;
+
+    image_t img = { 0 };
+    int errors = asm8080_assemble(text, len, &img);
+    free(text);
+    if (errors) {
+        fprintf(stderr, "%s: %d error(s)\n", name, errors);
+        image_free(&img);
+        return -1;
+    }
+    *entry = img.segment_count ? img.segments[0].addr : 0;
+    for (size_t i = 0; i < img.segment_count; i++) {
+        const image_segment_t *seg = &img.segments[i];
+        for (size_t j = 0; j < seg->len; j++) {
+            mem_write(m, seg->addr + j, seg->data[j]);
+            if (pages) pages[(uint16_t)(seg->addr + j) >> MEM_PAGE_SHIFT] = 1;
+        }
+    }
+    image_free(&img);
+    return 0;
+}
+
+// CP/M programs are raw bytes at 0100h, up to the BDOS
+static int com_load(const char *name, machine_t *m, uint16_t *entry, uint8_t *pages) {
+    char *data;
+    size_t len;
+    if (read_file(name, &data, &len) < 0) return -1;
+    if (len > CPM_BDOS_BASE - CPM_TPA) {
+        fprintf(stderr, "%s: too large for the CP/M TPA\n", name);
+        free(data);
+        return -1;
+    }
+    mem_load(m, CPM_TPA, (const uint8_t *)data, len);
+    free(data);
+    if (pages) {
+        for (size_t a = CPM_TPA; a < CPM_TPA + len; a += MEM_PAGE_SIZE) pages[a >> MEM_PAGE_SHIFT] = 1;
+    }
+    *entry = CPM_TPA;
+    return 0;
+}
+
+// Compressed images are mapped, not read, and stay mapped for the life of
+// the process: pages are only decompressed as the program touches them
+static int image_load(const char *name, machine_t *m, uint16_t *entry, uint8_t *pages) {
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || mem_attach_image(m, map, st.st_size, entry) < 0) {
+        fprintf(stderr, "%s: not a valid compressed image\n", name);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        return -1;
+    }
+    if (pages) {
+        for (int page = 0; page < MEM_PAGES; page++) {
+            if (m->mem.page_flags[page] & MEM_PAGE_LAZY) pages[page] = 1;
+        }
+    }
+    return 0;
+}
+
+int hex_load(const char *name, machine_t *m, uint16_t *entry, uint8_t *pages) {
+    size_t name_len = strlen(name);
+    if (name_len > 4 && strcasecmp(name + name_len - 4, ".asm") == 0) {
+        return asm_load(name, m, entry, pages);
+    }
+    if (name_len > 4 && strcasecmp(name + name_len - 4, ".l8z") == 0) {
+        return image_load(name, m, entry, pages);
+    }
+    if (name_len > 4 && strcasecmp(name + name_len - 4, ".com") == 0) {
+        return com_load(name, m, entry, pages);
+    }
+
+    char *text;
+    size_t len;
+    if (read_file(name, &text, &len) < 0) return -1;
+
+    ihex_record_t rec;
+    ihex_state_t state = { 0 };
+    bool first = true;
+    int line_num = 0, err = IHEX_OK;
+    *entry = 0;
+
+    for (size_t pos = 0; pos < len && !state.done;) {
+        const char *line = text + pos;
+        const char *nl = memchr(line, '\n', len - pos);
+        size_t line_len = nl ? (size_t)(nl - line) : len - pos;
+        pos += line_len + 1;
+        line_num++;
+        while (line_len && (line[line_len - 1] == '\r' || line[line_len - 1] == ' ')) line_len--;
+        if (!line_len) continue;
+
+        err = ihex_parse(line, line_len, &rec);
+        if (err != IHEX_OK) break;
+        if (rec.type != IHEX_DATA) {
+            ihex_apply(&state, &rec);
+            continue;
+        }
+
+        uint32_t addr = state.base + rec.addr;
+        if (addr + rec.len > MEMORY_SIZE) {
+            fprintf(stderr, "%s:%d: address %05Xh is beyond 64K\n", name, line_num, addr);
+            free(text);
+            return -1;
+        }
+        if (first) {
+            *entry = addr;
+            first = false;
+        }
+        for (int i = 0; i < rec.len; i++) {
+            mem_write(m, addr + i, rec.data[i]);
+            if (pages) pages[(addr + i) >> MEM_PAGE_SHIFT] = 1;
+        }
+    }
+    free(text);
+
+    if (err != IHEX_OK) {
+        fprintf(stderr, "%s:%d: %s\n", name, line_num, ihex_error(err));
+        return -1;
+    }
+    if (state.has_start) {
+        if (state.start >= MEMORY_SIZE) {
+            fprintf(stderr, "%s: start address %Xh is beyond 64K\n", name, state.start);
+            return -1;
+        }
+        *entry = state.start;
+    }
+    return 0;
+}
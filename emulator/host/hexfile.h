@@ -0,0 +1,18 @@
+#ifndef HEXFILE_H
+#define HEXFILE_H
+
+#include <stdint.h>
+#include "machine.h"
+
+// Load an Intel HEX file into the machine's memory (records parsed by
+// ihex.h, extended address records included, as long as everything lands
+// below 64K). The entry point is the start address record's, or else the
+// address of the first data record. If `pages` is non-NULL, entries for
+// every memory page the file writes to are set to 1. Checksums are
+// verified; errors are reported on stderr and return -1. A name ending in
+// .asm is assembled in-process instead (asm8080.h), one ending in .l8z is a
+// compressed image attached with mem_attach_image() (memory.h) and a .com
+// file is a CP/M program, loaded at 0100h.
+int hex_load(const char *name, machine_t *m, uint16_t *entry, uint8_t *pages);
+
+#endif
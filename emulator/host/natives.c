@@ -0,0 +1,68 @@
+#include <strings.h>
+#include "natives.h"
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x40
+
+static void mul16(machine_t *m, void *ctx) {
+    (void)ctx;
+    cpu_8080_t *cpu = &m->cpu;
+    cpu->hl.word = cpu->bc.word * cpu->de.word;
+}
+
+static void div16(machine_t *m, void *ctx) {
+    (void)ctx;
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t n = cpu->hl.word, d = cpu->de.word;
+    cpu->hl.word = d ? n / d : 0xFFFF;
+    cpu->de.word = d ? n % d : n;
+}
+
+static void memcpy8080(machine_t *m, void *ctx) {
+    (void)ctx;
+    cpu_8080_t *cpu = &m->cpu;
+    mem_dma_mark(m, cpu->de.word, cpu->bc.word);
+    for (; cpu->bc.word; cpu->bc.word--) {
+        mem_write(m, cpu->de.word++, mem_read(m, cpu->hl.word++));
+        cpu->cycles += NATIVE_BYTE_CYCLES;
+    }
+}
+
+static void fill(machine_t *m, void *ctx) {
+    (void)ctx;
+    cpu_8080_t *cpu = &m->cpu;
+    mem_dma_mark(m, cpu->hl.word, cpu->bc.word);
+    for (; cpu->bc.word; cpu->bc.word--) {
+        mem_write(m, cpu->hl.word++, cpu->a);
+        cpu->cycles += NATIVE_BYTE_CYCLES;
+    }
+}
+
+static void strcmp8080(machine_t *m, void *ctx) {
+    (void)ctx;
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t a = cpu->hl.word, b = cpu->de.word;
+    uint8_t x, y;
+    do {
+        x = mem_read(m, a++);
+        y = mem_read(m, b++);
+        cpu->cycles += NATIVE_BYTE_CYCLES;
+    } while (x == y && x);
+    cpu->f.z = x == y;
+    cpu->f.c = x < y;
+}
+
+static const native_t NATIVES[] = {
+    { "mul16", mul16, 600, HOOK_HL, 0 },
+    { "div16", div16, 900, HOOK_HL | HOOK_DE, 0 },
+    { "memcpy", memcpy8080, 30, HOOK_BC | HOOK_DE | HOOK_HL, 0 },
+    { "fill", fill, 30, HOOK_BC | HOOK_HL, 0 },
+    { "strcmp", strcmp8080, 30, 0, FLAG_Z | FLAG_C },
+};
+
+const native_t *native_find(const char *name) {
+    for (size_t i = 0; i < sizeof(NATIVES) / sizeof(NATIVES[0]); i++) {
+        if (strcasecmp(NATIVES[i].name, name) == 0) return &NATIVES[i];
+    }
+    return NULL;
+}
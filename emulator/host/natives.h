@@ -0,0 +1,34 @@
+#ifndef NATIVES_H
+#define NATIVES_H
+
+#include "machine.h"
+
+// Native versions of common guest subroutines, for hook_add(). Each has a
+// fixed register convention; a guest routine can be replaced by one only if
+// it follows it, which verify mode (hook.h) checks.
+//
+//   mul16   HL = BC * DE (low 16 bits)
+//   div16   HL = HL / DE, DE = remainder (DE = 0: HL = FFFFh, DE = HL)
+//   memcpy  copy BC bytes from HL up to DE; HL and DE end past the
+//           blocks, BC = 0
+//   fill    store A in BC bytes from HL; HL ends past the block, BC = 0
+//   strcmp  compare the NUL-terminated strings at HL and DE: Z if equal,
+//           C if HL's sorts first (bytes unsigned)
+//
+// The block routines charge NATIVE_BYTE_CYCLES per byte on top of the
+// hook's declared cycles.
+
+#define NATIVE_BYTE_CYCLES 8
+
+typedef struct {
+    const char *name;
+    hook_fn fn;
+    uint32_t cycles;  // Default declared cost
+    uint8_t regs;     // Results, as for hook_add
+    uint8_t flags;
+} native_t;
+
+// The native with this name (case-insensitive), or NULL
+const native_t *native_find(const char *name);
+
+#endif
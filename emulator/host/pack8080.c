@@ -0,0 +1,170 @@
+// pack8080 - compressed memory image builder
+//
+// Loads an Intel HEX image (or assembles a .asm source) and writes it as a
+// .l8z image (src/memory.h): the span of pages it touches, gaps zero-filled,
+// cut into chunks that are LZ4-compressed one by one so the emulator can
+// decompress each on first access. Chunks that do not compress are stored
+// as they are. With -v the source and the packed image are run side by
+// side, the packed one decompressing on demand as it would in run8080,
+// and must end with the same output, registers and memory.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "machine.h"
+#include "hexfile.h"
+#include "lz4.h"
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+// Serial output of a -v run, truncated at sizeof(data)
+typedef struct {
+    uint8_t data[4096];
+    size_t len;
+} capture_t;
+
+static int no_input(void *ctx) {
+    (void)ctx;
+    return -1;
+}
+
+static void capture(void *ctx, uint8_t ch) {
+    capture_t *c = ctx;
+    if (c->len < sizeof(c->data)) c->data[c->len++] = ch;
+}
+
+static void run_for(machine_t *m, uint16_t entry, uint64_t cycles, capture_t *out) {
+    io_init(m, no_input, capture, out);
+    sched_init(&m->sched);
+    cpu_init(&m->cpu);
+    m->cpu.pc = entry;
+    machine_run(m, cycles);
+}
+
+// Run the source and the packed image for `cycles` and compare them
+static int verify(const machine_t *source, uint16_t entry, const uint8_t *packed, size_t len, uint64_t cycles) {
+    static machine_t a, b;
+    static capture_t out_a, out_b;
+    uint16_t packed_entry;
+    a = *source;
+    mem_init(&b);
+    if (mem_attach_image(&b, packed, len, &packed_entry) < 0 || packed_entry != entry) {
+        fprintf(stderr, "Error: packed image does not load\n");
+        return -1;
+    }
+    // With -r the image's pages are ROM in both
+    for (int page = 0; page < MEM_PAGES; page++) a.mem.page_flags[page] |= b.mem.page_flags[page] & MEM_PAGE_ROM;
+    run_for(&a, entry, cycles, &out_a);
+    run_for(&b, packed_entry, cycles, &out_b);
+    mem_fault_range(&b, 0, MEMORY_SIZE);
+
+    const cpu_8080_t *x = &a.cpu, *y = &b.cpu;
+    bool same = out_a.len == out_b.len && memcmp(out_a.data, out_b.data, out_a.len) == 0 && x->a == y->a &&
+                x->f.byte == y->f.byte && x->bc.word == y->bc.word && x->de.word == y->de.word &&
+                x->hl.word == y->hl.word && x->sp == y->sp && x->pc == y->pc && x->cycles == y->cycles &&
+                x->halted == y->halted && memcmp(a.mem.ram, b.mem.ram, MEMORY_SIZE) == 0;
+    if (!same) {
+        fprintf(stderr, "Error: packed image diverges: PC %04X/%04X, %llu/%llu cycles, %zu/%zu output bytes\n",
+                x->pc, y->pc, (unsigned long long)x->cycles, (unsigned long long)y->cycles, out_a.len, out_b.len);
+        return -1;
+    }
+    printf("verified: %llu cycles, %zu output bytes, same state\n", (unsigned long long)x->cycles, out_a.len);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] in.hex|in.asm out.l8z\n"
+            "  -c BYTES  chunk size, a power of two from 256 to 4096 (default 4096)\n"
+            "  -r        mark the image as ROM\n"
+            "  -v CYCLES run the source and the packed image for CYCLES and compare\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    long chunk_size = 4096;
+    bool rom = false;
+    uint64_t verify_cycles = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:rv:h")) != -1) {
+        switch (opt) {
+        case 'c': chunk_size = strtol(optarg, NULL, 0); break;
+        case 'r': rom = true; break;
+        case 'v': verify_cycles = strtoull(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    int shift = MEM_PAGE_SHIFT;
+    while (shift < 12 && (1L << shift) < chunk_size) shift++;
+    if (argc - optind != 2 || chunk_size != 1L << shift) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static machine_t image;
+    static uint8_t pages[MEM_PAGES];
+    uint16_t entry;
+    mem_init(&image);
+    if (hex_load(argv[optind], &image, &entry, pages) < 0) return 1;
+    mem_fault_range(&image, 0, MEMORY_SIZE);
+
+    int first = 0, last = MEM_PAGES - 1;
+    while (first < MEM_PAGES && !pages[first]) first++;
+    while (last > first && !pages[last]) last--;
+    if (first == MEM_PAGES) {
+        fprintf(stderr, "Error: %s contains no data\n", argv[optind]);
+        return 1;
+    }
+    uint32_t base = first * MEM_PAGE_SIZE, size = (last + 1 - first) * MEM_PAGE_SIZE;
+    uint32_t chunks = (size + chunk_size - 1) >> shift;
+
+    // Worst case: every chunk stored as is
+    size_t index_end = MEM_IMAGE_HEADER_SIZE + (chunks + 1) * 4;
+    uint8_t *out = malloc(index_end + size);
+    if (!out) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    memcpy(out, MEM_IMAGE_MAGIC, 4);
+    put16(out + 4, base);
+    put16(out + 6, entry);
+    put32(out + 8, size);
+    out[12] = shift;
+    out[13] = rom ? MEM_IMAGE_ROM : 0;
+    put16(out + 14, 0);
+
+    size_t pos = index_end;
+    for (uint32_t c = 0; c < chunks; c++) {
+        const uint8_t *src = &image.mem.ram[base + (c << shift)];
+        size_t len = size - (c << shift) < (uint32_t)chunk_size ? size - (c << shift) : (size_t)chunk_size;
+        put32(out + MEM_IMAGE_HEADER_SIZE + c * 4, pos);
+        size_t n = lz4_compress(src, len, out + pos, len - 1);
+        if (!n) {
+            memcpy(out + pos, src, len);
+            n = len;
+        }
+        pos += n;
+    }
+    put32(out + MEM_IMAGE_HEADER_SIZE + chunks * 4, pos);
+
+    FILE *f = fopen(argv[optind + 1], "wb");
+    if (!f || fwrite(out, 1, pos, f) != pos || fclose(f) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", argv[optind + 1]);
+        return 1;
+    }
+    printf("%04X-%04X, %u chunks of %ld bytes: %u -> %zu bytes\n", (unsigned)base, (unsigned)(base + size - 1),
+           (unsigned)chunks, chunk_size, (unsigned)size, pos);
+    if (verify_cycles && verify(&image, entry, out, pos, verify_cycles) < 0) return 1;
+    free(out);
+    return 0;
+}
@@ -0,0 +1,166 @@
+// panelbench - front panel refresh benchmark
+//
+// Runs a program three ways: without a panel, with the panel driver
+// refreshing from scheduler events, and with the old loop that stepped
+// one instruction at a time and refreshed the LEDs and read the switches
+// after each. The panel talks to the recording mock (panelmock.h), so the
+// emulated speed, frame and latch rates and GPIO traffic of each are
+// measured on the host, along with how bright each LED ended up. With -m
+// the mock's clock is emulated time at that speed and the refresh figures
+// are reproducible; otherwise it is the host's clock.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "machine.h"
+#include "panel.h"
+#include "panelmock.h"
+#include "hexfile.h"
+
+enum { MODE_NONE, MODE_EVENTS, MODE_STEP };
+
+static const char *const MODE_NAMES[] = { "no panel", "panel events", "per-instruction" };
+
+typedef struct {
+    double seconds;
+    uint64_t cycles;
+    uint32_t frames;
+    size_t latches;
+    uint64_t gpio_ops;
+    double mock_seconds;
+    uint64_t planes[PANEL_LEVEL_BITS];
+} result_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int no_input(void *ctx) {
+    (void)ctx;
+    return -1;
+}
+
+static void discard(void *ctx, uint8_t ch) {
+    (void)ctx;
+    (void)ch;
+}
+
+// LED levels 0-F, most significant bit of the word first
+static void print_levels(const uint64_t *planes) {
+    static const char *const GROUPS[] = { "status", "", "data", "address", "" };
+    for (int i = 39; i >= 0; i--) {
+        if (i % 8 == 7) printf("%s%-8s", i == 39 ? "  " : " ", GROUPS[(39 - i) / 8]);
+        int level = 0;
+        for (int k = 0; k < PANEL_LEVEL_BITS; k++) level |= ((planes[k] >> i) & 1) << k;
+        putchar("0123456789ABCDEF"[level]);
+    }
+    putchar('\n');
+}
+
+static result_t run(const machine_t *image, uint16_t entry, int mode, uint64_t limit, double mhz, uint32_t switches) {
+    static machine_t m;
+    m = *image;
+    io_init(&m, no_input, discard, NULL);
+    sched_init(&m.sched);
+    cpu_init(&m.cpu);
+    m.cpu.pc = entry;
+    m.io.panel.run = true;
+
+    panel_mock_t mock;
+    panel_mock_init(&mock);
+    mock.switches = switches;
+    if (mhz > 0) {
+        mock.cycles = &m.cpu.cycles;
+        mock.mhz = mhz;
+    }
+    panel_t panel;
+    panel_init(&panel, &mock.gpio);
+    size_t latches0 = mock.log_count;
+    uint64_t ops0 = mock.puts + mock.gets;
+    uint32_t t0 = mock.gpio.time_us(&mock);
+
+    double start = now_seconds();
+    if (mode == MODE_STEP) {
+        while (!m.cpu.halted && m.cpu.cycles < limit) {
+            cpu_step(&m);
+            panel_sample(&m.io.panel, &m);
+            panel_update_leds(&panel, &m.io.panel);
+            panel_read_switches(&panel, &m.io.panel);
+        }
+    } else {
+        if (mode == MODE_EVENTS) panel_attach(&panel, &m);
+        machine_run(&m, limit);
+        if (mode == MODE_EVENTS) panel_detach(&panel, &m);
+    }
+
+    result_t r = {
+        .seconds = now_seconds() - start,
+        .cycles = m.cpu.cycles,
+        .frames = panel.frames,
+        .latches = mode == MODE_NONE ? 0 : mock.log_count - latches0,
+        .gpio_ops = mode == MODE_NONE ? 0 : mock.puts + mock.gets - ops0,
+        .mock_seconds = (uint32_t)(mock.gpio.time_us(&mock) - t0) / 1e6,
+    };
+    memcpy(r.planes, panel.planes, sizeof(r.planes));
+    panel_mock_free(&mock);
+    return r;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] program.hex|.asm|.l8z\n"
+            "  -c N    cycle limit per run (default 100000000)\n"
+            "  -m MHZ  mock clock runs at MHZ emulated (default: host clock)\n"
+            "  -s HEX  switch chain contents, control << 16 | sense\n"
+            "  -l      print the LED levels the panel ended with\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    uint64_t limit = 100000000;
+    double mhz = 0;
+    uint32_t switches = 0;
+    bool show = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:s:lh")) != -1) {
+        switch (opt) {
+        case 'c': limit = strtoull(optarg, NULL, 0); break;
+        case 'm': mhz = strtod(optarg, NULL); break;
+        case 's': switches = strtoul(optarg, NULL, 16); break;
+        case 'l': show = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc || mhz < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static machine_t image;
+    uint16_t entry;
+    mem_init(&image);
+    if (hex_load(argv[optind], &image, &entry, NULL) < 0) return 1;
+    mem_fault_range(&image, 0, MEMORY_SIZE);
+
+    printf("%-16s %12s %9s %8s %10s %12s %12s\n", "mode", "cycles", "MHz", "frames", "frames/s", "latches/s",
+           "GPIO ops/s");
+    result_t events = { 0 };
+    for (int mode = MODE_NONE; mode <= MODE_STEP; mode++) {
+        result_t r = run(&image, entry, mode, limit, mhz, switches);
+        if (mode == MODE_EVENTS) events = r;
+        double clock = r.mock_seconds > 0 ? r.mock_seconds : 1;
+        printf("%-16s %12llu %9.1f %8u %10.1f %12.1f %12.0f\n", MODE_NAMES[mode], (unsigned long long)r.cycles,
+               r.cycles / r.seconds / 1e6, r.frames, r.frames / clock, r.latches / clock, r.gpio_ops / clock);
+    }
+    if (show) {
+        printf("\nLED levels:\n");
+        print_levels(events.planes);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "panelmock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void mock_init_pin(void *ctx, unsigned pin, bool output) {
+    (void)ctx;
+    (void)pin;
+    (void)output;
+}
+
+static uint32_t mock_time_us(void *ctx) {
+    panel_mock_t *mock = ctx;
+    if (mock->cycles) return (uint32_t)(*mock->cycles / mock->mhz);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+}
+
+static void record(panel_mock_t *mock, uint64_t word) {
+    if (mock->log_count == mock->log_cap) {
+        mock->log_cap = mock->log_cap ? mock->log_cap * 2 : 1024;
+        mock->log = realloc(mock->log, mock->log_cap * sizeof(*mock->log));
+        if (!mock->log) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    mock->log[mock->log_count++] = (panel_mock_latch_t){ mock_time_us(mock), word };
+}
+
+// Shift registers act on rising clock edges; the 165 loads while /PL is low
+static void mock_put(void *ctx, unsigned pin, bool value) {
+    panel_mock_t *mock = ctx;
+    mock->puts++;
+    if (pin >= PANEL_MOCK_PINS) return;
+    bool rising = value && !mock->level[pin];
+    mock->level[pin] = value;
+
+    switch (pin) {
+    case PIN_595_CLOCK:
+        if (rising) mock->shift_595 = (mock->shift_595 << 1 | mock->level[PIN_595_DATA]) & 0xFFFFFFFFFFull;
+        break;
+    case PIN_595_LATCH:
+        if (rising) record(mock, mock->shift_595);
+        break;
+    case PIN_165_LOAD:
+        if (!value) mock->shift_165 = mock->switches & 0xFFFFFF;
+        break;
+    case PIN_165_CLOCK:
+        if (rising && mock->level[PIN_165_LOAD]) mock->shift_165 = (mock->shift_165 << 1) & 0xFFFFFF;
+        break;
+    }
+}
+
+static bool mock_get(void *ctx, unsigned pin) {
+    panel_mock_t *mock = ctx;
+    mock->gets++;
+    return pin == PIN_165_DATA && (mock->shift_165 >> 23) & 1;
+}
+
+void panel_mock_init(panel_mock_t *mock) {
+    memset(mock, 0, sizeof(*mock));
+    mock->gpio = (panel_gpio_t){ mock_init_pin, mock_put, mock_get, mock_time_us, mock };
+    mock->mhz = 2;
+}
+
+void panel_mock_free(panel_mock_t *mock) {
+    free(mock->log);
+    mock->log = NULL;
+    mock->log_count = mock->log_cap = 0;
+}
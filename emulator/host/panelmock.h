@@ -0,0 +1,40 @@
+#ifndef PANELMOCK_H
+#define PANELMOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "panel.h"
+
+// A recording GPIO backend for the front panel driver. It models the
+// 74HC595 and 74HC165 chains on the panel pins: every word latched into
+// the LEDs is logged with its time, and the switch chain reads `switches`
+// (control << 16 | sense). The clock is the host's monotonic clock, or,
+// with `cycles` set, emulated time at `mhz`, so runs are reproducible.
+
+#define PANEL_MOCK_PINS 32
+
+typedef struct {
+    uint32_t time_us;
+    uint64_t word;
+} panel_mock_latch_t;
+
+typedef struct {
+    panel_gpio_t gpio;         // Hand this to panel_init
+    uint32_t switches;
+
+    const uint64_t *cycles;    // Emulated clock, NULL for the host's
+    double mhz;
+
+    bool level[PANEL_MOCK_PINS];
+    uint64_t shift_595;
+    uint32_t shift_165;
+
+    panel_mock_latch_t *log;   // Every latch, in order
+    size_t log_count, log_cap;
+    uint64_t puts, gets;
+} panel_mock_t;
+
+void panel_mock_init(panel_mock_t *mock);
+void panel_mock_free(panel_mock_t *mock);
+
+#endif
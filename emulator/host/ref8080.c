@@ -0,0 +1,413 @@
+#include "ref8080.h"
+
+static uint8_t rd(ref8080_t *r, uint16_t addr) {
+    return r->mem[addr];
+}
+
+static void wr(ref8080_t *r, uint16_t addr, uint8_t val) {
+    r->mem[addr] = val;
+    if (r->store_count < 2) r->stores[r->store_count++] = addr;
+}
+
+static uint8_t imm8(ref8080_t *r) {
+    return rd(r, r->pc++);
+}
+
+static uint16_t imm16(ref8080_t *r) {
+    uint8_t lo = imm8(r);
+    uint8_t hi = imm8(r);
+    return (uint16_t)(hi << 8 | lo);
+}
+
+static uint16_t hl(const ref8080_t *r) {
+    return (uint16_t)(r->reg[REF_H] << 8 | r->reg[REF_L]);
+}
+
+static uint8_t get_reg(ref8080_t *r, int n) {
+    return n == REF_M ? rd(r, hl(r)) : r->reg[n];
+}
+
+static void set_reg(ref8080_t *r, int n, uint8_t val) {
+    if (n == REF_M) wr(r, hl(r), val);
+    else r->reg[n] = val;
+}
+
+// Register pairs: 0 BC, 1 DE, 2 HL, 3 SP
+static uint16_t get_pair(const ref8080_t *r, int rp) {
+    if (rp == 3) return r->sp;
+    return (uint16_t)(r->reg[rp * 2] << 8 | r->reg[rp * 2 + 1]);
+}
+
+static void set_pair(ref8080_t *r, int rp, uint16_t val) {
+    if (rp == 3) {
+        r->sp = val;
+    } else {
+        r->reg[rp * 2] = val >> 8;
+        r->reg[rp * 2 + 1] = val & 0xFF;
+    }
+}
+
+static void push16(ref8080_t *r, uint16_t val) {
+    wr(r, --r->sp, val >> 8);
+    wr(r, --r->sp, val & 0xFF);
+}
+
+static uint16_t pop16(ref8080_t *r) {
+    uint8_t lo = rd(r, r->sp++);
+    uint8_t hi = rd(r, r->sp++);
+    return (uint16_t)(hi << 8 | lo);
+}
+
+static void set_szp(ref8080_t *r, uint8_t val) {
+    int ones = 0;
+    for (int i = 0; i < 8; i++) ones += (val >> i) & 1;
+    r->s = val >= 0x80;
+    r->z = val == 0;
+    r->p = ones % 2 == 0;
+}
+
+uint8_t ref_flags(const ref8080_t *r) {
+    return (uint8_t)(r->s << 7 | r->z << 6 | r->ac << 4 | r->p << 2 | 0x02 | r->cy);
+}
+
+void ref_set_flags(ref8080_t *r, uint8_t f) {
+    r->s = (f & 0x80) != 0;
+    r->z = (f & 0x40) != 0;
+    r->ac = (f & 0x10) != 0;
+    r->p = (f & 0x04) != 0;
+    r->cy = (f & 0x01) != 0;
+}
+
+// Condition codes: NZ Z NC C PO PE P M
+static bool condition(const ref8080_t *r, int cc) {
+    bool flag;
+    switch (cc >> 1) {
+    case 0:  flag = r->z; break;
+    case 1:  flag = r->cy; break;
+    case 2:  flag = r->p; break;
+    default: flag = r->s; break;
+    }
+    return (cc & 1) ? flag : !flag;
+}
+
+// ADD ADC SUB SBB ANA XRA ORA CMP
+static void alu(ref8080_t *r, int op, uint8_t val) {
+    int a = r->reg[REF_A];
+    int result;
+
+    switch (op) {
+    case 0:
+    case 1: {
+        int c = op == 1 && r->cy;
+        result = a + val + c;
+        r->ac = (a & 0x0F) + (val & 0x0F) + c > 0x0F;
+        r->cy = result > 0xFF;
+        break;
+    }
+    case 2:
+    case 3:
+    case 7: {
+        int c = op == 3 && r->cy;
+        result = a - val - c;
+        // The 8080 subtracts by adding the complement, so AC is set when
+        // the low nibble did not borrow
+        r->ac = (a & 0x0F) - (val & 0x0F) - c >= 0;
+        r->cy = result < 0;
+        break;
+    }
+    case 4:
+        result = a & val;
+        r->ac = ((a | val) & 0x08) != 0;
+        r->cy = false;
+        break;
+    case 5:
+        result = a ^ val;
+        r->ac = false;
+        r->cy = false;
+        break;
+    default:
+        result = a | val;
+        r->ac = false;
+        r->cy = false;
+        break;
+    }
+
+    set_szp(r, result & 0xFF);
+    if (op != 7) r->reg[REF_A] = result & 0xFF;
+}
+
+// DAA as described in the datasheet: adjust the low nibble, then the high
+// nibble of the already adjusted value
+static void daa(ref8080_t *r) {
+    int a = r->reg[REF_A];
+    bool ac = false;
+    bool cy = r->cy;
+
+    if ((a & 0x0F) > 9 || r->ac) {
+        ac = (a & 0x0F) + 6 > 0x0F;
+        a += 6;
+    }
+    if ((a >> 4) > 9 || cy) {
+        a += 0x60;
+        if (a > 0xFF) cy = true;
+    }
+
+    r->reg[REF_A] = a & 0xFF;
+    r->ac = ac;
+    r->cy = cy;
+    set_szp(r, a & 0xFF);
+}
+
+static void exec_group0(ref8080_t *r, uint8_t op) {
+    int ddd = (op >> 3) & 7;
+    int rp = (op >> 4) & 3;
+
+    switch (op & 7) {
+    case 0:  // NOP and its undocumented aliases
+        r->cycles += 4;
+        break;
+
+    case 1:
+        if (op & 0x08) {  // DAD
+            uint32_t sum = (uint32_t)hl(r) + get_pair(r, rp);
+            set_pair(r, 2, sum & 0xFFFF);
+            r->cy = sum > 0xFFFF;
+        } else {          // LXI
+            set_pair(r, rp, imm16(r));
+        }
+        r->cycles += 10;
+        break;
+
+    case 2:
+        switch (ddd) {
+        case 0: case 2:  // STAX B/D
+            wr(r, get_pair(r, ddd >> 1), r->reg[REF_A]);
+            r->cycles += 7;
+            break;
+        case 1: case 3:  // LDAX B/D
+            r->reg[REF_A] = rd(r, get_pair(r, ddd >> 1));
+            r->cycles += 7;
+            break;
+        case 4: {        // SHLD
+            uint16_t addr = imm16(r);
+            wr(r, addr, r->reg[REF_L]);
+            wr(r, addr + 1, r->reg[REF_H]);
+            r->cycles += 16;
+            break;
+        }
+        case 5: {        // LHLD
+            uint16_t addr = imm16(r);
+            r->reg[REF_L] = rd(r, addr);
+            r->reg[REF_H] = rd(r, addr + 1);
+            r->cycles += 16;
+            break;
+        }
+        case 6:          // STA
+            wr(r, imm16(r), r->reg[REF_A]);
+            r->cycles += 13;
+            break;
+        default:         // LDA
+            r->reg[REF_A] = rd(r, imm16(r));
+            r->cycles += 13;
+            break;
+        }
+        break;
+
+    case 3:  // INX/DCX
+        set_pair(r, rp, get_pair(r, rp) + ((op & 0x08) ? -1 : 1));
+        r->cycles += 5;
+        break;
+
+    case 4: {  // INR
+        uint8_t v = get_reg(r, ddd);
+        r->ac = (v & 0x0F) == 0x0F;
+        set_reg(r, ddd, v + 1);
+        set_szp(r, v + 1);
+        r->cycles += ddd == REF_M ? 10 : 5;
+        break;
+    }
+
+    case 5: {  // DCR
+        uint8_t v = get_reg(r, ddd);
+        r->ac = (v & 0x0F) != 0;
+        set_reg(r, ddd, v - 1);
+        set_szp(r, v - 1);
+        r->cycles += ddd == REF_M ? 10 : 5;
+        break;
+    }
+
+    case 6:  // MVI
+        set_reg(r, ddd, imm8(r));
+        r->cycles += ddd == REF_M ? 10 : 7;
+        break;
+
+    default: {
+        uint8_t a = r->reg[REF_A];
+        switch (ddd) {
+        case 0: r->cy = a >> 7; r->reg[REF_A] = (uint8_t)(a << 1 | a >> 7); break;      // RLC
+        case 1: r->cy = a & 1; r->reg[REF_A] = (uint8_t)(a >> 1 | a << 7); break;       // RRC
+        case 2: r->reg[REF_A] = (uint8_t)(a << 1 | r->cy); r->cy = a >> 7; break;        // RAL
+        case 3: r->reg[REF_A] = (uint8_t)(a >> 1 | r->cy << 7); r->cy = a & 1; break;    // RAR
+        case 4: daa(r); break;
+        case 5: r->reg[REF_A] = ~a; break;   // CMA
+        case 6: r->cy = true; break;         // STC
+        default: r->cy = !r->cy; break;      // CMC
+        }
+        r->cycles += 4;
+        break;
+    }
+    }
+}
+
+static void exec_group3(ref8080_t *r, uint8_t op) {
+    int ddd = (op >> 3) & 7;
+    int rp = (op >> 4) & 3;
+
+    switch (op & 7) {
+    case 0:  // Rcc
+        if (condition(r, ddd)) {
+            r->pc = pop16(r);
+            r->cycles += 11;
+        } else {
+            r->cycles += 5;
+        }
+        break;
+
+    case 1:
+        if (!(op & 0x08)) {  // POP
+            uint16_t val = pop16(r);
+            if (rp == 3) {
+                r->reg[REF_A] = val >> 8;
+                ref_set_flags(r, val & 0xFF);
+            } else {
+                set_pair(r, rp, val);
+            }
+            r->cycles += 10;
+        } else if (rp < 2) {  // RET and its alias
+            r->pc = pop16(r);
+            r->cycles += 10;
+        } else if (rp == 2) {  // PCHL
+            r->pc = hl(r);
+            r->cycles += 5;
+        } else {               // SPHL
+            r->sp = hl(r);
+            r->cycles += 5;
+        }
+        break;
+
+    case 2: {  // Jcc
+        uint16_t addr = imm16(r);
+        if (condition(r, ddd)) r->pc = addr;
+        r->cycles += 10;
+        break;
+    }
+
+    case 3:
+        switch (ddd) {
+        case 0: case 1:  // JMP and its alias
+            r->pc = imm16(r);
+            r->cycles += 10;
+            break;
+        case 2:          // OUT
+            r->out(r->io_ctx, imm8(r), r->reg[REF_A]);
+            r->cycles += 10;
+            break;
+        case 3:          // IN
+            r->reg[REF_A] = r->in(r->io_ctx, imm8(r));
+            r->cycles += 10;
+            break;
+        case 4: {        // XTHL
+            uint8_t lo = rd(r, r->sp);
+            uint8_t hi = rd(r, r->sp + 1);
+            wr(r, r->sp, r->reg[REF_L]);
+            wr(r, r->sp + 1, r->reg[REF_H]);
+            r->reg[REF_L] = lo;
+            r->reg[REF_H] = hi;
+            r->cycles += 18;
+            break;
+        }
+        case 5: {        // XCHG
+            uint16_t de = get_pair(r, 1);
+            set_pair(r, 1, hl(r));
+            set_pair(r, 2, de);
+            r->cycles += 4;
+            break;
+        }
+        case 6:          // DI
+            r->inte = false;
+            r->cycles += 4;
+            break;
+        default:         // EI
+            r->inte = true;
+            r->cycles += 4;
+            break;
+        }
+        break;
+
+    case 4: {  // Ccc
+        uint16_t addr = imm16(r);
+        if (condition(r, ddd)) {
+            push16(r, r->pc);
+            r->pc = addr;
+            r->cycles += 17;
+        } else {
+            r->cycles += 11;
+        }
+        break;
+    }
+
+    case 5:
+        if (op & 0x08) {  // CALL and its aliases
+            uint16_t addr = imm16(r);
+            push16(r, r->pc);
+            r->pc = addr;
+            r->cycles += 17;
+        } else {          // PUSH
+            push16(r, rp == 3 ? (uint16_t)(r->reg[REF_A] << 8 | ref_flags(r)) : get_pair(r, rp));
+            r->cycles += 11;
+        }
+        break;
+
+    case 6:  // ALU immediate
+        alu(r, ddd, imm8(r));
+        r->cycles += 7;
+        break;
+
+    default:  // RST
+        push16(r, r->pc);
+        r->pc = (uint16_t)(ddd * 8);
+        r->cycles += 11;
+        break;
+    }
+}
+
+void ref_step(ref8080_t *r) {
+    r->store_count = 0;
+    if (r->halted) return;
+
+    uint8_t op = imm8(r);
+    int dst = (op >> 3) & 7;
+    int src = op & 7;
+
+    switch (op >> 6) {
+    case 0:
+        exec_group0(r, op);
+        break;
+    case 1:
+        if (op == 0x76) {  // HLT
+            r->halted = true;
+            r->cycles += 7;
+        } else {           // MOV
+            set_reg(r, dst, get_reg(r, src));
+            r->cycles += (dst == REF_M || src == REF_M) ? 7 : 5;
+        }
+        break;
+    case 2:
+        alu(r, dst, get_reg(r, src));
+        r->cycles += src == REF_M ? 7 : 4;
+        break;
+    default:
+        exec_group3(r, op);
+        break;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef REF8080_H
+#define REF8080_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Reference 8080 model for differential testing.
+//
+// Written independently of src/cpu.c, straight from the 8080 datasheet:
+// instructions are decoded from their bit fields, flags and cycle counts
+// are computed per instruction rather than looked up in shared tables. It is
+// slow and simple on purpose, so that it can act as an oracle for the fast
+// interpreter.
+
+// Register indices as encoded in the opcode (6 is memory via HL)
+enum { REF_B, REF_C, REF_D, REF_E, REF_H, REF_L, REF_M, REF_A };
+
+typedef struct {
+    uint8_t reg[8];
+    bool s, z, ac, p, cy;
+    uint16_t sp;
+    uint16_t pc;
+    bool inte;
+    bool halted;
+    uint64_t cycles;
+
+    uint8_t *mem;  // 64 KB
+    uint8_t (*in)(void *ctx, uint8_t port);
+    void (*out)(void *ctx, uint8_t port, uint8_t val);
+    void *io_ctx;
+
+    // Addresses stored to by the last instruction
+    int store_count;
+    uint16_t stores[2];
+} ref8080_t;
+
+// Flags in PUSH PSW layout: S Z 0 AC 0 P 1 C
+uint8_t ref_flags(const ref8080_t *r);
+void ref_set_flags(ref8080_t *r, uint8_t f);
+
+// Execute one instruction
+void ref_step(ref8080_t *r);
+
+#endif
@@ -0,0 +1,688 @@
+// run8080 - headless batch runner for 8080 guest programs
+//
+// Loads an Intel HEX image, feeds each input file (or stdin) to the serial
+// port, runs until HLT or a cycle limit and writes the guest output and final
+// registers as JSON. Instances are independent and run on a thread pool.
+// With -p it also counts instructions and cycles per address and writes a
+// profile, by source line when given the assembler's line table (-g).
+// Disk image files are mapped for the 88-DCDD (-d) and block device (-k)
+// controllers: written back to the file for a single run, private to each
+// machine when there are several. A .com program runs under CP/M high-level
+// emulation (cpm.h) with host directories as its drives (-a). Guest
+// routines can be replaced by native ones (-H), or checked against them (-V).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "machine.h"
+#include "batch.h"
+#include "hexfile.h"
+#include "diskfile.h"
+#include "cpm.h"
+#include "natives.h"
+#include "linetab.h"
+
+#define DEFAULT_CYCLE_LIMIT 100000000ULL
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+// One guest run. The machine belongs to the worker thread, so only the
+// final registers and the output are kept per run.
+typedef struct {
+    const char *input_name;
+    const buffer_t *input;
+    int copy;
+
+    size_t in_pos;
+    buffer_t output;
+
+    cpu_8080_t cpu;
+    bool hit_limit;
+    bool warm_boot;  // CP/M program exited
+} instance_t;
+
+typedef struct {
+    instance_t *jobs;
+    size_t count;
+    atomic_size_t next;
+    const machine_t *image;
+    uint16_t entry;
+    uint64_t cycle_limit;
+    int batch;  // Lanes per lockstep batch, 0 = plain interpreter
+
+    // Disk image files per drive, mapped again for every run
+    const char *dcdd_names[DISK_DRIVES];
+    const char *blk_names[DISK_DRIVES];
+    int dcdd_count, blk_count;
+
+    // CP/M drives for a .com program, NULL cpm_dirs[0] for other programs
+    const char *cpm_dirs[CPM_DRIVES];
+    int cpm_drives;
+
+    // Native hooks are registered on the image and copied to every run;
+    // their statistics are summed here
+    bool verify;
+    hook_t hook_totals[HOOK_MAX];
+    pthread_mutex_t hook_lock;
+
+    atomic_uint_fast64_t vector_steps;
+    atomic_uint_fast64_t scalar_steps;
+    atomic_uint_fast64_t vector_passes;
+
+    // Profile totals per address, NULL unless profiling
+    uint64_t *counts;
+    uint64_t *cycles;
+    pthread_mutex_t profile_lock;
+} pool_t;
+
+static void buf_push(buffer_t *b, uint8_t byte) {
+    if (b->len == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 256;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    b->data[b->len++] = byte;
+}
+
+static int read_stream(FILE *f, buffer_t *b) {
+    int ch;
+    while ((ch = fgetc(f)) != EOF) buf_push(b, ch);
+    return ferror(f) ? -1 : 0;
+}
+
+static int read_file(const char *name, buffer_t *b) {
+    if (strcmp(name, "-") == 0) return read_stream(stdin, b);
+    FILE *f = fopen(name, "rb");
+    if (!f) return -1;
+    int rc = read_stream(f, b);
+    fclose(f);
+    return rc;
+}
+
+// Serial backend: input buffer in, output buffer out
+static int instance_getc(void *ctx) {
+    instance_t *inst = ctx;
+    if (inst->in_pos >= inst->input->len) return -1;
+    return inst->input->data[inst->in_pos++];
+}
+
+static void instance_putc(void *ctx, uint8_t ch) {
+    instance_t *inst = ctx;
+    buf_push(&inst->output, ch);
+}
+
+// Map every disk file into a machine's controllers. Sizes were checked
+// before any run started, so only the mapping itself can fail here.
+static void attach_disks(const pool_t *pool, machine_t *m) {
+    bool shared = pool->count == 1;
+    for (int i = 0; i < pool->dcdd_count + pool->blk_count; i++) {
+        bool dcdd = i < pool->dcdd_count;
+        int drive = dcdd ? i : i - pool->dcdd_count;
+        disk_media_t media;
+        if (disk_map(dcdd ? pool->dcdd_names[drive] : pool->blk_names[drive], shared, &media) < 0) exit(1);
+        if (dcdd) dcdd_attach(m, drive, &media);
+        else blk_attach(m, drive, &media);
+    }
+}
+
+static void detach_disks(machine_t *m) {
+    for (int i = 0; i < DISK_DRIVES; i++) {
+        disk_unmap(&m->io.dcdd.drive[i]);
+        disk_unmap(&m->io.blk.drive[i]);
+    }
+}
+
+// hooks is the run's own copy of the image's hook table, if it has one
+static void instance_start(pool_t *pool, instance_t *inst, machine_t *m, hooks_t *hooks) {
+    m->mem = pool->image->mem;
+    cpu_init(&m->cpu);
+    io_init(m, instance_getc, instance_putc, inst);
+    sched_init(&m->sched);
+    m->hooks = NULL;
+    if (pool->image->hooks) {
+        *hooks = *pool->image->hooks;
+        hooks->verify = pool->verify;
+        m->hooks = hooks;
+    }
+    attach_disks(pool, m);
+    m->cpu.pc = pool->entry;
+}
+
+static void instance_finish(pool_t *pool, instance_t *inst, machine_t *m) {
+    inst->cpu = m->cpu;
+    inst->hit_limit = !m->cpu.halted;
+    detach_disks(m);
+    if (!m->hooks) return;
+
+    pthread_mutex_lock(&pool->hook_lock);
+    for (int i = 0; i < HOOK_MAX; i++) {
+        const hook_t *h = &m->hooks->hooks[i];
+        pool->hook_totals[i].calls += h->calls;
+        pool->hook_totals[i].mismatches += h->mismatches;
+        pool->hook_totals[i].guest_cycles += h->guest_cycles;
+    }
+    pthread_mutex_unlock(&pool->hook_lock);
+}
+
+// machine_run, counting the instructions and cycles spent at each address
+static void run_profiled(machine_t *m, uint64_t budget, uint64_t *counts, uint64_t *cycles) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint64_t end = cpu->cycles + budget;
+
+    while (!cpu->halted && cpu->cycles < end) {
+        uint64_t stop = m->sched.next < end ? m->sched.next : end;
+        while (!cpu->halted && cpu->cycles < stop) {
+            uint16_t pc = cpu->pc;
+            uint64_t before = cpu->cycles;
+            cpu_step(m);
+            counts[pc]++;
+            cycles[pc] += cpu->cycles - before;
+        }
+        if (cpu->cycles >= m->sched.next) sched_dispatch(m, cpu->cycles);
+    }
+}
+
+static void *worker(void *arg) {
+    pool_t *pool = arg;
+    size_t lanes = pool->batch ? pool->batch : 1;
+    machine_t *machines = malloc(lanes * sizeof(machine_t));
+    machine_t *lane[BATCH_MAX];
+    hooks_t *hooks = pool->image->hooks ? malloc(lanes * sizeof(hooks_t)) : NULL;
+    uint64_t *counts = pool->counts ? calloc(MEMORY_SIZE * 2, sizeof(uint64_t)) : NULL;
+    uint64_t *cycles = counts ? counts + MEMORY_SIZE : NULL;
+    if (!machines || (pool->image->hooks && !hooks) || (pool->counts && !counts)) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+
+    for (;;) {
+        size_t first = atomic_fetch_add(&pool->next, lanes);
+        if (first >= pool->count) break;
+        size_t n = pool->count - first < lanes ? pool->count - first : lanes;
+
+        for (size_t i = 0; i < n; i++) {
+            instance_start(pool, &pool->jobs[first + i], &machines[i], hooks ? &hooks[i] : NULL);
+            lane[i] = &machines[i];
+        }
+
+        if (pool->batch) {
+            batch_t batch;
+            batch_init(&batch, lane, n, pool->cycle_limit);
+            batch_run(&batch);
+            atomic_fetch_add(&pool->vector_steps, batch.vector_steps);
+            atomic_fetch_add(&pool->scalar_steps, batch.scalar_steps);
+            atomic_fetch_add(&pool->vector_passes, batch.vector_passes);
+        } else if (pool->cpm_dirs[0]) {
+            cpm_t cpm;
+            cpm_init(&cpm, pool->cpm_dirs, pool->cpm_drives, &machines[0]);
+            cpm_run(&cpm, &machines[0], pool->cycle_limit);
+            cpm_close(&cpm);
+            pool->jobs[first].warm_boot = cpm.exited;
+        } else if (counts) {
+            run_profiled(&machines[0], pool->cycle_limit, counts, cycles);
+        } else {
+            machine_run(&machines[0], pool->cycle_limit);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            instance_finish(pool, &pool->jobs[first + i], &machines[i]);
+        }
+    }
+
+    if (counts) {
+        pthread_mutex_lock(&pool->profile_lock);
+        for (size_t i = 0; i < MEMORY_SIZE; i++) {
+            pool->counts[i] += counts[i];
+            pool->cycles[i] += cycles[i];
+        }
+        pthread_mutex_unlock(&pool->profile_lock);
+        free(counts);
+    }
+    free(hooks);
+    free(machines);
+    return NULL;
+}
+
+static void json_string(FILE *out, const uint8_t *s, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        switch (c) {
+        case '"':  fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '\r': fputs("\\r", out); break;
+        case '\t': fputs("\\t", out); break;
+        default:
+            if (c < 0x20 || c >= 0x7F) fprintf(out, "\\u%04x", c);
+            else fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_result(FILE *out, const instance_t *inst) {
+    const cpu_8080_t *cpu = &inst->cpu;
+    fputs("  {\"input\": ", out);
+    json_string(out, (const uint8_t *)inst->input_name, strlen(inst->input_name));
+    fprintf(out, ", \"copy\": %d", inst->copy);
+    fprintf(out, ", \"exit\": \"%s\"", inst->warm_boot ? "warm_boot" : inst->hit_limit ? "cycle_limit" : "halt");
+    fprintf(out, ", \"cycles\": %llu", (unsigned long long)cpu->cycles);
+    fputs(", \"output\": ", out);
+    json_string(out, inst->output.data, inst->output.len);
+    fprintf(out, ", \"registers\": {\"a\": %u, \"f\": %u, \"b\": %u, \"c\": %u, "
+                 "\"d\": %u, \"e\": %u, \"h\": %u, \"l\": %u, \"sp\": %u, \"pc\": %u, "
+                 "\"inte\": %s}}",
+            cpu->a, cpu->f.byte, cpu->bc.hi, cpu->bc.lo, cpu->de.hi, cpu->de.lo,
+            cpu->hl.hi, cpu->hl.lo, cpu->sp, cpu->pc, cpu->inte ? "true" : "false");
+}
+
+// "SYMBOL+offset" for an address, or just the address
+static void format_addr(char *buf, size_t size, const linetab_t *lt, uint16_t addr) {
+    const linetab_symbol_t *sym = linetab_find_symbol(lt, addr);
+    if (!sym) snprintf(buf, size, "%04X", addr);
+    else if (sym->value == addr) snprintf(buf, size, "%s", sym->name);
+    else snprintf(buf, size, "%s+%u", sym->name, addr - sym->value);
+}
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t count;
+    uint16_t addr;
+    const linetab_line_t *line;
+} profile_row_t;
+
+static int compare_rows(const void *a, const void *b) {
+    const profile_row_t *x = a, *y = b;
+    if (x->cycles != y->cycles) return x->cycles < y->cycles ? 1 : -1;
+    return x->addr - y->addr;
+}
+
+// Hottest first, by source line if there is a line table (the count is how
+// often the line's first instruction ran), else by address. Code lines that
+// never ran are listed at the end for coverage.
+static int write_profile(const char *name, const pool_t *pool, const linetab_t *lt) {
+    FILE *out = fopen(name, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", name);
+        return -1;
+    }
+
+    size_t max_rows = lt->line_count ? lt->line_count : MEMORY_SIZE;
+    profile_row_t *rows = calloc(max_rows, sizeof(profile_row_t));
+    if (!rows) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    size_t n = 0, code_lines = 0, covered = 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < MEMORY_SIZE; i++) total += pool->cycles[i];
+
+    if (lt->line_count) {
+        for (size_t i = 0; i < lt->line_count; i++) {
+            const linetab_line_t *l = &lt->lines[i];
+            profile_row_t row = { 0, pool->counts[l->addr], l->addr, l };
+            for (uint32_t a = l->addr; a < (uint32_t)l->addr + l->len && a < MEMORY_SIZE; a++) {
+                row.cycles += pool->cycles[a];
+            }
+            if (l->flags & LINETAB_LINE_CODE) {
+                code_lines++;
+                if (row.count) covered++;
+            }
+            if (row.cycles) rows[n++] = row;
+        }
+    } else {
+        for (size_t a = 0; a < MEMORY_SIZE; a++) {
+            if (pool->counts[a]) rows[n++] = (profile_row_t){ pool->cycles[a], pool->counts[a], a, NULL };
+        }
+    }
+    qsort(rows, n, sizeof(profile_row_t), compare_rows);
+
+    fprintf(out, "%14s %6s %12s  %-24s %s\n", "cycles", "%", "count", "location", "address");
+    for (size_t i = 0; i < n; i++) {
+        const profile_row_t *r = &rows[i];
+        char where[64] = "", addr[48];
+        if (r->line) snprintf(where, sizeof(where), "%s:%u", lt->files[r->line->file], r->line->line);
+        format_addr(addr, sizeof(addr), lt, r->addr);
+        fprintf(out, "%14llu %5.1f%% %12llu  %-24s %s\n", (unsigned long long)r->cycles,
+                total ? 100.0 * r->cycles / total : 0.0, (unsigned long long)r->count, where, addr);
+    }
+
+    if (lt->line_count) {
+        fprintf(out, "\nCoverage: %zu of %zu code lines executed\n", covered, code_lines);
+        for (size_t i = 0; i < lt->line_count; i++) {
+            const linetab_line_t *l = &lt->lines[i];
+            if (!(l->flags & LINETAB_LINE_CODE) || pool->counts[l->addr]) continue;
+            char addr[48];
+            format_addr(addr, sizeof(addr), lt, l->addr);
+            fprintf(out, "  not run: %s:%u %s\n", lt->files[l->file], l->line, addr);
+        }
+    }
+    free(rows);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: cannot write %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_linetab(const char *name, linetab_t *lt) {
+    buffer_t buf = { 0 };
+    if (read_file(name, &buf) < 0) {
+        fprintf(stderr, "Error: cannot read %s\n", name);
+        return -1;
+    }
+    int rc = linetab_parse(lt, buf.data, buf.len);
+    free(buf.data);
+    if (rc < 0) fprintf(stderr, "Error: %s is not a valid line table\n", name);
+    return rc;
+}
+
+// "NAME@ADDR[,CYCLES]": ADDR is a symbol from the line table or hex
+static int add_hook(machine_t *m, const char *spec, const linetab_t *lt) {
+    char name[32], where[128];
+    const char *at = strchr(spec, '@');
+    if (!at || at - spec >= (long)sizeof(name)) {
+        fprintf(stderr, "Error: expected NAME@ADDR in -H %s\n", spec);
+        return -1;
+    }
+    memcpy(name, spec, at - spec);
+    name[at - spec] = 0;
+    const native_t *n = native_find(name);
+    if (!n) {
+        fprintf(stderr, "Error: no native routine %s\n", name);
+        return -1;
+    }
+    const char *comma = strchr(at + 1, ',');
+    size_t len = comma ? (size_t)(comma - at - 1) : strlen(at + 1);
+    if (!len || len >= sizeof(where)) {
+        fprintf(stderr, "Error: bad address in -H %s\n", spec);
+        return -1;
+    }
+    memcpy(where, at + 1, len);
+    where[len] = 0;
+
+    long addr = -1;
+    for (size_t i = 0; i < lt->symbol_count && addr < 0; i++) {
+        if (strcasecmp(lt->symbols[i].name, where) == 0) addr = lt->symbols[i].value;
+    }
+    if (addr < 0) {
+        char *end;
+        addr = strtol(where, &end, 16);
+        if ((*end && strcasecmp(end, "h") != 0) || addr < 0 || addr >= MEMORY_SIZE) {
+            fprintf(stderr, "Error: unknown address %s in -H %s\n", where, spec);
+            return -1;
+        }
+    }
+    uint32_t cycles = comma ? strtoul(comma + 1, NULL, 0) : n->cycles;
+    if (hook_add(m, addr, n->fn, (void *)n, cycles, n->regs, n->flags) < 0) {
+        fprintf(stderr, "Error: too many hooks\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Hook statistics to stderr with -t or -V; true if verification failed
+static bool report_hooks(const pool_t *pool, const machine_t *image, const linetab_t *lt, bool timing) {
+    bool failed = false;
+    for (int i = 0; image->hooks && i < HOOK_MAX; i++) {
+        const hook_t *h = &image->hooks->hooks[i];
+        const hook_t *t = &pool->hook_totals[i];
+        if (!h->fn || !(timing || pool->verify)) continue;
+        char addr[48];
+        format_addr(addr, sizeof(addr), lt, h->addr);
+        fprintf(stderr, "hook %s at %s: %llu calls", ((const native_t *)h->ctx)->name, addr,
+                (unsigned long long)t->calls);
+        if (pool->verify) {
+            fprintf(stderr, ", %llu mismatches, guest %.1f cycles per call (declared %u)",
+                    (unsigned long long)t->mismatches, t->calls ? (double)t->guest_cycles / t->calls : 0.0,
+                    (unsigned)h->cycles);
+            if (t->mismatches) failed = true;
+        }
+        fputc('\n', stderr);
+    }
+    return failed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] program.hex|.asm|.l8z [input...]\n"
+            "  -j N    worker threads (default: online CPUs)\n"
+            "  -n N    run each input N times (default 1)\n"
+            "  -c N    cycle limit per run (default %llu)\n"
+            "  -o FILE write JSON results to FILE (default stdout)\n"
+            "  -b K    run K machines per lockstep SIMD batch (max %d)\n"
+            "  -t      print timing and aggregate throughput to stderr\n"
+            "  -p FILE write an execution profile and coverage to FILE\n"
+            "  -g FILE line table from asm8080 -g, to profile by source line\n"
+            "  -d FILE disk image for the next 88-DCDD drive (up to %d)\n"
+            "  -k FILE disk image for the next block device drive (up to %d)\n"
+            "  -a DIR  host directory for the next CP/M drive of a .com program (default .)\n"
+            "  -e TEXT CP/M command tail for a .com program\n"
+            "  -H NAME@ADDR[,CYCLES]\n"
+            "          run native NAME (mul16, div16, memcpy, fill, strcmp) for calls\n"
+            "          to ADDR, a hex address or a -g symbol, charging CYCLES\n"
+            "  -V      run hooked routines in the guest too and compare (exit 1 on a mismatch)\n"
+            "Each input file is fed to the serial port of its own machine;\n"
+            "with no inputs (or '-') stdin is used. A .asm program is assembled in-process;\n"
+            "a .com program runs under CP/M 2.2 emulation with the input as its console.\n",
+            prog, DEFAULT_CYCLE_LIMIT, BATCH_MAX, DISK_DRIVES, DISK_DRIVES);
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long copies = 1;
+    uint64_t cycle_limit = DEFAULT_CYCLE_LIMIT;
+    const char *outname = NULL, *profile_name = NULL, *linetab_name = NULL;
+    long batch = 0;
+    bool timing = false;
+    const char *dcdd_names[DISK_DRIVES], *blk_names[DISK_DRIVES];
+    int dcdd_count = 0, blk_count = 0;
+    const char *cpm_dirs[CPM_DRIVES] = { 0 }, *cpm_tail = "";
+    int cpm_drives = 0;
+    const char *hook_specs[HOOK_MAX];
+    int hook_count = 0;
+    bool verify = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:n:c:o:b:tp:g:d:k:a:e:H:Vh")) != -1) {
+        switch (opt) {
+        case 'd':
+        case 'k':
+            if ((opt == 'd' ? dcdd_count : blk_count) == DISK_DRIVES) {
+                fprintf(stderr, "Error: at most %d drives per controller\n", DISK_DRIVES);
+                return 1;
+            }
+            if (opt == 'd') dcdd_names[dcdd_count++] = optarg;
+            else blk_names[blk_count++] = optarg;
+            break;
+        case 'a':
+            if (cpm_drives == CPM_DRIVES) {
+                fprintf(stderr, "Error: at most %d CP/M drives\n", CPM_DRIVES);
+                return 1;
+            }
+            cpm_dirs[cpm_drives++] = optarg;
+            break;
+        case 'e': cpm_tail = optarg; break;
+        case 'H':
+            if (hook_count == HOOK_MAX) {
+                fprintf(stderr, "Error: at most %d hooks\n", HOOK_MAX);
+                return 1;
+            }
+            hook_specs[hook_count++] = optarg;
+            break;
+        case 'V': verify = true; break;
+        case 'b': batch = strtol(optarg, NULL, 0); break;
+        case 't': timing = true; break;
+        case 'j': threads = strtol(optarg, NULL, 0); break;
+        case 'n': copies = strtol(optarg, NULL, 0); break;
+        case 'c': cycle_limit = strtoull(optarg, NULL, 0); break;
+        case 'o': outname = optarg; break;
+        case 'p': profile_name = optarg; break;
+        case 'g': linetab_name = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || threads < 1 || copies < 1 || batch < 0 || batch > BATCH_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (profile_name && batch) {
+        fprintf(stderr, "Error: -p runs the plain interpreter and cannot be used with -b\n");
+        return 1;
+    }
+    linetab_t linetab = { 0 };
+    if (linetab_name && load_linetab(linetab_name, &linetab) < 0) return 1;
+
+    static machine_t image;
+    uint16_t entry;
+    mem_init(&image);
+    if (hex_load(argv[optind], &image, &entry, NULL) < 0) return 1;
+
+    size_t name_len = strlen(argv[optind]);
+    bool cpm = name_len > 4 && strcasecmp(argv[optind] + name_len - 4, ".com") == 0;
+    if (cpm) {
+        if (batch || profile_name) {
+            fprintf(stderr, "Error: a .com program cannot be run with -b or -p\n");
+            return 1;
+        }
+        if (!cpm_drives) cpm_dirs[cpm_drives++] = ".";
+        cpm_setup_memory(&image, cpm_tail);
+    }
+    static hooks_t image_hooks;
+    hook_init(&image_hooks);
+    if (hook_count) image.hooks = &image_hooks;
+    for (int i = 0; i < hook_count; i++) {
+        if (add_hook(&image, hook_specs[i], &linetab) < 0) return 1;
+    }
+
+    // Inputs are read once and shared read-only between their copies
+    int input_count = argc - optind - 1;
+    char *stdin_name = "-";
+    char **input_names = input_count ? &argv[optind + 1] : &stdin_name;
+    if (!input_count) input_count = 1;
+
+    buffer_t *inputs = calloc(input_count, sizeof(*inputs));
+    for (int i = 0; i < input_count; i++) {
+        if (read_file(input_names[i], &inputs[i]) < 0) {
+            fprintf(stderr, "Error: cannot read %s\n", input_names[i]);
+            return 1;
+        }
+    }
+
+    pool_t pool = {
+        .count = (size_t)input_count * copies,
+        .image = &image,
+        .entry = entry,
+        .cycle_limit = cycle_limit,
+        .batch = batch,
+    };
+    memcpy(pool.dcdd_names, dcdd_names, sizeof(dcdd_names));
+    memcpy(pool.blk_names, blk_names, sizeof(blk_names));
+    pool.dcdd_count = dcdd_count;
+    pool.blk_count = blk_count;
+    pool.verify = verify;
+    pthread_mutex_init(&pool.hook_lock, NULL);
+    if (cpm) {
+        memcpy(pool.cpm_dirs, cpm_dirs, sizeof(cpm_dirs));
+        pool.cpm_drives = cpm_drives;
+    }
+
+    // Check every image once up front rather than failing partway through
+    for (int i = 0; i < dcdd_count + blk_count; i++) {
+        bool dcdd = i < dcdd_count;
+        const char *name = dcdd ? dcdd_names[i] : blk_names[i - dcdd_count];
+        disk_media_t media;
+        if (disk_map(name, false, &media) < 0) return 1;
+        int rc = dcdd ? dcdd_attach(&image, 0, &media) : blk_attach(&image, 0, &media);
+        disk_unmap(&media);
+        if (rc < 0) {
+            fprintf(stderr, "Error: %s is not a whole number of %s\n", name,
+                    dcdd ? "88-DCDD tracks (4384 bytes)" : "128-byte blocks");
+            return 1;
+        }
+    }
+    disk_init(&image);
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.vector_steps, 0);
+    atomic_init(&pool.scalar_steps, 0);
+    atomic_init(&pool.vector_passes, 0);
+    if (profile_name) {
+        pool.counts = calloc(MEMORY_SIZE * 2, sizeof(uint64_t));
+        if (!pool.counts) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+        pool.cycles = pool.counts + MEMORY_SIZE;
+        pthread_mutex_init(&pool.profile_lock, NULL);
+    }
+    pool.jobs = calloc(pool.count, sizeof(instance_t));
+    if (!pool.jobs) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < pool.count; i++) {
+        pool.jobs[i].input_name = input_names[i / copies];
+        pool.jobs[i].input = &inputs[i / copies];
+        pool.jobs[i].copy = i % copies;
+    }
+
+    if ((size_t)threads > pool.count) threads = pool.count;
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&tids[t], NULL, worker, &pool);
+    }
+    for (long t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (timing) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        uint64_t total = 0;
+        for (size_t i = 0; i < pool.count; i++) total += pool.jobs[i].cpu.cycles;
+        fprintf(stderr, "%zu runs on %ld threads: %llu cycles in %.3f s (%.1f MHz aggregate)\n",
+                pool.count, threads, (unsigned long long)total, secs, total / secs / 1e6);
+        if (batch) {
+            uint64_t vec = atomic_load(&pool.vector_steps);
+            uint64_t sca = atomic_load(&pool.scalar_steps);
+            uint64_t passes = atomic_load(&pool.vector_passes);
+            fprintf(stderr, "lockstep: %llu kernel passes of %.1f/%ld lanes, %.1f%% of instructions vectorized\n",
+                    (unsigned long long)passes, passes ? (double)vec / passes : 0.0, batch,
+                    vec + sca ? 100.0 * vec / (vec + sca) : 0.0);
+        }
+    }
+
+    FILE *out = outname ? fopen(outname, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: cannot create %s\n", outname);
+        return 1;
+    }
+    fputs("[\n", out);
+    for (size_t i = 0; i < pool.count; i++) {
+        write_result(out, &pool.jobs[i]);
+        fputs(i + 1 < pool.count ? ",\n" : "\n", out);
+    }
+    fputs("]\n", out);
+    if (out != stdout) fclose(out);
+
+    if (profile_name && write_profile(profile_name, &pool, &linetab) < 0) return 1;
+    return report_hooks(&pool, &image, &linetab, timing) ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+// send8080 - binary program upload to the monitor
+//
+// Loads an Intel HEX image (or assembles a .asm source), types the monitor's
+// b command on the serial port and sends the image as CRC-checked frames
+// (src/upload.h), run-length coded where that is shorter, keeping a window
+// of frames in flight and resending on NAK or timeout. The 256-byte pages
+// the image touches are sent whole, with gaps zero-filled.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#include "machine.h"
+#include "upload.h"
+#include "hexfile.h"
+
+#define ACK_TIMEOUT_MS   (UPLOAD_ACK_TIMEOUT_US / 1000)
+#define READY_TIMEOUT_MS 3000
+#define MAX_TIMEOUTS     10
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} frame_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static speed_t baud_rate(long baud) {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default: return 0;
+    }
+}
+
+// Raw 8-bit mode; USB CDC ignores the baud rate, a UART bridge does not
+static int open_port(const char *name, long baud) {
+    int fd = open(name, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    struct termios tio;
+    if (isatty(fd) && tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baud_rate(baud));
+        cfsetospeed(&tio, baud_rate(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+    }
+    return fd;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read one byte, or return -1 after timeout_ms with nothing
+static int read_byte(int fd, int timeout_ms) {
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    uint8_t ch;
+    if (poll(&p, 1, timeout_ms) <= 0 || read(fd, &ch, 1) != 1) return -1;
+    return ch;
+}
+
+static int add_frame(frame_t **frames, size_t *count, size_t *cap, uint8_t type, uint16_t addr,
+                     const uint8_t *data, size_t len, int rle) {
+    static uint8_t coded[UPLOAD_FRAME_MAX];
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        frame_t *grown = realloc(*frames, *cap * sizeof(frame_t));
+        if (!grown) return -1;
+        *frames = grown;
+    }
+    size_t coded_len = rle && len ? upload_rle_encode(data, len, coded, len - 1) : 0;
+    if (coded_len) {
+        type = UPLOAD_RLE;
+        data = coded;
+        len = coded_len;
+    }
+    frame_t *f = &(*frames)[(*count)++];
+    f->data = malloc(UPLOAD_HEADER_SIZE + len + UPLOAD_CRC_SIZE);
+    if (!f->data) return -1;
+    f->len = upload_frame(f->data, type, *count - 1, addr, data, len);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] port program.hex|program.asm\n"
+            "  -b BAUD serial speed (default 115200; USB ignores it)\n"
+            "  -f N    bytes per frame (default and max %d)\n"
+            "  -w N    frames in flight (default and max %d)\n"
+            "  -n      no run-length coding\n"
+            "Types the monitor's b command on port and uploads the program.\n",
+            prog, UPLOAD_FRAME_MAX, UPLOAD_WINDOW);
+}
+
+int main(int argc, char **argv) {
+    long baud = 115200, frame_size = UPLOAD_FRAME_MAX, window = UPLOAD_WINDOW;
+    int rle = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:f:w:nh")) != -1) {
+        switch (opt) {
+        case 'b': baud = strtol(optarg, NULL, 0); break;
+        case 'f': frame_size = strtol(optarg, NULL, 0); break;
+        case 'w': window = strtol(optarg, NULL, 0); break;
+        case 'n': rle = 0; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 2 != argc || !baud_rate(baud) || frame_size < 1 || frame_size > UPLOAD_FRAME_MAX ||
+        window < 1 || window > UPLOAD_WINDOW) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static machine_t image;
+    static uint8_t pages[MEM_PAGES];
+    uint16_t entry;
+    mem_init(&image);
+    if (hex_load(argv[optind + 1], &image, &entry, pages) < 0) return 1;
+    mem_fault_range(&image, 0, MEMORY_SIZE);  // Frames are cut straight from RAM
+
+    // Each run of touched pages becomes frames of up to frame_size bytes
+    frame_t *frames = NULL;
+    size_t count = 0, cap = 0, image_bytes = 0, wire_bytes = 0;
+    for (size_t page = 0; page < MEM_PAGES;) {
+        if (!pages[page]) {
+            page++;
+            continue;
+        }
+        size_t end = page;
+        while (end < MEM_PAGES && pages[end]) end++;
+        for (size_t addr = page * MEM_PAGE_SIZE; addr < end * MEM_PAGE_SIZE; addr += frame_size) {
+            size_t len = end * MEM_PAGE_SIZE - addr;
+            if (len > (size_t)frame_size) len = frame_size;
+            if (add_frame(&frames, &count, &cap, UPLOAD_DATA, addr, &image.mem.ram[addr], len, rle) < 0) goto oom;
+            image_bytes += len;
+        }
+        page = end;
+    }
+    if (add_frame(&frames, &count, &cap, UPLOAD_END, entry, NULL, 0, 0) < 0) goto oom;
+
+    int fd = open_port(argv[optind], baud);
+    if (fd < 0) return 1;
+
+    // The monitor echoes the command and prints a line before it is ready
+    if (write_all(fd, (const uint8_t *)"b\r", 2) < 0) goto io_error;
+    int ch;
+    do {
+        ch = read_byte(fd, READY_TIMEOUT_MS);
+    } while (ch >= 0 && ch != UPLOAD_READY);
+    if (ch < 0) {
+        fprintf(stderr, "Error: no reply from the monitor on %s\n", argv[optind]);
+        return 1;
+    }
+
+    // Go-back-N: frames [base, next) are in flight
+    double start = now_seconds();
+    size_t base = 0, next = 0, sent = 0, resent = 0;
+    int timeouts = 0;
+    while (base < count) {
+        while (next < count && next < base + window) {
+            if (write_all(fd, frames[next].data, frames[next].len) < 0) goto io_error;
+            wire_bytes += frames[next].len;
+            if (next < sent) resent++;
+            else sent = next + 1;
+            next++;
+        }
+
+        int code = read_byte(fd, ACK_TIMEOUT_MS);
+        int seq = code >= 0 ? read_byte(fd, ACK_TIMEOUT_MS) : -1;
+        if (seq < 0) {
+            if (++timeouts > MAX_TIMEOUTS) {
+                fprintf(stderr, "Error: no reply from the monitor, %zu of %zu frames sent\n", base, count);
+                return 1;
+            }
+            next = base;
+            continue;
+        }
+        timeouts = 0;
+        if ((code != UPLOAD_ACK && code != UPLOAD_NAK) || !(seq & 0x80)) continue;
+
+        // Find the frame the reply names among those in flight
+        size_t i = base;
+        while (i < next && (i & UPLOAD_SEQ_MASK) != (size_t)(seq & UPLOAD_SEQ_MASK)) i++;
+        if (i == next) continue;
+        if (code == UPLOAD_ACK) {
+            base = i + 1;
+        } else {
+            base = i;
+            next = i;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    fprintf(stderr, "Sent %zu bytes in %zu frames (%zu on the wire, %zu resent) in %.3f s, %.1f KB/s\n",
+            image_bytes, count, wire_bytes, resent, elapsed, elapsed > 0 ? image_bytes / elapsed / 1024 : 0);
+
+    // Pass on the monitor's summary line, printed once it stops listening
+    // for resends of END
+    int wait_ms = UPLOAD_LINGER_US / 1000 + 500;
+    while ((ch = read_byte(fd, wait_ms)) >= 0) {
+        putchar(ch);
+        wait_ms = 200;
+    }
+    close(fd);
+    return 0;
+
+io_error:
+    fprintf(stderr, "Error: writing to %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+oom:
+    fprintf(stderr, "Error: out of memory\n");
+    return 1;
+}
@@ -1,29 +1,8 @@
 #include "cpu.h"
-#include "memory.h"
-#include "io.h"
+#include "machine.h"
+#include "opcodes.h"
 #include <stdio.h>
 
-// Cycle counts for each opcode
-static const uint8_t CYCLES[256] = {
-//  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
-    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  // 0
-    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  // 1
-    4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4,  // 2
-    4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4,  // 3
-    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 4
-    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 5
-    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 6
-    7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,  // 7
-    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 8
-    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 9
-    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // A
-    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // B
-    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  // C
-    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  // D
-    5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  // E
-    5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11   // F
-};
-
 // Set Z, S, P flags based on result
 #define SET_ZSP(cpu, val) do { \
     (cpu)->f.z = ((val) == 0); \
@@ -46,27 +25,78 @@ static inline bool carry(int bit, uint8_t a, uint8_t b, bool cy) {
     return (c >> bit) & 1;
 }
 
+// Memory access while an instruction runs. Lazy image pages it can touch
+// were filled in by prefault() first (or there are none, for cpu_exec), so
+// unlike mem_read and mem_write these only check for ROM.
+static inline uint8_t cpu_read(machine_t *m, uint16_t addr) {
+    return m->mem.ram[addr];
+}
+
+static inline uint16_t cpu_read16(machine_t *m, uint16_t addr) {
+    return cpu_read(m, addr) | (cpu_read(m, addr + 1) << 8);
+}
+
+static inline void cpu_write(machine_t *m, uint16_t addr, uint8_t val) {
+    if (!(m->mem.page_flags[addr >> MEM_PAGE_SHIFT] & MEM_PAGE_ROM)) m->mem.ram[addr] = val;
+}
+
+static inline void cpu_write16(machine_t *m, uint16_t addr, uint16_t val) {
+    cpu_write(m, addr, val & 0xFF);
+    cpu_write(m, addr + 1, val >> 8);
+}
+
+static void prefault_at(machine_t *m, uint16_t addr, int len) {
+    for (int i = 0; i < len; i++) {
+        uint16_t a = addr + i;
+        if (m->mem.page_flags[a >> MEM_PAGE_SHIFT] & MEM_PAGE_LAZY) mem_fault(m, a);
+    }
+}
+
+// Fill in the lazy pages the next instruction touches: its own bytes, then
+// M, (BC), (DE), a direct address or the stack
+static void prefault(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
+    prefault_at(m, cpu->pc, 3);
+    uint8_t op = cpu_read(m, cpu->pc);
+    uint16_t operand = cpu_read16(m, cpu->pc + 1);
+
+    bool mov_m = op >= 0x40 && op < 0x80 && op != 0x76 && ((op & 0x07) == 6 || (op & 0x38) == 0x30);
+    if (mov_m || (op & 0xC7) == 0x86 || (op >= 0x34 && op <= 0x36)) {
+        prefault_at(m, cpu->hl.word, 1);  // MOV with M / ALU M / INR, DCR, MVI M
+    } else if ((op & 0xE7) == 0x02) {
+        prefault_at(m, op & 0x10 ? cpu->de.word : cpu->bc.word, 1);  // STAX / LDAX
+    } else if ((op & 0xE7) == 0x22) {
+        prefault_at(m, operand, op & 0x10 ? 1 : 2);  // SHLD, LHLD / STA, LDA
+    } else if ((op & 0xC7) == 0xC0 || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7 ||
+               (op & 0xCB) == 0xC1 || (op & 0xCF) == 0xC9 || (op & 0xCF) == 0xCD || op == 0xE3) {
+        prefault_at(m, cpu->sp - 2, 4);   // Rcc, Ccc, RST, PUSH, POP, RET, CALL, XTHL
+    }
+}
+
 // Fetch next byte from PC
-static inline uint8_t fetch(cpu_8080_t *cpu) {
-    return mem_read(cpu->pc++);
+static inline uint8_t fetch(machine_t *m) {
+    return cpu_read(m, m->cpu.pc++);
 }
 
 // Fetch next word (little-endian)
-static inline uint16_t fetch_word(cpu_8080_t *cpu) {
-    uint16_t lo = mem_read(cpu->pc++);
-    uint16_t hi = mem_read(cpu->pc++);
+static inline uint16_t fetch_word(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t lo = cpu_read(m, cpu->pc++);
+    uint16_t hi = cpu_read(m, cpu->pc++);
     return (hi << 8) | lo;
 }
 
 // Stack operations
-static inline void push(cpu_8080_t *cpu, uint16_t val) {
+static inline void push(machine_t *m, uint16_t val) {
+    cpu_8080_t *cpu = &m->cpu;
     cpu->sp -= 2;
-    mem_write(cpu->sp, val & 0xFF);
-    mem_write(cpu->sp + 1, val >> 8);
+    cpu_write(m, cpu->sp, val & 0xFF);
+    cpu_write(m, cpu->sp + 1, val >> 8);
 }
 
-static inline uint16_t pop(cpu_8080_t *cpu) {
-    uint16_t val = mem_read(cpu->sp) | (mem_read(cpu->sp + 1) << 8);
+static inline uint16_t pop(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t val = cpu_read(m, cpu->sp) | (cpu_read(m, cpu->sp + 1) << 8);
     cpu->sp += 2;
     return val;
 }
@@ -165,7 +195,7 @@ static inline void alu_daa(cpu_8080_t *cpu) {
     if (cpu->f.ac || (cpu->a & 0x0F) > 9) {
         correction = 0x06;
     }
-    if (cpu->f.c || cpu->a > 0x99 || ((cpu->a > 0x89) && (cpu->a & 0x0F) > 9)) {
+    if (cpu->f.c || cpu->a > 0x99) {
         correction |= 0x60;
         cy = 1;
     }
@@ -173,50 +203,73 @@ static inline void alu_daa(cpu_8080_t *cpu) {
     cpu->f.c = cy;
 }
 
+// Edge coverage for fuzzing: every control transfer, taken or not, reports
+// (address after the branch instruction, new PC)
+#ifdef CPU_COVERAGE
+#define COVER(m, to) cpu_cover((m), (m)->cpu.pc, (to))
+#else
+#define COVER(m, to) ((void)0)
+#endif
+
 // Jump/call/ret helpers
-static inline void do_jmp(cpu_8080_t *cpu, uint16_t addr) {
-    cpu->pc = addr;
+static inline void do_jmp(machine_t *m, uint16_t addr) {
+    COVER(m, addr);
+    m->cpu.pc = addr;
 }
 
-static inline void cond_jmp(cpu_8080_t *cpu, bool cond) {
-    uint16_t addr = fetch_word(cpu);
-    if (cond) cpu->pc = addr;
+static inline void cond_jmp(machine_t *m, bool cond) {
+    uint16_t addr = fetch_word(m);
+    if (cond) do_jmp(m, addr);
+    else COVER(m, m->cpu.pc);
 }
 
-static inline void do_call(cpu_8080_t *cpu, uint16_t addr) {
-    push(cpu, cpu->pc);
+static inline void do_call(machine_t *m, uint16_t addr) {
+    cpu_8080_t *cpu = &m->cpu;
+    if (__builtin_expect(m->mem.page_flags[addr >> MEM_PAGE_SHIFT] & MEM_PAGE_HOOK, 0) && hook_call(m, addr)) return;
+    push(m, cpu->pc);
+    COVER(m, addr);
     cpu->pc = addr;
 }
 
-static inline void cond_call(cpu_8080_t *cpu, bool cond) {
-    uint16_t addr = fetch_word(cpu);
+static inline void cond_call(machine_t *m, bool cond) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t addr = fetch_word(m);
     if (cond) {
-        do_call(cpu, addr);
-        cpu->cycles += 6;
+        do_call(m, addr);
+        cpu->cycles += OP_TAKEN_CYCLES;
+    } else {
+        COVER(m, cpu->pc);
     }
 }
 
-static inline void do_ret(cpu_8080_t *cpu) {
-    cpu->pc = pop(cpu);
+static inline void do_ret(machine_t *m) {
+    uint16_t addr = pop(m);
+    COVER(m, addr);
+    m->cpu.pc = addr;
 }
 
-static inline void cond_ret(cpu_8080_t *cpu, bool cond) {
+static inline void cond_ret(machine_t *m, bool cond) {
+    cpu_8080_t *cpu = &m->cpu;
     if (cond) {
-        do_ret(cpu);
-        cpu->cycles += 6;
+        do_ret(m);
+        cpu->cycles += OP_TAKEN_CYCLES;
+    } else {
+        COVER(m, cpu->pc);
     }
 }
 
 // PSW operations
-static inline void push_psw(cpu_8080_t *cpu) {
+static inline void push_psw(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
     cpu->f._1 = 1;  // bit 1 always 1
     cpu->f._0a = 0; // bit 3 always 0
     cpu->f._0b = 0; // bit 5 always 0
-    push(cpu, (cpu->a << 8) | cpu->f.byte);
+    push(m, (cpu->a << 8) | cpu->f.byte);
 }
 
-static inline void pop_psw(cpu_8080_t *cpu) {
-    uint16_t af = pop(cpu);
+static inline void pop_psw(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint16_t af = pop(m);
     cpu->a = af >> 8;
     cpu->f.byte = af & 0xFF;
 }
@@ -235,11 +288,17 @@ void cpu_init(cpu_8080_t *cpu) {
     cpu->cycles = 0;
 }
 
-int cpu_step(cpu_8080_t *cpu) {
+int cpu_step(machine_t *m) {
+    if (m->mem.lazy_pages && !m->cpu.halted) prefault(m);
+    return cpu_exec(m);
+}
+
+int cpu_exec(machine_t *m) {
+    cpu_8080_t *cpu = &m->cpu;
     if (cpu->halted) return 4;
 
-    uint8_t op = fetch(cpu);
-    cpu->cycles += CYCLES[op];
+    uint8_t op = fetch(m);
+    cpu->cycles += OP_CYCLES[op];
 
     switch (op) {
     // NOP
@@ -253,7 +312,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x43: cpu->bc.hi = cpu->de.lo; break;  // MOV B,E
     case 0x44: cpu->bc.hi = cpu->hl.hi; break;  // MOV B,H
     case 0x45: cpu->bc.hi = cpu->hl.lo; break;  // MOV B,L
-    case 0x46: cpu->bc.hi = mem_read(cpu->hl.word); break;  // MOV B,M
+    case 0x46: cpu->bc.hi = cpu_read(m, cpu->hl.word); break;  // MOV B,M
     case 0x47: cpu->bc.hi = cpu->a; break;      // MOV B,A
 
     case 0x48: cpu->bc.lo = cpu->bc.hi; break;  // MOV C,B
@@ -262,7 +321,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x4B: cpu->bc.lo = cpu->de.lo; break;  // MOV C,E
     case 0x4C: cpu->bc.lo = cpu->hl.hi; break;  // MOV C,H
     case 0x4D: cpu->bc.lo = cpu->hl.lo; break;  // MOV C,L
-    case 0x4E: cpu->bc.lo = mem_read(cpu->hl.word); break;  // MOV C,M
+    case 0x4E: cpu->bc.lo = cpu_read(m, cpu->hl.word); break;  // MOV C,M
     case 0x4F: cpu->bc.lo = cpu->a; break;      // MOV C,A
 
     case 0x50: cpu->de.hi = cpu->bc.hi; break;  // MOV D,B
@@ -271,7 +330,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x53: cpu->de.hi = cpu->de.lo; break;  // MOV D,E
     case 0x54: cpu->de.hi = cpu->hl.hi; break;  // MOV D,H
     case 0x55: cpu->de.hi = cpu->hl.lo; break;  // MOV D,L
-    case 0x56: cpu->de.hi = mem_read(cpu->hl.word); break;  // MOV D,M
+    case 0x56: cpu->de.hi = cpu_read(m, cpu->hl.word); break;  // MOV D,M
     case 0x57: cpu->de.hi = cpu->a; break;      // MOV D,A
 
     case 0x58: cpu->de.lo = cpu->bc.hi; break;  // MOV E,B
@@ -280,7 +339,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x5B: cpu->de.lo = cpu->de.lo; break;  // MOV E,E
     case 0x5C: cpu->de.lo = cpu->hl.hi; break;  // MOV E,H
     case 0x5D: cpu->de.lo = cpu->hl.lo; break;  // MOV E,L
-    case 0x5E: cpu->de.lo = mem_read(cpu->hl.word); break;  // MOV E,M
+    case 0x5E: cpu->de.lo = cpu_read(m, cpu->hl.word); break;  // MOV E,M
     case 0x5F: cpu->de.lo = cpu->a; break;      // MOV E,A
 
     case 0x60: cpu->hl.hi = cpu->bc.hi; break;  // MOV H,B
@@ -289,7 +348,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x63: cpu->hl.hi = cpu->de.lo; break;  // MOV H,E
     case 0x64: cpu->hl.hi = cpu->hl.hi; break;  // MOV H,H
     case 0x65: cpu->hl.hi = cpu->hl.lo; break;  // MOV H,L
-    case 0x66: cpu->hl.hi = mem_read(cpu->hl.word); break;  // MOV H,M
+    case 0x66: cpu->hl.hi = cpu_read(m, cpu->hl.word); break;  // MOV H,M
     case 0x67: cpu->hl.hi = cpu->a; break;      // MOV H,A
 
     case 0x68: cpu->hl.lo = cpu->bc.hi; break;  // MOV L,B
@@ -298,16 +357,16 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x6B: cpu->hl.lo = cpu->de.lo; break;  // MOV L,E
     case 0x6C: cpu->hl.lo = cpu->hl.hi; break;  // MOV L,H
     case 0x6D: cpu->hl.lo = cpu->hl.lo; break;  // MOV L,L
-    case 0x6E: cpu->hl.lo = mem_read(cpu->hl.word); break;  // MOV L,M
+    case 0x6E: cpu->hl.lo = cpu_read(m, cpu->hl.word); break;  // MOV L,M
     case 0x6F: cpu->hl.lo = cpu->a; break;      // MOV L,A
 
-    case 0x70: mem_write(cpu->hl.word, cpu->bc.hi); break;  // MOV M,B
-    case 0x71: mem_write(cpu->hl.word, cpu->bc.lo); break;  // MOV M,C
-    case 0x72: mem_write(cpu->hl.word, cpu->de.hi); break;  // MOV M,D
-    case 0x73: mem_write(cpu->hl.word, cpu->de.lo); break;  // MOV M,E
-    case 0x74: mem_write(cpu->hl.word, cpu->hl.hi); break;  // MOV M,H
-    case 0x75: mem_write(cpu->hl.word, cpu->hl.lo); break;  // MOV M,L
-    case 0x77: mem_write(cpu->hl.word, cpu->a); break;      // MOV M,A
+    case 0x70: cpu_write(m, cpu->hl.word, cpu->bc.hi); break;  // MOV M,B
+    case 0x71: cpu_write(m, cpu->hl.word, cpu->bc.lo); break;  // MOV M,C
+    case 0x72: cpu_write(m, cpu->hl.word, cpu->de.hi); break;  // MOV M,D
+    case 0x73: cpu_write(m, cpu->hl.word, cpu->de.lo); break;  // MOV M,E
+    case 0x74: cpu_write(m, cpu->hl.word, cpu->hl.hi); break;  // MOV M,H
+    case 0x75: cpu_write(m, cpu->hl.word, cpu->hl.lo); break;  // MOV M,L
+    case 0x77: cpu_write(m, cpu->hl.word, cpu->a); break;      // MOV M,A
 
     case 0x78: cpu->a = cpu->bc.hi; break;  // MOV A,B
     case 0x79: cpu->a = cpu->bc.lo; break;  // MOV A,C
@@ -315,40 +374,40 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x7B: cpu->a = cpu->de.lo; break;  // MOV A,E
     case 0x7C: cpu->a = cpu->hl.hi; break;  // MOV A,H
     case 0x7D: cpu->a = cpu->hl.lo; break;  // MOV A,L
-    case 0x7E: cpu->a = mem_read(cpu->hl.word); break;  // MOV A,M
+    case 0x7E: cpu->a = cpu_read(m, cpu->hl.word); break;  // MOV A,M
     case 0x7F: cpu->a = cpu->a; break;      // MOV A,A
 
     // MVI r,d8
-    case 0x06: cpu->bc.hi = fetch(cpu); break;  // MVI B
-    case 0x0E: cpu->bc.lo = fetch(cpu); break;  // MVI C
-    case 0x16: cpu->de.hi = fetch(cpu); break;  // MVI D
-    case 0x1E: cpu->de.lo = fetch(cpu); break;  // MVI E
-    case 0x26: cpu->hl.hi = fetch(cpu); break;  // MVI H
-    case 0x2E: cpu->hl.lo = fetch(cpu); break;  // MVI L
-    case 0x36: mem_write(cpu->hl.word, fetch(cpu)); break;  // MVI M
-    case 0x3E: cpu->a = fetch(cpu); break;      // MVI A
+    case 0x06: cpu->bc.hi = fetch(m); break;  // MVI B
+    case 0x0E: cpu->bc.lo = fetch(m); break;  // MVI C
+    case 0x16: cpu->de.hi = fetch(m); break;  // MVI D
+    case 0x1E: cpu->de.lo = fetch(m); break;  // MVI E
+    case 0x26: cpu->hl.hi = fetch(m); break;  // MVI H
+    case 0x2E: cpu->hl.lo = fetch(m); break;  // MVI L
+    case 0x36: cpu_write(m, cpu->hl.word, fetch(m)); break;  // MVI M
+    case 0x3E: cpu->a = fetch(m); break;      // MVI A
 
     // LXI rp,d16
-    case 0x01: cpu->bc.word = fetch_word(cpu); break;  // LXI B
-    case 0x11: cpu->de.word = fetch_word(cpu); break;  // LXI D
-    case 0x21: cpu->hl.word = fetch_word(cpu); break;  // LXI H
-    case 0x31: cpu->sp = fetch_word(cpu); break;       // LXI SP
+    case 0x01: cpu->bc.word = fetch_word(m); break;  // LXI B
+    case 0x11: cpu->de.word = fetch_word(m); break;  // LXI D
+    case 0x21: cpu->hl.word = fetch_word(m); break;  // LXI H
+    case 0x31: cpu->sp = fetch_word(m); break;       // LXI SP
 
     // LDA/STA/LHLD/SHLD
-    case 0x3A: cpu->a = mem_read(fetch_word(cpu)); break;  // LDA
-    case 0x32: mem_write(fetch_word(cpu), cpu->a); break;  // STA
-    case 0x2A: cpu->hl.word = mem_read16(fetch_word(cpu)); break;  // LHLD
-    case 0x22: mem_write16(fetch_word(cpu), cpu->hl.word); break;  // SHLD
+    case 0x3A: cpu->a = cpu_read(m, fetch_word(m)); break;  // LDA
+    case 0x32: cpu_write(m, fetch_word(m), cpu->a); break;  // STA
+    case 0x2A: cpu->hl.word = cpu_read16(m, fetch_word(m)); break;  // LHLD
+    case 0x22: cpu_write16(m, fetch_word(m), cpu->hl.word); break;  // SHLD
 
     // LDAX/STAX
-    case 0x0A: cpu->a = mem_read(cpu->bc.word); break;  // LDAX B
-    case 0x1A: cpu->a = mem_read(cpu->de.word); break;  // LDAX D
-    case 0x02: mem_write(cpu->bc.word, cpu->a); break;  // STAX B
-    case 0x12: mem_write(cpu->de.word, cpu->a); break;  // STAX D
+    case 0x0A: cpu->a = cpu_read(m, cpu->bc.word); break;  // LDAX B
+    case 0x1A: cpu->a = cpu_read(m, cpu->de.word); break;  // LDAX D
+    case 0x02: cpu_write(m, cpu->bc.word, cpu->a); break;  // STAX B
+    case 0x12: cpu_write(m, cpu->de.word, cpu->a); break;  // STAX D
 
     // XCHG, XTHL, SPHL
     case 0xEB: { uint16_t t = cpu->hl.word; cpu->hl.word = cpu->de.word; cpu->de.word = t; } break;  // XCHG
-    case 0xE3: { uint16_t t = mem_read16(cpu->sp); mem_write16(cpu->sp, cpu->hl.word); cpu->hl.word = t; } break;  // XTHL
+    case 0xE3: { uint16_t t = cpu_read16(m, cpu->sp); cpu_write16(m, cpu->sp, cpu->hl.word); cpu->hl.word = t; } break;  // XTHL
     case 0xF9: cpu->sp = cpu->hl.word; break;  // SPHL
 
     // ADD r
@@ -358,9 +417,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x83: alu_add(cpu, cpu->de.lo, 0); break;
     case 0x84: alu_add(cpu, cpu->hl.hi, 0); break;
     case 0x85: alu_add(cpu, cpu->hl.lo, 0); break;
-    case 0x86: alu_add(cpu, mem_read(cpu->hl.word), 0); break;
+    case 0x86: alu_add(cpu, cpu_read(m, cpu->hl.word), 0); break;
     case 0x87: alu_add(cpu, cpu->a, 0); break;
-    case 0xC6: alu_add(cpu, fetch(cpu), 0); break;  // ADI
+    case 0xC6: alu_add(cpu, fetch(m), 0); break;  // ADI
 
     // ADC r
     case 0x88: alu_add(cpu, cpu->bc.hi, cpu->f.c); break;
@@ -369,9 +428,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x8B: alu_add(cpu, cpu->de.lo, cpu->f.c); break;
     case 0x8C: alu_add(cpu, cpu->hl.hi, cpu->f.c); break;
     case 0x8D: alu_add(cpu, cpu->hl.lo, cpu->f.c); break;
-    case 0x8E: alu_add(cpu, mem_read(cpu->hl.word), cpu->f.c); break;
+    case 0x8E: alu_add(cpu, cpu_read(m, cpu->hl.word), cpu->f.c); break;
     case 0x8F: alu_add(cpu, cpu->a, cpu->f.c); break;
-    case 0xCE: alu_add(cpu, fetch(cpu), cpu->f.c); break;  // ACI
+    case 0xCE: alu_add(cpu, fetch(m), cpu->f.c); break;  // ACI
 
     // SUB r
     case 0x90: alu_sub(cpu, cpu->bc.hi, 0); break;
@@ -380,9 +439,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x93: alu_sub(cpu, cpu->de.lo, 0); break;
     case 0x94: alu_sub(cpu, cpu->hl.hi, 0); break;
     case 0x95: alu_sub(cpu, cpu->hl.lo, 0); break;
-    case 0x96: alu_sub(cpu, mem_read(cpu->hl.word), 0); break;
+    case 0x96: alu_sub(cpu, cpu_read(m, cpu->hl.word), 0); break;
     case 0x97: alu_sub(cpu, cpu->a, 0); break;
-    case 0xD6: alu_sub(cpu, fetch(cpu), 0); break;  // SUI
+    case 0xD6: alu_sub(cpu, fetch(m), 0); break;  // SUI
 
     // SBB r
     case 0x98: alu_sub(cpu, cpu->bc.hi, cpu->f.c); break;
@@ -391,9 +450,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x9B: alu_sub(cpu, cpu->de.lo, cpu->f.c); break;
     case 0x9C: alu_sub(cpu, cpu->hl.hi, cpu->f.c); break;
     case 0x9D: alu_sub(cpu, cpu->hl.lo, cpu->f.c); break;
-    case 0x9E: alu_sub(cpu, mem_read(cpu->hl.word), cpu->f.c); break;
+    case 0x9E: alu_sub(cpu, cpu_read(m, cpu->hl.word), cpu->f.c); break;
     case 0x9F: alu_sub(cpu, cpu->a, cpu->f.c); break;
-    case 0xDE: alu_sub(cpu, fetch(cpu), cpu->f.c); break;  // SBI
+    case 0xDE: alu_sub(cpu, fetch(m), cpu->f.c); break;  // SBI
 
     // ANA r
     case 0xA0: alu_ana(cpu, cpu->bc.hi); break;
@@ -402,9 +461,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0xA3: alu_ana(cpu, cpu->de.lo); break;
     case 0xA4: alu_ana(cpu, cpu->hl.hi); break;
     case 0xA5: alu_ana(cpu, cpu->hl.lo); break;
-    case 0xA6: alu_ana(cpu, mem_read(cpu->hl.word)); break;
+    case 0xA6: alu_ana(cpu, cpu_read(m, cpu->hl.word)); break;
     case 0xA7: alu_ana(cpu, cpu->a); break;
-    case 0xE6: alu_ana(cpu, fetch(cpu)); break;  // ANI
+    case 0xE6: alu_ana(cpu, fetch(m)); break;  // ANI
 
     // XRA r
     case 0xA8: alu_xra(cpu, cpu->bc.hi); break;
@@ -413,9 +472,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0xAB: alu_xra(cpu, cpu->de.lo); break;
     case 0xAC: alu_xra(cpu, cpu->hl.hi); break;
     case 0xAD: alu_xra(cpu, cpu->hl.lo); break;
-    case 0xAE: alu_xra(cpu, mem_read(cpu->hl.word)); break;
+    case 0xAE: alu_xra(cpu, cpu_read(m, cpu->hl.word)); break;
     case 0xAF: alu_xra(cpu, cpu->a); break;
-    case 0xEE: alu_xra(cpu, fetch(cpu)); break;  // XRI
+    case 0xEE: alu_xra(cpu, fetch(m)); break;  // XRI
 
     // ORA r
     case 0xB0: alu_ora(cpu, cpu->bc.hi); break;
@@ -424,9 +483,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0xB3: alu_ora(cpu, cpu->de.lo); break;
     case 0xB4: alu_ora(cpu, cpu->hl.hi); break;
     case 0xB5: alu_ora(cpu, cpu->hl.lo); break;
-    case 0xB6: alu_ora(cpu, mem_read(cpu->hl.word)); break;
+    case 0xB6: alu_ora(cpu, cpu_read(m, cpu->hl.word)); break;
     case 0xB7: alu_ora(cpu, cpu->a); break;
-    case 0xF6: alu_ora(cpu, fetch(cpu)); break;  // ORI
+    case 0xF6: alu_ora(cpu, fetch(m)); break;  // ORI
 
     // CMP r
     case 0xB8: alu_cmp(cpu, cpu->bc.hi); break;
@@ -435,9 +494,9 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0xBB: alu_cmp(cpu, cpu->de.lo); break;
     case 0xBC: alu_cmp(cpu, cpu->hl.hi); break;
     case 0xBD: alu_cmp(cpu, cpu->hl.lo); break;
-    case 0xBE: alu_cmp(cpu, mem_read(cpu->hl.word)); break;
+    case 0xBE: alu_cmp(cpu, cpu_read(m, cpu->hl.word)); break;
     case 0xBF: alu_cmp(cpu, cpu->a); break;
-    case 0xFE: alu_cmp(cpu, fetch(cpu)); break;  // CPI
+    case 0xFE: alu_cmp(cpu, fetch(m)); break;  // CPI
 
     // INR r
     case 0x04: cpu->bc.hi = alu_inr(cpu, cpu->bc.hi); break;
@@ -446,7 +505,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x1C: cpu->de.lo = alu_inr(cpu, cpu->de.lo); break;
     case 0x24: cpu->hl.hi = alu_inr(cpu, cpu->hl.hi); break;
     case 0x2C: cpu->hl.lo = alu_inr(cpu, cpu->hl.lo); break;
-    case 0x34: mem_write(cpu->hl.word, alu_inr(cpu, mem_read(cpu->hl.word))); break;
+    case 0x34: cpu_write(m, cpu->hl.word, alu_inr(cpu, cpu_read(m, cpu->hl.word))); break;
     case 0x3C: cpu->a = alu_inr(cpu, cpu->a); break;
 
     // DCR r
@@ -456,7 +515,7 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x1D: cpu->de.lo = alu_dcr(cpu, cpu->de.lo); break;
     case 0x25: cpu->hl.hi = alu_dcr(cpu, cpu->hl.hi); break;
     case 0x2D: cpu->hl.lo = alu_dcr(cpu, cpu->hl.lo); break;
-    case 0x35: mem_write(cpu->hl.word, alu_dcr(cpu, mem_read(cpu->hl.word))); break;
+    case 0x35: cpu_write(m, cpu->hl.word, alu_dcr(cpu, cpu_read(m, cpu->hl.word))); break;
     case 0x3D: cpu->a = alu_dcr(cpu, cpu->a); break;
 
     // INX/DCX rp
@@ -488,62 +547,62 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x3F: cpu->f.c = !cpu->f.c; break;  // CMC
 
     // JMP
-    case 0xC3: case 0xCB: do_jmp(cpu, fetch_word(cpu)); break;
-    case 0xC2: cond_jmp(cpu, !cpu->f.z); break;  // JNZ
-    case 0xCA: cond_jmp(cpu, cpu->f.z); break;   // JZ
-    case 0xD2: cond_jmp(cpu, !cpu->f.c); break;  // JNC
-    case 0xDA: cond_jmp(cpu, cpu->f.c); break;   // JC
-    case 0xE2: cond_jmp(cpu, !cpu->f.p); break;  // JPO
-    case 0xEA: cond_jmp(cpu, cpu->f.p); break;   // JPE
-    case 0xF2: cond_jmp(cpu, !cpu->f.s); break;  // JP
-    case 0xFA: cond_jmp(cpu, cpu->f.s); break;   // JM
-    case 0xE9: cpu->pc = cpu->hl.word; break;    // PCHL
+    case 0xC3: case 0xCB: do_jmp(m, fetch_word(m)); break;
+    case 0xC2: cond_jmp(m, !cpu->f.z); break;  // JNZ
+    case 0xCA: cond_jmp(m, cpu->f.z); break;   // JZ
+    case 0xD2: cond_jmp(m, !cpu->f.c); break;  // JNC
+    case 0xDA: cond_jmp(m, cpu->f.c); break;   // JC
+    case 0xE2: cond_jmp(m, !cpu->f.p); break;  // JPO
+    case 0xEA: cond_jmp(m, cpu->f.p); break;   // JPE
+    case 0xF2: cond_jmp(m, !cpu->f.s); break;  // JP
+    case 0xFA: cond_jmp(m, cpu->f.s); break;   // JM
+    case 0xE9: do_jmp(m, cpu->hl.word); break;    // PCHL
 
     // CALL
-    case 0xCD: case 0xDD: case 0xED: case 0xFD: do_call(cpu, fetch_word(cpu)); break;
-    case 0xC4: cond_call(cpu, !cpu->f.z); break;  // CNZ
-    case 0xCC: cond_call(cpu, cpu->f.z); break;   // CZ
-    case 0xD4: cond_call(cpu, !cpu->f.c); break;  // CNC
-    case 0xDC: cond_call(cpu, cpu->f.c); break;   // CC
-    case 0xE4: cond_call(cpu, !cpu->f.p); break;  // CPO
-    case 0xEC: cond_call(cpu, cpu->f.p); break;   // CPE
-    case 0xF4: cond_call(cpu, !cpu->f.s); break;  // CP
-    case 0xFC: cond_call(cpu, cpu->f.s); break;   // CM
+    case 0xCD: case 0xDD: case 0xED: case 0xFD: do_call(m, fetch_word(m)); break;
+    case 0xC4: cond_call(m, !cpu->f.z); break;  // CNZ
+    case 0xCC: cond_call(m, cpu->f.z); break;   // CZ
+    case 0xD4: cond_call(m, !cpu->f.c); break;  // CNC
+    case 0xDC: cond_call(m, cpu->f.c); break;   // CC
+    case 0xE4: cond_call(m, !cpu->f.p); break;  // CPO
+    case 0xEC: cond_call(m, cpu->f.p); break;   // CPE
+    case 0xF4: cond_call(m, !cpu->f.s); break;  // CP
+    case 0xFC: cond_call(m, cpu->f.s); break;   // CM
 
     // RET
-    case 0xC9: case 0xD9: do_ret(cpu); break;
-    case 0xC0: cond_ret(cpu, !cpu->f.z); break;  // RNZ
-    case 0xC8: cond_ret(cpu, cpu->f.z); break;   // RZ
-    case 0xD0: cond_ret(cpu, !cpu->f.c); break;  // RNC
-    case 0xD8: cond_ret(cpu, cpu->f.c); break;   // RC
-    case 0xE0: cond_ret(cpu, !cpu->f.p); break;  // RPO
-    case 0xE8: cond_ret(cpu, cpu->f.p); break;   // RPE
-    case 0xF0: cond_ret(cpu, !cpu->f.s); break;  // RP
-    case 0xF8: cond_ret(cpu, cpu->f.s); break;   // RM
+    case 0xC9: case 0xD9: do_ret(m); break;
+    case 0xC0: cond_ret(m, !cpu->f.z); break;  // RNZ
+    case 0xC8: cond_ret(m, cpu->f.z); break;   // RZ
+    case 0xD0: cond_ret(m, !cpu->f.c); break;  // RNC
+    case 0xD8: cond_ret(m, cpu->f.c); break;   // RC
+    case 0xE0: cond_ret(m, !cpu->f.p); break;  // RPO
+    case 0xE8: cond_ret(m, cpu->f.p); break;   // RPE
+    case 0xF0: cond_ret(m, !cpu->f.s); break;  // RP
+    case 0xF8: cond_ret(m, cpu->f.s); break;   // RM
 
     // RST n
-    case 0xC7: do_call(cpu, 0x00); break;
-    case 0xCF: do_call(cpu, 0x08); break;
-    case 0xD7: do_call(cpu, 0x10); break;
-    case 0xDF: do_call(cpu, 0x18); break;
-    case 0xE7: do_call(cpu, 0x20); break;
-    case 0xEF: do_call(cpu, 0x28); break;
-    case 0xF7: do_call(cpu, 0x30); break;
-    case 0xFF: do_call(cpu, 0x38); break;
+    case 0xC7: do_call(m, 0x00); break;
+    case 0xCF: do_call(m, 0x08); break;
+    case 0xD7: do_call(m, 0x10); break;
+    case 0xDF: do_call(m, 0x18); break;
+    case 0xE7: do_call(m, 0x20); break;
+    case 0xEF: do_call(m, 0x28); break;
+    case 0xF7: do_call(m, 0x30); break;
+    case 0xFF: do_call(m, 0x38); break;
 
     // PUSH/POP
-    case 0xC5: push(cpu, cpu->bc.word); break;
-    case 0xD5: push(cpu, cpu->de.word); break;
-    case 0xE5: push(cpu, cpu->hl.word); break;
-    case 0xF5: push_psw(cpu); break;
-    case 0xC1: cpu->bc.word = pop(cpu); break;
-    case 0xD1: cpu->de.word = pop(cpu); break;
-    case 0xE1: cpu->hl.word = pop(cpu); break;
-    case 0xF1: pop_psw(cpu); break;
+    case 0xC5: push(m, cpu->bc.word); break;
+    case 0xD5: push(m, cpu->de.word); break;
+    case 0xE5: push(m, cpu->hl.word); break;
+    case 0xF5: push_psw(m); break;
+    case 0xC1: cpu->bc.word = pop(m); break;
+    case 0xD1: cpu->de.word = pop(m); break;
+    case 0xE1: cpu->hl.word = pop(m); break;
+    case 0xF1: pop_psw(m); break;
 
     // I/O
-    case 0xDB: cpu->a = io_read(fetch(cpu)); break;  // IN
-    case 0xD3: io_write(fetch(cpu), cpu->a); break;  // OUT
+    case 0xDB: cpu->a = io_read(m, fetch(m)); break;  // IN
+    case 0xD3: io_write(m, fetch(m), cpu->a); break;  // OUT
 
     // Interrupts
     case 0xF3: cpu->inte = false; break;  // DI
@@ -553,86 +612,48 @@ int cpu_step(cpu_8080_t *cpu) {
     case 0x76: cpu->halted = true; break;
     }
 
-    return CYCLES[op];
+    return OP_CYCLES[op];
 }
 
-void cpu_interrupt(cpu_8080_t *cpu, uint8_t rst_num) {
+void cpu_interrupt(machine_t *m, uint8_t rst_num) {
+    cpu_8080_t *cpu = &m->cpu;
     if (cpu->inte) {
         cpu->inte = false;
         cpu->halted = false;
-        do_call(cpu, rst_num * 8);
+        if (m->mem.lazy_pages) prefault_at(m, cpu->sp - 2, 2);
+        do_call(m, rst_num * 8);
         cpu->cycles += 11;
     }
 }
 
-// Instruction lengths: 1, 2, or 3 bytes
-static const uint8_t OP_LENGTHS[256] = {
-//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
-    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 0
-    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 1
-    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 2
-    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 3
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 8
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // A
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // B
-    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,  // C
-    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,  // D
-    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,  // E
-    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1   // F
-};
-
-int cpu_disasm(uint16_t addr, char *buf, size_t buf_size) {
-    static const char *MNEMONICS[256] = {
-        "NOP", "LXI B,", "STAX B", "INX B", "INR B", "DCR B", "MVI B,", "RLC",
-        "NOP", "DAD B", "LDAX B", "DCX B", "INR C", "DCR C", "MVI C,", "RRC",
-        "NOP", "LXI D,", "STAX D", "INX D", "INR D", "DCR D", "MVI D,", "RAL",
-        "NOP", "DAD D", "LDAX D", "DCX D", "INR E", "DCR E", "MVI E,", "RAR",
-        "NOP", "LXI H,", "SHLD ", "INX H", "INR H", "DCR H", "MVI H,", "DAA",
-        "NOP", "DAD H", "LHLD ", "DCX H", "INR L", "DCR L", "MVI L,", "CMA",
-        "NOP", "LXI SP,", "STA ", "INX SP", "INR M", "DCR M", "MVI M,", "STC",
-        "NOP", "DAD SP", "LDA ", "DCX SP", "INR A", "DCR A", "MVI A,", "CMC",
-        "MOV B,B", "MOV B,C", "MOV B,D", "MOV B,E", "MOV B,H", "MOV B,L", "MOV B,M", "MOV B,A",
-        "MOV C,B", "MOV C,C", "MOV C,D", "MOV C,E", "MOV C,H", "MOV C,L", "MOV C,M", "MOV C,A",
-        "MOV D,B", "MOV D,C", "MOV D,D", "MOV D,E", "MOV D,H", "MOV D,L", "MOV D,M", "MOV D,A",
-        "MOV E,B", "MOV E,C", "MOV E,D", "MOV E,E", "MOV E,H", "MOV E,L", "MOV E,M", "MOV E,A",
-        "MOV H,B", "MOV H,C", "MOV H,D", "MOV H,E", "MOV H,H", "MOV H,L", "MOV H,M", "MOV H,A",
-        "MOV L,B", "MOV L,C", "MOV L,D", "MOV L,E", "MOV L,H", "MOV L,L", "MOV L,M", "MOV L,A",
-        "MOV M,B", "MOV M,C", "MOV M,D", "MOV M,E", "MOV M,H", "MOV M,L", "HLT", "MOV M,A",
-        "MOV A,B", "MOV A,C", "MOV A,D", "MOV A,E", "MOV A,H", "MOV A,L", "MOV A,M", "MOV A,A",
-        "ADD B", "ADD C", "ADD D", "ADD E", "ADD H", "ADD L", "ADD M", "ADD A",
-        "ADC B", "ADC C", "ADC D", "ADC E", "ADC H", "ADC L", "ADC M", "ADC A",
-        "SUB B", "SUB C", "SUB D", "SUB E", "SUB H", "SUB L", "SUB M", "SUB A",
-        "SBB B", "SBB C", "SBB D", "SBB E", "SBB H", "SBB L", "SBB M", "SBB A",
-        "ANA B", "ANA C", "ANA D", "ANA E", "ANA H", "ANA L", "ANA M", "ANA A",
-        "XRA B", "XRA C", "XRA D", "XRA E", "XRA H", "XRA L", "XRA M", "XRA A",
-        "ORA B", "ORA C", "ORA D", "ORA E", "ORA H", "ORA L", "ORA M", "ORA A",
-        "CMP B", "CMP C", "CMP D", "CMP E", "CMP H", "CMP L", "CMP M", "CMP A",
-        "RNZ", "POP B", "JNZ ", "JMP ", "CNZ ", "PUSH B", "ADI ", "RST 0",
-        "RZ", "RET", "JZ ", "JMP ", "CZ ", "CALL ", "ACI ", "RST 1",
-        "RNC", "POP D", "JNC ", "OUT ", "CNC ", "PUSH D", "SUI ", "RST 2",
-        "RC", "RET", "JC ", "IN ", "CC ", "CALL ", "SBI ", "RST 3",
-        "RPO", "POP H", "JPO ", "XTHL", "CPO ", "PUSH H", "ANI ", "RST 4",
-        "RPE", "PCHL", "JPE ", "XCHG", "CPE ", "CALL ", "XRI ", "RST 5",
-        "RP", "POP PSW", "JP ", "DI", "CP ", "PUSH PSW", "ORI ", "RST 6",
-        "RM", "SPHL", "JM ", "EI", "CM ", "CALL ", "CPI ", "RST 7"
-    };
-
-    uint8_t op = mem_read(addr);
+uint16_t cpu_bus_status(machine_t *m) {
+    const cpu_8080_t *cpu = &m->cpu;
+    uint16_t status = cpu->inte ? BUS_INTE : 0;
+    if (m->mem.page_flags[cpu->pc >> MEM_PAGE_SHIFT] & MEM_PAGE_ROM) status |= BUS_PROT;
+    if (cpu->halted) return status | BUS_HLTA | BUS_MEMR | BUS_WO;
+
+    uint8_t bus = OP_BUS[mem_read(m, cpu->pc)];
+    status |= BUS_M1 | BUS_MEMR;  // The fetch
+    if (bus & OP_BUS_STACK) status |= BUS_STACK;
+    if (bus & OP_BUS_IN) status |= BUS_INP;
+    if (bus & OP_BUS_OUT) status |= BUS_OUT;
+    if (bus & OP_BUS_HALT) status |= BUS_HLTA;
+    if (!(bus & (OP_BUS_WRITE | OP_BUS_OUT))) status |= BUS_WO;
+    return status;
+}
+
+int cpu_disasm(machine_t *m, uint16_t addr, char *buf, size_t buf_size) {
+    uint8_t op = mem_read(m, addr);
     uint8_t len = OP_LENGTHS[op];
 
     if (len == 1) {
-        snprintf(buf, buf_size, "%s", MNEMONICS[op]);
+        snprintf(buf, buf_size, "%s", OP_MNEMONICS[op]);
     } else if (len == 2) {
-        uint8_t byte = mem_read(addr + 1);
-        snprintf(buf, buf_size, "%s%02Xh", MNEMONICS[op], byte);
+        uint8_t byte = mem_read(m, addr + 1);
+        snprintf(buf, buf_size, "%s%02Xh", OP_MNEMONICS[op], byte);
     } else {
-        uint16_t word = mem_read(addr + 1) | (mem_read(addr + 2) << 8);
-        snprintf(buf, buf_size, "%s%04Xh", MNEMONICS[op], word);
+        uint16_t word = mem_read(m, addr + 1) | (mem_read(m, addr + 2) << 8);
+        snprintf(buf, buf_size, "%s%04Xh", OP_MNEMONICS[op], word);
     }
 
     return len;
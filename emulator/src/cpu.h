@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+typedef struct machine machine_t;
+
 // 8080 flags register: S Z 0 AC 0 P 1 C
 typedef union {
     uint8_t byte;
@@ -56,12 +58,41 @@ typedef struct {
 void cpu_init(cpu_8080_t *cpu);
 
 // Execute one instruction, returns cycles consumed
-int cpu_step(cpu_8080_t *cpu);
+int cpu_step(machine_t *m);
+
+// cpu_step for when no memory page is lazy (mem.lazy_pages is 0), which
+// saves it a check per instruction
+int cpu_exec(machine_t *m);
 
 // Raise an interrupt (RST 0-7)
-void cpu_interrupt(cpu_8080_t *cpu, uint8_t rst_num);
+void cpu_interrupt(machine_t *m, uint8_t rst_num);
+
+// Bus status lines, as the front panel's status LEDs show them (high
+// byte first on the LED chain, panel.h)
+#define BUS_INTE  0x8000
+#define BUS_PROT  0x4000
+#define BUS_MEMR  0x2000
+#define BUS_INP   0x1000
+#define BUS_M1    0x0800
+#define BUS_OUT   0x0400
+#define BUS_HLTA  0x0200
+#define BUS_STACK 0x0100
+#define BUS_WO    0x0080  // The 8080's /WO: lit unless writing or outputting
+#define BUS_INT   0x0040
+
+// The status lines raised during the instruction at PC, from its opcode's
+// OP_BUS entry (opcodes.h), with INTE and HLTA from the CPU and PROT from
+// the page map. Nothing per instruction: callers sample it.
+uint16_t cpu_bus_status(machine_t *m);
 
 // Debug: disassemble instruction at addr
-int cpu_disasm(uint16_t addr, char *buf, size_t buf_size);
+int cpu_disasm(machine_t *m, uint16_t addr, char *buf, size_t buf_size);
+
+#ifdef CPU_COVERAGE
+// Coverage hook, supplied by the tool when the core is built with
+// CPU_COVERAGE. Called on every jump, call and return, taken or not, with
+// the address following the branch instruction and the new PC.
+void cpu_cover(machine_t *m, uint16_t from, uint16_t to);
+#endif
 
 #endif
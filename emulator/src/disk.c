@@ -0,0 +1,144 @@
+#include "disk.h"
+#include "machine.h"
+#include <string.h>
+
+void disk_init(machine_t *m) {
+    memset(&m->io.dcdd, 0, sizeof(m->io.dcdd));
+    memset(&m->io.blk, 0, sizeof(m->io.blk));
+    m->io.dcdd.selected = -1;
+}
+
+int dcdd_attach(machine_t *m, int drive, const disk_media_t *media) {
+    if (drive < 0 || drive >= DISK_DRIVES || media->size % DCDD_TRACK_SIZE ||
+        media->size / DCDD_TRACK_SIZE > 255) {
+        return -1;
+    }
+    m->io.dcdd.drive[drive] = *media;
+    m->io.dcdd.track[drive] = 0;
+    return 0;
+}
+
+int blk_attach(machine_t *m, int drive, const disk_media_t *media) {
+    if (drive < 0 || drive >= DISK_DRIVES || media->size % BLK_SIZE || media->size / BLK_SIZE > 65536) return -1;
+    m->io.blk.drive[drive] = *media;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// 88-DCDD
+
+// Offset of the current sector in the selected drive's image
+static size_t dcdd_offset(const dcdd_t *d) {
+    return (size_t)d->track[d->selected] * DCDD_TRACK_SIZE + d->sector * DCDD_SECTOR_SIZE;
+}
+
+uint8_t dcdd_read(machine_t *m, uint8_t port) {
+    dcdd_t *d = &m->io.dcdd;
+    if (d->selected < 0) return 0xFF;
+    const disk_media_t *media = &d->drive[d->selected];
+
+    switch (port) {
+    case PORT_DCDD_STATUS: {
+        uint8_t status = 0xE5;  // Bits 3 and 4 always low, the head always movable
+        if (d->writing && d->pos < DCDD_SECTOR_SIZE) status &= ~0x01;
+        if (d->head_loaded) status &= ~0x04;
+        if (d->inte) status &= ~0x20;
+        if (d->track[d->selected] == 0) status &= ~0x40;
+        if (d->head_loaded && !d->writing) status &= ~0x80;
+        return status;
+    }
+
+    case PORT_DCDD_CONTROL:
+        // The disk turns by one sector per poll, so a BIOS waiting for
+        // its sector never waits long
+        if (!d->head_loaded) return 0xFF;
+        d->sector = (d->sector + 1) % DCDD_SECTORS;
+        d->pos = 0;
+        d->writing = false;
+        return 0xC0 | (d->sector << 1);
+
+    default:
+        if (!d->head_loaded || d->writing || d->pos >= DCDD_SECTOR_SIZE) return 0;
+        return media->data[dcdd_offset(d) + d->pos++];
+    }
+}
+
+void dcdd_write(machine_t *m, uint8_t port, uint8_t val) {
+    dcdd_t *d = &m->io.dcdd;
+    if (port == PORT_DCDD_STATUS) {
+        int drive = val & 0x0F;
+        d->selected = !(val & 0x80) && drive < DISK_DRIVES && d->drive[drive].data ? drive : -1;
+        d->pos = 0;
+        d->writing = false;
+        return;
+    }
+    if (d->selected < 0) return;
+    disk_media_t *media = &d->drive[d->selected];
+    uint8_t *track = &d->track[d->selected];
+
+    if (port == PORT_DCDD_CONTROL) {
+        size_t tracks = media->size / DCDD_TRACK_SIZE;
+        if ((val & 0x01) && *track + 1u < tracks) (*track)++;
+        if ((val & 0x02) && *track > 0) (*track)--;
+        if (val & 0x04) d->head_loaded = true;
+        if (val & 0x08) d->head_loaded = false;
+        if (val & 0x10) d->inte = true;
+        if (val & 0x20) d->inte = false;
+        if (val & 0x03) d->pos = 0;
+        if (val & 0x80) {
+            d->writing = true;
+            d->pos = 0;
+        }
+        return;
+    }
+
+    // Writes to a read-only image are taken and dropped, as with a
+    // write-protected disk the BIOS does not check for
+    if (!d->writing || d->pos >= DCDD_SECTOR_SIZE) return;
+    if (!media->read_only) media->data[dcdd_offset(d) + d->pos] = val;
+    if (++d->pos == DCDD_SECTOR_SIZE) d->writing = false;
+}
+
+// ---------------------------------------------------------------------------
+// Block device
+
+static uint8_t blk_transfer(machine_t *m, uint8_t command) {
+    blkdev_t *b = &m->io.blk;
+    if (command != BLK_READ && command != BLK_WRITE) return BLK_ERR_COMMAND;
+    if (b->unit >= DISK_DRIVES || !b->drive[b->unit].data) return BLK_ERR_DRIVE;
+    disk_media_t *media = &b->drive[b->unit];
+    size_t offset = (size_t)b->block * BLK_SIZE;
+    if (offset >= media->size) return BLK_ERR_BLOCK;
+
+    if (command == BLK_READ) {
+        mem_dma_write(m, b->dma, media->data + offset, BLK_SIZE);
+    } else {
+        if (media->read_only) return BLK_ERR_READONLY;
+        mem_dma_read(m, b->dma, media->data + offset, BLK_SIZE);
+    }
+    return BLK_OK;
+}
+
+uint8_t blk_read(machine_t *m, uint8_t port) {
+    blkdev_t *b = &m->io.blk;
+    switch (port) {
+    case PORT_BLK_COMMAND:  return b->status;
+    case PORT_BLK_DRIVE:    return b->unit;
+    case PORT_BLK_DMA_LO:   return b->dma & 0xFF;
+    case PORT_BLK_DMA_HI:   return b->dma >> 8;
+    case PORT_BLK_BLOCK_LO: return b->block & 0xFF;
+    default:                return b->block >> 8;
+    }
+}
+
+void blk_write(machine_t *m, uint8_t port, uint8_t val) {
+    blkdev_t *b = &m->io.blk;
+    switch (port) {
+    case PORT_BLK_COMMAND:  b->status = blk_transfer(m, val); break;
+    case PORT_BLK_DRIVE:    b->unit = val; break;
+    case PORT_BLK_DMA_LO:   b->dma = (b->dma & 0xFF00) | val; break;
+    case PORT_BLK_DMA_HI:   b->dma = (b->dma & 0x00FF) | (val << 8); break;
+    case PORT_BLK_BLOCK_LO: b->block = (b->block & 0xFF00) | val; break;
+    default:                b->block = (b->block & 0x00FF) | (val << 8); break;
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Disk controllers. Both work directly on image bytes the caller provides
+// (the host tools map the image files, so writes reach the file through
+// the page cache) and never copy a whole image.
+//
+// 88-DCDD: the Altair floppy controller, byte at a time as MITS and CP/M
+// BIOSes expect. Images are raw 137-byte sectors, 32 per track, track 0
+// first (77 tracks for an 8" disk; any whole number of tracks is taken).
+//
+//   08h out  select drive (bits 0-3), bit 7 deselects
+//   08h in   status, active low: 0 write ready, 1 head movable, 2 head
+//            loaded, 5 interrupts enabled, 6 on track 0, 7 read data ready
+//   09h out  control: 0 step in, 1 step out, 2 load head, 3 unload head,
+//            4/5 interrupt enable/disable, 7 start writing the sector
+//   09h in   sector position: bit 0 low at the start of a sector, bits 1-5
+//            the sector; each read moves on to the next sector
+//   0Ah      sector data, read or written one byte per access
+//
+// Block device: whole 128-byte blocks copied to or from memory by one OUT,
+// for BIOSes written for it. Images are any whole number of blocks, up to
+// 65536 of them (8 MB, the CP/M 2.2 limit).
+//
+//   20h out  command: 1 read block into memory, 2 write it from memory
+//   20h in   status of the last command (BLK_OK, BLK_ERR_*)
+//   21h      drive
+//   22h/23h  DMA address, low and high byte
+//   24h/25h  block number, low and high byte
+
+#define DISK_DRIVES       4
+
+#define PORT_DCDD_STATUS  0x08
+#define PORT_DCDD_CONTROL 0x09
+#define PORT_DCDD_DATA    0x0A
+
+#define DCDD_SECTORS      32
+#define DCDD_SECTOR_SIZE  137
+#define DCDD_TRACK_SIZE   (DCDD_SECTORS * DCDD_SECTOR_SIZE)
+
+#define PORT_BLK_COMMAND  0x20
+#define PORT_BLK_DRIVE    0x21
+#define PORT_BLK_DMA_LO   0x22
+#define PORT_BLK_DMA_HI   0x23
+#define PORT_BLK_BLOCK_LO 0x24
+#define PORT_BLK_BLOCK_HI 0x25
+
+#define BLK_SIZE          128
+#define BLK_READ          0x01
+#define BLK_WRITE         0x02
+
+enum {
+    BLK_OK,
+    BLK_ERR_DRIVE,    // No disk in the drive
+    BLK_ERR_BLOCK,    // Block number beyond the image
+    BLK_ERR_READONLY,
+    BLK_ERR_COMMAND,
+};
+
+typedef struct machine machine_t;
+
+// A disk image in memory, not owned; data is NULL for an empty drive
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    bool read_only;
+} disk_media_t;
+
+typedef struct {
+    disk_media_t drive[DISK_DRIVES];
+    uint8_t track[DISK_DRIVES];
+    int8_t selected;   // -1 for none
+    uint8_t sector;
+    uint8_t pos;       // Next byte within the sector
+    bool head_loaded;
+    bool writing;
+    bool inte;
+} dcdd_t;
+
+typedef struct {
+    disk_media_t drive[DISK_DRIVES];
+    uint8_t unit;
+    uint16_t dma;
+    uint16_t block;
+    uint8_t status;
+} blkdev_t;
+
+// Empty both controllers' drives and reset their registers
+void disk_init(machine_t *m);
+
+// Insert an image; returns -1 if its size is not a whole number of tracks
+// (88-DCDD) or blocks (block device) or the drive number is out of range
+int dcdd_attach(machine_t *m, int drive, const disk_media_t *media);
+int blk_attach(machine_t *m, int drive, const disk_media_t *media);
+
+uint8_t dcdd_read(machine_t *m, uint8_t port);
+void dcdd_write(machine_t *m, uint8_t port, uint8_t val);
+uint8_t blk_read(machine_t *m, uint8_t port);
+void blk_write(machine_t *m, uint8_t port, uint8_t val);
+
+#endif
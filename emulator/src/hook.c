@@ -0,0 +1,98 @@
+#include "hook.h"
+#include "machine.h"
+#include <stdlib.h>
+#include <string.h>
+
+void hook_init(hooks_t *hooks) {
+    memset(hooks, 0, sizeof(*hooks));
+}
+
+static hook_t *hook_find(machine_t *m, uint16_t addr) {
+    for (int i = 0; m->hooks && i < HOOK_MAX; i++) {
+        hook_t *h = &m->hooks->hooks[i];
+        if (h->fn && h->addr == addr) return h;
+    }
+    return NULL;
+}
+
+int hook_add(machine_t *m, uint16_t addr, hook_fn fn, void *ctx, uint32_t cycles, uint8_t regs, uint8_t flags) {
+    hook_t *h = hook_find(m, addr);
+    for (int i = 0; m->hooks && !h && i < HOOK_MAX; i++) {
+        if (!m->hooks->hooks[i].fn) h = &m->hooks->hooks[i];
+    }
+    if (!h) return -1;
+    *h = (hook_t){ .addr = addr, .fn = fn, .ctx = ctx, .cycles = cycles, .regs = regs, .flags = flags };
+    m->mem.page_flags[addr >> MEM_PAGE_SHIFT] |= MEM_PAGE_HOOK;
+    return 0;
+}
+
+void hook_remove(machine_t *m, uint16_t addr) {
+    hook_t *h = hook_find(m, addr);
+    if (!h) return;
+    h->fn = NULL;
+    for (int i = 0; i < HOOK_MAX; i++) {
+        h = &m->hooks->hooks[i];
+        if (h->fn && h->addr >> MEM_PAGE_SHIFT == addr >> MEM_PAGE_SHIFT) return;
+    }
+    m->mem.page_flags[addr >> MEM_PAGE_SHIFT] &= ~MEM_PAGE_HOOK;
+}
+
+static bool same_results(machine_t *guest, machine_t *native, const hook_t *h) {
+    const cpu_8080_t *g = &guest->cpu, *n = &native->cpu;
+    if ((h->regs & HOOK_A) && g->a != n->a) return false;
+    if ((h->regs & HOOK_BC) && g->bc.word != n->bc.word) return false;
+    if ((h->regs & HOOK_DE) && g->de.word != n->de.word) return false;
+    if ((h->regs & HOOK_HL) && g->hl.word != n->hl.word) return false;
+    if ((g->f.byte ^ n->f.byte) & h->flags) return false;
+
+    // What the routine left in its stack scratch is no result
+    for (int i = 1; i <= HOOK_STACK_SLACK; i++) {
+        uint16_t a = g->sp - i;
+        native->mem.ram[a] = guest->mem.ram[a];
+    }
+    return memcmp(guest->mem.ram, native->mem.ram, MEMORY_SIZE) == 0;
+}
+
+// Run the guest routine for real and the hook on a copy, and compare
+static void hook_verify(machine_t *m, hook_t *h) {
+    cpu_8080_t *cpu = &m->cpu;
+    machine_t *native = malloc(sizeof(machine_t));
+    if (!native) {
+        h->fn(m, h->ctx);
+        cpu->cycles += h->cycles;
+        return;
+    }
+    mem_fault_range(m, 0, MEMORY_SIZE);
+    *native = *m;
+    h->fn(native, h->ctx);
+
+    uint16_t ret = cpu->pc, sp = cpu->sp;
+    uint64_t start = cpu->cycles;
+    mem_write16(m, sp - 2, ret);
+    cpu->sp = sp - 2;
+    cpu->pc = h->addr;
+    m->hooks->verifying = true;
+    for (uint32_t steps = 0; !(cpu->pc == ret && cpu->sp == sp) && !cpu->halted && steps < HOOK_VERIFY_STEPS; steps++) {
+        cpu_step(m);
+    }
+    m->hooks->verifying = false;
+    h->guest_cycles += cpu->cycles - start;
+    mem_dma_mark(m, 0, MEMORY_SIZE);  // The routine may have written anywhere
+
+    if (cpu->pc != ret || cpu->sp != sp || !same_results(m, native, h)) h->mismatches++;
+    free(native);
+}
+
+bool hook_call(machine_t *m, uint16_t addr) {
+    if (!m->hooks || m->hooks->verifying) return false;
+    hook_t *h = hook_find(m, addr);
+    if (!h) return false;
+    h->calls++;
+    if (m->hooks->verify) {
+        hook_verify(m, h);
+    } else {
+        h->fn(m, h->ctx);
+        m->cpu.cycles += h->cycles;
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef HOOK_H
+#define HOOK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Native hooks: a host function that stands in for a guest subroutine.
+//
+// A CALL, Ccc or RST whose target has a hook runs the function instead of
+// jumping: the function updates registers and memory as the routine would
+// have, its declared cycle count is charged on top of the CALL, and
+// execution carries on after the CALL as if the routine had returned.
+// A function that writes memory reports what it wrote with mem_dma_mark(),
+// as the batch interpreter's cached code would not see it otherwise.
+// Pages with a hook have MEM_PAGE_HOOK set, so a call anywhere else costs
+// one test of the page flags and nothing more.
+//
+// The table lives outside machine_t, which only points at it: every copy
+// of a machine the host tools make stays the size it was.
+//
+// In verify mode the guest routine runs as well (to its RET, with hooks
+// off) and the function is run on a copy of the machine from before the
+// call. The declared output registers and flags and all of memory, except
+// the routine's stack scratch below SP, must match; the guest's results
+// are kept either way.
+
+#define HOOK_MAX          16
+#define HOOK_STACK_SLACK  64      // Bytes below SP a routine may use freely
+#define HOOK_VERIFY_STEPS 10000000
+
+// Output registers compared in verify mode
+#define HOOK_A   0x01
+#define HOOK_BC  0x02
+#define HOOK_DE  0x04
+#define HOOK_HL  0x08
+
+typedef struct machine machine_t;
+
+typedef void (*hook_fn)(machine_t *m, void *ctx);
+
+typedef struct {
+    uint16_t addr;
+    hook_fn fn;         // NULL when the slot is free
+    void *ctx;
+    uint32_t cycles;    // Charged per call, for the routine body and its RET
+    uint8_t regs;       // HOOK_* registers the routine returns results in
+    uint8_t flags;      // Flag bits it returns results in
+
+    // Statistics
+    uint64_t calls;
+    uint64_t mismatches;   // Verify mode: native and guest results differed
+    uint64_t guest_cycles; // Verify mode: cycles the guest routine took
+} hook_t;
+
+typedef struct {
+    hook_t hooks[HOOK_MAX];
+    bool verify;
+    bool verifying;     // Running a guest routine; hooks are off
+} hooks_t;
+
+// Empty a table; point a machine's hooks at it to use it
+void hook_init(hooks_t *hooks);
+
+// Register fn at addr (replacing any hook there). Returns -1 if the
+// machine has no table or it is full.
+int hook_add(machine_t *m, uint16_t addr, hook_fn fn, void *ctx, uint32_t cycles, uint8_t regs, uint8_t flags);
+
+void hook_remove(machine_t *m, uint16_t addr);
+
+// The slow path of a call to a page with MEM_PAGE_HOOK, with the return
+// address not yet pushed: runs the hook at addr and returns true, or
+// returns false if addr has none
+bool hook_call(machine_t *m, uint16_t addr);
+
+#endif
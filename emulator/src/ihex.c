@@ -0,0 +1,142 @@
+#include "ihex.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Digit values, 0xFF for anything that is not a hex digit
+static uint8_t hex_value[256];
+
+int ihex_decode_scalar(const char *hex, size_t n, uint8_t *out) {
+    if (!hex_value['1']) {
+        for (int c = 0; c < 256; c++) hex_value[c] = 0xFF;
+        for (int i = 0; i < 10; i++) hex_value['0' + i] = i;
+        for (int i = 0; i < 6; i++) hex_value['A' + i] = hex_value['a' + i] = 10 + i;
+    }
+    const uint8_t *s = (const uint8_t *)hex;
+    uint8_t bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t hi = hex_value[s[2 * i]], lo = hex_value[s[2 * i + 1]];
+        bad |= hi | lo;
+        out[i] = (hi << 4) | (lo & 0x0F);
+    }
+    return bad & 0xF0 ? -1 : 0;
+}
+
+#if defined(__SSE2__)
+
+// 16 digits to 8 bytes per step. Digits and letters are told apart with
+// signed compares, which is all SSE2 has: anything else falls outside both
+// ranges, including bytes from 80h up.
+static size_t decode_vector(const char *hex, size_t n, uint8_t *out) {
+    const __m128i zero = _mm_set1_epi8('0'), a = _mm_set1_epi8('a'), lower = _mm_set1_epi8(0x20);
+    const __m128i minus_one = _mm_set1_epi8(-1), ten = _mm_set1_epi8(10), six = _mm_set1_epi8(6);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(hex + 2 * i));
+        __m128i digit = _mm_sub_epi8(c, zero);
+        __m128i letter = _mm_sub_epi8(_mm_or_si128(c, lower), a);
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digit, minus_one), _mm_cmplt_epi8(digit, ten));
+        __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letter, minus_one), _mm_cmplt_epi8(letter, six));
+        if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xFFFF) return SIZE_MAX;
+        __m128i v = _mm_or_si128(_mm_and_si128(is_digit, digit),
+                                 _mm_and_si128(is_letter, _mm_add_epi8(letter, ten)));
+        // Each 16-bit lane holds a digit pair, first digit low
+        __m128i hi = _mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00FF));
+        __m128i pair = _mm_or_si128(hi, _mm_srli_epi16(v, 8));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(pair, pair));
+    }
+    return i;
+}
+
+#elif defined(__ARM_NEON)
+
+static uint8x16_t nibbles(uint8x16_t c, uint8x16_t *bad) {
+    uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+    uint8x16_t is_letter = vcltq_u8(letter, vdupq_n_u8(6));
+    *bad = vorrq_u8(*bad, vmvnq_u8(vorrq_u8(is_digit, is_letter)));
+    return vbslq_u8(is_digit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+}
+
+// 32 digits to 16 bytes per step; vld2 splits high and low digits
+static size_t decode_vector(const char *hex, size_t n, uint8_t *out) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t c = vld2q_u8((const uint8_t *)hex + 2 * i);
+        uint8x16_t bad = vdupq_n_u8(0);
+        uint8x16_t hi = nibbles(c.val[0], &bad), lo = nibbles(c.val[1], &bad);
+        uint8x8_t any = vorr_u8(vget_low_u8(bad), vget_high_u8(bad));
+        if (vget_lane_u64(vreinterpret_u64_u8(any), 0)) return SIZE_MAX;
+        vst1q_u8(out + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    }
+    return i;
+}
+
+#else
+
+static size_t decode_vector(const char *hex, size_t n, uint8_t *out) {
+    (void)hex;
+    (void)n;
+    (void)out;
+    return 0;
+}
+
+#endif
+
+int ihex_decode(const char *hex, size_t n, uint8_t *out) {
+    size_t done = decode_vector(hex, n, out);
+    if (done == SIZE_MAX) return -1;
+    return ihex_decode_scalar(hex + 2 * done, n - done, out + done);
+}
+
+int ihex_parse(const char *line, size_t len, ihex_record_t *rec) {
+    // Bytes after the type that address and start records must have
+    static const int8_t TYPE_LEN[] = { -1, 0, 2, 4, 2, 4 };
+    uint8_t head[4];
+    if (len < 11 || line[0] != ':' || ihex_decode(line + 1, 4, head) < 0) return IHEX_BAD_RECORD;
+    rec->len = head[0];
+    rec->addr = (head[1] << 8) | head[2];
+    rec->type = head[3];
+    if (rec->type > IHEX_LINEAR_START || len < 11 + 2 * (size_t)rec->len) return IHEX_BAD_RECORD;
+    if (TYPE_LEN[rec->type] >= 0 && rec->len != TYPE_LEN[rec->type]) return IHEX_BAD_RECORD;
+    if (ihex_decode(line + 9, rec->len + 1, rec->data) < 0) return IHEX_BAD_RECORD;
+
+    uint8_t sum = head[0] + head[1] + head[2] + head[3];
+    for (int i = 0; i <= rec->len; i++) sum += rec->data[i];
+    return sum ? IHEX_BAD_CHECKSUM : IHEX_OK;
+}
+
+void ihex_apply(ihex_state_t *state, const ihex_record_t *rec) {
+    const uint8_t *d = rec->data;
+    switch (rec->type) {
+    case IHEX_EOF:
+        state->done = true;
+        break;
+    case IHEX_SEGMENT_BASE:
+        state->base = (uint32_t)((d[0] << 8) | d[1]) << 4;
+        break;
+    case IHEX_LINEAR_BASE:
+        state->base = (uint32_t)((d[0] << 8) | d[1]) << 16;
+        break;
+    case IHEX_SEGMENT_START:
+        state->start = ((uint32_t)((d[0] << 8) | d[1]) << 4) + ((d[2] << 8) | d[3]);
+        state->has_start = true;
+        break;
+    case IHEX_LINEAR_START:
+        state->start = ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+        state->has_start = true;
+        break;
+    }
+}
+
+const char *ihex_error(int err) {
+    switch (err) {
+    case IHEX_OK: return "no error";
+    case IHEX_BAD_CHECKSUM: return "checksum mismatch";
+    default: return "malformed Intel HEX record";
+    }
+}
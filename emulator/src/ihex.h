@@ -0,0 +1,57 @@
+#ifndef IHEX_H
+#define IHEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Intel HEX records, for the monitor's l command and the host loader.
+// Hex digits are decoded 16 at a time with SSE2 or NEON where the compiler
+// targets them, and through a table otherwise (the Pico).
+
+#define IHEX_DATA          0x00
+#define IHEX_EOF           0x01
+#define IHEX_SEGMENT_BASE  0x02  // Base = value << 4
+#define IHEX_SEGMENT_START 0x03  // Start = CS << 4 + IP
+#define IHEX_LINEAR_BASE   0x04  // Base = value << 16
+#define IHEX_LINEAR_START  0x05
+
+// Longest record: ':' and 5 + 255 bytes as hex digits
+#define IHEX_LINE_MAX (1 + 2 * (5 + 255))
+
+enum {
+    IHEX_OK,
+    IHEX_BAD_RECORD,    // Not ':', too short, a bad digit or unknown type
+    IHEX_BAD_CHECKSUM,
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    uint16_t addr;
+    uint8_t data[256];  // len bytes, then the checksum
+} ihex_record_t;
+
+// What the records so far have set
+typedef struct {
+    uint32_t base;   // Added to each data record's address
+    uint32_t start;  // Entry point, if has_start
+    bool has_start;
+    bool done;       // EOF record seen
+} ihex_state_t;
+
+// Decode n bytes from 2n hex digits. Returns 0, or -1 on a bad digit.
+int ihex_decode(const char *hex, size_t n, uint8_t *out);
+int ihex_decode_scalar(const char *hex, size_t n, uint8_t *out);
+
+// Parse one record of len characters, without the line ending, and verify
+// its checksum. Returns IHEX_OK or an error.
+int ihex_parse(const char *line, size_t len, ihex_record_t *rec);
+
+// Apply an address, start or EOF record to the state. A data record's
+// bytes go to state->base + rec->addr.
+void ihex_apply(ihex_state_t *state, const ihex_record_t *rec);
+
+const char *ihex_error(int err);
+
+#endif
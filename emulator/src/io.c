@@ -1,57 +1,95 @@
 #include "io.h"
-#include <stdio.h>
-#include "pico/stdlib.h"
+#include "machine.h"
 
-front_panel_t front_panel = {0};
+// Pull one byte from the serial backend into the receive latch
+static bool serial_poll(io_t *io) {
+    if (io->serial_in_ready) return true;
+    int ch = io->serial_getc(io->serial_ctx);
+    if (ch < 0) return false;
+    io->serial_in_buf = ch;
+    io->serial_in_ready = true;
+    return true;
+}
+
+void io_init(machine_t *m, serial_getc_fn getc, serial_putc_fn putc, void *ctx) {
+    io_t *io = &m->io;
+    io->serial_getc = getc;
+    io->serial_putc = putc;
+    io->serial_ctx = ctx;
+    io->serial_in_buf = 0;
+    io->serial_in_ready = false;
 
-static uint8_t serial_in_buf = 0;
-static bool serial_in_ready = false;
+    io->panel.address_display = 0;
+    io->panel.data_display = 0;
+    io->panel.sense_switches = 0;
+    io->panel.status = 0;
+    io->panel.run = false;
+    io->panel.wait = false;
 
-void io_init(void) {
-    front_panel.address_display = 0;
-    front_panel.data_display = 0;
-    front_panel.sense_switches = 0;
-    front_panel.run = false;
-    front_panel.wait = false;
+    disk_init(m);
 }
 
-uint8_t io_read(uint8_t port) {
+uint8_t io_read(machine_t *m, uint8_t port) {
+    io_t *io = &m->io;
     switch (port) {
     case PORT_SERIAL_STATUS: {
         uint8_t status = 0;
-        // Check if USB serial has data available
-        int ch = getchar_timeout_us(0);
-        if (ch != PICO_ERROR_TIMEOUT) {
-            serial_in_buf = ch;
-            serial_in_ready = true;
-        }
-        if (serial_in_ready) status |= 0x01;  // RX ready
+        if (serial_poll(io)) status |= 0x01;  // RX ready
         status |= 0x02;  // TX always ready
         return status;
     }
 
     case PORT_SERIAL_DATA:
-        if (serial_in_ready) {
-            serial_in_ready = false;
-            return serial_in_buf;
+        if (io->serial_in_ready) {
+            io->serial_in_ready = false;
+            return io->serial_in_buf;
         }
         return 0;
 
     case PORT_SENSE_SW_HI:
-        return front_panel.sense_switches >> 8;
+        return io->panel.sense_switches >> 8;
 
     case PORT_SENSE_SW_LO:
-        return front_panel.sense_switches & 0xFF;
+        return io->panel.sense_switches & 0xFF;
+
+    case PORT_DCDD_STATUS:
+    case PORT_DCDD_CONTROL:
+    case PORT_DCDD_DATA:
+        return dcdd_read(m, port);
+
+    case PORT_BLK_COMMAND:
+    case PORT_BLK_DRIVE:
+    case PORT_BLK_DMA_LO:
+    case PORT_BLK_DMA_HI:
+    case PORT_BLK_BLOCK_LO:
+    case PORT_BLK_BLOCK_HI:
+        return blk_read(m, port);
 
     default:
         return 0xFF;
     }
 }
 
-void io_write(uint8_t port, uint8_t val) {
+void io_write(machine_t *m, uint8_t port, uint8_t val) {
+    io_t *io = &m->io;
     switch (port) {
     case PORT_SERIAL_DATA:
-        putchar(val);
+        io->serial_putc(io->serial_ctx, val);
+        break;
+
+    case PORT_DCDD_STATUS:
+    case PORT_DCDD_CONTROL:
+    case PORT_DCDD_DATA:
+        dcdd_write(m, port, val);
+        break;
+
+    case PORT_BLK_COMMAND:
+    case PORT_BLK_DRIVE:
+    case PORT_BLK_DMA_LO:
+    case PORT_BLK_DMA_HI:
+    case PORT_BLK_BLOCK_LO:
+    case PORT_BLK_BLOCK_HI:
+        blk_write(m, port, val);
         break;
 
     default:
@@ -59,16 +97,9 @@ void io_write(uint8_t port, uint8_t val) {
     }
 
     // Update front panel data display
-    front_panel.data_display = val;
+    io->panel.data_display = val;
 }
 
-bool io_serial_available(void) {
-    if (serial_in_ready) return true;
-    int ch = getchar_timeout_us(0);
-    if (ch != PICO_ERROR_TIMEOUT) {
-        serial_in_buf = ch;
-        serial_in_ready = true;
-        return true;
-    }
-    return false;
+bool io_serial_available(machine_t *m) {
+    return serial_poll(&m->io);
 }
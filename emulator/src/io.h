@@ -3,10 +3,12 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "disk.h"
 
 // Altair 8800 I/O ports
 // Port 0x00: Serial status (bit 0 = rx ready, bit 1 = tx ready)
 // Port 0x01: Serial data
+// Ports 0x08-0x0A: 88-DCDD disk controller, 0x20-0x25: block device (disk.h)
 
 #define PORT_SERIAL_STATUS  0x00
 #define PORT_SERIAL_DATA    0x01
@@ -15,27 +17,47 @@
 #define PORT_SENSE_SW_HI    0xFF  // Sense switches high byte
 #define PORT_SENSE_SW_LO    0xFE  // Sense switches low byte
 
-// Initialize I/O subsystem
-void io_init(void);
-
-// Read from I/O port
-uint8_t io_read(uint8_t port);
-
-// Write to I/O port
-void io_write(uint8_t port, uint8_t val);
-
-// Check if serial input available (for polling)
-bool io_serial_available(void);
+typedef struct machine machine_t;
 
 // Front panel state (for future LED panel)
 typedef struct {
     uint16_t address_display;
     uint8_t data_display;
+    uint16_t status;         // BUS_* lines (cpu.h)
     uint16_t sense_switches;
     bool run;
     bool wait;
 } front_panel_t;
 
-extern front_panel_t front_panel;
+// Serial backend: getc returns -1 when no byte is waiting
+typedef int (*serial_getc_fn)(void *ctx);
+typedef void (*serial_putc_fn)(void *ctx, uint8_t ch);
+
+// Per-machine I/O state
+typedef struct {
+    serial_getc_fn serial_getc;
+    serial_putc_fn serial_putc;
+    void *serial_ctx;
+
+    uint8_t serial_in_buf;
+    bool serial_in_ready;
+
+    front_panel_t panel;
+
+    dcdd_t dcdd;
+    blkdev_t blk;
+} io_t;
+
+// Initialize I/O subsystem with the given serial backend, no disks
+void io_init(machine_t *m, serial_getc_fn getc, serial_putc_fn putc, void *ctx);
+
+// Read from I/O port
+uint8_t io_read(machine_t *m, uint8_t port);
+
+// Write to I/O port
+void io_write(machine_t *m, uint8_t port, uint8_t val);
+
+// Check if serial input available (for polling)
+bool io_serial_available(machine_t *m);
 
 #endif
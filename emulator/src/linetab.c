@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "linetab.h"
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int linetab_parse(linetab_t *t, const uint8_t *data, size_t len) {
+    memset(t, 0, sizeof(*t));
+    if (len < LINETAB_HEADER_SIZE || memcmp(data, LINETAB_MAGIC, 4) != 0) return -1;
+
+    size_t files = get16(data + 4);
+    size_t symbols = get32(data + 8);
+    size_t lines = get32(data + 12);
+    size_t strings = get32(data + 16);
+    size_t need = LINETAB_HEADER_SIZE + files * LINETAB_FILE_SIZE +
+                  symbols * LINETAB_SYMBOL_SIZE + lines * LINETAB_LINE_SIZE;
+    if (files > LINETAB_MAX_FILES || symbols > len || lines > len || need > len ||
+        len - need != strings || (strings && data[len - 1] != '\0')) {
+        return -1;
+    }
+
+    t->strings = malloc(strings + 1);
+    t->files = malloc((files + 1) * sizeof(*t->files));
+    t->symbols = malloc((symbols + 1) * sizeof(*t->symbols));
+    t->lines = malloc((lines + 1) * sizeof(*t->lines));
+    if (!t->strings || !t->files || !t->symbols || !t->lines) goto fail;
+    memcpy(t->strings, data + need, strings);
+    t->strings[strings] = '\0';
+
+    const uint8_t *p = data + LINETAB_HEADER_SIZE;
+    for (size_t i = 0; i < files; i++, p += LINETAB_FILE_SIZE) {
+        uint32_t name = get32(p);
+        if (name > strings) goto fail;
+        t->files[i] = t->strings + name;
+    }
+    for (size_t i = 0; i < symbols; i++, p += LINETAB_SYMBOL_SIZE) {
+        uint32_t name = get32(p);
+        if (name > strings) goto fail;
+        t->symbols[i] = (linetab_symbol_t){ t->strings + name, get16(p + 4), get16(p + 6) };
+    }
+    for (size_t i = 0; i < lines; i++, p += LINETAB_LINE_SIZE) {
+        t->lines[i] = (linetab_line_t){ get16(p), get16(p + 2), get32(p + 4), p[8], p[9] };
+        if (t->lines[i].file >= files) goto fail;
+    }
+    t->file_count = files;
+    t->symbol_count = symbols;
+    t->line_count = lines;
+    return 0;
+
+fail:
+    linetab_free(t);
+    return -1;
+}
+
+void linetab_free(linetab_t *t) {
+    free(t->strings);
+    free(t->files);
+    free(t->symbols);
+    free(t->lines);
+    memset(t, 0, sizeof(*t));
+}
+
+const linetab_line_t *linetab_find_line(const linetab_t *t, uint16_t addr) {
+    // Last line starting at or below addr
+    size_t lo = 0, hi = t->line_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (t->lines[mid].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (!lo) return NULL;
+    const linetab_line_t *l = &t->lines[lo - 1];
+    return addr - l->addr < l->len ? l : NULL;
+}
+
+const linetab_symbol_t *linetab_find_symbol(const linetab_t *t, uint16_t addr) {
+    size_t lo = 0, hi = t->symbol_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (t->symbols[mid].value <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? &t->symbols[lo - 1] : NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef LINETAB_H
+#define LINETAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Address-to-line tables written by asm8080 -g, for symbolized disassembly,
+// profiles and coverage. The file is little-endian:
+//
+//   header   "L80\1", u16 file count, u16 0, u32 symbol count,
+//            u32 line count, u32 string bytes
+//   files    u32 name offset, one per source file (0 is the main source)
+//   symbols  u32 name offset, u16 value, u16 flags; sorted by value
+//   lines    u16 address, u16 byte count, u32 line, u8 file, u8 flags;
+//            sorted by address, one per source line that emitted bytes
+//   strings  NUL-terminated names
+
+#define LINETAB_MAGIC       "L80\1"
+#define LINETAB_HEADER_SIZE 20
+#define LINETAB_FILE_SIZE   4
+#define LINETAB_SYMBOL_SIZE 8
+#define LINETAB_LINE_SIZE   10
+#define LINETAB_MAX_FILES   256
+
+#define LINETAB_SYM_PUBLIC  0x01
+#define LINETAB_LINE_CODE   0x01  // Instructions rather than data
+
+typedef struct {
+    uint16_t addr;
+    uint16_t len;
+    uint32_t line;
+    uint8_t file;
+    uint8_t flags;
+} linetab_line_t;
+
+typedef struct {
+    const char *name;
+    uint16_t value;
+    uint16_t flags;
+} linetab_symbol_t;
+
+typedef struct {
+    const char **files;
+    size_t file_count;
+    linetab_symbol_t *symbols;
+    size_t symbol_count;
+    linetab_line_t *lines;
+    size_t line_count;
+    char *strings;
+} linetab_t;
+
+// Decode a table from memory into freshly allocated arrays. Returns -1 if
+// the data is malformed or memory runs out.
+int linetab_parse(linetab_t *t, const uint8_t *data, size_t len);
+void linetab_free(linetab_t *t);
+
+// The line whose code covers addr, or NULL
+const linetab_line_t *linetab_find_line(const linetab_t *t, uint16_t addr);
+
+// The symbol with the highest value at or below addr, or NULL
+const linetab_symbol_t *linetab_find_symbol(const linetab_t *t, uint16_t addr);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5   // A block ends with at least this many literals
+#define MATCH_LIMIT   12  // and no match starts closer than this to the end
+#define MAX_OFFSET    65535
+#define HASH_BITS     12
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Token nibble 15 continues the length in bytes of 255, then a final byte
+static size_t put_length(uint8_t *out, size_t len) {
+    size_t o = 0;
+    for (; len >= 255; len -= 255) out[o++] = 255;
+    out[o++] = len;
+    return o;
+}
+
+// One sequence: literals, then a match unless this is the last one
+static size_t put_sequence(uint8_t *out, size_t cap, const uint8_t *lit, size_t lit_len, size_t offset,
+                           size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + (match_len - MIN_MATCH) / 255 + 1 : 0);
+    if (need > cap) return 0;
+    size_t o = 1;
+    out[0] = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15) o += put_length(&out[o], lit_len - 15);
+    memcpy(&out[o], lit, lit_len);
+    o += lit_len;
+    if (match_len) {
+        out[o++] = offset & 0xFF;
+        out[o++] = offset >> 8;
+        size_t m = match_len - MIN_MATCH;
+        out[0] |= m < 15 ? m : 15;
+        if (m >= 15) o += put_length(&out[o], m - 15);
+    }
+    return o;
+}
+
+size_t lz4_compress(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    uint32_t table[1 << HASH_BITS];  // Position + 1 of the last 4 bytes with each hash
+    size_t anchor = 0, i = 0, o = 0;
+    memset(table, 0, sizeof(table));
+
+    while (len >= MATCH_LIMIT && i <= len - MATCH_LIMIT) {
+        uint32_t seq = read32(&in[i]);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[h];
+        table[h] = i + 1;
+        if (!ref || i - (ref - 1) > MAX_OFFSET || read32(&in[ref - 1]) != seq) {
+            i++;
+            continue;
+        }
+        ref--;
+        size_t match = MIN_MATCH;
+        while (i + match < len - LAST_LITERALS && in[ref + match] == in[i + match]) match++;
+
+        size_t n = put_sequence(&out[o], cap - o, &in[anchor], i - anchor, i - ref, match);
+        if (!n) return 0;
+        o += n;
+        i += match;
+        anchor = i;
+    }
+
+    size_t n = put_sequence(&out[o], cap - o, &in[anchor], len - anchor, 0, 0);
+    return n ? o + n : 0;
+}
+
+// Length continuation bytes; SIZE_MAX if the input runs out
+static size_t get_length(const uint8_t *in, size_t len, size_t *i) {
+    size_t total = 0;
+    uint8_t b;
+    do {
+        if (*i >= len) return SIZE_MAX;
+        b = in[(*i)++];
+        total += b;
+    } while (b == 255);
+    return total;
+}
+
+int lz4_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t out_len) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        uint8_t token = in[i++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            size_t more = get_length(in, len, &i);
+            if (more == SIZE_MAX) return -1;
+            lit += more;
+        }
+        if (lit > len - i || lit > out_len - o) return -1;
+        memcpy(&out[o], &in[i], lit);
+        i += lit;
+        o += lit;
+        if (i == len) break;  // The last sequence has no match
+
+        if (len - i < 2) return -1;
+        size_t offset = in[i] | (in[i + 1] << 8);
+        i += 2;
+        size_t match = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15) {
+            size_t more = get_length(in, len, &i);
+            if (more == SIZE_MAX) return -1;
+            match += more;
+        }
+        if (!offset || offset > o || match > out_len - o) return -1;
+        if (offset >= match) {
+            memcpy(&out[o], &out[o - offset], match);
+        } else {
+            for (size_t k = 0; k < match; k++) out[o + k] = out[o - offset + k];  // Overlapping run
+        }
+        o += match;
+    }
+    return o == out_len ? 0 : -1;
+}
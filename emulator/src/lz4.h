@@ -0,0 +1,18 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// LZ4 block format (no frame header), for compressed memory images. Blocks
+// made here decode with the reference LZ4_decompress_safe and vice versa.
+
+// Greedy single-pass compression. Returns the compressed length, or 0 if it
+// would not fit in cap.
+size_t lz4_compress(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+
+// Decompress a block that must produce exactly out_len bytes. Returns 0, or
+// -1 if the block is malformed.
+int lz4_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t out_len);
+
+#endif
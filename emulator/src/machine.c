@@ -0,0 +1,27 @@
+#include "machine.h"
+
+void machine_init(machine_t *m, serial_getc_fn getc, serial_putc_fn putc, void *ctx) {
+    mem_init(m);
+    cpu_init(&m->cpu);
+    io_init(m, getc, putc, ctx);
+    sched_init(&m->sched);
+    m->hooks = NULL;
+}
+
+uint64_t machine_run(machine_t *m, uint64_t budget) {
+    cpu_8080_t *cpu = &m->cpu;
+    uint64_t start = cpu->cycles;
+    uint64_t end = start + budget;
+
+    while (!cpu->halted && cpu->cycles < end) {
+        uint64_t stop = m->sched.next < end ? m->sched.next : end;
+        if (m->mem.lazy_pages) {
+            while (!cpu->halted && cpu->cycles < stop) cpu_step(m);
+        } else {
+            while (!cpu->halted && cpu->cycles < stop) cpu_exec(m);
+        }
+        if (cpu->cycles >= m->sched.next) sched_dispatch(m, cpu->cycles);
+    }
+
+    return cpu->cycles - start;
+}
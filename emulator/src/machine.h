@@ -0,0 +1,59 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "sched.h"
+#include "hook.h"
+
+// One complete emulated machine. Everything the core touches hangs off this
+// struct, so any number of machines can coexist in a process and a machine
+// can be copied as a snapshot.
+struct machine {
+    cpu_8080_t cpu;
+    memory_t mem;
+    io_t io;
+    sched_t sched;
+    hooks_t *hooks;  // Native hooks (hook.h), NULL for none
+};
+
+// Memory accessors - hot path, inlined into the CPU core. Lazy pages of a
+// compressed image are filled in on first touch.
+static inline uint8_t mem_read(machine_t *m, uint16_t addr) {
+    if (__builtin_expect(m->mem.lazy_pages != 0, 0) && (m->mem.page_flags[addr >> MEM_PAGE_SHIFT] & MEM_PAGE_LAZY)) {
+        mem_fault(m, addr);
+    }
+    return m->mem.ram[addr];
+}
+
+static inline void mem_write(machine_t *m, uint16_t addr, uint8_t val) {
+    uint8_t flags = m->mem.page_flags[addr >> MEM_PAGE_SHIFT];
+    if (flags & MEM_PAGE_LAZY) {
+        mem_fault(m, addr);
+        flags &= ~MEM_PAGE_LAZY;
+    }
+    if (!(flags & MEM_PAGE_ROM)) m->mem.ram[addr] = val;
+}
+
+// Read/write 16-bit word (little endian)
+static inline uint16_t mem_read16(machine_t *m, uint16_t addr) {
+    return mem_read(m, addr) | (mem_read(m, addr + 1) << 8);
+}
+
+static inline void mem_write16(machine_t *m, uint16_t addr, uint16_t val) {
+    mem_write(m, addr, val & 0xFF);
+    mem_write(m, addr + 1, val >> 8);
+}
+
+// Reset CPU, clear memory and scheduler, detach any hooks, attach the
+// serial backend
+void machine_init(machine_t *m, serial_getc_fn getc, serial_putc_fn putc, void *ctx);
+
+// Run until HLT or until `budget` more cycles have elapsed, firing scheduled
+// events as their deadlines pass. Returns cycles executed.
+uint64_t machine_run(machine_t *m, uint64_t budget);
+
+#endif
@@ -3,15 +3,66 @@
 #include <ctype.h>
 #include "pico/stdlib.h"
 #include "pico/stdio_usb.h"
-#include "cpu.h"
-#include "memory.h"
-#include "io.h"
+#include "machine.h"
 #include "panel.h"
+#include "asm8080.h"
+#include "upload.h"
+#include "ihex.h"
 
 // Set to 1 when you have the LED panel connected
 #define PANEL_ENABLED 1
 
-static cpu_8080_t cpu;
+// Source typed at the a command, assembled in one go
+#define ASM_SOURCE_MAX 4096
+
+// Cycles run between checks for a key or the STOP switch
+#define RUN_SLICE_CYCLES 20000
+
+static machine_t machine;
+static cpu_8080_t *const cpu = &machine.cpu;
+#if PANEL_ENABLED
+static panel_t panel;
+#endif
+
+// Point the panel at PC and show it
+static void show_pc(void) {
+    panel_sample(&machine.io.panel, &machine);
+#if PANEL_ENABLED
+    panel_update_leds(&panel, &machine.io.panel);
+#endif
+}
+
+// Serial backend: guest serial port maps onto USB stdio
+static int usb_serial_getc(void *ctx) {
+    (void)ctx;
+    int ch = getchar_timeout_us(0);
+    return ch == PICO_ERROR_TIMEOUT ? -1 : ch;
+}
+
+static void usb_serial_putc(void *ctx, uint8_t ch) {
+    (void)ctx;
+    putchar(ch);
+}
+
+// Upload link for the b command: raw bytes, no echo or CRLF translation
+static size_t usb_read(void *ctx, uint8_t *buf, size_t len, uint32_t timeout_us) {
+    (void)ctx;
+    size_t n = 0;
+    while (n < len) {
+        int ch = getchar_timeout_us(timeout_us);
+        if (ch == PICO_ERROR_TIMEOUT) break;
+        buf[n++] = ch;
+    }
+    return n;
+}
+
+static void usb_write(void *ctx, const uint8_t *buf, size_t len) {
+    (void)ctx;
+    for (size_t i = 0; i < len; i++) putchar_raw(buf[i]);
+    stdio_flush();
+}
+
+static const upload_port_t usb_port = { usb_read, usb_write, NULL };
 
 // Parse hex number from string
 static uint16_t parse_hex(const char *s) {
@@ -25,29 +76,29 @@ static uint16_t parse_hex(const char *s) {
     return val;
 }
 
-// Parse exactly n hex digits
-static uint16_t parse_hex_n(const char *s, int n) {
-    uint16_t val = 0;
-    for (int i = 0; i < n && s[i]; i++) {
-        char c = toupper(s[i]);
-        if (c >= '0' && c <= '9') val = (val << 4) | (c - '0');
-        else if (c >= 'A' && c <= 'F') val = (val << 4) | (c - 'A' + 10);
-    }
-    return val;
-}
-
 // Print CPU state
 static void print_state(void) {
     printf("A=%02X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X\n",
-           cpu.a, cpu.bc.word, cpu.de.word, cpu.hl.word, cpu.sp, cpu.pc);
+           cpu->a, cpu->bc.word, cpu->de.word, cpu->hl.word, cpu->sp, cpu->pc);
     printf("Flags: %c%c%c%c%c  INTE=%d  CYC=%llu\n",
-           cpu.f.s ? 'S' : '-',
-           cpu.f.z ? 'Z' : '-',
-           cpu.f.ac ? 'A' : '-',
-           cpu.f.p ? 'P' : '-',
-           cpu.f.c ? 'C' : '-',
-           cpu.inte,
-           cpu.cycles);
+           cpu->f.s ? 'S' : '-',
+           cpu->f.z ? 'Z' : '-',
+           cpu->f.ac ? 'A' : '-',
+           cpu->f.p ? 'P' : '-',
+           cpu->f.c ? 'C' : '-',
+           cpu->inte,
+           cpu->cycles);
+
+    // Status lights for the next instruction, high bit first
+    static const char *const STATUS_NAMES[] = {
+        "INTE", "PROT", "MEMR", "INP", "M1", "OUT", "HLTA", "STACK", "WO", "INT"
+    };
+    uint16_t status = cpu_bus_status(&machine);
+    printf("Status:");
+    for (int i = 0; i < 10; i++) {
+        if (status & (0x8000 >> i)) printf(" %s", STATUS_NAMES[i]);
+    }
+    printf("\n");
 }
 
 // Dump memory
@@ -55,7 +106,7 @@ static void dump_mem(uint16_t addr, uint16_t len) {
     for (uint16_t i = 0; i < len; i += 16) {
         printf("%04X: ", addr + i);
         for (int j = 0; j < 16 && (i + j) < len; j++) {
-            printf("%02X ", mem_read(addr + i + j));
+            printf("%02X ", mem_read(&machine, addr + i + j));
         }
         printf("\n");
     }
@@ -75,6 +126,8 @@ static void monitor(void) {
     printf("  d addr n - Dump n bytes at address\n");
     printf("  u addr n - Disassemble n instructions\n");
     printf("  l        - Load Intel HEX\n");
+    printf("  b        - Binary upload from send8080\n");
+    printf("  a addr   - Assemble lines into memory\n");
     printf("  ?        - Show CPU state\n");
     printf("  x        - Reset CPU and memory\n");
     printf("> ");
@@ -95,37 +148,37 @@ static void monitor(void) {
                 switch (cmd) {
                 case 'r':  // Run
                     printf("Running... (any key to stop)\n");
-                    cpu.halted = false;
-                    front_panel.run = true;
-                    while (!cpu.halted) {
-                        cpu_step(&cpu);
-                        front_panel.address_display = cpu.pc;
-                        front_panel.data_display = mem_read(cpu.pc);
+                    cpu->halted = false;
+                    machine.io.panel.run = true;
 #if PANEL_ENABLED
-                        panel_update_leds();
-                        panel_read_switches();
-                        if (panel_get_control_press() & SW_STOP) break;
+                    // The panel refreshes itself from scheduler events
+                    panel_attach(&panel, &machine);
+#endif
+                    while (!cpu->halted) {
+                        machine_run(&machine, RUN_SLICE_CYCLES);
+#if PANEL_ENABLED
+                        if (panel_get_control_press(&panel) & SW_STOP) break;
 #endif
                         if (getchar_timeout_us(0) != PICO_ERROR_TIMEOUT) break;
                     }
-                    front_panel.run = false;
+#if PANEL_ENABLED
+                    panel_detach(&panel, &machine);
+#endif
+                    machine.io.panel.run = false;
+                    show_pc();
                     print_state();
                     break;
 
                 case 's':  // Step
-                    cpu_step(&cpu);
-                    front_panel.address_display = cpu.pc;
-                    front_panel.data_display = mem_read(cpu.pc);
-#if PANEL_ENABLED
-                    panel_update_leds();
-#endif
+                    cpu_step(&machine);
+                    show_pc();
                     print_state();
                     break;
 
                 case 'g': {  // Go to address
                     uint16_t addr = parse_hex(args);
-                    cpu.pc = addr;
-                    printf("PC=%04X\n", cpu.pc);
+                    cpu->pc = addr;
+                    printf("PC=%04X\n", cpu->pc);
                     break;
                 }
 
@@ -136,7 +189,7 @@ static void monitor(void) {
                         while (*args == ' ') args++;
                         if (*args) {
                             uint8_t val = parse_hex(args);
-                            mem_write(addr++, val);
+                            mem_write(&machine, addr++, val);
                             while (*args && !isspace(*args)) args++;
                         }
                     }
@@ -154,16 +207,16 @@ static void monitor(void) {
                 }
 
                 case 'u': {  // Disassemble
-                    uint16_t addr = *args ? parse_hex(args) : cpu.pc;
+                    uint16_t addr = *args ? parse_hex(args) : cpu->pc;
                     while (*args && !isspace(*args)) args++;
                     while (*args == ' ') args++;
                     int count = *args ? parse_hex(args) : 10;
                     char disasm_buf[32];
                     for (int i = 0; i < count; i++) {
-                        int len = cpu_disasm(addr, disasm_buf, sizeof(disasm_buf));
+                        int len = cpu_disasm(&machine, addr, disasm_buf, sizeof(disasm_buf));
                         printf("%04X: ", addr);
                         for (int j = 0; j < 3; j++) {
-                            if (j < len) printf("%02X ", mem_read(addr + j));
+                            if (j < len) printf("%02X ", mem_read(&machine, addr + j));
                             else printf("   ");
                         }
                         printf(" %s\n", disasm_buf);
@@ -177,22 +230,23 @@ static void monitor(void) {
                     break;
 
                 case 'x':  // Reset
-                    cpu_init(&cpu);
-                    mem_init();
+                    cpu_init(cpu);
+                    mem_init(&machine);
                     printf("Reset\n");
                     break;
 
                 case 'l': {  // Load Intel HEX
                     printf("Paste Intel HEX (end with EOF record or blank line):\n");
+                    static char hexline[IHEX_LINE_MAX + 1];
+                    static ihex_record_t rec;
+                    ihex_state_t state = { 0 };
                     uint16_t total_bytes = 0;
-                    uint16_t start_addr = 0xFFFF;
-                    bool first = true;
+                    uint32_t start_addr = 0xFFFFFFFF;
 
-                    while (1) {
+                    while (!state.done) {
                         // Read a line
-                        char hexline[80];
                         int hpos = 0;
-                        while (hpos < 79) {
+                        while (hpos < IHEX_LINE_MAX) {
                             int ch = getchar_timeout_us(5000000);  // 5s timeout
                             if (ch == PICO_ERROR_TIMEOUT) break;
                             if (ch == '\r' || ch == '\n') {
@@ -207,40 +261,98 @@ static void monitor(void) {
                         // Empty line = done
                         if (hpos == 0) break;
 
-                        // Must start with ':'
-                        if (hexline[0] != ':') {
-                            printf("Error: line must start with ':'\n");
+                        int err = ihex_parse(hexline, hpos, &rec);
+                        if (err != IHEX_OK) {
+                            printf("Error: %s\n", ihex_error(err));
+                            continue;
+                        }
+                        if (rec.type != IHEX_DATA) {
+                            ihex_apply(&state, &rec);
+                            if (state.done) printf("EOF record\n");
                             continue;
                         }
 
-                        // Parse: :LLAAAATT[DD...]CC
-                        uint8_t len = parse_hex_n(&hexline[1], 2);
-                        uint16_t addr = parse_hex_n(&hexline[3], 4);
-                        uint8_t type = parse_hex_n(&hexline[7], 2);
-
-                        if (type == 0x01) {  // EOF record
-                            printf("EOF record\n");
-                            break;
+                        uint32_t addr = state.base + rec.addr;
+                        if (addr + rec.len > MEMORY_SIZE) {
+                            printf("Error: address %05lXh is beyond 64K\n", (unsigned long)addr);
+                            continue;
                         }
+                        if (start_addr == 0xFFFFFFFF) start_addr = addr;
+                        for (int i = 0; i < rec.len; i++) {
+                            mem_write(&machine, addr + i, rec.data[i]);
+                            total_bytes++;
+                        }
+                    }
+                    if (state.has_start && state.start < MEMORY_SIZE) start_addr = state.start;
+                    printf("Loaded %d bytes", total_bytes);
+                    if (start_addr != 0xFFFFFFFF) {
+                        printf(" starting at %04lXh", (unsigned long)start_addr);
+                        cpu->pc = start_addr;
+                    }
+                    printf("\n");
+                    break;
+                }
 
-                        if (type == 0x00) {  // Data record
-                            if (first) {
-                                start_addr = addr;
-                                first = false;
+                case 'b': {  // Binary upload
+                    printf("Waiting for send8080...\n");
+                    upload_stats_t stats;
+                    if (upload_receive(&machine, &usb_port, 5000000, &stats) < 0) {  // 5s timeout
+                        printf("\nUpload timed out after %lu bytes\n", (unsigned long)stats.bytes);
+                        break;
+                    }
+                    printf("\nLoaded %lu bytes in %lu frames (%lu dropped) starting at %04Xh\n",
+                           (unsigned long)stats.bytes, (unsigned long)stats.frames,
+                           (unsigned long)stats.errors, stats.entry);
+                    cpu->pc = stats.entry;
+                    break;
+                }
+
+                case 'a': {  // Assemble into memory
+                    static char source[ASM_SOURCE_MAX];
+                    size_t len = 0;
+                    image_t img = { .origin = *args ? parse_hex(args) : cpu->pc };
+                    printf("Enter assembly at %04Xh (end with a blank line):\n", img.origin);
+
+                    while (1) {
+                        size_t start = len;
+                        while (1) {
+                            int ch = getchar_timeout_us(100);
+                            if (ch == PICO_ERROR_TIMEOUT) continue;
+                            if (ch == '\r' || ch == '\n') {
+                                putchar('\n');
+                                break;
                             }
-                            for (int i = 0; i < len; i++) {
-                                uint8_t byte = parse_hex_n(&hexline[9 + i * 2], 2);
-                                mem_write(addr + i, byte);
-                                total_bytes++;
+                            if (ch == 127 || ch == 8) {
+                                if (len > start) {
+                                    len--;
+                                    printf("\b \b");
+                                }
+                            } else if (len < sizeof(source) - 1) {
+                                source[len++] = ch;
+                                putchar(ch);
                             }
                         }
+                        // Empty line = done
+                        if (len == start) break;
+                        if (len < sizeof(source)) source[len++] = '\n';
                     }
-                    printf("Loaded %d bytes", total_bytes);
-                    if (start_addr != 0xFFFF) {
-                        printf(" starting at %04Xh", start_addr);
-                        cpu.pc = start_addr;
+
+                    int errors = asm8080_assemble(source, len, &img);
+                    if (errors) {
+                        printf("%d error(s)\n", errors);
+                    } else {
+                        for (size_t i = 0; i < img.segment_count; i++) {
+                            const image_segment_t *seg = &img.segments[i];
+                            mem_load(&machine, seg->addr, seg->data, seg->len);
+                        }
+                        printf("Assembled %u bytes", (unsigned)img.len);
+                        if (img.segment_count) {
+                            printf(" starting at %04Xh", img.segments[0].addr);
+                            cpu->pc = img.segments[0].addr;
+                        }
+                        printf("\n");
                     }
-                    printf("\n");
+                    image_free(&img);
                     break;
                 }
 
@@ -271,11 +383,9 @@ int main() {
         sleep_ms(100);
     }
 
-    mem_init();
-    cpu_init(&cpu);
-    io_init();
+    machine_init(&machine, usb_serial_getc, usb_serial_putc, NULL);
 #if PANEL_ENABLED
-    panel_init();
+    panel_init(&panel, &panel_gpio_pico);
 #endif
 
     // Load a simple test program at 0x0000
@@ -290,7 +400,7 @@ int main() {
         0xD3, 0x01,  // OUT 1
         0x76         // HLT
     };
-    mem_load(0x0000, test_prog, sizeof(test_prog));
+    mem_load(&machine, 0x0000, test_prog, sizeof(test_prog));
 
     monitor();
 
@@ -1,33 +1,137 @@
 #include "memory.h"
+#include "machine.h"
+#include "lz4.h"
 #include <string.h>
 
-static uint8_t ram[MEMORY_SIZE];
+void mem_init(machine_t *m) {
+    memset(m->mem.ram, 0, sizeof(m->mem.ram));
+    memset(m->mem.page_flags, 0, sizeof(m->mem.page_flags));
+    m->mem.image = NULL;
+    m->mem.lazy_pages = 0;
+    m->mem.dma_len = 0;
+}
+
+void mem_protect(machine_t *m, uint16_t addr, size_t len, bool rom) {
+    if (len == 0) return;
+    size_t first = addr >> MEM_PAGE_SHIFT;
+    size_t last = (addr + len - 1) >> MEM_PAGE_SHIFT;
+    for (size_t page = first; page <= last && page < MEM_PAGES; page++) {
+        if (rom) m->mem.page_flags[page] |= MEM_PAGE_ROM;
+        else m->mem.page_flags[page] &= ~MEM_PAGE_ROM;
+    }
+}
+
+void mem_load(machine_t *m, uint16_t addr, const uint8_t *data, size_t len) {
+    if (len > (size_t)MEMORY_SIZE - addr) len = (size_t)MEMORY_SIZE - addr;
+    mem_fault_range(m, addr, len);
+    memcpy(&m->mem.ram[addr], data, len);
+}
+
+uint8_t *mem_get_ptr(machine_t *m, uint16_t addr) {
+    return &m->mem.ram[addr];
+}
 
-void mem_init(void) {
-    memset(ram, 0, sizeof(ram));
+void mem_dma_mark(machine_t *m, uint16_t addr, size_t len) {
+    if (!len) return;
+    if (m->mem.dma_len) {
+        m->mem.dma_addr = 0;  // Two transfers not yet seen: report everything
+        m->mem.dma_len = MEMORY_SIZE;
+    } else {
+        m->mem.dma_addr = addr;
+        m->mem.dma_len = len < MEMORY_SIZE ? len : MEMORY_SIZE;
+    }
 }
 
-uint8_t mem_read(uint16_t addr) {
-    return ram[addr];
+void mem_dma_write(machine_t *m, uint16_t addr, const uint8_t *data, size_t len) {
+    mem_dma_mark(m, addr, len);
+    // One run per page, so ROM is checked once per page rather than per byte
+    while (len) {
+        size_t run = MEM_PAGE_SIZE - (addr & (MEM_PAGE_SIZE - 1));
+        if (run > len) run = len;
+        mem_fault_range(m, addr, run);
+        if (!(m->mem.page_flags[addr >> MEM_PAGE_SHIFT] & MEM_PAGE_ROM)) memcpy(&m->mem.ram[addr], data, run);
+        addr += run;
+        data += run;
+        len -= run;
+    }
 }
 
-void mem_write(uint16_t addr, uint8_t val) {
-    ram[addr] = val;
+void mem_dma_read(machine_t *m, uint16_t addr, uint8_t *data, size_t len) {
+    while (len) {
+        size_t run = MEMORY_SIZE - addr;
+        if (run > len) run = len;
+        mem_fault_range(m, addr, run);
+        memcpy(data, &m->mem.ram[addr], run);
+        addr += run;
+        data += run;
+        len -= run;
+    }
 }
 
-uint16_t mem_read16(uint16_t addr) {
-    return ram[addr] | (ram[addr + 1] << 8);
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
 }
 
-void mem_write16(uint16_t addr, uint16_t val) {
-    ram[addr] = val & 0xFF;
-    ram[addr + 1] = val >> 8;
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-void mem_load(uint16_t addr, const uint8_t *data, size_t len) {
-    memcpy(&ram[addr], data, len);
+int mem_attach_image(machine_t *m, const uint8_t *image, size_t len, uint16_t *entry) {
+    if (len < MEM_IMAGE_HEADER_SIZE || memcmp(image, MEM_IMAGE_MAGIC, 4) != 0) return -1;
+    uint16_t addr = get16(image + 4);
+    uint32_t size = get32(image + 8);
+    uint8_t shift = image[12];
+    if (addr % MEM_PAGE_SIZE || size > (uint32_t)MEMORY_SIZE - addr || shift < MEM_PAGE_SHIFT || shift > 12) return -1;
+
+    // The index is checked once here so a fault only has to trust it
+    size_t chunks = (size + (1u << shift) - 1) >> shift;
+    size_t blocks = MEM_IMAGE_HEADER_SIZE + (chunks + 1) * 4;
+    if (len < blocks) return -1;
+    uint32_t prev = blocks;
+    for (size_t i = 0; i <= chunks; i++) {
+        uint32_t off = get32(image + MEM_IMAGE_HEADER_SIZE + i * 4);
+        if (off < prev || off > len) return -1;
+        prev = off;
+    }
+
+    if (m->mem.lazy_pages) mem_fault_range(m, 0, MEMORY_SIZE);
+    m->mem.image = image;
+    for (uint32_t a = addr; a < addr + size; a += MEM_PAGE_SIZE) {
+        m->mem.page_flags[a >> MEM_PAGE_SHIFT] |= MEM_PAGE_LAZY;
+        m->mem.lazy_pages++;
+    }
+    if (image[13] & MEM_IMAGE_ROM) mem_protect(m, addr, size, true);
+    if (entry) *entry = get16(image + 6);
+    return 0;
+}
+
+void mem_fault(machine_t *m, uint16_t addr) {
+    const uint8_t *image = m->mem.image;
+    uint16_t base = get16(image + 4);
+    uint32_t size = get32(image + 8);
+    uint8_t shift = image[12];
+
+    size_t chunk = (uint16_t)(addr - base) >> shift;
+    uint32_t start = base + (chunk << shift);
+    uint32_t len = size - (start - base) < (1u << shift) ? size - (start - base) : 1u << shift;
+    const uint8_t *index = image + MEM_IMAGE_HEADER_SIZE + chunk * 4;
+    uint32_t off = get32(index), block_len = get32(index + 4) - off;
+
+    if (block_len == len) {
+        memcpy(&m->mem.ram[start], image + off, len);
+    } else if (lz4_decompress(image + off, block_len, &m->mem.ram[start], len) < 0) {
+        memset(&m->mem.ram[start], 0xFF, len);
+    }
+    for (uint32_t a = start; a < start + len; a += MEM_PAGE_SIZE) {
+        m->mem.page_flags[a >> MEM_PAGE_SHIFT] &= ~MEM_PAGE_LAZY;
+        m->mem.lazy_pages--;
+    }
 }
 
-uint8_t *mem_get_ptr(uint16_t addr) {
-    return &ram[addr];
+void mem_fault_range(machine_t *m, uint16_t addr, size_t len) {
+    if (!m->mem.lazy_pages) return;
+    if (len > (size_t)MEMORY_SIZE - addr) len = (size_t)MEMORY_SIZE - addr;
+    for (size_t page = addr >> MEM_PAGE_SHIFT; page < MEM_PAGES && page << MEM_PAGE_SHIFT < addr + len; page++) {
+        if (m->mem.page_flags[page] & MEM_PAGE_LAZY) mem_fault(m, page << MEM_PAGE_SHIFT);
+    }
 }
@@ -3,24 +3,87 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #define MEMORY_SIZE 65536
 
-// Initialize memory (zeroes it out)
-void mem_init(void);
+// Memory map granularity: attributes are kept per 256-byte page
+#define MEM_PAGE_SHIFT  8
+#define MEM_PAGE_SIZE   (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES       (MEMORY_SIZE / MEM_PAGE_SIZE)
 
-// Read/write single byte
-uint8_t mem_read(uint16_t addr);
-void mem_write(uint16_t addr, uint8_t val);
+// Page attributes
+#define MEM_PAGE_ROM    0x01  // Writes are ignored
+#define MEM_PAGE_LAZY   0x02  // Still compressed in the attached image
+#define MEM_PAGE_HOOK   0x04  // Has a native hook at some address (hook.h)
 
-// Read/write 16-bit word (little endian)
-uint16_t mem_read16(uint16_t addr);
-void mem_write16(uint16_t addr, uint16_t val);
+// Compressed images (.l8z), little-endian:
+//
+//   header  "L8Z\1", u16 load address (page aligned), u16 entry point,
+//           u32 length, u8 chunk shift (8 to 12), u8 flags, u16 0
+//   index   u32 file offset of each chunk's block, then of the end
+//   blocks  LZ4 blocks (lz4.h), each decoding to one chunk of the image;
+//           a block as long as its chunk is stored as is
+//
+// Chunks are 1 << shift bytes from the load address, the last one possibly
+// shorter. An attached image is not copied: its pages are marked lazy and
+// each chunk is decompressed into RAM the first time one of its bytes is
+// read or written, so attaching costs the same at any image size.
 
-// Load data into memory at specified address
-void mem_load(uint16_t addr, const uint8_t *data, size_t len);
+#define MEM_IMAGE_MAGIC       "L8Z\1"
+#define MEM_IMAGE_HEADER_SIZE 16
+#define MEM_IMAGE_ROM         0x01  // Flag: mark the image's pages as ROM
 
-// Get pointer to memory (for DMA-style access)
-uint8_t *mem_get_ptr(uint16_t addr);
+typedef struct machine machine_t;
+
+// One machine's address space and memory map
+typedef struct {
+    uint8_t ram[MEMORY_SIZE];
+    uint8_t page_flags[MEM_PAGES];
+    const uint8_t *image;  // Attached compressed image, not owned
+    uint16_t lazy_pages;   // Pages still MEM_PAGE_LAZY; reads check nothing else at 0
+
+    // Bytes written by mem_dma_write or reported with mem_dma_mark since
+    // the owner last zeroed dma_len, for anything that caches guest code
+    // (the host batch interpreter)
+    uint16_t dma_addr;
+    uint32_t dma_len;
+} memory_t;
+
+// The byte/word accessors (mem_read, mem_write, mem_read16, mem_write16)
+// are on the CPU hot path and are defined inline in machine.h.
+
+// Initialize memory (zeroes it out, all pages writable)
+void mem_init(machine_t *m);
+
+// Mark [addr, addr + len) as ROM or RAM (whole pages)
+void mem_protect(machine_t *m, uint16_t addr, size_t len, bool rom);
+
+// Load data into memory at specified address (ignores ROM protection)
+void mem_load(machine_t *m, uint16_t addr, const uint8_t *data, size_t len);
+
+// Get pointer to memory (for DMA-style access). Lazy pages are not filled
+// in; call mem_fault_range() first for bytes that may be in an image.
+uint8_t *mem_get_ptr(machine_t *m, uint16_t addr);
+
+// Device transfers to and from memory (disk DMA). Addresses wrap at 64K,
+// lazy pages are filled in first and ROM pages are not written.
+void mem_dma_write(machine_t *m, uint16_t addr, const uint8_t *data, size_t len);
+void mem_dma_read(machine_t *m, uint16_t addr, uint8_t *data, size_t len);
+
+// Record [addr, addr + len) as written outside the CPU, for code that
+// writes guest memory itself (native hooks) rather than by mem_dma_write
+void mem_dma_mark(machine_t *m, uint16_t addr, size_t len);
+
+// Attach a compressed image, which must stay valid while any page is lazy.
+// Pages still lazy from an earlier image are decompressed first. Returns
+// -1 if the header or index is malformed; a block that turns out to be
+// malformed when its chunk is first used reads as FFh.
+int mem_attach_image(machine_t *m, const uint8_t *image, size_t len, uint16_t *entry);
+
+// Decompress the chunk holding addr (the slow path of the accessors), or
+// every lazy chunk in [addr, addr + len)
+void mem_fault(machine_t *m, uint16_t addr);
+void mem_fault_range(machine_t *m, uint16_t addr, size_t len);
 
 #endif
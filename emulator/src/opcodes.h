@@ -0,0 +1,123 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include <stdint.h>
+
+// Per-opcode tables shared by the interpreter, the tools and the assembler
+
+// Cycle counts for each opcode
+static const uint8_t OP_CYCLES[256] = {
+//  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  // 0
+    4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  // 1
+    4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4,  // 2
+    4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4,  // 3
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 4
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 5
+    5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  // 6
+    7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,  // 7
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 8
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 9
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // A
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // B
+    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  // C
+    5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  // D
+    5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  // E
+    5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11   // F
+};
+
+// Conditional calls and returns take this many extra cycles when the
+// condition holds; OP_CYCLES has the not-taken count
+#define OP_TAKEN_CYCLES 6
+
+static inline int op_is_cond_call_ret(uint8_t op) {
+    return (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC0;
+}
+
+// Instruction lengths: 1, 2, or 3 bytes
+static const uint8_t OP_LENGTHS[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 0
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,  // 1
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 2
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,  // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 8
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // A
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // B
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,  // C
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,  // D
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,  // E
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1   // F
+};
+
+// Bus cycles each opcode makes after its fetch (which is always an M1
+// memory read), for the front panel's status lights
+#define OP_BUS_READ  0x01  // Memory reads: operands, M, direct addresses
+#define OP_BUS_WRITE 0x02  // Memory writes
+#define OP_BUS_STACK 0x04  // The reads or writes are on the stack
+#define OP_BUS_IN    0x08
+#define OP_BUS_OUT   0x10
+#define OP_BUS_HALT  0x20
+
+static const uint8_t OP_BUS[256] = {
+//  0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F
+    0x00, 0x01, 0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,  // 0
+    0x00, 0x01, 0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,  // 1
+    0x00, 0x01, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,  // 2
+    0x00, 0x01, 0x03, 0x00, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,  // 3
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 4
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 5
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 6
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x20, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 7
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // 9
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // A
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,  // B
+    0x05, 0x05, 0x01, 0x01, 0x07, 0x06, 0x01, 0x06, 0x05, 0x05, 0x01, 0x01, 0x07, 0x07, 0x01, 0x06,  // C
+    0x05, 0x05, 0x01, 0x11, 0x07, 0x06, 0x01, 0x06, 0x05, 0x05, 0x01, 0x09, 0x07, 0x07, 0x01, 0x06,  // D
+    0x05, 0x05, 0x01, 0x07, 0x07, 0x06, 0x01, 0x06, 0x05, 0x00, 0x01, 0x00, 0x07, 0x07, 0x01, 0x06,  // E
+    0x05, 0x05, 0x01, 0x00, 0x07, 0x06, 0x01, 0x06, 0x05, 0x00, 0x01, 0x00, 0x07, 0x07, 0x01, 0x06   // F
+};
+
+// Disassembly text; operands that follow are printed after the text
+static const char *const OP_MNEMONICS[256] = {
+    "NOP", "LXI B,", "STAX B", "INX B", "INR B", "DCR B", "MVI B,", "RLC",
+    "NOP", "DAD B", "LDAX B", "DCX B", "INR C", "DCR C", "MVI C,", "RRC",
+    "NOP", "LXI D,", "STAX D", "INX D", "INR D", "DCR D", "MVI D,", "RAL",
+    "NOP", "DAD D", "LDAX D", "DCX D", "INR E", "DCR E", "MVI E,", "RAR",
+    "NOP", "LXI H,", "SHLD ", "INX H", "INR H", "DCR H", "MVI H,", "DAA",
+    "NOP", "DAD H", "LHLD ", "DCX H", "INR L", "DCR L", "MVI L,", "CMA",
+    "NOP", "LXI SP,", "STA ", "INX SP", "INR M", "DCR M", "MVI M,", "STC",
+    "NOP", "DAD SP", "LDA ", "DCX SP", "INR A", "DCR A", "MVI A,", "CMC",
+    "MOV B,B", "MOV B,C", "MOV B,D", "MOV B,E", "MOV B,H", "MOV B,L", "MOV B,M", "MOV B,A",
+    "MOV C,B", "MOV C,C", "MOV C,D", "MOV C,E", "MOV C,H", "MOV C,L", "MOV C,M", "MOV C,A",
+    "MOV D,B", "MOV D,C", "MOV D,D", "MOV D,E", "MOV D,H", "MOV D,L", "MOV D,M", "MOV D,A",
+    "MOV E,B", "MOV E,C", "MOV E,D", "MOV E,E", "MOV E,H", "MOV E,L", "MOV E,M", "MOV E,A",
+    "MOV H,B", "MOV H,C", "MOV H,D", "MOV H,E", "MOV H,H", "MOV H,L", "MOV H,M", "MOV H,A",
+    "MOV L,B", "MOV L,C", "MOV L,D", "MOV L,E", "MOV L,H", "MOV L,L", "MOV L,M", "MOV L,A",
+    "MOV M,B", "MOV M,C", "MOV M,D", "MOV M,E", "MOV M,H", "MOV M,L", "HLT", "MOV M,A",
+    "MOV A,B", "MOV A,C", "MOV A,D", "MOV A,E", "MOV A,H", "MOV A,L", "MOV A,M", "MOV A,A",
+    "ADD B", "ADD C", "ADD D", "ADD E", "ADD H", "ADD L", "ADD M", "ADD A",
+    "ADC B", "ADC C", "ADC D", "ADC E", "ADC H", "ADC L", "ADC M", "ADC A",
+    "SUB B", "SUB C", "SUB D", "SUB E", "SUB H", "SUB L", "SUB M", "SUB A",
+    "SBB B", "SBB C", "SBB D", "SBB E", "SBB H", "SBB L", "SBB M", "SBB A",
+    "ANA B", "ANA C", "ANA D", "ANA E", "ANA H", "ANA L", "ANA M", "ANA A",
+    "XRA B", "XRA C", "XRA D", "XRA E", "XRA H", "XRA L", "XRA M", "XRA A",
+    "ORA B", "ORA C", "ORA D", "ORA E", "ORA H", "ORA L", "ORA M", "ORA A",
+    "CMP B", "CMP C", "CMP D", "CMP E", "CMP H", "CMP L", "CMP M", "CMP A",
+    "RNZ", "POP B", "JNZ ", "JMP ", "CNZ ", "PUSH B", "ADI ", "RST 0",
+    "RZ", "RET", "JZ ", "JMP ", "CZ ", "CALL ", "ACI ", "RST 1",
+    "RNC", "POP D", "JNC ", "OUT ", "CNC ", "PUSH D", "SUI ", "RST 2",
+    "RC", "RET", "JC ", "IN ", "CC ", "CALL ", "SBI ", "RST 3",
+    "RPO", "POP H", "JPO ", "XTHL", "CPO ", "PUSH H", "ANI ", "RST 4",
+    "RPE", "PCHL", "JPE ", "XCHG", "CPE ", "CALL ", "XRI ", "RST 5",
+    "RP", "POP PSW", "JP ", "DI", "CP ", "PUSH PSW", "ORI ", "RST 6",
+    "RM", "SPHL", "JM ", "EI", "CM ", "CALL ", "CPI ", "RST 7"
+};
+
+#endif
@@ -1,109 +1,178 @@
 #include "panel.h"
-#include "io.h"
-#include "pico/stdlib.h"
-#include "hardware/gpio.h"
+#include "machine.h"
+#include <string.h>
 
-// Debounce state
-static uint8_t last_control = 0;
-static uint8_t control_pressed = 0;
-static uint32_t debounce_time = 0;
+void panel_init(panel_t *p, const panel_gpio_t *gpio) {
+    const panel_gpio_t *g = gpio;
+    memset(p, 0, sizeof(*p));
+    p->gpio = gpio;
+    p->event = -1;
 
-void panel_init(void) {
     // 595 outputs
-    gpio_init(PIN_595_DATA);
-    gpio_init(PIN_595_CLOCK);
-    gpio_init(PIN_595_LATCH);
-    gpio_set_dir(PIN_595_DATA, GPIO_OUT);
-    gpio_set_dir(PIN_595_CLOCK, GPIO_OUT);
-    gpio_set_dir(PIN_595_LATCH, GPIO_OUT);
+    g->init(g->ctx, PIN_595_DATA, true);
+    g->init(g->ctx, PIN_595_CLOCK, true);
+    g->init(g->ctx, PIN_595_LATCH, true);
 
     // 165 inputs
-    gpio_init(PIN_165_DATA);
-    gpio_init(PIN_165_CLOCK);
-    gpio_init(PIN_165_LOAD);
-    gpio_set_dir(PIN_165_DATA, GPIO_IN);
-    gpio_set_dir(PIN_165_CLOCK, GPIO_OUT);
-    gpio_set_dir(PIN_165_LOAD, GPIO_OUT);
+    g->init(g->ctx, PIN_165_DATA, false);
+    g->init(g->ctx, PIN_165_CLOCK, true);
+    g->init(g->ctx, PIN_165_LOAD, true);
 
     // Initial states
-    gpio_put(PIN_595_DATA, 0);
-    gpio_put(PIN_595_CLOCK, 0);
-    gpio_put(PIN_595_LATCH, 0);
-    gpio_put(PIN_165_CLOCK, 0);
-    gpio_put(PIN_165_LOAD, 1);  // Active low, keep high
-
-    // Clear all LEDs
-    panel_update_leds();
+    g->put(g->ctx, PIN_595_DATA, 0);
+    g->put(g->ctx, PIN_595_CLOCK, 0);
+    g->put(g->ctx, PIN_595_LATCH, 0);
+    g->put(g->ctx, PIN_165_CLOCK, 0);
+    g->put(g->ctx, PIN_165_LOAD, 1);  // Active low, keep high
+
+    // Clear all LEDs, whatever they power up showing
+    p->shown = ~0ull;
+    static const front_panel_t dark = {0};
+    panel_update_leds(p, &dark);
 }
 
-// Shift out a single byte, MSB first
-static inline void shift_out_byte(uint8_t val) {
-    for (int i = 7; i >= 0; i--) {
-        gpio_put(PIN_595_DATA, (val >> i) & 1);
-        gpio_put(PIN_595_CLOCK, 1);
-        gpio_put(PIN_595_CLOCK, 0);
+void panel_sample(front_panel_t *fp, machine_t *m) {
+    fp->address_display = m->cpu.pc;
+    fp->data_display = mem_read(m, m->cpu.pc);
+    fp->status = cpu_bus_status(m);
+}
+
+uint64_t panel_word(const front_panel_t *fp) {
+    return (uint64_t)fp->status << 24 | (uint32_t)fp->data_display << 16 | fp->address_display;
+}
+
+// Shift out 40 bits MSB first (status_hi, status_lo, data, addr_hi,
+// addr_lo) and latch them, unless they are showing already
+static void latch(panel_t *p, uint64_t word) {
+    const panel_gpio_t *g = p->gpio;
+    if (word == p->shown) return;
+    for (int i = 39; i >= 0; i--) {
+        g->put(g->ctx, PIN_595_DATA, (word >> i) & 1);
+        g->put(g->ctx, PIN_595_CLOCK, 1);
+        g->put(g->ctx, PIN_595_CLOCK, 0);
     }
+    g->put(g->ctx, PIN_595_LATCH, 1);
+    g->put(g->ctx, PIN_595_LATCH, 0);
+    p->shown = word;
+    p->latches++;
 }
 
-void panel_update_leds(void) {
-    // Build status byte from CPU state
-    uint8_t status_hi = 0;
-    uint8_t status_lo = 0;
-
-    if (front_panel.run) status_hi |= ST_MEMR;
-    if (front_panel.wait) status_hi |= ST_HLTA;
-    // Add more status bits as needed from CPU state
-
-    // Shift out 40 bits: status_hi, status_lo, data, addr_hi, addr_lo
-    shift_out_byte(status_hi);
-    shift_out_byte(status_lo);
-    shift_out_byte(front_panel.data_display);
-    shift_out_byte(front_panel.address_display >> 8);
-    shift_out_byte(front_panel.address_display & 0xFF);
-
-    // Latch outputs
-    gpio_put(PIN_595_LATCH, 1);
-    gpio_put(PIN_595_LATCH, 0);
+void panel_update_leds(panel_t *p, const front_panel_t *fp) {
+    latch(p, panel_word(fp));
 }
 
 // Shift in a single byte, MSB first
-static inline uint8_t shift_in_byte(void) {
+static inline uint8_t shift_in_byte(const panel_gpio_t *g) {
     uint8_t val = 0;
     for (int i = 0; i < 8; i++) {
         val <<= 1;
-        val |= gpio_get(PIN_165_DATA) ? 1 : 0;
-        gpio_put(PIN_165_CLOCK, 1);
-        gpio_put(PIN_165_CLOCK, 0);
+        val |= g->get(g->ctx, PIN_165_DATA) ? 1 : 0;
+        g->put(g->ctx, PIN_165_CLOCK, 1);
+        g->put(g->ctx, PIN_165_CLOCK, 0);
     }
     return val;
 }
 
-void panel_read_switches(void) {
+void panel_read_switches(panel_t *p, front_panel_t *fp) {
+    const panel_gpio_t *g = p->gpio;
+
     // Pulse load low to capture parallel inputs
-    gpio_put(PIN_165_LOAD, 0);
-    gpio_put(PIN_165_LOAD, 1);
+    g->put(g->ctx, PIN_165_LOAD, 0);
+    g->put(g->ctx, PIN_165_LOAD, 1);
 
     // Shift in 24 bits: control, sense_hi, sense_lo
-    uint8_t control = shift_in_byte();
-    uint8_t sense_hi = shift_in_byte();
-    uint8_t sense_lo = shift_in_byte();
+    uint8_t control = shift_in_byte(g);
+    uint8_t sense_hi = shift_in_byte(g);
+    uint8_t sense_lo = shift_in_byte(g);
 
-    front_panel.sense_switches = (sense_hi << 8) | sense_lo;
+    fp->sense_switches = (sense_hi << 8) | sense_lo;
 
     // Debounce control switches (detect rising edge)
-    uint32_t now = time_us_32();
-    if (now - debounce_time > 50000) {  // 50ms debounce
-        uint8_t newly_pressed = control & ~last_control;
+    uint32_t now = g->time_us(g->ctx);
+    if (now - p->debounce_time > PANEL_DEBOUNCE_US) {
+        uint8_t newly_pressed = control & ~p->last_control;
         if (newly_pressed) {
-            control_pressed = newly_pressed;
-            debounce_time = now;
+            p->control_pressed = newly_pressed;
+            p->debounce_time = now;
         }
     }
-    last_control = control;
+    p->last_control = control;
 }
 
-uint8_t panel_get_control_press(void) {
-    uint8_t pressed = control_pressed;
-    control_pressed = 0;
+uint8_t panel_get_control_press(panel_t *p) {
+    uint8_t pressed = p->control_pressed;
+    p->control_pressed = 0;
     return pressed;
 }
+
+// Slots 0, 1-2, 3-6 and 7-14 of a frame show bits 0 to 3 of the counts
+static int slot_plane(int slot) {
+    int plane = 0;
+    while (slot + 1 >= 2 << plane) plane++;
+    return plane;
+}
+
+static void panel_tick(machine_t *m, void *ctx);
+
+static void schedule(panel_t *p, machine_t *m) {
+    p->event = sched_add(&m->sched, m->cpu.cycles + p->poll, 0, panel_tick, p);
+}
+
+static void panel_tick(machine_t *m, void *ctx) {
+    panel_t *p = ctx;
+    const panel_gpio_t *g = p->gpio;
+    uint32_t now = g->time_us(g->ctx);
+    if ((int32_t)(now - p->next_us) < 0) {
+        schedule(p, m);
+        return;
+    }
+    // Behind by more than a frame (a slow host, a long I/O wait): resync
+    // rather than sample in a burst
+    p->next_us = (int32_t)(now - p->next_us) > PANEL_FRAME_US ? now + PANEL_SLOT_US : p->next_us + PANEL_SLOT_US;
+
+    // Check the clock about PANEL_POLLS_PER_SLOT times in the next slot,
+    // going by how many cycles the last one took
+    uint64_t per_slot = (m->cpu.cycles - p->slot_cycles) / PANEL_POLLS_PER_SLOT;
+    p->poll = per_slot < PANEL_POLL_MIN ? PANEL_POLL_MIN : per_slot > PANEL_POLL_MAX ? PANEL_POLL_MAX : per_slot;
+    p->slot_cycles = m->cpu.cycles;
+    schedule(p, m);
+
+    front_panel_t *fp = &m->io.panel;
+    panel_sample(fp, m);
+
+    // Add the sample to the bit-sliced counters, all 40 LEDs at once
+    uint64_t carry = panel_word(fp);
+    for (int k = 0; k < PANEL_LEVEL_BITS && carry; k++) {
+        uint64_t next = p->counts[k] & carry;
+        p->counts[k] ^= carry;
+        carry = next;
+    }
+
+    latch(p, p->planes[slot_plane(p->slot)]);
+
+    if (++p->slot == PANEL_SLOTS) {
+        for (int k = 0; k < PANEL_LEVEL_BITS; k++) {
+            p->planes[k] = p->counts[k];
+            p->counts[k] = 0;
+        }
+        p->slot = 0;
+        p->frames++;
+        panel_read_switches(p, fp);
+    }
+}
+
+void panel_attach(panel_t *p, machine_t *m) {
+    memset(p->counts, 0, sizeof(p->counts));
+    // Until the first frame is sampled, keep showing what is lit now
+    for (int k = 0; k < PANEL_LEVEL_BITS; k++) p->planes[k] = p->shown;
+    p->slot = 0;
+    p->next_us = p->gpio->time_us(p->gpio->ctx);
+    p->slot_cycles = m->cpu.cycles;
+    p->poll = PANEL_POLL_MIN;
+    schedule(p, m);
+}
+
+void panel_detach(panel_t *p, machine_t *m) {
+    sched_cancel(&m->sched, p->event);
+    p->event = -1;
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "io.h"
 
 /*
 ALTAIR 8800 FRONT PANEL
@@ -89,6 +90,19 @@ Switch in (24 bits):
   [23:16] Control: RESET DEP_NXT DEP EX_NXT EXAM STEP RUN STOP
   [15:8]  Sense: SW15-SW8
   [7:0]   Sense: SW7-SW0
+
+REFRESH
+-------
+While the CPU runs, nothing is done per instruction. A scheduler event
+checks the clock a few times a slot, rescheduling itself to follow the
+emulation speed, and once per slot samples the bus (PC, the byte there,
+status) into a 4-bit counter per LED. A frame is PANEL_SLOTS slots,
+about 1 ms. Each LED's count over a frame is its duty cycle, and the
+next frame shows it by binary code modulation: bit k of every count is
+latched for 2^k slots. So an LED glows as bright as its line was active,
+as on a real Altair. The chain is only shifted when the word to latch
+differs from the one showing, so a steady panel costs no
+GPIO traffic. The switches are read once per frame.
 */
 
 // GPIO
@@ -109,19 +123,71 @@ Switch in (24 bits):
 #define SW_DEPOSIT_NEXT 0x40
 #define SW_RESET        0x80
 
-// Status bits
-#define ST_INTE   0x80
-#define ST_PROT   0x40
-#define ST_MEMR   0x20
-#define ST_INP    0x10
-#define ST_M1     0x08
-#define ST_OUT    0x04
-#define ST_HLTA   0x02
-#define ST_STACK  0x01
-
-void panel_init(void);
-void panel_update_leds(void);
-void panel_read_switches(void);
-uint8_t panel_get_control_press(void);
+// The status LEDs show the BUS_* lines in cpu.h
+
+// Refresh timing
+#define PANEL_LEVEL_BITS  4
+#define PANEL_SLOTS       ((1 << PANEL_LEVEL_BITS) - 1)  // Samples per frame
+#define PANEL_FRAME_US    1000
+#define PANEL_SLOT_US     (PANEL_FRAME_US / PANEL_SLOTS)
+#define PANEL_POLL_MIN    64     // Cycles between clock checks, adapted
+#define PANEL_POLL_MAX    65536  // to about PANEL_POLLS_PER_SLOT a slot
+#define PANEL_POLLS_PER_SLOT 4
+#define PANEL_DEBOUNCE_US 50000
+
+// GPIO backend: the Pico's pins (panel_gpio_pico) or a host mock
+typedef struct {
+    void (*init)(void *ctx, unsigned pin, bool output);
+    void (*put)(void *ctx, unsigned pin, bool value);
+    bool (*get)(void *ctx, unsigned pin);
+    uint32_t (*time_us)(void *ctx);
+    void *ctx;
+} panel_gpio_t;
+
+// panel_pico.c, firmware only
+extern const panel_gpio_t panel_gpio_pico;
+
+typedef struct {
+    const panel_gpio_t *gpio;
+    uint64_t shown;                     // LED word latched now
+
+    // Duty cycle: bit k of each LED's sample count, one word per k
+    uint64_t counts[PANEL_LEVEL_BITS];  // Frame being sampled
+    uint64_t planes[PANEL_LEVEL_BITS];  // Frame being shown
+    int slot;
+    uint32_t next_us;                   // Time of the next slot
+    uint64_t slot_cycles;               // CPU cycles at the last slot
+    uint32_t poll;                      // Cycles between clock checks
+    int event;                          // Scheduler event, -1 when detached
+
+    // Debounce state
+    uint8_t last_control;
+    uint8_t control_pressed;
+    uint32_t debounce_time;
+
+    // Statistics
+    uint32_t frames;
+    uint32_t latches;                   // Words shifted out
+} panel_t;
+
+// Set up the pins and clear all LEDs
+void panel_init(panel_t *p, const panel_gpio_t *gpio);
+
+// Point the panel at the instruction at PC: its address, opcode and the
+// status lines its bus cycles raise
+void panel_sample(front_panel_t *fp, machine_t *m);
+
+// The 40-bit LED word for a panel state
+uint64_t panel_word(const front_panel_t *fp);
+
+// Show fp now at full brightness (single step, stop)
+void panel_update_leds(panel_t *p, const front_panel_t *fp);
+
+void panel_read_switches(panel_t *p, front_panel_t *fp);
+uint8_t panel_get_control_press(panel_t *p);
+
+// Refresh from m's bus while m runs, through its scheduler
+void panel_attach(panel_t *p, machine_t *m);
+void panel_detach(panel_t *p, machine_t *m);
 
 #endif
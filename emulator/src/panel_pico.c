@@ -0,0 +1,28 @@
+#include "panel.h"
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+
+// The panel's GPIO backend on the Pico's own pins
+
+static void pico_init(void *ctx, unsigned pin, bool output) {
+    (void)ctx;
+    gpio_init(pin);
+    gpio_set_dir(pin, output ? GPIO_OUT : GPIO_IN);
+}
+
+static void pico_put(void *ctx, unsigned pin, bool value) {
+    (void)ctx;
+    gpio_put(pin, value);
+}
+
+static bool pico_get(void *ctx, unsigned pin) {
+    (void)ctx;
+    return gpio_get(pin);
+}
+
+static uint32_t pico_time_us(void *ctx) {
+    (void)ctx;
+    return time_us_32();
+}
+
+const panel_gpio_t panel_gpio_pico = { pico_init, pico_put, pico_get, pico_time_us, NULL };
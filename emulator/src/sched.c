@@ -0,0 +1,52 @@
+#include "sched.h"
+#include "machine.h"
+
+static void update_next(sched_t *s) {
+    uint64_t next = SCHED_NEVER;
+    for (int i = 0; i < SCHED_MAX_EVENTS; i++) {
+        if (s->events[i].fn && s->events[i].when < next) next = s->events[i].when;
+    }
+    s->next = next;
+}
+
+void sched_init(sched_t *s) {
+    for (int i = 0; i < SCHED_MAX_EVENTS; i++) s->events[i].fn = NULL;
+    s->next = SCHED_NEVER;
+}
+
+int sched_add(sched_t *s, uint64_t when, uint64_t period, sched_fn fn, void *ctx) {
+    for (int i = 0; i < SCHED_MAX_EVENTS; i++) {
+        sched_event_t *ev = &s->events[i];
+        if (ev->fn) continue;
+        ev->when = when;
+        ev->period = period;
+        ev->fn = fn;
+        ev->ctx = ctx;
+        if (when < s->next) s->next = when;
+        return i;
+    }
+    return -1;
+}
+
+void sched_cancel(sched_t *s, int id) {
+    if (id < 0 || id >= SCHED_MAX_EVENTS) return;
+    s->events[id].fn = NULL;
+    update_next(s);
+}
+
+void sched_dispatch(machine_t *m, uint64_t now) {
+    sched_t *s = &m->sched;
+    for (int i = 0; i < SCHED_MAX_EVENTS; i++) {
+        sched_event_t *ev = &s->events[i];
+        if (!ev->fn || ev->when > now) continue;
+        sched_fn fn = ev->fn;
+        if (ev->period) {
+            // Skip missed periods rather than firing a burst
+            ev->when += ev->period * ((now - ev->when) / ev->period + 1);
+        } else {
+            ev->fn = NULL;
+        }
+        fn(m, ev->ctx);
+    }
+    update_next(s);
+}
@@ -0,0 +1,41 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+// Cycle-driven event scheduler. The run loop executes instructions up to the
+// earliest deadline and then fires whatever is due, so periodic work (panel
+// refresh, host polling, timer interrupts) costs nothing per instruction.
+
+#define SCHED_MAX_EVENTS 8
+#define SCHED_NEVER      UINT64_MAX
+
+typedef struct machine machine_t;
+
+typedef void (*sched_fn)(machine_t *m, void *ctx);
+
+typedef struct {
+    uint64_t when;    // Absolute cycle count of next firing
+    uint64_t period;  // Re-arm interval, 0 for one-shot
+    sched_fn fn;      // NULL when slot is free
+    void *ctx;
+} sched_event_t;
+
+typedef struct {
+    sched_event_t events[SCHED_MAX_EVENTS];
+    uint64_t next;    // Earliest pending deadline
+} sched_t;
+
+void sched_init(sched_t *s);
+
+// Schedule fn at absolute cycle `when`, repeating every `period` cycles if
+// nonzero. Returns event id, or -1 if the table is full.
+int sched_add(sched_t *s, uint64_t when, uint64_t period, sched_fn fn, void *ctx);
+
+// Remove a pending event
+void sched_cancel(sched_t *s, int id);
+
+// Fire all events due at or before `now`
+void sched_dispatch(machine_t *m, uint64_t now);
+
+#endif
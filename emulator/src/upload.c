@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include <string.h>
+#include "upload.h"
+
+static uint32_t crc_table[256];
+
+uint32_t upload_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    if (!crc_table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0xEDB88320 : 0);
+            crc_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+size_t upload_rle_encode(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < 130 && in[i + run] == in[i]) run++;
+        if (run >= 3) {
+            if (o + 2 > cap) return 0;
+            out[o++] = run + 125;
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+        // Literals up to the next run of three
+        size_t start = i, n = 0;
+        while (i < len && n < 128) {
+            if (i + 2 < len && in[i] == in[i + 1] && in[i] == in[i + 2]) break;
+            i++;
+            n++;
+        }
+        if (o + 1 + n > cap) return 0;
+        out[o++] = n - 1;
+        memcpy(&out[o], &in[start], n);
+        o += n;
+    }
+    return o;
+}
+
+size_t upload_rle_decode(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        uint8_t c = in[i++];
+        if (c < 128) {
+            size_t n = c + 1;
+            if (i + n > len || o + n > cap) return 0;
+            memcpy(&out[o], &in[i], n);
+            i += n;
+            o += n;
+        } else {
+            size_t n = c - 125;
+            if (i >= len || o + n > cap) return 0;
+            memset(&out[o], in[i++], n);
+            o += n;
+        }
+    }
+    return o;
+}
+
+size_t upload_frame(uint8_t *out, uint8_t type, uint8_t seq, uint16_t addr, const uint8_t *payload, uint16_t len) {
+    out[0] = UPLOAD_SYNC;
+    out[1] = type;
+    out[2] = seq & UPLOAD_SEQ_MASK;
+    out[3] = addr & 0xFF;
+    out[4] = addr >> 8;
+    out[5] = len & 0xFF;
+    out[6] = len >> 8;
+    if (len) memcpy(&out[UPLOAD_HEADER_SIZE], payload, len);
+    uint32_t crc = upload_crc32(0, &out[1], UPLOAD_HEADER_SIZE - 1 + len);
+    for (int i = 0; i < UPLOAD_CRC_SIZE; i++) out[UPLOAD_HEADER_SIZE + len + i] = crc >> (8 * i);
+    return UPLOAD_HEADER_SIZE + len + UPLOAD_CRC_SIZE;
+}
+
+static void reply(const upload_port_t *port, uint8_t code, uint8_t seq) {
+    uint8_t r[2] = { code, 0x80 | (seq & UPLOAD_SEQ_MASK) };
+    port->write(port->ctx, r, sizeof(r));
+}
+
+int upload_receive(machine_t *m, const upload_port_t *port, uint32_t timeout_us, upload_stats_t *stats) {
+    static uint8_t frame[UPLOAD_HEADER_SIZE + UPLOAD_FRAME_MAX + UPLOAD_CRC_SIZE];
+    static uint8_t decoded[UPLOAD_FRAME_MAX];
+    uint8_t expected = 0;
+    bool nak_sent = false;  // One NAK per expected frame; after that the sender's timeout resends
+    bool done = false;      // END taken: only resends of it are answered
+
+    memset(stats, 0, sizeof(*stats));
+    uint8_t ready = UPLOAD_READY;
+    port->write(port->ctx, &ready, 1);
+
+    for (;;) {
+        do {
+            if (port->read(port->ctx, frame, 1, done ? UPLOAD_LINGER_US : timeout_us) != 1) return done ? 0 : -1;
+        } while (frame[0] != UPLOAD_SYNC);
+
+        bool ok = port->read(port->ctx, &frame[1], UPLOAD_HEADER_SIZE - 1, UPLOAD_BYTE_TIMEOUT_US) ==
+                  UPLOAD_HEADER_SIZE - 1;
+        uint8_t type = frame[1], seq = frame[2];
+        uint16_t addr = frame[3] | (frame[4] << 8);
+        uint16_t len = frame[5] | (frame[6] << 8);
+        ok = ok && type >= UPLOAD_DATA && type <= UPLOAD_END && len <= UPLOAD_FRAME_MAX;
+        ok = ok && port->read(port->ctx, &frame[UPLOAD_HEADER_SIZE], len + UPLOAD_CRC_SIZE,
+                              UPLOAD_BYTE_TIMEOUT_US) == (size_t)len + UPLOAD_CRC_SIZE;
+        if (ok) {
+            const uint8_t *c = &frame[UPLOAD_HEADER_SIZE + len];
+            uint32_t crc = c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t)c[3] << 24);
+            ok = crc == upload_crc32(0, &frame[1], UPLOAD_HEADER_SIZE - 1 + len);
+        }
+
+        const uint8_t *data = &frame[UPLOAD_HEADER_SIZE];
+        size_t n = len;
+        if (ok && type == UPLOAD_RLE) {
+            n = upload_rle_decode(data, len, decoded, sizeof(decoded));
+            data = decoded;
+            ok = n > 0;
+        }
+        if (!ok) {
+            stats->errors++;
+            if (!nak_sent) reply(port, UPLOAD_NAK, expected);
+            nak_sent = true;
+            continue;
+        }
+
+        if (seq != expected) {
+            // A resend of a frame already taken (its ACK was lost), or a
+            // frame after one that never arrived
+            if (((expected - seq) & UPLOAD_SEQ_MASK) <= UPLOAD_WINDOW) {
+                reply(port, UPLOAD_ACK, expected - 1);
+            } else if (!nak_sent) {
+                reply(port, UPLOAD_NAK, expected);
+                nak_sent = true;
+            }
+            continue;
+        }
+
+        if (type == UPLOAD_END) {
+            stats->entry = addr;
+        } else {
+            mem_load(m, addr, data, n);
+            stats->bytes += n;
+        }
+        stats->frames++;
+        reply(port, UPLOAD_ACK, seq);
+        expected = (expected + 1) & UPLOAD_SEQ_MASK;
+        done = type == UPLOAD_END;
+        nak_sent = done;  // Nothing follows END to ask for
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "machine.h"
+
+// Binary program upload for the monitor's b command, sent by host/send8080.
+// Frames are little-endian:
+//
+//   0xA5, u8 type, u8 seq, u16 addr, u16 len, len payload bytes, u32 CRC
+//
+// The CRC is CRC-32 (as in zlib) over type through payload. DATA frames
+// carry bytes for addr; RLE frames carry the same bytes run-length coded,
+// with len the coded length; END carries the entry point in addr. The
+// receiver answers each frame with two bytes, ACK or NAK and 0x80 | seq,
+// neither of which is a newline that USB stdio would expand.
+//
+// Sequence numbers count up mod 128 from 0. A sender keeps up to
+// UPLOAD_WINDOW frames unacknowledged; an ACK covers its frame and all
+// before it. After a NAK, or no reply within a timeout, the sender goes back
+// to the NAKed or oldest unacknowledged frame and resends from there.
+//
+// The ACK for END may be lost too, so the receiver keeps answering resends
+// of END until the line has been quiet for UPLOAD_LINGER_US, longer than
+// the sender waits before resending.
+
+#define UPLOAD_SYNC   0xA5
+#define UPLOAD_READY  0x02  // Sent once when the receiver starts listening
+#define UPLOAD_ACK    0x06
+#define UPLOAD_NAK    0x15
+
+#define UPLOAD_DATA   0x01
+#define UPLOAD_RLE    0x02
+#define UPLOAD_END    0x03
+
+#define UPLOAD_HEADER_SIZE 7
+#define UPLOAD_CRC_SIZE    4
+#define UPLOAD_FRAME_MAX   4096  // Payload bytes, and decoded bytes per frame
+#define UPLOAD_WINDOW      8
+#define UPLOAD_SEQ_MASK    0x7F
+
+// No byte for this long inside a frame means part of it was lost
+#define UPLOAD_BYTE_TIMEOUT_US 100000
+
+// A sender resends after this long without a reply
+#define UPLOAD_ACK_TIMEOUT_US 250000
+#define UPLOAD_LINGER_US      (2 * UPLOAD_ACK_TIMEOUT_US)
+
+// The receiver's serial link. read returns the number of bytes read, fewer
+// than len if none arrives for timeout_us.
+typedef struct {
+    size_t (*read)(void *ctx, uint8_t *buf, size_t len, uint32_t timeout_us);
+    void (*write)(void *ctx, const uint8_t *buf, size_t len);
+    void *ctx;
+} upload_port_t;
+
+typedef struct {
+    uint32_t bytes;   // Decoded bytes written to memory
+    uint32_t frames;  // Frames accepted, END included
+    uint32_t errors;  // Frames dropped for bad CRC or format
+    uint16_t entry;
+} upload_stats_t;
+
+// CRC-32 of data, continuing from crc (0 to start)
+uint32_t upload_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+// Run-length coding: a control byte c < 128 is followed by c + 1 literal
+// bytes, and c >= 128 by one byte repeated c - 125 times (3 to 130). Both
+// return the output length, or 0 if it would not fit in cap or the input
+// is malformed.
+size_t upload_rle_encode(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+size_t upload_rle_decode(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+
+// Build a frame in out, which must hold UPLOAD_HEADER_SIZE + len +
+// UPLOAD_CRC_SIZE bytes. Returns its size.
+size_t upload_frame(uint8_t *out, uint8_t type, uint8_t seq, uint16_t addr, const uint8_t *payload, uint16_t len);
+
+// Announce UPLOAD_READY and receive frames into memory with mem_load() until
+// END, then linger for resends of it. Returns 0, or -1 if nothing arrives
+// between frames for timeout_us before END.
+int upload_receive(machine_t *m, const upload_port_t *port, uint32_t timeout_us, upload_stats_t *stats);
+
+#endif